@@ -47,6 +47,7 @@
 #endif
 
 #define AVSTOR_AVL_HEIGHT       64  // Maximum AVL tree height
+#define AVSTOR_MERKLE_FANOUT    64  // Hashes combined by a hash of the page checksum tree
 
 // Node types
 #define AVSTOR_TYPE_KEY         0
@@ -63,9 +64,30 @@
 #define AVSTOR_VALUES           1
 #define AVSTOR_ASCENDING        0
 #define AVSTOR_DESCENDING       2
+#define AVSTOR_SCAN             4   // Traversal hint: pages read only by the cursor are evicted first
 
 #define AVSTOR_INVALID_HANDLE   (-1)
 
+// Change kinds reported by avstor_diff
+#define AVSTOR_DIFF_ADDED       1   // Node exists only under the second node
+#define AVSTOR_DIFF_REMOVED     2   // Node exists only under the first node
+#define AVSTOR_DIFF_CHANGED     3   // Value exists under both nodes but type or data differs
+
+// Set operations of avstor_join on the names of the children of two nodes
+#define AVSTOR_JOIN_INTERSECT   1   // Names under both nodes
+#define AVSTOR_JOIN_UNION       2   // Names under either node
+#define AVSTOR_JOIN_DIFFERENCE  3   // Names under the first node only
+#define AVSTOR_JOIN_SYMMETRIC   4   // Names under exactly one of the nodes
+
+// Flags of avstor_key_stats
+#define AVSTOR_STATS_RECURSIVE  1   // Sum the statistics of all keys below instead of the key itself
+
+// Field types of tuple keys, see avstor_tuple_init
+#define AVSTOR_TUPLE_END        0x00    // No more fields
+#define AVSTOR_TUPLE_INT64      0x10
+#define AVSTOR_TUPLE_DOUBLE     0x20
+#define AVSTOR_TUPLE_BYTES      0x30    // Strings and binary data
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -86,7 +108,12 @@ enum {
 
 enum {
     AVSTOR_FILE_64BIT       = 0x00000001,
-    AVSTOR_FILE_BIGENDIAN   = 0x00000002
+    AVSTOR_FILE_BIGENDIAN   = 0x00000002,
+    AVSTOR_FILE_NAMES       = 0x00000004,   // Node names may refer to the name dictionary
+    AVSTOR_FILE_PAGE64      = 0x00000008,   // Page counts are stored with 64 bits
+    AVSTOR_FILE_MERKLE      = 0x00000010,   // Page checksum tree is kept in side pages
+    AVSTOR_FILE_KEYSTATS    = 0x00000020,   // Keys count their children, see AVSTOR_OPEN_KEYSTATS
+    AVSTOR_FILE_PARENTS     = 0x00000040    // Nodes refer to the key they belong to, see AVSTOR_OPEN_PARENTS
 };
 
 enum {
@@ -94,7 +121,29 @@ enum {
     AVSTOR_OPEN_READONLY    = 0x00000002,
     AVSTOR_OPEN_CREATE      = 0x00000004,
     AVSTOR_OPEN_SHARED      = 0x00000008,
-    AVSTOR_OPEN_AUTOSAVE    = 0x00000100
+    AVSTOR_OPEN_AUTOSAVE    = 0x00000100,
+    AVSTOR_OPEN_DEDUP       = 0x00000200,   // Store binary values with identical content only once
+    AVSTOR_OPEN_PRIORITIZE_KEYS = 0x00000400,   // Evict pages holding keys after other pages
+    AVSTOR_OPEN_ARENAS      = 0x00000800,   // Give each writing thread its own insertion pages
+    AVSTOR_OPEN_MMAP        = 0x00001000,   // Access committed pages in a file mapping, bypassing the cache
+    AVSTOR_OPEN_LOOKUP_CACHE = 0x00002000,  // Remember the nodes found by avstor_find by parent and name
+    AVSTOR_OPEN_MERKLE      = 0x00004000,   // Keep a tree of page checksums, see avstor_merkle_root
+    AVSTOR_OPEN_KEYSTATS    = 0x00008000,   // With AVSTOR_OPEN_CREATE, keep key statistics, see avstor_key_stats
+    AVSTOR_OPEN_PARENTS     = 0x00010000    // With AVSTOR_OPEN_CREATE, keep parent references, see avstor_get_parent
+};
+
+// Cache priority classes, see avstor_pin_subtree
+enum {
+    AVSTOR_PRIORITY_NORMAL  = 0,
+    AVSTOR_PRIORITY_HIGH    = 1,    // Evicted only when no normal page can be
+    AVSTOR_PRIORITY_PINNED  = 2     // Never evicted
+};
+
+// Maintenance task priorities, see avstor_sched_start
+enum {
+    AVSTOR_TASK_LOW         = 0,
+    AVSTOR_TASK_NORMAL      = 1,
+    AVSTOR_TASK_HIGH        = 2
 };
 
 typedef struct avstor   avstor;
@@ -121,12 +170,85 @@ typedef struct avstor_inorder {
     int                 flags;
 } avstor_inorder;
 
+// Name of a node. Names are ordered by comparer, or byte by byte if comparer is NULL, in which case
+// names differing only in trailing zero bytes are equal. A tree must always use the same order.
 typedef struct avstor_key {
     void                *buf;
     size_t              len;    
     int                 (*comparer)(const void *, const void*);
 } avstor_key;
 
+#define AVSTOR_TRACE_PAGES      32  // Number of pages recorded in avstor_trace
+
+// Cache hits and misses of a page, see avstor_trace
+typedef struct avstor_trace_page {
+    avstor_off          offset;
+    unsigned            hits;
+    unsigned            misses;
+} avstor_trace_page;
+
+// Trace of the calls made by a thread, see avstor_trace_begin
+typedef struct avstor_trace {
+    unsigned            depth;          // deepest tree level reached by key lookups, root is 1
+    unsigned            comparisons;    // key comparisons
+    unsigned            cache_hits;
+    unsigned            cache_misses;
+    unsigned long       bytes_read;
+    unsigned long       lock_wait_us;   // time spent waiting for locks
+    unsigned            page_count;     // number of entries in pages
+    unsigned            untracked_touches;  // hits and misses of pages not in pages, which is full
+    unsigned            lookup_hits;    // lookups answered from the lookup cache, see AVSTOR_OPEN_LOOKUP_CACHE
+    avstor_trace_page   pages[AVSTOR_TRACE_PAGES];
+} avstor_trace;
+
+// Memory allocated for an open file in bytes, see avstor_memory_usage
+typedef struct avstor_memory {
+    size_t              pool_bytes;     // page buffer blocks
+    size_t              pool_used;      // page buffers in use by the cache
+    size_t              cache_items;    // cache items and page tables
+    size_t              other;          // header copies, cache chunk list, mount, tier and pin tables,
+                                        // name dictionary, allocation arenas, write buffer, lookup cache,
+                                        // page checksum tree
+    size_t              total;
+    size_t              limit;          // limit for page buffers, 0 if unlimited, mapped pages not included
+    unsigned            cache_capacity; // cache items, including those added past the cache size
+    size_t              mapped_bytes;   // file bytes accessed through the mapping, see AVSTOR_OPEN_MMAP
+} avstor_memory;
+
+// Children of a key, see avstor_key_stats
+typedef struct avstor_stats {
+    uint64_t            subkeys;
+    uint64_t            values;
+    uint64_t            value_bytes;    // data lengths of the values, as reported by avstor_get_value
+    unsigned            depth;          // level of the key, 1 for keys under the root
+    unsigned            height;         // levels of keys below, only with AVSTOR_STATS_RECURSIVE
+} avstor_stats;
+
+// Totals of the integer values of a name below a key, see avstor_rollup_declare
+typedef struct avstor_rollup {
+    int64_t             sum;
+    int64_t             min;            // 0 if count is 0
+    int64_t             max;
+    uint64_t            count;
+} avstor_rollup;
+
+// Tuple key being encoded or decoded, see avstor_tuple_init
+typedef struct avstor_tuple {
+    unsigned char       *buf;
+    size_t              size;
+    size_t              len;
+    size_t              pos;    // next field to decode
+} avstor_tuple;
+
+// Called by avstor_diff for each difference found. node_a is NULL for AVSTOR_DIFF_ADDED,
+// node_b is NULL for AVSTOR_DIFF_REMOVED. Return nonzero to stop the diff.
+typedef int (*avstor_diff_callback)(void *ctx, int change, const avstor_node *node_a,
+                                    const avstor_node *node_b);
+
+// Called by avstor_join for each name in the result. node_a is NULL if the name is only under the
+// second node, node_b if it is only under the first. Return nonzero to stop the join.
+typedef int (*avstor_join_callback)(void *ctx, const avstor_node *node_a, const avstor_node *node_b);
+
 int AVCALL avstor_open(avstor **db, const char* filename, unsigned szcache, int oflags);
 
 int AVCALL avstor_close(avstor *db);
@@ -163,6 +285,10 @@ int AVCALL avstor_create_link(const avstor_node *parent, const avstor_key *key,
 
 int AVCALL avstor_get_name(const avstor_node *node, avstor_key *key);
 
+int AVCALL avstor_get_parent(const avstor_node *node, avstor_node *out_parent);
+
+int AVCALL avstor_get_path(const avstor_node *node, avstor_node *out_path, unsigned size, unsigned *out_depth);
+
 int AVCALL avstor_get_value(const avstor_node* value, void *buf, size_t szbuf, 
                             unsigned *out_type, size_t *out_bytes, uint32_t *out_length);
 
@@ -199,10 +325,113 @@ int AVCALL avstor_inorder_first(avstor_inorder *st, const avstor_node *parent, c
 
 int AVCALL avstor_inorder_next(avstor_inorder *st, avstor_node *out_node);
 
+int AVCALL avstor_sample(const avstor_node *parent, int flags, unsigned n, avstor_node *out_nodes,
+                         uint64_t rng_seed);
+
+int AVCALL avstor_mount(const avstor_node *key, avstor *src);
+
+int AVCALL avstor_unmount(const avstor_node *key);
+
+int AVCALL avstor_import_file(const avstor_node *parent, const avstor_key *key, const char *src_path);
+
+int AVCALL avstor_tier_open(avstor *db, const char *filename);
+
+int AVCALL avstor_tier_migrate(avstor *db, unsigned idle_seconds, uint32_t *out_pages);
+
+int AVCALL avstor_tier_migrate_async(avstor *db, unsigned idle_seconds, int priority);
+
+int AVCALL avstor_buffer_open(avstor *db, const char *filename);
+
+int AVCALL avstor_buffer_put(const avstor_node *parent, const avstor_key *key, unsigned type,
+                             const void *value, size_t len);
+
+int AVCALL avstor_buffer_delete(const avstor_node *parent, const avstor_key *key);
+
+int AVCALL avstor_buffer_get(const avstor_node *parent, const avstor_key *key, void *buf, size_t szbuf,
+                             unsigned *out_type, size_t *out_bytes, uint32_t *out_length);
+
+int AVCALL avstor_buffer_merge(avstor *db);
+
+int AVCALL avstor_buffer_merge_async(avstor *db, int priority);
+
+int AVCALL avstor_key_stats(const avstor_node *node, int flags, avstor_stats *out_stats);
+
+int AVCALL avstor_rollup_declare(const avstor_node *node, const avstor_key *name);
+
+int AVCALL avstor_rollup_remove(const avstor_node *node, const avstor_key *name);
+
+int AVCALL avstor_rollup_get(const avstor_node *node, const avstor_key *name, avstor_rollup *out_rollup);
+
+int AVCALL avstor_merkle_root(avstor *db, uint32_t *out_root, unsigned *out_levels, avstor_off *out_pages);
+
+int AVCALL avstor_merkle_hashes(avstor *db, unsigned level, avstor_off first, uint32_t *out_hashes,
+                                unsigned count, unsigned *out_count);
+
+int AVCALL avstor_sched_start(unsigned thread_count);
+
+int AVCALL avstor_sched_stop(void);
+
+int AVCALL avstor_sched_set_budget(unsigned kb_per_sec, unsigned iops);
+
+int AVCALL avstor_sched_pause(int paused);
+
+int AVCALL avstor_sched_wait(avstor *db);
+
+int AVCALL avstor_pin_subtree(const avstor_node *node, int priority);
+
+int AVCALL avstor_memory_usage(avstor *db, avstor_memory *out);
+
+int AVCALL avstor_set_memory_limit(avstor *db, size_t limit);
+
+int AVCALL avstor_intern(avstor *db, const avstor_key *name);
+
+int AVCALL avstor_get_file_flags(avstor *db, uint32_t *out_flags);
+
+int AVCALL avstor_diff(const avstor_node *node_a, const avstor_node *node_b,
+                       int (*comparer)(const void *, const void *),
+                       avstor_diff_callback callback, void *ctx);
+
+int AVCALL avstor_join(const avstor_node *node_a, const avstor_node *node_b, int mode, int flags,
+                       avstor_join_callback callback, void *ctx);
+
+void AVCALL avstor_tuple_init(avstor_tuple *tuple, void *buf, size_t size);
+
+void AVCALL avstor_tuple_parse(avstor_tuple *tuple, const void *buf, size_t len);
+
+int AVCALL avstor_tuple_add_int64(avstor_tuple *tuple, int64_t value);
+
+int AVCALL avstor_tuple_add_double(avstor_tuple *tuple, double value);
+
+int AVCALL avstor_tuple_add_bytes(avstor_tuple *tuple, const void *value, size_t len);
+
+int AVCALL avstor_tuple_add_string(avstor_tuple *tuple, const char *value);
+
+int AVCALL avstor_tuple_range_end(avstor_tuple *tuple);
+
+void AVCALL avstor_tuple_key(const avstor_tuple *tuple, avstor_key *key);
+
+int AVCALL avstor_tuple_type(const avstor_tuple *tuple);
+
+int AVCALL avstor_tuple_get_int64(avstor_tuple *tuple, int64_t *out_val);
+
+int AVCALL avstor_tuple_get_double(avstor_tuple *tuple, double *out_val);
+
+int AVCALL avstor_tuple_get_bytes(avstor_tuple *tuple, void *buf, size_t szbuf, size_t *out_len);
+
+int AVCALL avstor_tuple_get_string(avstor_tuple *tuple, char *buf, size_t szbuf);
+
+void AVCALL avstor_trace_begin(avstor_trace *trace);
+
+void AVCALL avstor_trace_end(void);
+
 const char* AVCALL avstor_get_errstr(void);
 
 int AVCALL avs_check_cache_consistency(avstor *db);
 
+int AVCALL avs_set_file_flags(avstor *db, uint32_t flags);
+
+int AVCALL avs_get_pool_page(avstor *db, unsigned page_pool, avstor_off *out_page);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,6 +30,10 @@
 * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1   // for fallocate()
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -39,11 +43,20 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <avstor.h>
 
 #define PAGE_SIZE               4096
-#define L2_ASSOC                8
+#define CACHE_CHUNK_ITEMS       64
+#define CACHE_SCAN_ITEMS        16      // Items last loaded by scans, at most a quarter of the cache
+#define CACHE_SCAN_LOADED       1
+#define CACHE_SCAN_USED         2
+#define TIER_EXTENT_PAGES       64
+#define TIER_SLOT_NONE          0xFFFFFFFFu     // Page was written to the file again after it was moved
+#define TIER_SLOT_HOLE          0x80000000u     // Page is a hole in the file, read from the slot in the low bits
+#define MAP_PAGE_CHECKED        0x40000000      // Checksum of a page in the file mapping was verified
+#define SCHED_CANCEL_POLL_MS    10      // Longest sleep of a throttled task before it checks for cancellation
 
 #if defined(__I86__) || defined(M_I86) || defined(_M_I86)
 #if !defined(__I86__)
@@ -68,6 +81,7 @@
 #endif
 
 #if defined(__unix__)
+#include <sys/mman.h>
 #include <unistd.h>
 #define stricmp strcasecmp
 #else
@@ -87,6 +101,11 @@
 #define atomic_dec_int(addend)                (atomic_fetch_add((addend), -1) - 1)
 #define atomic_load_int_acquire(x)            atomic_load_explicit((x), memory_order_acquire)
 #define atomic_store_int_release(x, value)    atomic_store_explicit((x), (value), memory_order_release)
+#define atomic_cas_int(obj, expected, value)  atomic_compare_exchange_strong((obj), (expected), (value))
+#define atomic_ptr(type)                      _Atomic(type*)
+#define atomic_load_ptr_acquire(x)            atomic_load_explicit((x), memory_order_acquire)
+#define atomic_store_ptr_release(x, value)    atomic_store_explicit((x), (value), memory_order_release)
+#define avthrd_yield()                        thrd_yield()
 
 #else
 
@@ -99,6 +118,15 @@
 #define atomic_dec_int                        _atomic_dec
 #define atomic_load_int_acquire               atomic_load
 #define atomic_store_int_release              atomic_store
+#define atomic_cas_int                        atomic_compare_exchange_strong
+#define avthrd_yield()                        thrd_yield()
+
+// The custom atomics only handle ints and target x86, where aligned pointers are read and written
+// atomically and stores are not reordered with other stores, nor loads with other loads. Volatile
+// keeps the compiler from reordering them.
+#define atomic_ptr(type)                      type* volatile
+#define atomic_load_ptr_acquire(obj)          (*(obj))
+#define atomic_store_ptr_release(obj,value)   (void)(*(obj) = (value))
 
 #endif
 
@@ -125,6 +153,11 @@
 #define atomic_dec_int(obj)                   (--(*(obj)))
 #define atomic_load_int_acquire(obj)          (*(obj))
 #define atomic_store_int_release(obj,value)   (void)(*(obj) = (value))
+#define atomic_cas_int(obj,expected,value)    (*(obj) == *(expected) ? (*(obj) = (value), 1) : (*(expected) = *(obj), 0))
+#define atomic_ptr(type)                      type*
+#define atomic_load_ptr_acquire(obj)          (*(obj))
+#define atomic_store_ptr_release(obj,value)   (void)(*(obj) = (value))
+#define avthrd_yield()                        ((void)0)
 
 #endif
 
@@ -213,21 +246,39 @@
 #if !defined(AVSTOR_CONFIG_FILE_64BIT) || defined(__DOS__)
 #define MAX_FILE_PAGES          (0x80000000U / (unsigned)PAGE_SIZE - 1U)
 #elif defined(AVSTOR_CONFIG_FILE_64BIT)
-#define MAX_FILE_PAGES          0x0FFFFFFFFU
+// page offsets must fit in 64 bits, see AVSTOR_FILE_PAGE64
+#define MAX_FILE_PAGES          ((((avstor_off)1) << 52) - 1U)
 #endif
 #define INVALID_INDEX           0
 #define PAGE_HDR                0x00u
 #define PAGE_KEYS               0x01u
+#define PAGE_MERKLE             0x02u   // Page checksums of the checksum tree, see AVSTOR_OPEN_MERKLE
+#define PAGE_MERKLE_DIR         0x03u   // Page numbers of PAGE_MERKLE pages
 #define PAGE_DIRTY              0x80u
+#define PAGE_FLAG_KEYS          0x01u   // Page was allocated for key nodes
 #define NODE_TYPEMASK           (0x0Fu << 2u)
 #define NODE_SIZEMASK           0xFFC0u
 #define BF_MASK                 0x03u
+#define NODE_BLOB               0x09u   // Shared content of deduplicated values
+#define NODE_BLOBREF            0x0Au   // Deduplicated binary value
+#define NODE_NAME               0x0Bu   // Entry of the name dictionary, see avstor_intern
+#define NODE_ROLLUP             0x0Cu   // Totals of the values of a name below a key, see avstor_rollup_declare
+#define KEY_FLAG_ROLLUPS        0x01u   // Set in AvKey.flags of keys with rollups
+#define NAME_INTERNED           0x01u   // Set in szname of nodes whose name is a dictionary id
+#define NAME_ID_NONE            0xFFFFFFFFu
+#define NAME_PREFIX_LEN         8u      // Bytes of a name compared at once, see compare_bytes
 #define NODE_FLAG_VAR           1
 #define NODE_FLAG_LONGVAR       2
 #define MAX_KEY_LEN             240u
 #define MAX_BINARY_LEN          250u
 #define MAX_STRING_LEN          250u
+#define MIN_DEDUP_LEN           32u
 #define SIZE_PAGE_HDR           offsetof(AvPage, hdr_end)
+#define MERKLE_FANOUT           64u     // hashes of a level of the checksum tree combined into one
+#define MERKLE_PAGE_LEAVES      960u    // page checksums per PAGE_MERKLE page, a multiple of MERKLE_FANOUT
+#define MERKLE_DIR_ENTRIES      480u    // page numbers per PAGE_MERKLE_DIR page
+#define MERKLE_MAX_LEVELS       10u     // levels of the checksum tree of a file of MAX_FILE_PAGES pages
+#define SAMPLE_ATTEMPTS         32u     // random descents per node picked by avstor_sample
 #define SIZE_NODE_HDR           offsetof(AvNode, name)
 #define PAGE_MASK               (~((uintptr_t)PAGE_SIZE - 1u))
 #define OFFSET_MASK             (~((avstor_off)PAGE_SIZE - 1u))
@@ -236,6 +287,7 @@
 #define NODE_TYPE(node)         (((node)->hdr & NODE_TYPEMASK) >> 2)
 
 #define get_node_size(node)     ((unsigned)((node)->hdr & NODE_SIZEMASK) >> 4u)
+#define get_name_size(node)     ((unsigned)((node)->szname & ~NAME_INTERNED))
 #define align_node(sz)          (((sz) + 3) & ~0x3u)
 
 #if defined(NDEBUG)
@@ -279,6 +331,7 @@ typedef struct ExceptionFrame
 typedef struct AvTLSData {
     ExceptionFrame          *tls_cur_ex;
     const char              *tls_last_err_msg;
+    avstor_trace            *tls_trace;
 } AvTLSData;
 #endif
 
@@ -313,6 +366,9 @@ typedef struct rwl_t {
 } rwl_t;
 #endif
 
+// Page number in the file, 64-bit in 64-bit files
+typedef avstor_off AvPageNum;
+
 // Since nodes in 64-bit files are also 4-byte aligned, we use this
 // struct rather than using int64_t directly to retain 4 byte alignment
 typedef struct NodeRef {
@@ -326,8 +382,31 @@ typedef struct NodeRef {
 typedef struct AvPage AvPage;
 typedef struct {
     AvPage*             page;
-    avstor_off          offset;
-    uint32_t            load_time;
+
+    // offset of the loaded page, 0 while the item is free or a page is being loaded into it. Only
+    // changed while the page is claimed, so it is stable for whoever locks the page.
+    volatile avstor_off offset;
+
+    // offset the item is filed under in the page table, 0 if free. Protected by the cache lock
+    avstor_off          key;
+
+    // page number of key folded to 32 bits, 0 if free. Compared by lookups without the cache lock
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    volatile atomic_int tag;
+#else
+    int                 tag;
+#endif
+
+    // eviction class, see AVSTOR_PRIORITY_NORMAL
+    uint32_t            priority;
+
+    // set when the page is used, cleared when the clock hand passes it
+    volatile uint32_t   referenced;
+
+    // CACHE_SCAN_LOADED while the item is in the ring of scan items, CACHE_SCAN_USED once the page
+    // is used again. Lookups then don't set referenced, since they are mostly of the nodes the scan
+    // returns. Cleared when the item leaves the ring.
+    volatile uint32_t   scanned;
 } CacheItem;
 
 // Represents page data in the file
@@ -356,10 +435,13 @@ struct AvPage {
     // bit field, PAGE_DIRTY denotes modified pages
     uint8_t             status;
 
-    // PAGE_HDR, PAGE_KEYS
+    // PAGE_HDR, PAGE_KEYS, PAGE_MERKLE, PAGE_MERKLE_DIR
     uint8_t             type;
 
-    uint8_t             reserved[2];
+    // PAGE_FLAG_KEYS
+    uint8_t             page_flags;
+
+    uint8_t             reserved;
 
     union {
         // Header page (first page in file), type PAGE_HDR
@@ -386,6 +468,42 @@ struct AvPage {
             // page number of the last page a node was inserted into
             uint32_t            page_pool[256];
 
+            // root of the tree of deduplicated blobs, see AVSTOR_OPEN_DEDUP
+            NodeRef             root_blobs;
+#if !defined(AVSTOR_CONFIG_FILE_64BIT)
+            int32_t             pad_root_blobs;
+#endif
+
+            // root of the name dictionary, see avstor_intern
+            NodeRef             root_names;
+#if !defined(AVSTOR_CONFIG_FILE_64BIT)
+            int32_t             pad_root_names;
+#endif
+
+            // high 32 bits of pagecount and page_pool entries in 64-bit files, valid if
+            // AVSTOR_FILE_PAGE64 is set, see get_pagecount
+            uint32_t            pagecount_hi;
+            uint32_t            page_pool_hi[256];
+
+            // sequence number of the last write buffer record merged into the file, low word
+            // first, see avstor_buffer_open
+            uint32_t            buffer_seq[2];
+
+            // root hash of the page checksum tree and page number of its first directory page,
+            // low word first, valid if AVSTOR_FILE_MERKLE is set, see AVSTOR_OPEN_MERKLE
+            uint32_t            merkle_root;
+            uint32_t            merkle_dir[2];
+
+            // number of keys under the root, valid if AVSTOR_FILE_KEYSTATS is set
+            uint32_t            root_subkeys;
+
+            // root of the tree of rollups, keyed by the offset of the key they belong to, see
+            // avstor_rollup_declare
+            NodeRef             root_rollups;
+#if !defined(AVSTOR_CONFIG_FILE_64BIT)
+            int32_t             pad_root_rollups;
+#endif
+
             // placeholder for end of hdr
             char                hdr_end;
         };
@@ -409,24 +527,44 @@ struct AvPage {
             // it is done this way
             uint16_t            nodes[1];
         };
+
+        // Side page of the page checksum tree, type PAGE_MERKLE or PAGE_MERKLE_DIR
+        struct {
+            // next directory page, low word first, 0 at the end of the chain
+            uint32_t            merkle_next[2];
+
+            // checksums of MERKLE_PAGE_LEAVES consecutive pages, or the page numbers of
+            // MERKLE_DIR_ENTRIES PAGE_MERKLE pages, low word first, 0 past the last one
+            uint32_t            merkle_items[1];
+        };
     };
 };
 
-typedef struct CacheRow {
-#ifdef AVSTOR_CONFIG_THREAD_SAFE
-    rwl_t               lock;
-#endif
-    uint32_t            load_count;
-    unsigned            capacity;
-    CacheItem*          items;
-} CacheRow;
+// Open addressing table of cache items by page offset, at most half full. Tables and items are
+// published to lookups without the cache lock by release stores to PageCache.table and slots.
+typedef struct CacheTable {
+    struct CacheTable*  retired;    // previous, smaller table
+    unsigned            mask;
+    atomic_ptr(CacheItem) slots[1];
+} CacheTable;
 
 typedef struct PageCache {
-    CacheRow*           rows;
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    AvMutex             lock;       // serializes loading, eviction and changes to the table
+#endif
+    atomic_ptr(CacheTable) table;
+    CacheItem**         chunks;     // items are allocated in chunks so they never move
+    unsigned            chunk_count;
+    unsigned            item_count;
+    unsigned            item_target;
+    unsigned            hand;       // clock hand for eviction
+    // ring of the items last loaded by scans, with the offsets they were loaded with
+    CacheItem*          scan_items[CACHE_SCAN_ITEMS];
+    avstor_off          scan_offsets[CACHE_SCAN_ITEMS];
+    unsigned            scan_head;
+    unsigned            scan_count;
     AvPage*             header;
     AvPage*             old_header;
-    unsigned            l2_len;
-    unsigned            l2_mask;
 } PageCache;
 
 typedef struct BufferPool {
@@ -437,8 +575,145 @@ typedef struct BufferPool {
     unsigned            capacity;
     unsigned            count;
     unsigned            next_page;
+
+    // maximum number of blocks, 0 if unlimited. See avstor_set_memory_limit
+    unsigned            max_count;
 } BufferPool;
 
+typedef struct AvPageMapItem {
+    // page number in the file, 0 if unused
+    AvPageNum           page;
+    // wide enough to hold a page number, costs no space over uint32_t once padded
+    AvPageNum           value;
+} AvPageMapItem;
+
+// Open addressing hash table of values attached to page numbers
+typedef struct AvPageMap {
+    AvPageMapItem       *items;
+    unsigned            mask;
+    unsigned            count;
+} AvPageMap;
+
+// Secondary file holding cold pages, see avstor_tier_open
+typedef struct AvTier {
+    int                 file;
+
+    // number of pages in the tier file, which is only appended to
+    uint32_t            slot_count;
+
+    // page number in the tier file of pages moved there, with TIER_SLOT_HOLE set once the page
+    // is punched out of the file
+    AvPageMap           map;
+
+    // time of last access per extent of TIER_EXTENT_PAGES pages, in seconds since
+    // base_time plus one; 0 if not accessed since the tier file was opened. Atomic since
+    // it is updated by readers.
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    volatile atomic_int *access_time;
+#else
+    int                 *access_time;
+#endif
+    uint32_t            extent_count;
+    time_t              base_time;
+} AvTier;
+
+// Value mutation held by the write buffer, which is also the format of its records in the log
+typedef struct AvBufEntry {
+    uint32_t            checksum;   // of the record after this field
+    uint32_t            size;       // of the record
+    uint64_t            seq;        // sequence number, increasing with each record
+    avstor_off          parent;     // key the value is under
+    uint32_t            key_len;
+    uint32_t            value_len;
+    uint32_t            type;       // type of the value, or BUFFER_DELETE
+    uint32_t            parent_len; // of the name of parent
+
+    // key, value, then the name of parent, which tells whether parent still is the same key
+    char                data[1];
+} AvBufEntry;
+
+// Value mutations waiting to be merged into the tree, see avstor_buffer_open
+typedef struct AvWriteBuffer {
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    AvMutex             lock;
+    AvMutex             merge_lock; // held by the merge in progress
+#endif
+    int                 file;
+    avstor_off          log_size;   // offset the next record is written at
+    uint64_t            seq;        // of the last record written
+
+    // entries ordered by parent and key, see buffer_compare
+    AvBufEntry          **entries;
+    unsigned            count;
+    unsigned            capacity;
+
+    // older entries taken by a merge, kept until it is committed
+    AvBufEntry          **merging;
+    unsigned            merge_count;
+
+    size_t              bytes;      // of all entries
+    int                 merge_queued;
+} AvWriteBuffer;
+
+#define LOOKUP_SLOTS            4096    // entries of the lookup cache, a power of 2
+#define LOOKUP_STRIPES          16      // slots are locked in this many interleaved groups
+
+// Node found by avstor_find, see AVSTOR_OPEN_LOOKUP_CACHE. The slot is unused if node is 0.
+typedef struct AvLookupSlot {
+    avstor_off          parent;
+    avstor_off          node;
+    uint32_t            hash;       // of the name, see lookup_hash
+} AvLookupSlot;
+
+// Nodes recently found by parent and name, filed in one slot each, see AVSTOR_OPEN_LOOKUP_CACHE
+typedef struct AvLookupCache {
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    AvMutex             locks[LOOKUP_STRIPES];  // slot i is protected by lock i % LOOKUP_STRIPES
+#endif
+    AvLookupSlot        slots[LOOKUP_SLOTS];
+} AvLookupCache;
+
+// Page checksum tree, see AVSTOR_OPEN_MERKLE
+typedef struct AvMerkle {
+    // hashes by level, level 0 holds page checksums and the top level the root
+    uint32_t            *hashes[MERKLE_MAX_LEVELS];
+    AvPageNum           counts[MERKLE_MAX_LEVELS];
+    unsigned            levels;
+    AvPageNum           capacity;   // of level 0, that of the other levels follows from it
+
+    // PAGE_MERKLE pages, 0 if not yet allocated, and whether each has checksums not yet written
+    AvPageNum           *pages;
+    char                *dirty;
+    size_t              page_count;
+
+    // PAGE_MERKLE_DIR pages, those from dirs_stale on must be written again
+    AvPageNum           *dirs;
+    size_t              dir_count;
+    size_t              dirs_stale;
+} AvMerkle;
+
+// Another file mounted at a key, see avstor_mount
+typedef struct AvMount {
+    avstor_off          key;
+    avstor              *db;
+} AvMount;
+
+// Name of the dictionary, indexed by id, see avstor_intern
+typedef struct AvName {
+    unsigned            len;
+    char                *buf;
+} AvName;
+
+// Insertion pages of a writing thread, see AVSTOR_OPEN_ARENAS
+typedef struct AvArena AvArena;
+struct AvArena {
+    AvArena             *next;
+    const void          *owner;
+
+    // page number of the last page a node was inserted into, by page pool + 1
+    AvPageMap           pools;
+};
+
 struct avstor {
 #if defined(AVSTOR_CONFIG_THREAD_SAFE)
     rwl_t               global_rwl;
@@ -448,9 +723,51 @@ struct avstor {
 #endif
     int                 file;
     int                 oflags;
-    unsigned            l2_size;
     BufferPool          bpool;
     PageCache           cache;
+    AvMount             *mounts;
+    unsigned            mount_count;
+    AvTier              *tier;
+    AvWriteBuffer       *wbuf;
+    AvLookupCache       *lookups;
+    AvMerkle            *merkle;
+
+    // cache priority of pinned pages, see avstor_pin_subtree
+    AvPageMap           pins;
+
+    // name dictionary loaded from the file and an index of its names by hash. Names added
+    // after the last commit are dropped on rollback.
+    AvName              *names;
+    unsigned            name_count;
+    unsigned            name_capacity;
+    unsigned            names_committed;
+    size_t              names_bytes;
+    AvPageMap           name_index;
+
+    // insertion pages of each thread that wrote since the last commit, see AVSTOR_OPEN_ARENAS
+    AvArena             *arenas;
+    unsigned            arena_count;
+
+    // copy-on-write mapping of the pages below map_size, used in place of the cache, see
+    // AVSTOR_OPEN_MMAP. Bit n of map_touched is set once a writer locked page n since the last
+    // commit or rollback. Writing to a page would copy it, so the lock count of page n is kept in
+    // map_locks[n], along with MAP_PAGE_CHECKED once its checksum was verified.
+    char                *map;
+    avstor_off          map_size;
+    uint32_t            *map_touched;
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    volatile atomic_int *map_locks;
+#else
+    int                 *map_locks;
+#endif
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    // maintenance tasks queued or running for this file and the first error they returned, and
+    // whether the file is being closed, protected by the scheduler mutex
+    unsigned            task_count;
+    int                 task_result;
+    int                 task_cancelled;
+#endif
 };
 
 typedef struct AvStackData AvStackData;
@@ -482,7 +799,20 @@ struct AvKey {
     NodeRef             subkey_root;
     NodeRef             value_root;
     uint16_t            level;
-    uint8_t             pad[2];
+
+    // KEY_FLAG_ROLLUPS
+    uint8_t             flags;
+    uint8_t             pad;
+};
+
+// Follows AvKey in files with AVSTOR_FILE_KEYSTATS. Value nodes of those files and of files with
+// AVSTOR_FILE_PARENTS end with the reference of the key they belong to, and keys of files with
+// AVSTOR_FILE_PARENTS with that of their parent. It is empty for internal nodes and keys under
+// the root, see get_node_owner.
+struct AvKeyStats {
+    uint32_t            subkeys;
+    uint32_t            values;
+    uint32_t            value_bytes[2]; // low word first
 };
 
 // int32 node
@@ -517,6 +847,32 @@ struct AvLinkValue {
     NodeRef             link;
 };
 
+// Shared blob of deduplicated values. Length must come first, as in AvVarValue.
+struct AvBlobValue {
+    uint8_t             length;
+    uint8_t             pad[3];
+    uint32_t            refcount;
+};
+
+// Deduplicated binary value
+struct AvBlobRefValue {
+    NodeRef             blob;
+};
+
+// Entry of the name dictionary, named by its id. Length must come first, as in AvVarValue.
+struct AvNameValue {
+    uint8_t             length;
+};
+
+// Rollup of a key, named by the name of the values it covers, in the tree of rollups. Sums and
+// bounds are int64 values, stored like those of AvInt64Value.
+struct AvRollupValue {
+    uint32_t            sum[2];
+    uint32_t            min[2];
+    uint32_t            max[2];
+    uint32_t            count[2];
+};
+
 // Fixed data portion of node
 typedef union AvNodeData {
     struct AvKey            vkey;
@@ -525,6 +881,10 @@ typedef union AvNodeData {
     struct AvVarValue       vvar;
     struct AvLVarValue      vlongvar;
     struct AvLinkValue      vLink;
+    struct AvBlobValue      vBlob;
+    struct AvBlobRefValue   vBlobRef;
+    struct AvNameValue      vName;
+    struct AvRollupValue    vRollup;
 } AvNodeData;
 
 typedef struct AvNodeClass {
@@ -574,10 +934,10 @@ static const AvNodeClass NODE_CLASS[16] = {
     { sizeof(struct AvLVarValue), NODE_FLAG_LONGVAR },  // 0x06  (NODE_LONGSTRING)
     { sizeof(struct AvLVarValue), NODE_FLAG_LONGVAR },  // 0x07  (NODE_LONGBINARY)
     { sizeof(struct AvLinkValue), 0 },                  // 0x08  (NODE_LINK)
-    { 0, 0 },                                           // 0x09  (unused)
-    { 0, 0 },                                           // 0x0A  (unused)
-    { 0, 0 },                                           // 0x0B  (unused)
-    { 0, 0 },                                           // 0x0C  (unused)
+    { sizeof(struct AvBlobValue), NODE_FLAG_VAR },      // 0x09  (NODE_BLOB)
+    { sizeof(struct AvBlobRefValue), 0 },               // 0x0A  (NODE_BLOBREF)
+    { sizeof(struct AvNameValue), NODE_FLAG_VAR },      // 0x0B  (NODE_NAME)
+    { sizeof(struct AvRollupValue), 0 },                // 0x0C  (NODE_ROLLUP)
     { 0, 0 },                                           // 0x0D  (unused)
     { 0, 0 },                                           // 0x0E  (unused)
     { 0, 0 }                                            // 0x0F  (unused)
@@ -588,6 +948,7 @@ static DWORD tls_idx;
 
 #define cur_ex              ((AvTLSData*)TlsGetValue(tls_idx))->tls_cur_ex
 #define last_err_msg        ((AvTLSData*)TlsGetValue(tls_idx))->tls_last_err_msg
+#define cur_trace           ((AvTLSData*)TlsGetValue(tls_idx))->tls_trace
 
 #elif defined(__OS2__) && defined(AVSTOR_CONFIG_THREAD_SAFE)
 // thread locals don't work under OS/2 and Watcom
@@ -595,6 +956,7 @@ static tss_t tls_idx;
 
 #define cur_ex              ((AvTLSData*)tss_get(tls_idx))->tls_cur_ex
 #define last_err_msg        ((AvTLSData*)tss_get(tls_idx))->tls_last_err_msg
+#define cur_trace           ((AvTLSData*)tss_get(tls_idx))->tls_trace
 
 #else
 static
@@ -604,6 +966,11 @@ ExceptionFrame *cur_ex = NULL;
 static
 THREAD_LOCAL
 const char* last_err_msg = NULL;
+
+// see avstor_trace_begin
+static
+THREAD_LOCAL
+avstor_trace *cur_trace = NULL;
 #endif
 
 #if defined(_WINDLL) || (defined(__OS2__) && defined(AVSTOR_CONFIG_THREAD_SAFE))
@@ -611,9 +978,13 @@ static void init_tls_vars(void)
 {
     cur_ex = NULL;
     last_err_msg = NULL;
+    cur_trace = NULL;
 }
 #endif
 
+// The address of a thread-local variable identifies the calling thread
+#define cur_thread_id       ((const void*)&cur_trace)
+
 #define is_invalid_avstor_key(key)   ((key)->len > MAX_KEY_LEN)
 
 NORETURN
@@ -843,24 +1214,56 @@ static void rwl_destroy(rwl_t *rwl)
     rwl->lock = 0;
 }
 
+// Monotonic clock in microseconds
+static uint64_t clock_us(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)count.QuadPart / (uint64_t)freq.QuadPart * 1000000u
+        + (uint64_t)count.QuadPart % (uint64_t)freq.QuadPart * 1000000u / (uint64_t)freq.QuadPart;
+#elif defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)(ts.tv_nsec / 1000);
+#else
+    return (uint64_t)time(NULL) * 1000000u;
+#endif
+}
+
 static void rwl_lock_shared(rwl_t *rwl)
 {
+    uint64_t wait_start = 0;
     avmtx_lock(&rwl->mtx);
     while (rwl->lock < 0 || (rwl->lock & 1)) {
+        if (cur_trace && !wait_start) {
+            wait_start = clock_us();
+        }
         avcnd_wait(&rwl->cv, &rwl->mtx);
     }
     rwl->lock += 2;
     avmtx_unlock(&rwl->mtx);
+    if (wait_start) {
+        cur_trace->lock_wait_us += (unsigned long)(clock_us() - wait_start);
+    }
 }
 
 static void rwl_lock_exclusive(rwl_t *rwl)
 {
+    uint64_t wait_start = 0;
     avmtx_lock(&rwl->mtx);
     while (rwl->lock != 0) {
+        if (cur_trace && !wait_start) {
+            wait_start = clock_us();
+        }
         avcnd_wait(&rwl->cv, &rwl->mtx);
     }
     rwl->lock = -2;
     avmtx_unlock(&rwl->mtx);
+    if (wait_start) {
+        cur_trace->lock_wait_us += (unsigned long)(clock_us() - wait_start);
+    }
 }
 
 static int rwl_upgrade(rwl_t *rwl)
@@ -900,7 +1303,7 @@ static void rwl_release(rwl_t *rwl)
     if (rwl->lock == 3) {
         avcnd_signal(&rwl->cv_upgr);
     }
-    else if ((lock & ~1) == -2 && (rwl->lock & ~1) == 0) {
+    else if ((rwl->lock & ~1) == 0) {
         avmtx_unlock(&rwl->mtx);
         avcnd_broadcast(&rwl->cv);
         return;
@@ -909,22 +1312,20 @@ unlock_and_exit:
     avmtx_unlock(&rwl->mtx);
 }
 
-static int rwl_upgrade_or_lock_exclusive(rwl_t *rwl)
+// Returns whether the calling thread holds the lock exclusively, provided it holds the lock. The
+// state is read without the mutex: other threads cannot change its sign until the caller releases.
+static __inline int rwl_is_exclusive(const rwl_t *rwl)
 {
-    if (rwl_upgrade(rwl)) {
-        return 1;
-    }
-    rwl_release(rwl);
-    rwl_lock_exclusive(rwl);
-    return 0;
+    return rwl->lock < 0;
 }
 
-static int rwl_upgrade_or_release(rwl_t *rwl)
+static int rwl_upgrade_or_lock_exclusive(rwl_t *rwl)
 {
     if (rwl_upgrade(rwl)) {
         return 1;
     }
     rwl_release(rwl);
+    rwl_lock_exclusive(rwl);
     return 0;
 }
 #else
@@ -934,7 +1335,7 @@ static int rwl_upgrade_or_release(rwl_t *rwl)
 #define rwl_lock_exclusive(rwl) ((void)0)
 #define rwl_release(rwl) ((void)0)
 #define rwl_upgrade_or_lock_exclusive(rwl) (1)
-#define rwl_upgrade_or_release(rwl) (1)
+#define rwl_is_exclusive(rwl) (1)
 #define avmtx_init(mtx) (1)
 #define avmtx_destroy(mtx) ((void)0)
 #define avmtx_lock(mtx) ((void)0)
@@ -1054,6 +1455,9 @@ static AvPage* bpool_alloc_page(BufferPool *bp)
     AvPage *result = NULL;
     avmtx_lock(&bp->lock);
     if (bp->next_page >= PAGES_PER_BLOCK) {
+        if (bp->max_count != 0 && bp->count >= bp->max_count) {
+            goto err_alloc;
+        }
         if (bp->count >= bp->capacity) {
             AvPage **new_blocks;
             bp->capacity *= 2;
@@ -1105,31 +1509,33 @@ static int io_commit(int fid)
     return FlushFileBuffers((HANDLE)(intptr_t)fid);
 }
 
-static int io_read(avstor *db, void *buf, avstor_off pos, unsigned count)
+static int io_read(avstor *db, int file, void *buf, avstor_off pos, unsigned count)
 {
     OVERLAPPED ovlp;
     DWORD bytes;
+    (void)db;
     ZeroMemory(&ovlp, sizeof(ovlp));
     ovlp.Offset = (DWORD)pos;
 #if defined(AVSTOR_CONFIG_FILE_64BIT)
     ovlp.OffsetHigh = pos >> 32;
 #endif
-    if (!ReadFile((HANDLE)(intptr_t)db->file, buf, count, &bytes, &ovlp)) {
+    if (!ReadFile((HANDLE)(intptr_t)file, buf, count, &bytes, &ovlp)) {
         return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
     }
     return (int)bytes;
 }
 
-static int io_write(avstor *db, const void *buf, avstor_off pos, unsigned count)
+static int io_write(avstor *db, int file, const void *buf, avstor_off pos, unsigned count)
 {
     OVERLAPPED ovlp;
     DWORD bytes;
+    (void)db;
     ZeroMemory(&ovlp, sizeof(ovlp));
     ovlp.Offset = (DWORD)pos;
 #if defined(AVSTOR_CONFIG_FILE_64BIT)
     ovlp.OffsetHigh = pos >> 32;
 #endif
-    if (!WriteFile((HANDLE)(intptr_t)db->file, buf, count, &bytes, &ovlp)) {
+    if (!WriteFile((HANDLE)(intptr_t)file, buf, count, &bytes, &ovlp)) {
         return -1;
     }
     return (int)bytes;
@@ -1168,14 +1574,16 @@ static int io_commit(int fid)
 
 #if defined(__unix__)
 
-static int io_read(avstor *db, void *buf, avstor_off pos, unsigned count)
+static int io_read(avstor *db, int file, void *buf, avstor_off pos, unsigned count)
 {
-    return pread(db->file, buf, count, (off_t)pos);
+    (void)db;
+    return pread(file, buf, count, (off_t)pos);
 }
 
-static int io_write(avstor *db, const void *buf, avstor_off pos, unsigned count)
+static int io_write(avstor *db, int file, const void *buf, avstor_off pos, unsigned count)
 {
-    return pwrite(db->file, buf, count, (off_t)pos);
+    (void)db;
+    return pwrite(file, buf, count, (off_t)pos);
 }
 
 #else
@@ -1197,17 +1605,17 @@ static int io_seek(int fid, avstor_off pos)
 #endif
 }
 
-static int io_read(avstor *db, void *buf, avstor_off pos, unsigned count)
+static int io_read(avstor *db, int file, void *buf, avstor_off pos, unsigned count)
 {
     int result;
 #if defined(IO_REQUIRES_SYNC)
     avmtx_lock(&db->io_mtx);
 #endif
-    if (!io_seek(db->file, pos)) {
+    if (!io_seek(file, pos)) {
         result = -1;
     }
     else {
-        result = read(db->file, buf, count);
+        result = read(file, buf, count);
     }
 #if defined(IO_REQUIRES_SYNC)
     avmtx_unlock(&db->io_mtx);
@@ -1215,17 +1623,17 @@ static int io_read(avstor *db, void *buf, avstor_off pos, unsigned count)
     return result;
 }
 
-static int io_write(avstor *db, const void *buf, avstor_off pos, unsigned count)
+static int io_write(avstor *db, int file, const void *buf, avstor_off pos, unsigned count)
 {
     int result;
 #if defined(IO_REQUIRES_SYNC)
     avmtx_lock(&db->io_mtx);
 #endif
-    if (!io_seek(db->file, pos)) {
+    if (!io_seek(file, pos)) {
         result = -1;
     }
     else {
-        result = write(db->file, buf, count);
+        result = write(file, buf, count);
     }
 #if defined(IO_REQUIRES_SYNC)
     avmtx_unlock(&db->io_mtx);
@@ -1240,6 +1648,37 @@ static int io_write(avstor *db, const void *buf, avstor_off pos, unsigned count)
 //}
 #endif
 
+#if defined(__linux__)
+#define IO_PUNCH_HOLE 1
+
+// Deallocates a range of the file, which reads as zeros afterwards
+static int io_punch_hole(int fid, avstor_off pos, avstor_off len)
+{
+    return fallocate(fid, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)pos, (off_t)len) == 0;
+}
+#endif
+
+#if defined(__unix__)
+#define IO_MMAP 1
+
+// Maps len bytes of a file privately: stores to the mapping are never written back to the file,
+// so a crash cannot expose uncommitted pages. Returns NULL on failure.
+static void* io_map(int fid, avstor_off len)
+{
+    void *result;
+    if ((avstor_off)(size_t)len != len) {
+        return NULL;
+    }
+    result = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fid, 0);
+    return result == MAP_FAILED ? NULL : result;
+}
+
+static void io_unmap(void *addr, avstor_off len)
+{
+    (void)munmap(addr, (size_t)len);
+}
+#endif
+
 static int offset_comparer(const void* v1, const void* v2)
 {
     avstor_off ofs1, ofs2;
@@ -1290,6 +1729,25 @@ static __inline void unlock_page(AvPage *page)
 #endif
 }
 
+// Locks a page unless it is claimed for eviction or loading. Returns 0 if it is
+static __inline int try_lock_page(AvPage *page)
+{
+    int count = atomic_load_int_acquire(&page->lock_count);
+    while (count >= 0) {
+        if (atomic_cas_int(&page->lock_count, &count, count + 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Claims an unlocked page for eviction or loading. Lookups of the page fail until it is released
+static __inline int cache_claim_page(AvPage *page)
+{
+    int count = 0;
+    return atomic_cas_int(&page->lock_count, &count, -1);
+}
+
 static __inline void set_page_dirty(AvPage *page)
 {
     page->status |= PAGE_DIRTY;
@@ -1307,11 +1765,12 @@ static __inline int is_page_dirty(AvPage *page)
 
 static const uint32_t MOD_ADLER = 65521;
 
-static uint32_t compute_page_checksum(AvPage *page)
+// Computes the checksum of a page, reading its checksum field as 0 without writing to the page
+static uint32_t compute_page_checksum(const AvPage *page)
 {
-    unsigned char *cp = (unsigned char*)page;
-    uint32_t a = 1, b = 0;
-    unsigned cnt = PAGE_SIZE;
+    const unsigned char *cp = (const unsigned char*)page + sizeof(page->checksum);
+    uint32_t a = 1, b = (uint32_t)sizeof(page->checksum);  // each zero byte of the field adds a to b
+    unsigned cnt = PAGE_SIZE - (unsigned)sizeof(page->checksum);
 
     while (cnt--) {
         a = (a + *cp++);
@@ -1324,1159 +1783,5610 @@ static uint32_t compute_page_checksum(AvPage *page)
 
 static __inline void update_page_checksum(AvPage *page)
 {
-    page->checksum = 0;
     page->checksum = compute_page_checksum(page);
 }
 
-static void avstor_destroy(avstor *db)
+// Folds a page number to 32 bits for hashing
+static __inline uint32_t fold_page_num(AvPageNum page_num)
 {
-    PageCache *cache = &db->cache;
-    unsigned i;
-    if (cache->rows) {
-        for (i = 0; i < cache->l2_len; ++i) {
-            if (cache->rows[i].items) {
-                free(cache->rows[i].items);
-                cache->rows[i].items = NULL;
-            }
-            rwl_destroy(&cache->rows[i].lock);
-        }
-        free(cache->rows);
-        cache->rows = NULL;
-    }
-    if (db->cache.header) {
-        avs_aligned_free(db->cache.header);
-        db->cache.header = NULL;
-    }
-    db->cache.old_header = NULL;
-    bpool_destroy(&db->bpool);
-    rwl_destroy(&db->global_rwl);
-#if defined(IO_REQUIRES_SYNC)
-    avmtx_destroy(&db->io_mtx);
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    return (uint32_t)page_num ^ (uint32_t)(page_num >> 32);
+#else
+    return page_num;
 #endif
-    free(db);
 }
 
-static unsigned mask_to_power_of_two(unsigned x)
+// Number of pages in the file
+static __inline AvPageNum get_pagecount(const AvPage *hdr)
 {
-    unsigned cnt = 0;
-    if (x == 0) return 0;
-    while ((void)cnt++, x >>= 1)
-        ;
-    return 1 << (cnt - 1);
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    return ((AvPageNum)hdr->pagecount_hi << 32) | hdr->pagecount;
+#else
+    return hdr->pagecount;
+#endif
 }
 
-//static unsigned ulog2(unsigned x)
-//{
-//    if (x > 1) {
-//        unsigned cnt = 0;
-//        while ((void)cnt++, x >>= 1)
-//            ;
-//        return (cnt - 1);
-//    }
-//    return 0;
-//}
+static __inline void set_pagecount(AvPage *hdr, AvPageNum count)
+{
+    hdr->pagecount = (uint32_t)count;
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    hdr->pagecount_hi = (uint32_t)(count >> 32);
+#endif
+}
 
-static int avstor_init(avstor **pdb, unsigned szcache)
+// Page a node of the given page pool was last inserted into, 0 if none
+static __inline AvPageNum get_pool_page(const AvPage *hdr, unsigned page_pool)
 {
-    PageCache *cache;
-    avstor *db;
-    unsigned i;
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    return ((AvPageNum)hdr->page_pool_hi[page_pool] << 32) | hdr->page_pool[page_pool];
+#else
+    return hdr->page_pool[page_pool];
+#endif
+}
 
-    if (!(db = calloc(1, sizeof(*db)))) {
-        return 0;
-    }
+static __inline void set_pool_page(AvPage *hdr, unsigned page_pool, AvPageNum page_num)
+{
+    hdr->page_pool[page_pool] = (uint32_t)page_num;
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    hdr->page_pool_hi[page_pool] = (uint32_t)(page_num >> 32);
+#endif
+}
 
-    db->l2_size = szcache;
-    cache = &db->cache;
-    cache->l2_len = db->l2_size / (KB_PER_PAGE * L2_ASSOC);
-    cache->l2_mask = cache->l2_len - 1;
+// Sequence number of the last write buffer record merged into the file
+static __inline uint64_t get_buffer_seq(const AvPage *hdr)
+{
+    return ((uint64_t)hdr->buffer_seq[1] << 32) | hdr->buffer_seq[0];
+}
 
-    if (!rwl_init(&db->global_rwl)) {
-        goto err_rwl_init;
-    }
-#if defined(IO_REQUIRES_SYNC)
-    if (!avmtx_init(&db->io_mtx)) {
-        goto err_avmtx_init;
-    }
-#endif
+static __inline void set_buffer_seq(AvPage *hdr, uint64_t seq)
+{
+    hdr->buffer_seq[0] = (uint32_t)seq;
+    hdr->buffer_seq[1] = (uint32_t)(seq >> 32);
+}
 
-    if (!bpool_init(&db->bpool, 512 / DEFAULT_BLOCK_SIZE)) {
-        goto err_bpool_init;
+static AvPageMapItem* pagemap_find(const AvPageMap *map, AvPageNum page_num)
+{
+    unsigned i;
+    if (!map->items) {
+        return NULL;
     }
-
-    if (!(cache->header = avs_aligned_malloc(PAGE_SIZE * 2, PAGE_SIZE))) {
-        avstor_destroy(db);
-        return 0;
+    for (i = (fold_page_num(page_num) * 2654435761u) & map->mask; map->items[i].page != 0; i = (i + 1) & map->mask) {
+        if (map->items[i].page == page_num) {
+            return &map->items[i];
+        }
     }
-    cache->old_header = PTR(cache->header, PAGE_SIZE);
+    return NULL;
+}
 
-    if (!(cache->rows = calloc(cache->l2_len, sizeof(CacheRow)))) {
-        avstor_destroy(db);
-        return 0;
+// Returns 0 if out of memory
+static int pagemap_put(AvPageMap *map, AvPageNum page_num, AvPageNum value)
+{
+    AvPageMapItem *item;
+    unsigned i;
+    if ((item = pagemap_find(map, page_num))) {
+        item->value = value;
+        return 1;
     }
-
-    for (i = 0; i < cache->l2_len; ++i) {
-#if defined(AVSTOR_CONFIG_THREAD_SAFE)
-        if (!rwl_init(&cache->rows[i].lock)) {
-            avstor_destroy(db);
+    if (!map->items || (map->count + 1) * 2 > map->mask + 1) {
+        AvPageMapItem *old_items = map->items;
+        unsigned old_len = old_items ? map->mask + 1 : 0;
+        unsigned len = old_items ? old_len * 2 : 256;
+        if (!(map->items = calloc(len, sizeof(AvPageMapItem)))) {
+            map->items = old_items;
             return 0;
         }
-#endif
-        cache->rows[i].load_count = 1;
-        cache->rows[i].capacity = L2_ASSOC;
-        if (!(cache->rows[i].items = calloc(L2_ASSOC, sizeof(CacheItem)))) {
-            avstor_destroy(db);
-            return 0;
+        map->mask = len - 1;
+        map->count = 0;
+        for (i = 0; i < old_len; ++i) {
+            if (old_items[i].page != 0) {
+                (void)pagemap_put(map, old_items[i].page, old_items[i].value);
+            }
         }
+        free(old_items);
     }
-    *pdb = db;
+    for (i = (fold_page_num(page_num) * 2654435761u) & map->mask; map->items[i].page != 0; i = (i + 1) & map->mask)
+        ;
+    map->items[i].page = page_num;
+    map->items[i].value = value;
+    map->count++;
     return 1;
-err_bpool_init:
-#if defined(IO_REQUIRES_SYNC)
-    avmtx_destroy(&db->io_mtx);
-err_avmtx_init:
-#endif
-    rwl_destroy(&db->global_rwl);
-err_rwl_init:
-    free(db);
-    return 0;
 }
 
-static int read_page(avstor *db, avstor_off page_offset, AvPage *page)
+static void pagemap_free(AvPageMap *map)
 {
-    uint32_t checksum;
-    int numread = io_read(db, page, page_offset, PAGE_SIZE);
+    free(map->items);
+    map->items = NULL;
+    map->mask = map->count = 0;
+}
 
-    if (!numread) {
-        RETURN(AVSTOR_IOERR, "page offset beyond EOF.");
+// Names of the dictionary are indexed by FNV-1a hash, 0 is reserved for unused index slots
+static uint32_t hash_name(const void *buf, size_t len)
+{
+    const unsigned char *cp = (const unsigned char*)buf;
+    uint32_t fnv = 2166136261u;
+    while (len--) {
+        fnv = (fnv ^ *cp++) * 16777619u;
     }
-    else if (numread < 0) {
-        RETURN(AVSTOR_IOERR, "io_read() failed.");
+    return fnv ? fnv : 1;
+}
+
+// Returns the dictionary id of a name, or NAME_ID_NONE
+static uint32_t find_name(const avstor *db, const void *buf, size_t len)
+{
+    AvPageMapItem *item;
+    if (db->name_count == 0 || !(item = pagemap_find(&db->name_index, hash_name(buf, len)))) {
+        return NAME_ID_NONE;
     }
-    else if (numread < PAGE_SIZE) {
-        RETURN(AVSTOR_CORRUPT, "io_read() read fewer than expected bytes.");
+    if (db->names[item->value].len != len || memcmp(db->names[item->value].buf, buf, len) != 0) {
+        return NAME_ID_NONE;
     }
+    return item->value;
+}
 
-    checksum = page->checksum;
-    page->checksum = 0;
-    if (checksum != compute_page_checksum(page)) {
-        page->checksum = checksum;
-        RETURN(AVSTOR_CORRUPT, "page checksum error.");
+// Appends a name to the in-memory dictionary as id name_count. A name whose hash is already
+// indexed stays out of the index, so it is never used in place of node names.
+static void add_name(avstor *db, const void *buf, unsigned len)
+{
+    AvName *name;
+    uint32_t hash = hash_name(buf, len);
+    if (db->name_count == db->name_capacity) {
+        unsigned capacity = db->name_capacity ? db->name_capacity * 2 : 64;
+        AvName *names = realloc(db->names, capacity * sizeof(AvName));
+        if (!names) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        db->names = names;
+        db->name_capacity = capacity;
+    }
+    name = &db->names[db->name_count];
+    if (!(name->buf = malloc(len))) {
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
     }
-    page->checksum = checksum;
+    if (!pagemap_find(&db->name_index, hash) && !pagemap_put(&db->name_index, hash, db->name_count)) {
+        free(name->buf);
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    memcpy(name->buf, buf, len);
+    name->len = len;
+    db->names_bytes += len;
+    db->name_count++;
+}
 
-    // TODO: validate page more rigorously for security
-
-    return AVSTOR_OK;
-}
-
-static int write_page(avstor *db, AvPage* page)
+// Drops the names with id count and above, as after a rollback. Names the index can no longer
+// hold for lack of memory are kept out of it.
+static void truncate_names(avstor *db, unsigned count)
 {
-    assert(atomic_load_int_acquire(&page->lock_count) == 0);
-    if (is_page_dirty(page)) {
-        int res;
-        set_page_clean(page);
-        update_page_checksum(page);
-        res = io_write(db, page, page->page_offset, PAGE_SIZE);
-        if (res < PAGE_SIZE) {
-            set_page_dirty(page);
-            RETURN(AVSTOR_IOERR, "io_write() failed.");
+    unsigned i;
+    if (count == db->name_count) {
+        return;
+    }
+    for (i = count; i < db->name_count; ++i) {
+        db->names_bytes -= db->names[i].len;
+        free(db->names[i].buf);
+    }
+    db->name_count = count;
+    pagemap_free(&db->name_index);
+    for (i = 0; i < count; ++i) {
+        uint32_t hash = hash_name(db->names[i].buf, db->names[i].len);
+        if (!pagemap_find(&db->name_index, hash)) {
+            (void)pagemap_put(&db->name_index, hash, i);
         }
     }
-    return AVSTOR_OK;
 }
 
-static __inline unsigned cache_get_row(PageCache *cache, avstor_off page_ofs)
+static void arenas_free(avstor *db)
 {
-    // multiplier from L'Ecuyer 1999
-    return (unsigned)((((page_ofs / PAGE_SIZE) * 1597334677u) >> 3) & cache->l2_mask);
+    while (db->arenas) {
+        AvArena *next = db->arenas->next;
+        pagemap_free(&db->arenas->pools);
+        free(db->arenas);
+        db->arenas = next;
+    }
+    db->arena_count = 0;
 }
 
-static __inline CacheItem* cache_lookup_scan_line(CacheRow *line, avstor_off page_ofs, CacheItem* *out_item)
+static void free_names(avstor *db)
 {
-    unsigned cnt;
-    CacheItem *item, *avail_item = NULL;
-    for (cnt = 0; cnt < line->capacity; ++cnt) {
-        item = &line->items[cnt];
-        if (!item->page) {
-            *out_item = item;
-            return NULL;
-        }
-        else if (item->offset == 0) {
-            avail_item = item;
-        }
-        else if (item->offset == page_ofs) {
-            return item;
-        }
-    }
-    *out_item = avail_item;
-    return NULL;
+    truncate_names(db, 0);
+    free(db->names);
+    db->names = NULL;
+    db->name_capacity = db->names_committed = 0;
+    pagemap_free(&db->name_index);
 }
 
-enum {
-    evict_success = 0,
-    evict_fail,
-    evict_io_error,
-    evict_must_flush
-};
-
-static int cache_evict(avstor *db, CacheRow *line, CacheItem* *out_item)
+static __inline uint32_t tier_now(const AvTier *tier)
 {
-    CacheItem *poldest = NULL;
-    unsigned col;
-    uint32_t min_age = line->load_count;
-    int auto_save = db->oflags & AVSTOR_OPEN_AUTOSAVE;
+    return (uint32_t)(time(NULL) - tier->base_time) + 1;
+}
 
-    /* Find oldest non-locked page */
-    for (col = 0; col < line->capacity; ++col) {
-        CacheItem* item = &line->items[col];
-        AvPage *page = item->page;
-        if (!page) {
-            break;
-        }
-        else if (item->offset != 0 && item->load_time < min_age
-                 && atomic_load_int_acquire(&page->lock_count) == 0) {
-            min_age = item->load_time;
-            poldest = item;
+// Records an access to a page. Extents created after the last migration are not tracked yet.
+static __inline void tier_touch(AvTier *tier, avstor_off page_ofs)
+{
+    avstor_off extent = page_ofs / ((avstor_off)PAGE_SIZE * TIER_EXTENT_PAGES);
+    if (extent < tier->extent_count) {
+        int now = (int)tier_now(tier);
+        // the time changes once a second, so most accesses leave the line shared
+        if (atomic_load_int_acquire(&tier->access_time[extent]) != now) {
+            atomic_store_int_release(&tier->access_time[extent], now);
         }
     }
+}
 
-    if (poldest) {
-        if (is_page_dirty(poldest->page)) {
-            if (auto_save) {
-                if (AVSTOR_OK != write_page(db, poldest->page)) {
-                    return evict_io_error;
-                }
-            }
-            else {
-                return evict_must_flush;
-            }
-        }
-        poldest->offset = 0;
-        *out_item = poldest;
-        return evict_success;
+// Returns the tier file slot of a page punched out of the file, or TIER_SLOT_NONE if the page is
+// read from the file
+static __inline AvPageNum tier_hole_slot(const AvTier *tier, AvPageNum page_num)
+{
+    AvPageMapItem *slot = pagemap_find(&tier->map, page_num);
+    if (!slot || slot->value == TIER_SLOT_NONE || !(slot->value & TIER_SLOT_HOLE)) {
+        return TIER_SLOT_NONE;
     }
-    return evict_fail;
+    return slot->value & ~(AvPageNum)TIER_SLOT_HOLE;
 }
 
-static CacheItem* cache_line_realloc(avstor *db, CacheRow *line)
+static void tier_destroy(AvTier *tier)
 {
-    CacheItem* new_items;
-    unsigned col;
-    unsigned old_capacity = line->capacity;
-
-    line->capacity += 4;
-    if ((new_items = realloc(line->items, line->capacity * sizeof(CacheItem)))) {
-        CacheItem* item;
-        for (col = old_capacity; col < line->capacity; ++col) {
-            new_items[col].load_time = 0;
-            new_items[col].offset = 0;
-            new_items[col].page = NULL;
-        }
-        line->items = new_items;
-        item = &line->items[old_capacity];
-        if ((item->page = bpool_alloc_page(&db->bpool))) {
-            return item;
-        }
+    if (tier->file != AVSTOR_INVALID_HANDLE) {
+        io_close(tier->file);
     }
-    return NULL;
+    pagemap_free(&tier->map);
+    free((void*)tier->access_time);
+    free(tier);
 }
 
-static AvPage* cache_lookup(avstor *db, avstor_off page_ofs, int is_existing)
+static void buffer_destroy(AvWriteBuffer *wb)
 {
-    PageCache *cache = &db->cache;
-    CacheItem *item;
-    AvPage *page;
-    CacheRow *row;
-
-    unsigned row_num = cache_get_row(cache, page_ofs);
-    CacheItem *first_empty_item;
-    int evict_result;
-    assert(page_ofs != 0);
-    row = &cache->rows[row_num];
-
-    do {
-        rwl_lock_shared(&row->lock);
-        if ((item = cache_lookup_scan_line(row, page_ofs, &first_empty_item))) {
-            // page was found in cache
-
-            // This is OK because nobody else has exclusive lock on row, i.e. not trying to evict
-            lock_page(item->page);
-
-            rwl_release(&row->lock);
-            return item->page;
-        }
-        // not in cache. Try to upgrade lock or retry lookup
-    } while (!rwl_upgrade_or_release(&row->lock));
-
-    // At this point the cache line is locked exclusively
-    if (first_empty_item) {
-        item = first_empty_item;
-        if ((item->page = bpool_alloc_page(&db->bpool))) {
-            goto skip_evict;
-        }
-        // Out of memory. We will have to evict.
+    unsigned i;
+    if (wb->file != AVSTOR_INVALID_HANDLE) {
+        io_close(wb->file);
     }
+    for (i = 0; i < wb->count; ++i) {
+        free(wb->entries[i]);
+    }
+    for (i = 0; i < wb->merge_count; ++i) {
+        free(wb->merging[i]);
+    }
+    free(wb->entries);
+    free(wb->merging);
+    avmtx_destroy(&wb->merge_lock);
+    avmtx_destroy(&wb->lock);
+    free(wb);
+}
 
-    evict_result = cache_evict(db, row, &item);
-
-    if (evict_result != evict_success) {
-        if (evict_result == evict_fail) {
-            // This should almost never happen, maybe with exremely small cache sizes and many threads
-            if (!(item = cache_line_realloc(db, row))) {
-                rwl_release(&row->lock);
-                THROW(AVSTOR_NOMEM, "cache_line_realloc failed: out of memory");
+// Allocates an empty lookup cache, or returns NULL if out of memory
+static AvLookupCache* lookup_create(void)
+{
+    AvLookupCache *lc = calloc(1, sizeof(*lc));
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    unsigned i;
+    for (i = 0; lc && i < LOOKUP_STRIPES; ++i) {
+        if (!avmtx_init(&lc->locks[i])) {
+            while (i--) {
+                avmtx_destroy(&lc->locks[i]);
             }
-        }
-        else if (evict_result == evict_io_error) {
-            rwl_release(&row->lock);
-            THROW(AVSTOR_IOERR, "IO error during cache page flush");
-        }
-        else if (evict_result == evict_must_flush) {
-            rwl_release(&row->lock);
-            THROW(AVSTOR_ABORT, "Must flush but AUTOSAVE is off");
+            free(lc);
+            return NULL;
         }
     }
+#endif
+    return lc;
+}
 
-skip_evict:
-
-    page = item->page;
-    if (is_existing) {
-        int result;
-        // If looking for existing page, we can load it into the empty (or evicted) page
-        if (AVSTOR_OK != (result = read_page(db, page_ofs, page))) {
-            rwl_release(&row->lock);
-            THROW(result, "read_page() failed while reading page into cache");
-        }
-        item->load_time = row->load_count++;
-    }
-    else {
-        // Clear the evicted or newly allocated page
-        memset(page, 0, PAGE_SIZE);
-        page->page_offset = page_ofs;
-        item->load_time = 0;
+static void lookup_destroy(AvLookupCache *lc)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    unsigned i;
+    for (i = 0; i < LOOKUP_STRIPES; ++i) {
+        avmtx_destroy(&lc->locks[i]);
     }
-    item->offset = page_ofs;
-    atomic_store_int_release(&page->lock_count, 1);
-    rwl_release(&row->lock);
-    return page;
+#endif
+    free(lc);
 }
 
-//static __inline void backtrace_init(AvStack* st, NodeRef* root)
-//{
-//    st->top = -1;
-//    st->root = root;
-//}
+/*
+* Page checksum tree. Level 0 holds the checksum of each page as last written to the file, 0 for
+* the header and the side pages the tree is kept in. A hash of level n + 1 combines up to
+* MERKLE_FANOUT consecutive hashes of level n, and the top level holds a single hash, the root.
+* Files with the same root have the same pages; otherwise, following the hashes that differ down
+* the levels locates the pages that differ. Page checksums are stored in PAGE_MERKLE pages, which
+* are written at commit, the other levels are computed when the file is opened.
+*/
 
-static __inline AvStackData* backtrace_push(AvStack* st)
+// FNV-1a over 32-bit words, so that the hashes do not depend on byte order
+static uint32_t merkle_combine(const uint32_t *hashes, unsigned count)
 {
-    if (st->top < AVSTOR_AVL_HEIGHT - 1) {
-        return &st->data[++st->top];
-    }
-    else {
-        THROW(AVSTOR_INTERNAL, MSG_BACKTRACE_OVERFLOW);
+    uint32_t fnv = 2166136261u;
+    while (count--) {
+        fnv = (fnv ^ *hashes++) * 16777619u;
     }
+    return fnv;
 }
 
-static __inline AvStackData* backtrace_pop(AvStack* st)
+// Recomputes the hashes above the page checksums from page_num on
+static void merkle_update_levels(AvMerkle *m, AvPageNum page_num)
 {
-    return st->top >= 0 ? &st->data[st->top--] : NULL;
+    unsigned level;
+    AvPageNum i;
+    for (level = 1; level < m->levels; ++level) {
+        page_num /= MERKLE_FANOUT;
+        for (i = page_num; i < m->counts[level]; ++i) {
+            AvPageNum first = i * MERKLE_FANOUT, count = m->counts[level - 1] - first;
+            m->hashes[level][i] = merkle_combine(m->hashes[level - 1] + first,
+                                                 count < MERKLE_FANOUT ? (unsigned)count : MERKLE_FANOUT);
+        }
+    }
 }
 
-static __inline const AvStackData* backtrace_peek(const AvStack* st, int pos)
+// Sets the checksum of a page, updating one hash per level
+static void merkle_set_leaf(AvMerkle *m, AvPageNum page_num, uint32_t checksum)
 {
-    return pos >= 0 ? &st->data[pos] : NULL;
+    unsigned level;
+    assert(page_num < m->counts[0]);
+    if (m->hashes[0][page_num] == checksum) {
+        return;
+    }
+    m->hashes[0][page_num] = checksum;
+    m->dirty[page_num / MERKLE_PAGE_LEAVES] = 1;
+    for (level = 1; level < m->levels; ++level) {
+        AvPageNum first, count;
+        page_num /= MERKLE_FANOUT;
+        first = page_num * MERKLE_FANOUT;
+        count = m->counts[level - 1] - first;
+        m->hashes[level][page_num] = merkle_combine(m->hashes[level - 1] + first,
+                                                    count < MERKLE_FANOUT ? (unsigned)count : MERKLE_FANOUT);
+    }
 }
 
-static __inline AvStackData* backtrace_top(AvStack* st)
+// Makes the tree cover count pages, pages added have checksum 0. Shrinking never fails. Returns
+// 0 if out of memory.
+static int merkle_resize(AvMerkle *m, AvPageNum count)
 {
-    return st->top >= 0 ? &st->data[st->top] : NULL;
-}
+    AvPageNum old_count = m->counts[0], n;
+    size_t page_count = (size_t)((count + MERKLE_PAGE_LEAVES - 1) / MERKLE_PAGE_LEAVES);
+    unsigned level;
 
-static __inline void set_bf(AvNode *node, int bf)
-{
-    assert(bf >= -1 && bf <= 1);
-    node->hdr = (node->hdr & ~BF_MASK) | ((uint16_t)(bf + 1));
+    if (count > m->capacity) {
+        AvPageNum capacity = m->capacity ? m->capacity : MERKLE_PAGE_LEAVES;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        for (level = 0, n = capacity; level < MERKLE_MAX_LEVELS; ++level) {
+            uint32_t *hashes = realloc(m->hashes[level], (size_t)n * sizeof(uint32_t));
+            if (!hashes) {
+                return 0;
+            }
+            m->hashes[level] = hashes;
+            n = (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+        }
+        m->capacity = capacity;
+    }
+    if (page_count > m->page_count) {
+        AvPageNum *pages = realloc(m->pages, page_count * sizeof(AvPageNum));
+        char *dirty;
+        if (!pages) {
+            return 0;
+        }
+        m->pages = pages;
+        if (!(dirty = realloc(m->dirty, page_count))) {
+            return 0;
+        }
+        m->dirty = dirty;
+        memset(pages + m->page_count, 0, (page_count - m->page_count) * sizeof(AvPageNum));
+        memset(dirty + m->page_count, 1, page_count - m->page_count);
+        m->page_count = page_count;
+    }
+    if (count > old_count) {
+        memset(m->hashes[0] + old_count, 0, (size_t)(count - old_count) * sizeof(uint32_t));
+    }
+
+    // the top level has a single hash, and is above the page checksums even if there is one page
+    m->counts[0] = count;
+    for (m->levels = 1; m->levels < 2 || m->counts[m->levels - 1] > 1; ++m->levels) {
+        m->counts[m->levels] = (m->counts[m->levels - 1] + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+    }
+    n = old_count < count ? old_count : count;
+    merkle_update_levels(m, n > 0 ? n - 1 : 0);
+    return 1;
 }
 
-static __inline AvPage* get_ptr_page(const void *ptr)
+static void merkle_free(AvMerkle *m)
 {
-    return (AvPage*)((uintptr_t)ptr & PAGE_MASK);
+    unsigned level;
+    for (level = 0; level < MERKLE_MAX_LEVELS; ++level) {
+        free(m->hashes[level]);
+    }
+    free(m->pages);
+    free(m->dirty);
+    free(m->dirs);
+    free(m);
 }
 
-#define set_ptr_dirty(node) set_page_dirty(get_ptr_page(node))
-
-static __inline avstor_off get_ofs(const AvNode *node)
+static void map_release(avstor *db)
 {
-    return get_ptr_page(node)->page_offset + offsetof(AvPage, nodes[node->index]);
+#if defined(IO_MMAP)
+    if (db->map) {
+        io_unmap(db->map, db->map_size);
+    }
+#endif
+    db->map = NULL;
+    db->map_size = 0;
+    free(db->map_touched);
+    db->map_touched = NULL;
+    free((void*)db->map_locks);
+    db->map_locks = NULL;
 }
 
-static __inline NodeRef get_nref(const AvNode *node)
+static CacheTable* cache_table_alloc(unsigned size)
 {
-    return ofs_to_nref(get_ofs(node));
+    CacheTable *table = calloc(1, sizeof(CacheTable) + (size - 1) * sizeof(table->slots[0]));
+    if (table) {
+        table->mask = size - 1;
+    }
+    return table;
 }
 
-static void set_nref(const AvNode *src, NodeRef *dest)
+static void avstor_destroy(avstor *db)
 {
-    if (src) {
-        *dest = get_nref(src);
+    PageCache *cache = &db->cache;
+    CacheTable *table;
+    unsigned i;
+    for (i = 0; i < cache->chunk_count; ++i) {
+        free(cache->chunks[i]);
     }
-    else {
-        *dest = NODEREF_NULL;
+    free(cache->chunks);
+    cache->chunks = NULL;
+    cache->chunk_count = cache->item_count = cache->scan_head = cache->scan_count = 0;
+    while ((table = cache->table)) {
+        cache->table = table->retired;
+        free(table);
     }
-    set_ptr_dirty(dest);
+    if (db->cache.header) {
+        avs_aligned_free(db->cache.header);
+        db->cache.header = NULL;
+    }
+    db->cache.old_header = NULL;
+    if (db->mounts) {
+        free(db->mounts);
+        db->mounts = NULL;
+    }
+    if (db->tier) {
+        tier_destroy(db->tier);
+        db->tier = NULL;
+    }
+    if (db->wbuf) {
+        buffer_destroy(db->wbuf);
+        db->wbuf = NULL;
+    }
+    if (db->lookups) {
+        lookup_destroy(db->lookups);
+        db->lookups = NULL;
+    }
+    if (db->merkle) {
+        merkle_free(db->merkle);
+        db->merkle = NULL;
+    }
+    pagemap_free(&db->pins);
+    free_names(db);
+    arenas_free(db);
+    map_release(db);
+    bpool_destroy(&db->bpool);
+    avmtx_destroy(&cache->lock);
+    rwl_destroy(&db->global_rwl);
+#if defined(IO_REQUIRES_SYNC)
+    avmtx_destroy(&db->io_mtx);
+#endif
+    free(db);
 }
 
-static __inline void assign_nref(NodeRef src, NodeRef *dest)
+static unsigned mask_to_power_of_two(unsigned x)
 {
-    *dest = src;
-    set_ptr_dirty(dest);
+    unsigned cnt = 0;
+    if (x == 0) return 0;
+    while ((void)cnt++, x >>= 1)
+        ;
+    return 1 << (cnt - 1);
 }
 
-static __inline AvNode* get_node(AvPage *page, unsigned ioff)
+//static unsigned ulog2(unsigned x)
+//{
+//    if (x > 1) {
+//        unsigned cnt = 0;
+//        while ((void)cnt++, x >>= 1)
+//            ;
+//        return (cnt - 1);
+//    }
+//    return 0;
+//}
+
+static int avstor_init(avstor **pdb, unsigned szcache)
 {
-    uint16_t node_offset = *(uint16_t*)PTR(page, ioff);
-    if (node_offset == INVALID_INDEX) {
-        THROW(AVSTOR_INVOPER, "Node has been deleted.");
+    PageCache *cache;
+    avstor *db;
+
+    if (!(db = calloc(1, sizeof(*db)))) {
+        return 0;
     }
-    return PTR(page, node_offset);
-}
 
-#if !defined (NDEBUG)
+    cache = &db->cache;
+    cache->item_target = szcache / KB_PER_PAGE;
 
-static int is_node_addr_valid(const avstor *db, const AvNode* node)
-{
-    //return 1;
-    AvPage* page = get_ptr_page(node);
-    (void)db;
-    if (!page) {
-        goto error_node;
+    if (!rwl_init(&db->global_rwl)) {
+        goto err_rwl_init;
     }
-    /* if (memcmp(&page->id, &PAGE_ID, sizeof(PAGE_ID)) != 0) {
-         goto error_node;
-     }*/
-    if (get_node(page, offsetof(AvPage, nodes[node->index])) != node) {
-        goto error_node;
+#if defined(IO_REQUIRES_SYNC)
+    if (!avmtx_init(&db->io_mtx)) {
+        goto err_avmtx_init;
+    }
+#endif
+    if (!avmtx_init(&cache->lock)) {
+        goto err_cache_lock_init;
+    }
+
+    if (!bpool_init(&db->bpool, 512 / DEFAULT_BLOCK_SIZE)) {
+        goto err_bpool_init;
     }
+
+    if (!(cache->header = avs_aligned_malloc(PAGE_SIZE * 2, PAGE_SIZE))) {
+        avstor_destroy(db);
+        return 0;
+    }
+    cache->old_header = PTR(cache->header, PAGE_SIZE);
+
+    if (!(cache->table = cache_table_alloc(cache->item_target * 2))) {
+        avstor_destroy(db);
+        return 0;
+    }
+    *pdb = db;
     return 1;
-error_node:
-    errout ("Node pointer is invalid.");
+err_bpool_init:
+    avmtx_destroy(&cache->lock);
+err_cache_lock_init:
+#if defined(IO_REQUIRES_SYNC)
+    avmtx_destroy(&db->io_mtx);
+err_avmtx_init:
+#endif
+    rwl_destroy(&db->global_rwl);
+err_rwl_init:
+    free(db);
     return 0;
 }
-#endif
 
-static __inline void set_node_size(AvNode* node, unsigned nodesz)
+static int is_page_checksum_valid(const AvPage *page)
 {
-    node->hdr = (node->hdr & ~NODE_SIZEMASK) | (uint16_t)(nodesz << 4u);
+    return page->checksum == compute_page_checksum(page);
 }
 
-static unsigned get_page_free_space(AvPage* page)
+static int read_page(avstor *db, avstor_off page_offset, AvPage *page)
 {
-    unsigned top = page->top;
-    unsigned bottom = align_node(  //compensate for alignment
-                                 offsetof(AvPage, nodes[page->index_count])
-                                 + (page->index_freelist == INVALID_INDEX ? 2 : 0)); // compensate in case a new index has to be allocated
-    return (top > bottom) ? top - bottom : 0;
-}
+    // Pages moved to the tier file are holes in the primary file, read from the tier file instead
+    AvPageNum slot = db->tier ? tier_hole_slot(db->tier, page_offset / PAGE_SIZE) : TIER_SLOT_NONE;
+    int numread;
+    if (slot != TIER_SLOT_NONE) {
+        numread = io_read(db, db->tier->file, page, (avstor_off)slot * PAGE_SIZE, PAGE_SIZE);
+        if (numread == PAGE_SIZE && page->page_offset != page_offset) {
+            RETURN(AVSTOR_CORRUPT, "tier file page mismatch.");
+        }
+    }
+    else {
+        numread = io_read(db, db->file, page, page_offset, PAGE_SIZE);
+    }
+    if (cur_trace && numread > 0) {
+        cur_trace->bytes_read += (unsigned long)numread;
+    }
 
-static __inline AvPage* get_page(avstor *db, avstor_off page_offset)
+    if (!numread) {
+        RETURN(AVSTOR_IOERR, "page offset beyond EOF.");
+    }
+    else if (numread < 0) {
+        RETURN(AVSTOR_IOERR, "io_read() failed.");
+    }
+    else if (numread < PAGE_SIZE) {
+        RETURN(AVSTOR_CORRUPT, "io_read() read fewer than expected bytes.");
+    }
+
+    if (!is_page_checksum_valid(page)) {
+        RETURN(AVSTOR_CORRUPT, "page checksum error.");
+    }
+
+    // TODO: validate page more rigorously for security
+
+    return AVSTOR_OK;
+}
+
+static int write_page(avstor *db, AvPage* page)
 {
-    return cache_lookup(db, page_offset, 1);
+    assert(atomic_load_int_acquire(&page->lock_count) <= 0);
+    if (is_page_dirty(page)) {
+        union {
+            AvPage page;
+            char data[PAGE_SIZE];
+        } buf;
+        AvPage *out = page;
+        int res;
+        set_page_clean(page);
+        if (atomic_load_int_acquire(&page->lock_count) < 0) {
+            // a page claimed for eviction is written with an unlocked count, as pages in the file
+            // must be, while lookups keep failing to lock it
+            memcpy(&buf, page, PAGE_SIZE);
+            out = &buf.page;
+            atomic_store_int_release(&out->lock_count, 0);
+        }
+        update_page_checksum(out);
+        if (db->tier) {
+            // the copy in the tier file is stale, and the page must not be punched out
+            AvPageMapItem *slot = pagemap_find(&db->tier->map, page->page_offset / PAGE_SIZE);
+            if (slot) {
+                slot->value = TIER_SLOT_NONE;
+            }
+        }
+        res = io_write(db, db->file, out, page->page_offset, PAGE_SIZE);
+        if (res < PAGE_SIZE) {
+            set_page_dirty(page);
+            RETURN(AVSTOR_IOERR, "io_write() failed.");
+        }
+        if (db->merkle) {
+            merkle_set_leaf(db->merkle, page->page_offset / PAGE_SIZE, page->type == PAGE_KEYS ? out->checksum : 0);
+        }
+    }
+    return AVSTOR_OK;
 }
 
-static AvNode* lock_node(avstor *db, const avstor_off noderef)
+static __inline unsigned cache_hash(const CacheTable *table, avstor_off page_ofs)
 {
-    assert(noderef != 0);
-    return get_node(get_page(db, noderef & OFFSET_MASK), (unsigned)(noderef & ~OFFSET_MASK));
+    // multiplier from L'Ecuyer 1999, high bits of page numbers are folded in first
+    return (unsigned)(((fold_page_num(page_ofs / PAGE_SIZE) * 1597334677u) >> 3) & table->mask);
 }
 
-static AvNode* lock_node_ex(avstor *db, const NodeRef *noderef)
+static __inline CacheItem* cache_item(const PageCache *cache, unsigned index)
 {
-    AvPage *node_page;
-    avstor_off pageofs, node_ofs;
-    assert(noderef && !is_nref_empty(*noderef));
-    node_page = get_ptr_page(noderef);
-    assert(atomic_load_int_acquire(&node_page->lock_count) > 0);  // page containging noderef should already be locked
-    node_ofs = nref_to_ofs(*noderef);
-    pageofs = node_ofs & OFFSET_MASK;
-    if (pageofs != node_page->page_offset) {
-        /* This assumes page of noderef is already locked, otherwise it could get swapped out! */
-        node_page = get_page(db, pageofs);
-    }
-    else {
-        // This is ok because page is already locked, we're only increasing the lock count
-        lock_page(node_page);
-    }
-    return get_node(node_page, (unsigned)(node_ofs & ~OFFSET_MASK));
+    return &cache->chunks[index / CACHE_CHUNK_ITEMS][index % CACHE_CHUNK_ITEMS];
 }
 
-static __inline void unlock_ptr(const void *ptr)
+static __inline int cache_tag(avstor_off page_ofs)
 {
-    assert(ptr);
-    unlock_page(get_ptr_page(ptr));
+    return (int)fold_page_num(page_ofs / PAGE_SIZE);
 }
 
-static AvNode* lock_unlock_node(avstor *db, const avstor_off ofs, AvNode *node_to_unlock)
+// Returns the item filed under page_ofs, or NULL. Cache lock must be held
+static CacheItem* cache_find(const PageCache *cache, avstor_off page_ofs)
 {
-    AvPage *node_page;
-    avstor_off pageofs;
-    if (!node_to_unlock) {
-        return lock_node(db, ofs);
+    const CacheTable *table = cache->table;
+    CacheItem *item;
+    unsigned i;
+    for (i = cache_hash(table, page_ofs); (item = table->slots[i]) != NULL; i = (i + 1) & table->mask) {
+        if (item->key == page_ofs) {
+            return item;
+        }
     }
-    node_page = get_ptr_page(node_to_unlock);
-    assert(atomic_load_int_acquire(&node_page->lock_count) > 0);  // page containging noderef should already be locked
-    pageofs = ofs & OFFSET_MASK;
-    if (pageofs != node_page->page_offset) {
-        unlock_ptr(node_to_unlock);
-        node_page = get_page(db, pageofs);
+    return NULL;
+}
+
+// Returns an item that may hold the page at page_ofs, or NULL, without the cache lock. Only the
+// tag of the items is read, so the item found may be stale or hold another page with the same
+// tag, and an item being filed or moved may be missed. The offset of the item must be checked
+// once its page is locked.
+static CacheItem* cache_find_unlocked(const PageCache *cache, avstor_off page_ofs)
+{
+    CacheTable *table = atomic_load_ptr_acquire(&cache->table);
+    CacheItem *item;
+    int tag = cache_tag(page_ofs);
+    unsigned i;
+    for (i = cache_hash(table, page_ofs); (item = atomic_load_ptr_acquire(&table->slots[i])) != NULL;
+         i = (i + 1) & table->mask) {
+        if (atomic_load_int_acquire(&item->tag) == tag) {
+            return item;
+        }
     }
-    else {
-        // This is ok because page is already locked, we're only increasing the lock count
-        //lock_page(node_page);
+    return NULL;
+}
+
+static void cache_table_put(CacheTable *table, CacheItem *item)
+{
+    unsigned i = cache_hash(table, item->key);
+    while (table->slots[i]) {
+        i = (i + 1) & table->mask;
     }
-    return get_node(node_page, (unsigned)(ofs & ~OFFSET_MASK));
+    atomic_store_ptr_release(&table->slots[i], item);
 }
 
-static __inline void unlock_ptr_checked(const void *ptr)
+// Files an item under page_ofs. Cache lock must be held
+static void cache_file_item(PageCache *cache, CacheItem *item, avstor_off page_ofs)
 {
-    if (ptr) {
-        unlock_ptr(ptr);
+    item->key = page_ofs;
+    atomic_store_int_release(&item->tag, cache_tag(page_ofs));
+    cache_table_put(cache->table, item);
+}
+
+// Removes an item from the page table, moving back the items after it in its probe sequence so
+// that lookups can stop at the first empty slot. Cache lock must be held
+static void cache_unfile_item(PageCache *cache, CacheItem *item)
+{
+    CacheTable *table = cache->table;
+    unsigned i = cache_hash(table, item->key), j, home;
+    while (table->slots[i] != item) {
+        i = (i + 1) & table->mask;
+    }
+    for (j = (i + 1) & table->mask; table->slots[j]; j = (j + 1) & table->mask) {
+        // the item at j can fill the gap at i unless its home slot lies in (i, j]
+        home = cache_hash(table, table->slots[j]->key);
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
     }
+    table->slots[i] = NULL;
+    item->key = 0;
+    atomic_store_int_release(&item->tag, 0);
 }
 
-static __inline void lock_ref(const NodeRef *noderef)
+// Replaces the page table with one twice as large. The old one is kept until the file is closed
+// since lookups may still be reading it. Cache lock must be held
+static int cache_grow_table(PageCache *cache)
 {
-    AvPage *page = get_ptr_page(noderef);
-    // Outside shared cache row lock, we can only increment lock count of currently locked page.
-    // Otherwise, a page currently being evicted might end up getting re-locked, which would be bad.
-    // Header is exception, it is never in the cache
-    assert(atomic_load_int_acquire(&page->lock_count) > 0 || page->page_offset == 0);
-    lock_page(page);
+    CacheTable *old_table = cache->table, *table;
+    unsigned i;
+    if (!(table = cache_table_alloc((old_table->mask + 1) * 2))) {
+        return 0;
+    }
+    for (i = 0; i <= old_table->mask; ++i) {
+        if (old_table->slots[i]) {
+            cache_table_put(table, old_table->slots[i]);
+        }
+    }
+    table->retired = old_table;
+    atomic_store_ptr_release(&cache->table, table);
+    return 1;
 }
 
-static AvNode* find_node_with_backtrace(avstor *db, const avstor_key *key, AvStack *st,
-                                        NodeRef *root, NodeRef* volatile *out_ref)
+// Adds an item with a new page buffer, claimed for loading, or returns NULL if out of memory.
+// Cache lock must be held
+static CacheItem* cache_add_item(avstor *db)
 {
-    AvStackData *top = NULL;
-    AvNode *cur = NULL;
-    st->top = -1;
-    st->root = root;
-    if (out_ref) {
-        *out_ref = NULL;
+    PageCache *cache = &db->cache;
+    unsigned chunk = cache->item_count / CACHE_CHUNK_ITEMS;
+    CacheItem *item;
+
+    if ((cache->item_count + 1) * 2 > cache->table->mask + 1 && !cache_grow_table(cache)) {
+        return NULL;
     }
-    if (root && !is_nref_empty(*root)) {
-        NodeRef *ref = root;
-        int comp;
-        lock_ref(ref);
-        cur = lock_node_ex(db, ref);
+    if (chunk == cache->chunk_count) {
+        CacheItem **chunks = realloc(cache->chunks, (chunk + 1) * sizeof(CacheItem*));
+        if (!chunks) {
+            return NULL;
+        }
+        cache->chunks = chunks;
+        if (!(chunks[chunk] = calloc(CACHE_CHUNK_ITEMS, sizeof(CacheItem)))) {
+            return NULL;
+        }
+        cache->chunk_count++;
+    }
+    item = &cache->chunks[chunk][cache->item_count % CACHE_CHUNK_ITEMS];
+    if (!(item->page = bpool_alloc_page(&db->bpool))) {
+        return NULL;
+    }
+    atomic_store_int_release(&item->page->lock_count, -1);
+    cache->item_count++;
+    return item;
+}
 
-        while (0 != (comp = key->comparer(key->buf, cur->name))) {
-            top = backtrace_push(st);
-            top->comp = comp;
-            top->noderef = nref_to_ofs(*ref);
-            unlock_ptr(ref);
-            ref = (comp < 0) ? &cur->left : &cur->right;
-            if (is_nref_empty(*ref)) {
-                if (out_ref) {
-                    *out_ref = ref;  // leave page of ref locked if returning it
-                    return NULL;
+/*
+* Moves the clock hand over the items until it finds one to evict, and claims it. Pages of higher
+* priority are only taken if no lower one can be, locked and pinned pages never. A page used since
+* the hand last passed gets a second chance. Without AVSTOR_OPEN_AUTOSAVE, dirty pages are skipped
+* and out_must_flush is set. Returns NULL if no page can be evicted. Cache lock must be held.
+* A scan first takes a page that has no second chance and isn't in the ring of scan items, leaving
+* the second chances of the other pages alone, so that a scan larger than the cache doesn't evict
+* the pages used by other lookups.
+*/
+static CacheItem* cache_evict(avstor *db, int scan, int *out_must_flush)
+{
+    PageCache *cache = &db->cache;
+    int auto_save = db->oflags & AVSTOR_OPEN_AUTOSAVE;
+    uint32_t priority;
+    unsigned n;
+
+    for (n = 0; scan && n < cache->item_count; ++n) {
+        CacheItem *item = cache_item(cache, cache->hand);
+        cache->hand = (cache->hand + 1) % cache->item_count;
+        if (item->key != 0 && (item->priority > AVSTOR_PRIORITY_NORMAL || item->referenced || item->scanned
+                               || (!auto_save && is_page_dirty(item->page)))) {
+            continue;
+        }
+        if (cache_claim_page(item->page)) {
+            return item;
+        }
+    }
+    for (priority = AVSTOR_PRIORITY_NORMAL; priority < AVSTOR_PRIORITY_PINNED; ++priority) {
+        // the first turn may only clear the referenced flags
+        for (n = 0; n < cache->item_count * 2; ++n) {
+            CacheItem *item = cache_item(cache, cache->hand);
+            cache->hand = (cache->hand + 1) % cache->item_count;
+            if (item->key != 0) {
+                if (item->priority > priority) {
+                    continue;
                 }
-                else {
-                    cur = NULL;
-                    break;
+                if (item->referenced) {
+                    item->referenced = 0;
+                    continue;
+                }
+                if (!auto_save && is_page_dirty(item->page)) {
+                    *out_must_flush = 1;
+                    continue;
                 }
             }
-            cur = lock_node_ex(db, ref);
+            if (cache_claim_page(item->page)) {
+                return item;
+            }
         }
-        unlock_ptr(ref);
     }
-    return cur;
+    return NULL;
 }
 
-static void rotate_right(AvNode *x, AvNode *z)
+// Returns how many items scans may keep reusing
+static unsigned cache_scan_limit(const PageCache *cache)
 {
-    NodeRef t23 = z->right;
-    assign_nref(t23, &x->left);
-    set_nref(x, &z->right);
-    if (BF(z) == 0) {
-        set_bf(x, -1);
-        set_bf(z, 1);
-    }
-    else {
-        set_bf(x, 0);
-        set_bf(z, 0);
-    }
+    unsigned limit = cache->item_target / 4;
+    return limit == 0 ? 1 : (limit > CACHE_SCAN_ITEMS ? CACHE_SCAN_ITEMS : limit);
 }
 
-static void rotate_left(AvNode *x, AvNode *z)
+// Appends an item a scan loaded a page into to the ring of scan items. Cache lock must be held
+static void cache_push_scan(PageCache *cache, CacheItem *item, avstor_off page_ofs)
 {
-    NodeRef t23 = z->left;
-    assign_nref(t23, &x->right);
-    set_nref(x, &z->left);
-    if (BF(z) == 0) {
-        set_bf(x, 1);
-        set_bf(z, -1);
+    unsigned i = (cache->scan_head + cache->scan_count++) % CACHE_SCAN_ITEMS;
+    cache->scan_items[i] = item;
+    cache->scan_offsets[i] = page_ofs;
+}
+
+// Removes the oldest item from the ring of scan items. Cache lock must be held
+static CacheItem* cache_pop_scan(PageCache *cache, avstor_off *out_ofs)
+{
+    CacheItem *item = cache->scan_items[cache->scan_head];
+    *out_ofs = cache->scan_offsets[cache->scan_head];
+    cache->scan_head = (cache->scan_head + 1) % CACHE_SCAN_ITEMS;
+    cache->scan_count--;
+    return item;
+}
+
+/*
+* Claims the oldest of the items last loaded by scans once there are cache_scan_limit of them. Pages
+* are loaded into these first, also by the lookups of the nodes a scan returns, so that a scan keeps
+* reusing a few items instead of moving the clock hand, which would take the second chance of every
+* other page on each turn. An item used since it was passed gets a second chance, and items that
+* were reloaded, referenced or raised in priority leave the ring. Cache lock must be held
+*/
+static CacheItem* cache_recycle_scan(avstor *db)
+{
+    PageCache *cache = &db->cache;
+    int auto_save = db->oflags & AVSTOR_OPEN_AUTOSAVE;
+    unsigned n;
+
+    if (cache->scan_count < cache_scan_limit(cache)) {
+        return NULL;
     }
-    else {
-        set_bf(x, 0);
-        set_bf(z, 0);
+    for (n = 0; n < CACHE_SCAN_ITEMS * 2 && cache->scan_count != 0; ++n) {
+        avstor_off ofs;
+        CacheItem *item = cache_pop_scan(cache, &ofs);
+        if (item->key != ofs) {
+            continue;
+        }
+        if (item->referenced || item->priority > AVSTOR_PRIORITY_NORMAL) {
+            item->scanned = 0;
+            continue;
+        }
+        if (item->scanned == CACHE_SCAN_USED) {
+            item->scanned = CACHE_SCAN_LOADED;
+        }
+        else if ((auto_save || !is_page_dirty(item->page)) && cache_claim_page(item->page)) {
+            return item;
+        }
+        cache_push_scan(cache, item, ofs);
     }
+    return NULL;
 }
 
-static AvNode* rotate_right_left(avstor *db, AvNode *x, AvNode *z)
+// Records an item a scan loads a page into, dropping the oldest one if full. Cache lock must be held
+static void cache_add_scan(PageCache *cache, CacheItem *item, avstor_off page_ofs)
 {
-    AvNode *y = lock_node_ex(db, &z->left);
-    NodeRef t3 = y->right;
-    NodeRef t2;
-    assign_nref(t3, &z->left);
-    set_nref(z, &y->right);
-    t2 = y->left;
-    assign_nref(t2, &x->right);
-    set_nref(x, &y->left);
-    if (BF(y) == 0) {
-        set_bf(x, 0);
-        set_bf(z, 0);
+    avstor_off ofs;
+    while (cache->scan_count >= cache_scan_limit(cache)) {
+        CacheItem *oldest = cache_pop_scan(cache, &ofs);
+        if (oldest->key == ofs) {
+            oldest->scanned = 0;
+        }
     }
-    else if (BF(y) > 0) {
-        set_bf(x, -1);
-        set_bf(z, 0);
+    cache_push_scan(cache, item, page_ofs);
+}
+
+// Copies a page read from the file into a claimed cache page, or clears it if src is NULL. The lock
+// count is left alone: a lookup holding a stale reference to the item may try to lock the page.
+static void cache_fill_page(AvPage *page, const AvPage *src)
+{
+    size_t count_ofs = offsetof(AvPage, lock_count), count_end = count_ofs + sizeof(page->lock_count);
+    if (src) {
+        memcpy(page, src, count_ofs);
+        memcpy(PTR(page, count_end), PTR(src, count_end), PAGE_SIZE - count_end);
     }
     else {
-        set_bf(x, 0);
-        set_bf(z, 1);
+        memset(page, 0, count_ofs);
+        memset(PTR(page, count_end), 0, PAGE_SIZE - count_end);
     }
-    set_bf(y, 0);
-    unlock_ptr(z);
-    return y;
 }
 
-static AvNode* rotate_left_right(avstor *db, AvNode *x, AvNode *z)
+static uint32_t cache_get_priority(avstor *db, const AvPage *page)
 {
-    AvNode *y = lock_node_ex(db, &z->right);
-    NodeRef t3 = y->left;
-    NodeRef t2;
-    assign_nref(t3, &z->right);
-    set_nref(z, &y->left);
-    t2 = y->right;
-    assign_nref(t2, &x->left);
-    set_nref(x, &y->right);
-    if (BF(y) == 0) {
-        set_bf(x, 0);
-        set_bf(z, 0);
-    }
-    else if (BF(y) < 0) {
-        set_bf(x, 1);
-        set_bf(z, 0);
+    AvPageMapItem *pin = pagemap_find(&db->pins, page->page_offset / PAGE_SIZE);
+    if (pin) {
+        return pin->value;
     }
-    else {
-        set_bf(x, 0);
-        set_bf(z, -1);
+    if ((db->oflags & AVSTOR_OPEN_PRIORITIZE_KEYS) && (page->page_flags & PAGE_FLAG_KEYS)) {
+        return AVSTOR_PRIORITY_HIGH;
     }
-    set_bf(y, 0);
-    unlock_ptr(z);
-    return y;
+    return AVSTOR_PRIORITY_NORMAL;
 }
 
-static void backtrace_set_ref(avstor *db, AvStack *st, int pos, AvNode *cur, AvNode *src)
+// Records a cache hit or miss for a page in the trace of the calling thread
+static void trace_page(avstor_trace *trace, avstor_off page_ofs, int is_miss)
 {
-    const AvStackData *data = backtrace_peek(st, pos);
-    if (data) {
-        avstor_off cur_ofs = get_ofs(cur);
-        AvNode *dest = lock_node(db, data->noderef);
-        NodeRef *dest_child;
-        if (nref_to_ofs(dest->left) == cur_ofs) {
-            dest_child = &dest->left;
-        }
-        else if (nref_to_ofs(dest->right) == cur_ofs) {
-            dest_child = &dest->right;
+    unsigned i;
+    if (is_miss) {
+        trace->cache_misses++;
+    }
+    else {
+        trace->cache_hits++;
+    }
+    for (i = 0; i < trace->page_count; ++i) {
+        if (trace->pages[i].offset == page_ofs) {
+            break;
         }
-        else {
-            unlock_ptr(dest);
-            THROW(AVSTOR_INTERNAL, "dest is not a parent of cur");
+    }
+    if (i == trace->page_count) {
+        if (i == AVSTOR_TRACE_PAGES) {
+            trace->untracked_touches++;
+            return;
         }
-        set_nref(src, dest_child);
-        unlock_ptr(dest);
+        trace->page_count++;
+        trace->pages[i].offset = page_ofs;
+        trace->pages[i].hits = trace->pages[i].misses = 0;
+    }
+    if (is_miss) {
+        trace->pages[i].misses++;
     }
     else {
-        set_nref(src, st->root);
+        trace->pages[i].hits++;
     }
 }
 
-static void balance_down(avstor *db, AvStack *st)
+// Records a page of the file mapping as possibly modified since the last commit
+static __inline void map_touch(avstor *db, avstor_off page_ofs)
 {
-    AvStackData *top;
-    while ((top = backtrace_pop(st))) {
-        AvNode *cur = lock_node(db, top->noderef);
-        int comp = top->comp < 0 ? -1 : 1;  // because strcmp could return below -1 or above +1
-        int bf_cur = BF(cur);
-        if (bf_cur == 0) {
-            // was balanced but either subtree increased in height
-            set_bf(cur, comp);
-            set_ptr_dirty(cur);
-            unlock_ptr(cur);
-        }
-        else if ((comp + bf_cur) != 0) {
-            //Was unbalanced and now even more unbalanced. Must rotate.
-            AvNode *z;
-            if (bf_cur > 0) {
-                z = lock_node_ex(db, &cur->right);
-                if (BF(z) > 0) {
-                    rotate_left(cur, z);
-                }
-                else {
-                    z = rotate_right_left(db, cur, z);
-                }
-            }
-            else {
-                z = lock_node_ex(db, &cur->left);
-                if (BF(z) < 0) {
-                    rotate_right(cur, z);
-                }
-                else {
-                    z = rotate_left_right(db, cur, z);
-                }
-            }
-            backtrace_set_ref(db, st, st->top, cur, z);
-            unlock_ptr(z);
-            unlock_ptr(cur);
-            break;
+    size_t page_num = (size_t)(page_ofs / PAGE_SIZE);
+    db->map_touched[page_num / 32] |= 1u << (page_num % 32);
+}
+
+// Locks a page of the file mapping, verifying its checksum the first time. Only writers can modify
+// pages, so only the pages they lock are recorded for commit and rollback.
+static AvPage* map_lookup(avstor *db, avstor_off page_ofs)
+{
+    AvPage *page = PTR(db->map, (size_t)page_ofs);
+    size_t page_num = (size_t)(page_ofs / PAGE_SIZE);
+    int count = atomic_load_int_acquire(&db->map_locks[page_num]);
+    if (page->page_offset != page_ofs) {
+        THROW(AVSTOR_CORRUPT, "page offset mismatch in mapped file.");
+    }
+    if (!(count & MAP_PAGE_CHECKED)) {
+        if (!is_page_checksum_valid(page)) {
+            THROW(AVSTOR_CORRUPT, "page checksum error.");
         }
-        else {
-            // was unbalanced but now balanced
-            set_bf(cur, 0);
-            set_ptr_dirty(cur);
-            unlock_ptr(cur);
-            break;
+        // other threads may be verifying or locking the page at the same time
+        while (!(count & MAP_PAGE_CHECKED)
+               && !atomic_cas_int(&db->map_locks[page_num], &count, count | MAP_PAGE_CHECKED)) {
         }
     }
+    (void)atomic_inc_int(&db->map_locks[page_num]);
+    if (rwl_is_exclusive(&db->global_rwl)) {
+        map_touch(db, page_ofs);
+    }
+    if (cur_trace) {
+        trace_page(cur_trace, page_ofs, 0);
+    }
+    return page;
 }
 
-static void balance_up(avstor *db, AvStack *st)
+// cache_lookup flags
+#define CACHE_EXISTING          1   // Load the page from the file
+#define CACHE_SCAN              2   // Page is read by a scan, make it the first to be evicted
+
+static AvPage* cache_lookup(avstor *db, avstor_off page_ofs, unsigned flags)
 {
-    AvStackData *top;
-    while ((top = backtrace_pop(st))) {
-        AvNode *cur = lock_node(db, top->noderef);
-        int comp = top->comp;
-        int bf_cur = BF(cur);
-        int b;
-        if (comp < 0) {
-            if (bf_cur > 0) {
-                AvNode *z = lock_node_ex(db, &cur->right);
-                b = BF(z);
-                if (b < 0) {
-                    z = rotate_right_left(db, cur, z);
+    PageCache *cache = &db->cache;
+    CacheItem *item;
+    AvPage *page;
+    int result, must_flush = 0;
+    // a page loaded into an item recycled from a scan is mostly a node the scan returned
+    int scan = (flags & CACHE_SCAN) != 0;
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    union {
+        AvPage page;
+        char data[PAGE_SIZE];
+    } buf;
+#endif
+
+    assert(page_ofs != 0);
+    if (page_ofs < db->map_size) {
+        return map_lookup(db, page_ofs);
+    }
+    if (db->tier) {
+        tier_touch(db->tier, page_ofs);
+    }
+
+    while (1) {
+        // Loaded pages are found without the cache lock. The item may have been evicted in the
+        // meantime, which locking the page and checking its offset afterwards detects.
+        if ((item = cache_find_unlocked(cache, page_ofs)) && try_lock_page(item->page)) {
+            if (item->offset == page_ofs) {
+                if (item->scanned == CACHE_SCAN_LOADED) {
+                    item->scanned = CACHE_SCAN_USED;
                 }
-                else {
-                    rotate_left(cur, z);
+                else if (!item->scanned && !item->referenced && !(flags & CACHE_SCAN)) {
+                    item->referenced = 1;
                 }
-                backtrace_set_ref(db, st, st->top, cur, z);
-                unlock_ptr(z);
-                unlock_ptr(cur);
-            }
-            else {
-                set_ptr_dirty(cur);
-                if (bf_cur == 0) {
-                    set_bf(cur, 1);
-                    unlock_ptr(cur);
-                    break;
+                if (cur_trace) {
+                    trace_page(cur_trace, page_ofs, 0);
                 }
-                set_bf(cur, 0);
-                unlock_ptr(cur);
-                continue;
+                return item->page;
             }
+            unlock_page(item->page);
         }
-        else {
-            if (bf_cur < 0) {
-                AvNode *z = lock_node_ex(db, &cur->left);
-                b = BF(z);
-                if (b > 0) {
-                    z = rotate_left_right(db, cur, z);
-                }
-                else {
-                    rotate_right(cur, z);
-                }
-                backtrace_set_ref(db, st, st->top, cur, z);
-                unlock_ptr(z);
-                unlock_ptr(cur);
-            }
-            else {
-                set_ptr_dirty(cur);
-                if (bf_cur == 0) {
-                    set_bf(cur, -1);
-                    unlock_ptr(cur);
-                    break;
-                }
-                set_bf(cur, 0);
-                unlock_ptr(cur);
-                continue;
-            }
+        avmtx_lock(&cache->lock);
+        if (!cache_find(cache, page_ofs)) {
+            break;
         }
-        if (b == 0) break;
+        // another thread is loading the page
+        avmtx_unlock(&cache->lock);
+        avthrd_yield();
     }
-}
 
-static void remove_node(avstor *db, AvNode *node, AvStack *st)
-{
-    AvStackData *top;
-    NodeRef *ref;
-    assert(node && st);
-
-    if (!(top = backtrace_top(st))) {
-        ref = st->root;
+    // At this point the cache is locked and the page is not in it
+    item = cache->item_count < cache->item_target ? cache_add_item(db) : NULL;
+    if (!item && (item = cache_recycle_scan(db)) && (flags & CACHE_EXISTING)) {
+        scan = 1;
     }
-    else {
-        AvNode *temp = lock_node(db, top->noderef);
-        ref = top->comp < 0 ? &temp->left : &temp->right;
-        unlock_ptr(temp);
+    if (!item && !(item = cache_evict(db, flags & CACHE_SCAN, &must_flush))) {
+        if (must_flush) {
+            avmtx_unlock(&cache->lock);
+            THROW(AVSTOR_ABORT, "Must flush but AUTOSAVE is off");
+        }
+        // This should almost never happen, maybe with exremely small cache sizes and many threads
+        if (!(item = cache_add_item(db))) {
+            avmtx_unlock(&cache->lock);
+            THROW(AVSTOR_NOMEM, "cache_add_item failed: out of memory");
+        }
     }
-
-    if (is_nref_empty(node->left) && is_nref_empty(node->right)) {
-        // Case 1: node to remove has no children
-        assign_nref(NODEREF_NULL, ref);
+    if (item->key != 0) {
+        if (AVSTOR_OK != write_page(db, item->page)) {
+            atomic_store_int_release(&item->page->lock_count, 0);
+            avmtx_unlock(&cache->lock);
+            THROW(AVSTOR_IOERR, "IO error during cache page flush");
+        }
+        item->offset = 0;
+        cache_unfile_item(cache, item);
     }
-    else if (is_nref_empty(node->left) || is_nref_empty(node->right)) {
-        // Case 2: node has only one child
-        NodeRef *childRef = (!is_nref_empty(node->left)) ? &node->left : &node->right;
-        assign_nref(*childRef, ref);
-        assign_nref(NODEREF_NULL, childRef);
+    // lookups of the page wait until it is loaded
+    cache_file_item(cache, item, page_ofs);
+    if (scan) {
+        cache_add_scan(cache, item, page_ofs);
     }
-    else {
-        // Case 3: node has two children
-        // Find in-order successor (smallest in right subtree)
-        AvNode *succ;
-        AvStackData *topdel;
-        AvNode* topdel_node;
-        int delpos;
-        top = backtrace_push(st);
-        assert(top);
-        top->noderef = get_ofs(node);
-        top->comp = 1;
-        ref = &node->right;
-        lock_ref(ref);
-        succ = lock_node_ex(db, ref);
-        topdel = top;
-        delpos = st->top;
-        while (!is_nref_empty(succ->left)) {
-            top = backtrace_push(st);
-            assert(top);
-            top->noderef = nref_to_ofs(*ref);
-            top->comp = -1;
-            unlock_ptr(ref);
-            ref = &succ->left;
-            //lock_ref(ref);
-            //unlock_ptr(succ);
-            succ = lock_node_ex(db, ref);
+    avmtx_unlock(&cache->lock);
+
+    page = item->page;
+    if (flags & CACHE_EXISTING) {
+        // If looking for existing page, we can load it into the empty (or evicted) page
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+        if (AVSTOR_OK == (result = read_page(db, page_ofs, &buf.page))) {
+            cache_fill_page(page, &buf.page);
         }
-        assign_nref(node->left, &succ->left);
-        if (topdel != top) {
-            assign_nref(succ->right, ref);
-            assign_nref(node->right, &succ->right);
+#else
+        result = read_page(db, page_ofs, page);
+#endif
+        if (result != AVSTOR_OK) {
+            avmtx_lock(&cache->lock);
+            cache_unfile_item(cache, item);
+            avmtx_unlock(&cache->lock);
+            atomic_store_int_release(&page->lock_count, 0);
+            THROW(result, "read_page() failed while reading page into cache");
         }
-        unlock_ptr(ref);
-        topdel_node = lock_node(db, topdel->noderef);
-        backtrace_set_ref(db, st, delpos-1, topdel_node, succ);
-        unlock_ptr(topdel_node);
-        topdel->noderef = get_ofs(succ);
-        set_bf(succ, BF(node));
-        unlock_ptr(succ);
     }
-    balance_up(db, st);
-    assign_nref(NODEREF_NULL, &node->left);
-    assign_nref(NODEREF_NULL, &node->right);
+    else {
+        // Clear the evicted or newly allocated page
+        cache_fill_page(page, NULL);
+        page->page_offset = page_ofs;
+    }
+    item->referenced = !scan && (flags & CACHE_EXISTING);
+    item->scanned = scan ? CACHE_SCAN_LOADED : 0;
+    item->priority = cache_get_priority(db, page);
+    if (cur_trace && (flags & CACHE_EXISTING)) {
+        trace_page(cur_trace, page_ofs, 1);
+    }
+    item->offset = page_ofs;
+    atomic_store_int_release(&page->lock_count, 1);
+    return page;
 }
 
-static AvPage* create_page(avstor *db, unsigned type)
+// Changes the eviction class of a page if it is in the cache
+static void cache_set_priority(avstor *db, avstor_off page_ofs, uint32_t priority)
 {
-    AvPage *hdr = db->cache.header;
-    AvPage *page;
-    avstor_off page_offset;
-
-    if (hdr->pagecount == MAX_FILE_PAGES) {
-        THROW(AVSTOR_INVOPER, "Maximum allowable file size exceeded");
+    CacheItem *item;
+    avmtx_lock(&db->cache.lock);
+    if ((item = cache_find(&db->cache, page_ofs))) {
+        item->priority = priority;
     }
-    page_offset = (avstor_off)hdr->pagecount * (unsigned)PAGE_SIZE;
-    page = cache_lookup(db, page_offset, 0);
-    //memcpy(&page->id, &PAGE_ID, sizeof(PAGE_ID));
-    page->type = (uint8_t)type;
-    page->top = PAGE_SIZE;
-    page->index_freelist = INVALID_INDEX;
-    set_page_dirty(page);
-    hdr->pagecount++;
-    set_page_dirty(hdr);
+    avmtx_unlock(&db->cache.lock);
+}
 
-    return page;
+// Drops a cached page. Cache lock must be held and the page must not be locked
+static void cache_drop_item(PageCache *cache, CacheItem *item)
+{
+    // claimed while its offset changes, like an evicted page
+    int claimed = cache_claim_page(item->page);
+    assert(claimed);
+    (void)claimed;
+    item->offset = 0;
+    cache_unfile_item(cache, item);
+    atomic_store_int_release(&item->page->lock_count, 0);
 }
 
-static AvNode* alloc_node(avstor *db, AvPage *preferred_page, unsigned size, unsigned page_pool)
+// Drops a page from the cache after it was written to the file bypassing the cache
+static void cache_invalidate(avstor *db, avstor_off page_ofs)
 {
-    AvPage *page = NULL;
-    uint16_t *index;
-    AvNode *node;
-    unsigned index_ofs;
-    uint16_t nextfree;
+    CacheItem *item;
+    avmtx_lock(&db->cache.lock);
+    if ((item = cache_find(&db->cache, page_ofs))) {
+        cache_drop_item(&db->cache, item);
+    }
+    avmtx_unlock(&db->cache.lock);
+}
 
-    if (preferred_page && size <= get_page_free_space(preferred_page)) {
-        page = preferred_page;
-        assert(atomic_load_int_acquire(&page->lock_count) > 0);
-        lock_page(page);
-        set_page_dirty(page);
+// Maps the committed pages of the file if AVSTOR_OPEN_MMAP is set and the file grew since it was
+// last mapped, dropping cached copies of the pages now in the mapping. Pages stay in the cache if
+// the file cannot be mapped. The global lock must be held exclusively, with no uncommitted page.
+static void map_file(avstor *db)
+{
+#if defined(IO_MMAP)
+    PageCache *cache = &db->cache;
+    avstor_off size = get_pagecount(cache->header) * PAGE_SIZE;
+    unsigned i;
+
+    if (!(db->oflags & AVSTOR_OPEN_MMAP) || size <= db->map_size) {
+        return;
     }
-    else {
-        uint32_t page_num = db->cache.header->page_pool[page_pool];
-        if (page_num != 0) {
-            page = get_page(db, (avstor_off)page_num * PAGE_SIZE);
-            if (size > get_page_free_space(page)) {
-                unlock_page(page);
-                page = NULL;
-            }
-            else {
-                set_page_dirty(page);
-            }
+    map_release(db);
+    if (!(db->map = io_map(db->file, size))) {
+        return;
+    }
+    db->map_size = size;
+    if (!(db->map_touched = calloc((size_t)(size / PAGE_SIZE / 32) + 1, sizeof(uint32_t)))
+        || !(db->map_locks = calloc((size_t)(size / PAGE_SIZE), sizeof(*db->map_locks)))) {
+        map_release(db);
+        return;
+    }
+    avmtx_lock(&cache->lock);
+    for (i = 0; i < cache->item_count; ++i) {
+        CacheItem *item = cache_item(cache, i);
+        if (item->key != 0 && item->key < size) {
+            cache_drop_item(cache, item);
         }
-        if (!page || page_num == 0) {
-            page = create_page(db, PAGE_KEYS);
-            if (size > get_page_free_space(page)) {
-                THROW(AVSTOR_INTERNAL, MSG_NO_SPACE_IN_PAGE);
+    }
+    avmtx_unlock(&cache->lock);
+#else
+    (void)db;
+#endif
+}
+
+// Writes the modified pages of the file mapping, if any
+static int map_write_pages(avstor *db)
+{
+    size_t count = (size_t)(db->map_size / PAGE_SIZE), n;
+    int result;
+    for (n = 1; n < count; ++n) {
+        if (db->map_touched[n / 32] == 0) {
+            n |= 31;
+        }
+        else if (db->map_touched[n / 32] & (1u << (n % 32))) {
+            if (AVSTOR_OK != (result = write_page(db, PTR(db->map, n * PAGE_SIZE)))) {
+                return result;
             }
-            db->cache.header->page_pool[page_pool] = (uint32_t)(page->page_offset / PAGE_SIZE);
         }
     }
+    if (count != 0) {
+        memset(db->map_touched, 0, (count / 32 + 1) * sizeof(uint32_t));
+    }
+    return AVSTOR_OK;
+}
 
-    nextfree = page->index_freelist;
-    //set_page_dirty(page);
-    if (nextfree == INVALID_INDEX) {
-        index = &page->nodes[page->index_count];
-        page->index_count++;
+// Reloads the modified pages of the file mapping from the file on rollback and releases the locks
+// left on the other pages touched. The mapping is dropped if a page cannot be reloaded.
+static void map_restore_pages(avstor *db)
+{
+    size_t count = (size_t)(db->map_size / PAGE_SIZE), n;
+    for (n = 1; n < count; ++n) {
+        if (db->map_touched[n / 32] == 0) {
+            n |= 31;
+        }
+        else if (db->map_touched[n / 32] & (1u << (n % 32))) {
+            AvPage *page = PTR(db->map, n * PAGE_SIZE);
+            if (is_page_dirty(page) && AVSTOR_OK != read_page(db, (avstor_off)n * PAGE_SIZE, page)) {
+                map_release(db);
+                return;
+            }
+            atomic_store_int_release(&db->map_locks[n], 0);
+        }
     }
-    else {
-        index = (uint16_t*)PTR(page, nextfree);
-        page->index_freelist = *index;
+    if (count != 0) {
+        memset(db->map_touched, 0, (count / 32 + 1) * sizeof(uint32_t));
     }
-    page->top -= size;
-    *index = page->top;
-    index_ofs = PTR_DIFF(page, index);
-    node = get_node(page, index_ofs);
+}
 
-    // check if we have overwritten the node index array
-    if ((void*)node < (void*)&page->nodes[page->index_count]) {
-        THROW(AVSTOR_INTERNAL, MSG_PAGE_CORRUPTED);
+//static __inline void backtrace_init(AvStack* st, NodeRef* root)
+//{
+//    st->top = -1;
+//    st->root = root;
+//}
+
+static __inline AvStackData* backtrace_push(AvStack* st)
+{
+    if (st->top < AVSTOR_AVL_HEIGHT - 1) {
+        return &st->data[++st->top];
+    }
+    else {
+        THROW(AVSTOR_INTERNAL, MSG_BACKTRACE_OVERFLOW);
     }
+}
 
-    node->index = (uint8_t)((index_ofs - offsetof(AvPage, nodes)) / sizeof(uint16_t));
-    set_node_size(node, size);
-    //lock_page(page);
-    return node;
+static __inline AvStackData* backtrace_pop(AvStack* st)
+{
+    return st->top >= 0 ? &st->data[st->top--] : NULL;
 }
 
-static AvNode* resize_node(AvNode* node, unsigned newsize)
+static __inline const AvStackData* backtrace_peek(const AvStack* st, int pos)
 {
-    AvPage *page;
-    AvNode *next, *dest, *cur, *src;
-    unsigned oldsize, page_free, newtop, count;
+    return pos >= 0 ? &st->data[pos] : NULL;
+}
 
-    assert((newsize == 0 || newsize >= sizeof(AvNode)) && newsize == align_node(newsize));
+static __inline AvStackData* backtrace_top(AvStack* st)
+{
+    return st->top >= 0 ? &st->data[st->top] : NULL;
+}
 
-    oldsize = get_node_size(node);
-    if (newsize == oldsize) {
-        return node;
-    }
-    page = get_ptr_page(node);
-    page_free = get_page_free_space(page);
-    if (newsize > oldsize && (newsize - oldsize) > page_free) {
-        THROW(AVSTOR_INTERNAL, "resize_node() failed");
+static __inline void set_bf(AvNode *node, int bf)
+{
+    assert(bf >= -1 && bf <= 1);
+    node->hdr = (node->hdr & ~BF_MASK) | ((uint16_t)(bf + 1));
+}
+
+static __inline AvPage* get_ptr_page(const void *ptr)
+{
+    return (AvPage*)((uintptr_t)ptr & PAGE_MASK);
+}
+
+#define set_ptr_dirty(node) set_page_dirty(get_ptr_page(node))
+
+static __inline avstor_off get_ofs(const AvNode *node)
+{
+    return get_ptr_page(node)->page_offset + offsetof(AvPage, nodes[node->index]);
+}
+
+static __inline NodeRef get_nref(const AvNode *node)
+{
+    return ofs_to_nref(get_ofs(node));
+}
+
+static void set_nref(const AvNode *src, NodeRef *dest)
+{
+    if (src) {
+        *dest = get_nref(src);
     }
-    newtop = page->top + oldsize - newsize;
-    next = PTR(node, oldsize);
-    if (newsize == 0) { // free the node instead of resize
-        //check if we deallocated the last index
-        uint16_t* oldindex = &page->nodes[node->index];
-        if (node->index == page->index_count - 1) {
-            // yes, just decrease count and zero the last one
-            *oldindex = 0;
-            page->index_count--;
-        }
-        else {
-            // no, add it to free index list
-            *oldindex = page->index_freelist;
-            page->index_freelist = offsetof(AvPage, nodes[node->index]);
-        }
+    else {
+        *dest = NODEREF_NULL;
     }
-    src = PTR(page, page->top);
-    dest = PTR(page, newtop);
-    count = PTR_DIFF(src, node);
-    set_node_size(node, newsize);
-    if (newsize < oldsize) {
-        memmove(dest, src, (size_t)count + newsize);
-        memset(src, 0, (size_t)oldsize - newsize);
+    set_ptr_dirty(dest);
+}
+
+static __inline void assign_nref(NodeRef src, NodeRef *dest)
+{
+    *dest = src;
+    set_ptr_dirty(dest);
+}
+
+static __inline AvNode* get_node(AvPage *page, unsigned ioff)
+{
+    uint16_t node_offset = *(uint16_t*)PTR(page, ioff);
+    if (node_offset == INVALID_INDEX) {
+        THROW(AVSTOR_INVOPER, "Node has been deleted.");
     }
-    else {
-        unsigned diff = newsize - oldsize;
-        memmove(dest, src, (size_t)count + oldsize);
-        memset(PTR(node, oldsize - diff), 0, diff);
+    return PTR(page, node_offset);
+}
+
+#if !defined (NDEBUG)
+
+static int is_node_addr_valid(const avstor *db, const AvNode* node)
+{
+    //return 1;
+    AvPage* page = get_ptr_page(node);
+    (void)db;
+    if (!page) {
+        goto error_node;
     }
-    // Adjust index offsets
-    cur = dest;
-    while (cur < next) {
-        uint16_t* curslot = &page->nodes[cur->index];
-        *curslot = (uint16_t)((int)*curslot + ((int)oldsize - (int)newsize));
-        assert(is_node_addr_valid(NULL, cur));
-        cur = (AvNode*)PTR(cur, get_node_size(cur));
+    /* if (memcmp(&page->id, &PAGE_ID, sizeof(PAGE_ID)) != 0) {
+         goto error_node;
+     }*/
+    if (get_node(page, offsetof(AvPage, nodes[node->index])) != node) {
+        goto error_node;
     }
-    page->top = (uint16_t)newtop;
-    return PTR(node, (int)oldsize - (int)newsize);
+    return 1;
+error_node:
+    errout ("Node pointer is invalid.");
+    return 0;
 }
+#endif
 
-static void free_node(AvNode* node)
+static __inline void set_node_size(AvNode* node, unsigned nodesz)
 {
-    resize_node(node, 0);
+    node->hdr = (node->hdr & ~NODE_SIZEMASK) | (uint16_t)(nodesz << 4u);
 }
 
-static void delete_node(avstor *db, AvNode *node, AvStack *st)
+static __inline void set_node_type(AvNode *node, unsigned type)
 {
-    remove_node(db, node, st);
-    free_node(node);
+    node->hdr = (node->hdr & ~NODE_TYPEMASK) | (uint16_t)(type << 2);
 }
 
-static AvNode* create_node(avstor *db, AvPage *preferred_page, const avstor_key *key,
-                           unsigned szvalue, unsigned type, unsigned level)
+static unsigned get_page_free_space(AvPage* page)
 {
-    AvNode *node;
+    unsigned top = page->top;
+    unsigned bottom = align_node(  //compensate for alignment
+                                 offsetof(AvPage, nodes[page->index_count])
+                                 + (page->index_freelist == INVALID_INDEX ? 2 : 0)); // compensate in case a new index has to be allocated
+    return (top > bottom) ? top - bottom : 0;
+}
 
-    // Offset of the fixed portion
-    // Size of header + length of name (including null termination), aligned
-    unsigned data_ofs = align_node(SIZE_NODE_HDR + key->len);
+static __inline AvPage* get_page(avstor *db, avstor_off page_offset)
+{
+    return cache_lookup(db, page_offset, CACHE_EXISTING);
+}
 
-    // Add size of fixed portion (if any) and size of variable portion (if any)
-    // and align to get node size
-    unsigned node_size = align_node(data_ofs + NODE_CLASS[type].szdata + szvalue);
+// Returns whether a page is in the file mapping, whose lock counts are kept in map_locks
+static __inline int is_mapped_page(const avstor *db, const AvPage *page)
+{
+    return (const char*)page >= db->map && (const char*)page < db->map + (size_t)db->map_size;
+}
 
-    unsigned page_pool = (level > 127) ? 254 : (level << 1);
-    if (type != AVSTOR_TYPE_KEY) {
-        page_pool++;
+// Locks a page that is already locked, or one in the file mapping
+static __inline void lock_db_page(avstor *db, AvPage *page)
+{
+    if (is_mapped_page(db, page)) {
+        (void)atomic_inc_int(&db->map_locks[(size_t)((const char*)page - db->map) / PAGE_SIZE]);
+    }
+    else {
+        lock_page(page);
     }
-    node = alloc_node(db, preferred_page, node_size, page_pool);
-
-    node->hdr = (node->hdr & ~NODE_TYPEMASK) | (uint16_t)((type) << 2);
-    node->left = NODEREF_NULL;
-    node->right = NODEREF_NULL;
-    node->szname = (uint8_t)(data_ofs - SIZE_NODE_HDR);
-    memcpy(&node->name, key->buf, key->len);
-
-    return node;
 }
 
-/*
-static void print_node(avstor* rb, AvNode* node, int level) {
-    char buf[256];
-    int i;
-    for (i = 0; i < level; ++i) {
-        buf[i] = ' ';
+static __inline void unlock_db_page(avstor *db, AvPage *page)
+{
+    if (is_mapped_page(db, page)) {
+#if !defined(NDEBUG)
+        // a page is verified before it is first locked, so an unbalanced unlock clears the flag
+        int result = atomic_dec_int(&db->map_locks[(size_t)((const char*)page - db->map) / PAGE_SIZE]);
+        assert(result & MAP_PAGE_CHECKED);
+#else
+        (void)atomic_dec_int(&db->map_locks[(size_t)((const char*)page - db->map) / PAGE_SIZE]);
+#endif
     }
-    buf[i] = 0;
-    if (node == NULL) {
-        printf("%s<NULL>\n", buf);
-        return;
+    else {
+        unlock_page(page);
     }
-    printf("%s%s[%i]\n", buf, get_node_name_ptr(node), BF(node));
-    print_node(rb, lock_node_ex(rb, &node->left), level + 2);
-    print_node(rb, lock_node_ex(rb, &node->right), level + 2);
 }
 
-static int check_bf(avstor* rb, AvNode* node) {
-    if (node != NULL) {
-        int h1 = check_bf(rb, lock_node_ex(rb, &node->left));
-        int h2 = check_bf(rb, lock_node_ex(rb, &node->right));
-        int bf = h2 - h1;
-        if (h1 > (h2 + 1) || h2 > (h1 + 1)) {
-            fprintf(stderr, "...AVL property violated!\n");
-        }
-        if (BF(node) != bf) {
-            fprintf(stderr, "...Balance Factor invalid for %s! %i vs actual %i\n", get_node_name_ptr(node), BF(node), bf);
-        }
-        return (h1 > h2 ? h1 : h2) + 1;
+#if !defined(NDEBUG)
+static int is_db_page_locked(avstor *db, AvPage *page)
+{
+    if (is_mapped_page(db, page)) {
+        int count = atomic_load_int_acquire(&db->map_locks[(size_t)((const char*)page - db->map) / PAGE_SIZE]);
+        return (count & ~MAP_PAGE_CHECKED) > 0;
     }
-    return 0;
+    return atomic_load_int_acquire(&page->lock_count) > 0;
 }
-*/
+#endif
 
-static void insert_node(avstor *db, AvNode *item, AvStack *st)
+static AvNode* lock_node(avstor *db, const avstor_off noderef)
 {
-    AvStackData *top;
-    if ((top = backtrace_top(st))) {
-        AvNode *cur = lock_node(db, top->noderef);
-        NodeRef *ref = top->comp < 0 ? &cur->left : &cur->right;
-        assert(is_nref_empty(*ref));
+    assert(noderef != 0);
+    return get_node(get_page(db, noderef & OFFSET_MASK), (unsigned)(noderef & ~OFFSET_MASK));
+}
 
-        set_nref(item, ref);
-        set_bf(item, 0);
-        unlock_ptr(cur);
-        // trace back on the stack of ancestors and rebalance
-        balance_down(db, st);
+static AvNode* lock_node_ex(avstor *db, const NodeRef *noderef)
+{
+    AvPage *node_page;
+    avstor_off pageofs, node_ofs;
+    assert(noderef && !is_nref_empty(*noderef));
+    node_page = get_ptr_page(noderef);
+    assert(is_db_page_locked(db, node_page));  // page containging noderef should already be locked
+    node_ofs = nref_to_ofs(*noderef);
+    pageofs = node_ofs & OFFSET_MASK;
+    if (pageofs != node_page->page_offset) {
+        /* This assumes page of noderef is already locked, otherwise it could get swapped out! */
+        node_page = get_page(db, pageofs);
+    }
+    else {
+        // This is ok because page is already locked, we're only increasing the lock count
+        lock_db_page(db, node_page);
+    }
+    return get_node(node_page, (unsigned)(node_ofs & ~OFFSET_MASK));
+}
+
+static __inline void unlock_ptr(avstor *db, const void *ptr)
+{
+    assert(ptr);
+    unlock_db_page(db, get_ptr_page(ptr));
+}
+
+// Locks the node at ofs and unlocks node_to_unlock, if any. cache_flags are passed to cache_lookup
+// when the node is in another page.
+static AvNode* lock_unlock_node(avstor *db, const avstor_off ofs, AvNode *node_to_unlock, unsigned cache_flags)
+{
+    AvPage *node_page;
+    avstor_off pageofs = ofs & OFFSET_MASK;
+    if (!node_to_unlock) {
+        return get_node(cache_lookup(db, pageofs, cache_flags), (unsigned)(ofs & ~OFFSET_MASK));
+    }
+    node_page = get_ptr_page(node_to_unlock);
+    assert(is_db_page_locked(db, node_page));  // page containging noderef should already be locked
+    if (pageofs != node_page->page_offset) {
+        unlock_ptr(db, node_to_unlock);
+        node_page = cache_lookup(db, pageofs, cache_flags);
+    }
+    else {
+        // This is ok because page is already locked, we're only increasing the lock count
+        //lock_page(node_page);
+    }
+    return get_node(node_page, (unsigned)(ofs & ~OFFSET_MASK));
+}
+
+static __inline void unlock_ptr_checked(avstor *db, const void *ptr)
+{
+    if (ptr) {
+        unlock_ptr(db, ptr);
+    }
+}
+
+// Records the page of ptr as touched by a writer if it is in the file mapping
+static __inline void map_touch_ptr(avstor *db, const void *ptr)
+{
+    const AvPage *page = get_ptr_page(ptr);
+    if (ptr && is_mapped_page(db, page)) {
+        map_touch(db, (avstor_off)((const char*)page - db->map));
+    }
+}
+
+static __inline void lock_ref(avstor *db, const NodeRef *noderef)
+{
+    AvPage *page = get_ptr_page(noderef);
+    // Outside the cache lock, we can only increment lock count of currently locked page.
+    // Otherwise, a page currently being evicted might end up getting re-locked, which would be bad.
+    // Header is exception, it is never in the cache
+    assert(is_db_page_locked(db, page) || page->page_offset == 0);
+    lock_db_page(db, page);
+}
+
+static __inline uint32_t get_name_id(const AvNode *node)
+{
+    uint32_t id;
+    memcpy(&id, node->name, sizeof(id));
+    return id;
+}
+
+static const AvName* get_interned_name(const avstor *db, const AvNode *node)
+{
+    uint32_t id = get_name_id(node);
+    if (id >= db->name_count) {
+        THROW(AVSTOR_CORRUPT, "Invalid name id");
+    }
+    return &db->names[id];
+}
+
+static __inline const void* get_node_name_ptr(const avstor *db, const AvNode *node)
+{
+    return (node->szname & NAME_INTERNED) ? get_interned_name(db, node)->buf : node->name;
+}
+
+// First 8 bytes of a name as a big-endian integer, missing bytes are 0
+static __inline uint64_t get_name_prefix(const void *buf, size_t len)
+{
+    const unsigned char *cp = (const unsigned char*)buf;
+    uint64_t prefix = 0;
+    unsigned i;
+    for (i = 0; i < NAME_PREFIX_LEN; ++i) {
+        prefix = (prefix << 8) | (i < len ? cp[i] : 0u);
+    }
+    return prefix;
+}
+
+// Key of a tree search, with what can be computed once for all nodes visited
+typedef struct AvSearchKey {
+    const avstor_key    *key;
+
+    // dictionary id of the key or NAME_ID_NONE, see avstor_intern
+    uint32_t            id;
+
+    // prefix of the key, if ordered bytewise
+    uint64_t            prefix;
+} AvSearchKey;
+
+static void init_search_key(const avstor *db, const avstor_key *key, AvSearchKey *sk)
+{
+    sk->key = key;
+    sk->id = find_name(db, key->buf, key->len);
+    sk->prefix = key->comparer ? 0 : get_name_prefix(key->buf, key->len);
+}
+
+// Compares the name of a key without comparer with a name of len bytes. Names are compared as if
+// padded with zeros, which is how they are stored: names differing only in trailing zero bytes
+// are equal. Most comparisons are decided by the prefixes alone.
+static int compare_bytes(const AvSearchKey *sk, const void *name, size_t len)
+{
+    const unsigned char *kp = (const unsigned char*)sk->key->buf, *np = (const unsigned char*)name;
+    size_t keylen = sk->key->len, i, common;
+    uint64_t prefix = get_name_prefix(name, len);
+    int comp;
+
+    if (sk->prefix != prefix) {
+        return sk->prefix < prefix ? -1 : 1;
+    }
+    common = keylen < len ? keylen : len;
+    if (common > NAME_PREFIX_LEN
+        && 0 != (comp = memcmp(kp + NAME_PREFIX_LEN, np + NAME_PREFIX_LEN, common - NAME_PREFIX_LEN))) {
+        return comp;
+    }
+    // the longer name is greater unless the rest of it is zeros
+    for (i = common > NAME_PREFIX_LEN ? common : NAME_PREFIX_LEN; i < keylen; ++i) {
+        if (kp[i]) {
+            return 1;
+        }
+    }
+    for (i = common > NAME_PREFIX_LEN ? common : NAME_PREFIX_LEN; i < len; ++i) {
+        if (np[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Compares a key with the name of a node at the given depth of a tree, see avstor_trace_begin.
+// Nodes with the dictionary id of the key are equal without comparing.
+static __inline int compare_key(const avstor *db, const AvSearchKey *sk, const AvNode *node,
+                                unsigned depth)
+{
+    const void *name = node->name;
+    size_t len = node->szname;
+    avstor_trace *trace = cur_trace;
+    if (trace) {
+        trace->comparisons++;
+        if (depth > trace->depth) {
+            trace->depth = depth;
+        }
+    }
+    if (node->szname & NAME_INTERNED) {
+        const AvName *interned;
+        if (get_name_id(node) == sk->id) {
+            return 0;
+        }
+        interned = get_interned_name(db, node);
+        name = interned->buf;
+        len = interned->len;
+    }
+    return sk->key->comparer ? sk->key->comparer(sk->key->buf, name) : compare_bytes(sk, name, len);
+}
+
+static AvNode* find_node_with_backtrace(avstor *db, const avstor_key *key, AvStack *st,
+                                        NodeRef *root, NodeRef* volatile *out_ref)
+{
+    AvStackData *top = NULL;
+    AvNode *cur = NULL;
+    st->top = -1;
+    st->root = root;
+    if (out_ref) {
+        *out_ref = NULL;
+    }
+    if (root && !is_nref_empty(*root)) {
+        NodeRef *ref = root;
+        AvSearchKey sk;
+        int comp;
+        init_search_key(db, key, &sk);
+        lock_ref(db, ref);
+        cur = lock_node_ex(db, ref);
+
+        while (0 != (comp = compare_key(db, &sk, cur, (unsigned)(st->top + 2)))) {
+            top = backtrace_push(st);
+            top->comp = comp;
+            top->noderef = nref_to_ofs(*ref);
+            unlock_ptr(db, ref);
+            ref = (comp < 0) ? &cur->left : &cur->right;
+            if (is_nref_empty(*ref)) {
+                if (out_ref) {
+                    *out_ref = ref;  // leave page of ref locked if returning it
+                    return NULL;
+                }
+                else {
+                    cur = NULL;
+                    break;
+                }
+            }
+            cur = lock_node_ex(db, ref);
+        }
+        unlock_ptr(db, ref);
+    }
+    return cur;
+}
+
+static void rotate_right(AvNode *x, AvNode *z)
+{
+    NodeRef t23 = z->right;
+    assign_nref(t23, &x->left);
+    set_nref(x, &z->right);
+    if (BF(z) == 0) {
+        set_bf(x, -1);
+        set_bf(z, 1);
+    }
+    else {
+        set_bf(x, 0);
+        set_bf(z, 0);
+    }
+}
+
+static void rotate_left(AvNode *x, AvNode *z)
+{
+    NodeRef t23 = z->left;
+    assign_nref(t23, &x->right);
+    set_nref(x, &z->left);
+    if (BF(z) == 0) {
+        set_bf(x, 1);
+        set_bf(z, -1);
+    }
+    else {
+        set_bf(x, 0);
+        set_bf(z, 0);
+    }
+}
+
+static AvNode* rotate_right_left(avstor *db, AvNode *x, AvNode *z)
+{
+    AvNode *y = lock_node_ex(db, &z->left);
+    NodeRef t3 = y->right;
+    NodeRef t2;
+    assign_nref(t3, &z->left);
+    set_nref(z, &y->right);
+    t2 = y->left;
+    assign_nref(t2, &x->right);
+    set_nref(x, &y->left);
+    if (BF(y) == 0) {
+        set_bf(x, 0);
+        set_bf(z, 0);
+    }
+    else if (BF(y) > 0) {
+        set_bf(x, -1);
+        set_bf(z, 0);
+    }
+    else {
+        set_bf(x, 0);
+        set_bf(z, 1);
+    }
+    set_bf(y, 0);
+    unlock_ptr(db, z);
+    return y;
+}
+
+static AvNode* rotate_left_right(avstor *db, AvNode *x, AvNode *z)
+{
+    AvNode *y = lock_node_ex(db, &z->right);
+    NodeRef t3 = y->left;
+    NodeRef t2;
+    assign_nref(t3, &z->right);
+    set_nref(z, &y->left);
+    t2 = y->right;
+    assign_nref(t2, &x->left);
+    set_nref(x, &y->right);
+    if (BF(y) == 0) {
+        set_bf(x, 0);
+        set_bf(z, 0);
+    }
+    else if (BF(y) < 0) {
+        set_bf(x, 1);
+        set_bf(z, 0);
+    }
+    else {
+        set_bf(x, 0);
+        set_bf(z, -1);
+    }
+    set_bf(y, 0);
+    unlock_ptr(db, z);
+    return y;
+}
+
+static void backtrace_set_ref(avstor *db, AvStack *st, int pos, AvNode *cur, AvNode *src)
+{
+    const AvStackData *data = backtrace_peek(st, pos);
+    if (data) {
+        avstor_off cur_ofs = get_ofs(cur);
+        AvNode *dest = lock_node(db, data->noderef);
+        NodeRef *dest_child;
+        if (nref_to_ofs(dest->left) == cur_ofs) {
+            dest_child = &dest->left;
+        }
+        else if (nref_to_ofs(dest->right) == cur_ofs) {
+            dest_child = &dest->right;
+        }
+        else {
+            unlock_ptr(db, dest);
+            THROW(AVSTOR_INTERNAL, "dest is not a parent of cur");
+        }
+        set_nref(src, dest_child);
+        unlock_ptr(db, dest);
+    }
+    else {
+        set_nref(src, st->root);
+    }
+}
+
+static void balance_down(avstor *db, AvStack *st)
+{
+    AvStackData *top;
+    while ((top = backtrace_pop(st))) {
+        AvNode *cur = lock_node(db, top->noderef);
+        int comp = top->comp < 0 ? -1 : 1;  // because strcmp could return below -1 or above +1
+        int bf_cur = BF(cur);
+        if (bf_cur == 0) {
+            // was balanced but either subtree increased in height
+            set_bf(cur, comp);
+            set_ptr_dirty(cur);
+            unlock_ptr(db, cur);
+        }
+        else if ((comp + bf_cur) != 0) {
+            //Was unbalanced and now even more unbalanced. Must rotate.
+            AvNode *z;
+            if (bf_cur > 0) {
+                z = lock_node_ex(db, &cur->right);
+                if (BF(z) > 0) {
+                    rotate_left(cur, z);
+                }
+                else {
+                    z = rotate_right_left(db, cur, z);
+                }
+            }
+            else {
+                z = lock_node_ex(db, &cur->left);
+                if (BF(z) < 0) {
+                    rotate_right(cur, z);
+                }
+                else {
+                    z = rotate_left_right(db, cur, z);
+                }
+            }
+            backtrace_set_ref(db, st, st->top, cur, z);
+            unlock_ptr(db, z);
+            unlock_ptr(db, cur);
+            break;
+        }
+        else {
+            // was unbalanced but now balanced
+            set_bf(cur, 0);
+            set_ptr_dirty(cur);
+            unlock_ptr(db, cur);
+            break;
+        }
+    }
+}
+
+static void balance_up(avstor *db, AvStack *st)
+{
+    AvStackData *top;
+    while ((top = backtrace_pop(st))) {
+        AvNode *cur = lock_node(db, top->noderef);
+        int comp = top->comp;
+        int bf_cur = BF(cur);
+        int b;
+        if (comp < 0) {
+            if (bf_cur > 0) {
+                AvNode *z = lock_node_ex(db, &cur->right);
+                b = BF(z);
+                if (b < 0) {
+                    z = rotate_right_left(db, cur, z);
+                }
+                else {
+                    rotate_left(cur, z);
+                }
+                backtrace_set_ref(db, st, st->top, cur, z);
+                unlock_ptr(db, z);
+                unlock_ptr(db, cur);
+            }
+            else {
+                set_ptr_dirty(cur);
+                if (bf_cur == 0) {
+                    set_bf(cur, 1);
+                    unlock_ptr(db, cur);
+                    break;
+                }
+                set_bf(cur, 0);
+                unlock_ptr(db, cur);
+                continue;
+            }
+        }
+        else {
+            if (bf_cur < 0) {
+                AvNode *z = lock_node_ex(db, &cur->left);
+                b = BF(z);
+                if (b > 0) {
+                    z = rotate_left_right(db, cur, z);
+                }
+                else {
+                    rotate_right(cur, z);
+                }
+                backtrace_set_ref(db, st, st->top, cur, z);
+                unlock_ptr(db, z);
+                unlock_ptr(db, cur);
+            }
+            else {
+                set_ptr_dirty(cur);
+                if (bf_cur == 0) {
+                    set_bf(cur, -1);
+                    unlock_ptr(db, cur);
+                    break;
+                }
+                set_bf(cur, 0);
+                unlock_ptr(db, cur);
+                continue;
+            }
+        }
+        if (b == 0) break;
+    }
+}
+
+static void remove_node(avstor *db, AvNode *node, AvStack *st)
+{
+    AvStackData *top;
+    NodeRef *ref;
+    assert(node && st);
+
+    if (!(top = backtrace_top(st))) {
+        ref = st->root;
+    }
+    else {
+        AvNode *temp = lock_node(db, top->noderef);
+        ref = top->comp < 0 ? &temp->left : &temp->right;
+        unlock_ptr(db, temp);
+    }
+
+    if (is_nref_empty(node->left) && is_nref_empty(node->right)) {
+        // Case 1: node to remove has no children
+        assign_nref(NODEREF_NULL, ref);
+    }
+    else if (is_nref_empty(node->left) || is_nref_empty(node->right)) {
+        // Case 2: node has only one child
+        NodeRef *childRef = (!is_nref_empty(node->left)) ? &node->left : &node->right;
+        assign_nref(*childRef, ref);
+        assign_nref(NODEREF_NULL, childRef);
+    }
+    else {
+        // Case 3: node has two children
+        // Find in-order successor (smallest in right subtree)
+        AvNode *succ;
+        AvStackData *topdel;
+        AvNode* topdel_node;
+        int delpos;
+        top = backtrace_push(st);
+        assert(top);
+        top->noderef = get_ofs(node);
+        top->comp = 1;
+        ref = &node->right;
+        lock_ref(db, ref);
+        succ = lock_node_ex(db, ref);
+        topdel = top;
+        delpos = st->top;
+        while (!is_nref_empty(succ->left)) {
+            top = backtrace_push(st);
+            assert(top);
+            top->noderef = nref_to_ofs(*ref);
+            top->comp = -1;
+            unlock_ptr(db, ref);
+            ref = &succ->left;
+            //lock_ref(db, ref);
+            //unlock_ptr(db, succ);
+            succ = lock_node_ex(db, ref);
+        }
+        assign_nref(node->left, &succ->left);
+        if (topdel != top) {
+            assign_nref(succ->right, ref);
+            assign_nref(node->right, &succ->right);
+        }
+        unlock_ptr(db, ref);
+        topdel_node = lock_node(db, topdel->noderef);
+        backtrace_set_ref(db, st, delpos-1, topdel_node, succ);
+        unlock_ptr(db, topdel_node);
+        topdel->noderef = get_ofs(succ);
+        set_bf(succ, BF(node));
+        unlock_ptr(db, succ);
+    }
+    balance_up(db, st);
+    assign_nref(NODEREF_NULL, &node->left);
+    assign_nref(NODEREF_NULL, &node->right);
+}
+
+static AvPage* create_page(avstor *db, unsigned type)
+{
+    AvPage *hdr = db->cache.header;
+    AvPage *page;
+    avstor_off page_offset;
+
+    if (get_pagecount(hdr) == MAX_FILE_PAGES) {
+        THROW(AVSTOR_INVOPER, "Maximum allowable file size exceeded");
+    }
+    page_offset = get_pagecount(hdr) * (unsigned)PAGE_SIZE;
+    if (db->merkle && !merkle_resize(db->merkle, get_pagecount(hdr) + 1)) {
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    page = cache_lookup(db, page_offset, 0);
+    //memcpy(&page->id, &PAGE_ID, sizeof(PAGE_ID));
+    page->type = (uint8_t)type;
+    page->top = PAGE_SIZE;
+    page->index_freelist = INVALID_INDEX;
+    set_page_dirty(page);
+    set_pagecount(hdr, get_pagecount(hdr) + 1);
+    set_page_dirty(hdr);
+
+    return page;
+}
+
+// Returns the arena of the calling thread, creating it if necessary. Global lock must be held
+// exclusively.
+static AvArena* get_arena(avstor *db)
+{
+    AvArena *arena;
+    for (arena = db->arenas; arena; arena = arena->next) {
+        if (arena->owner == cur_thread_id) {
+            return arena;
+        }
+    }
+    if (!(arena = calloc(1, sizeof(AvArena)))) {
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    arena->owner = cur_thread_id;
+    arena->next = db->arenas;
+    db->arenas = arena;
+    db->arena_count++;
+    return arena;
+}
+
+// Returns the insertion page of a page pool in an arena, claiming that of the file if the arena
+// has none yet, or 0
+static AvPageNum arena_get_page(avstor *db, AvArena *arena, unsigned page_pool)
+{
+    AvPageMapItem *item = pagemap_find(&arena->pools, page_pool + 1);
+    AvPageNum page_num;
+    if (item) {
+        return item->value;
+    }
+    if ((page_num = get_pool_page(db->cache.header, page_pool)) != 0) {
+        if (!pagemap_put(&arena->pools, page_pool + 1, page_num)) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        set_pool_page(db->cache.header, page_pool, 0);
+        set_page_dirty(db->cache.header);
+    }
+    return page_num;
+}
+
+// Returns the free space of an insertion page
+static unsigned get_pool_page_free_space(avstor *db, AvPageNum page_num)
+{
+    AvPage *page = get_page(db, page_num * PAGE_SIZE);
+    unsigned free_space = get_page_free_space(page);
+    unlock_db_page(db, page);
+    return free_space;
+}
+
+// Returns the insertion pages of all arenas to the file, or drops them after a rollback, and frees
+// the arenas. Of the pages several arenas hold for a page pool, the file keeps the one with the
+// most free space.
+static void arenas_release(avstor *db, int keep_pages)
+{
+    AvArena *arena;
+    AvPageNum page_num;
+    unsigned i, page_pool;
+    for (arena = db->arenas; keep_pages && arena; arena = arena->next) {
+        for (i = 0; arena->pools.items && i <= arena->pools.mask; ++i) {
+            if (arena->pools.items[i].page == 0) {
+                continue;
+            }
+            page_pool = (unsigned)arena->pools.items[i].page - 1;
+            page_num = get_pool_page(db->cache.header, page_pool);
+            if (page_num == 0 || get_pool_page_free_space(db, page_num)
+                < get_pool_page_free_space(db, arena->pools.items[i].value)) {
+                set_pool_page(db->cache.header, page_pool, arena->pools.items[i].value);
+                set_page_dirty(db->cache.header);
+            }
+        }
+    }
+    arenas_free(db);
+}
+
+static AvNode* alloc_node(avstor *db, AvPage *preferred_page, unsigned size, unsigned page_pool)
+{
+    AvPage *page = NULL;
+    uint16_t *index;
+    AvNode *node;
+    unsigned index_ofs;
+    uint16_t nextfree;
+
+    if (preferred_page && size <= get_page_free_space(preferred_page)) {
+        page = preferred_page;
+        assert(is_db_page_locked(db, page));
+        lock_db_page(db, page);
+        set_page_dirty(page);
+    }
+    else {
+        AvArena *arena = (db->oflags & AVSTOR_OPEN_ARENAS) ? get_arena(db) : NULL;
+        AvPageNum page_num = arena ? arena_get_page(db, arena, page_pool) : get_pool_page(db->cache.header, page_pool);
+        if (page_num != 0) {
+            page = get_page(db, page_num * PAGE_SIZE);
+            if (size > get_page_free_space(page)) {
+                unlock_db_page(db, page);
+                page = NULL;
+            }
+            else {
+                set_page_dirty(page);
+            }
+        }
+        if (!page || page_num == 0) {
+            page = create_page(db, PAGE_KEYS);
+            if (size > get_page_free_space(page)) {
+                THROW(AVSTOR_INTERNAL, MSG_NO_SPACE_IN_PAGE);
+            }
+            if (!(page_pool & 1)) {
+                page->page_flags |= PAGE_FLAG_KEYS;
+                if (db->oflags & AVSTOR_OPEN_PRIORITIZE_KEYS) {
+                    cache_set_priority(db, page->page_offset, AVSTOR_PRIORITY_HIGH);
+                }
+            }
+            page_num = page->page_offset / PAGE_SIZE;
+            if (!arena) {
+                set_pool_page(db->cache.header, page_pool, page_num);
+            }
+            else if (!pagemap_put(&arena->pools, page_pool + 1, page_num)) {
+                THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+            }
+        }
+    }
+
+    nextfree = page->index_freelist;
+    //set_page_dirty(page);
+    if (nextfree == INVALID_INDEX) {
+        index = &page->nodes[page->index_count];
+        page->index_count++;
+    }
+    else {
+        index = (uint16_t*)PTR(page, nextfree);
+        page->index_freelist = *index;
+    }
+    page->top -= size;
+    *index = page->top;
+    index_ofs = PTR_DIFF(page, index);
+    node = get_node(page, index_ofs);
+
+    // check if we have overwritten the node index array
+    if ((void*)node < (void*)&page->nodes[page->index_count]) {
+        THROW(AVSTOR_INTERNAL, MSG_PAGE_CORRUPTED);
+    }
+
+    node->index = (uint8_t)((index_ofs - offsetof(AvPage, nodes)) / sizeof(uint16_t));
+    set_node_size(node, size);
+    //lock_page(page);
+    return node;
+}
+
+static AvNode* resize_node(AvNode* node, unsigned newsize)
+{
+    AvPage *page;
+    AvNode *next, *dest, *cur, *src;
+    unsigned oldsize, page_free, newtop, count;
+
+    assert((newsize == 0 || newsize >= sizeof(AvNode)) && newsize == align_node(newsize));
+
+    oldsize = get_node_size(node);
+    if (newsize == oldsize) {
+        return node;
+    }
+    page = get_ptr_page(node);
+    page_free = get_page_free_space(page);
+    if (newsize > oldsize && (newsize - oldsize) > page_free) {
+        THROW(AVSTOR_INTERNAL, "resize_node() failed");
+    }
+    newtop = page->top + oldsize - newsize;
+    next = PTR(node, oldsize);
+    if (newsize == 0) { // free the node instead of resize
+        //check if we deallocated the last index
+        uint16_t* oldindex = &page->nodes[node->index];
+        if (node->index == page->index_count - 1) {
+            // yes, just decrease count and zero the last one
+            *oldindex = 0;
+            page->index_count--;
+        }
+        else {
+            // no, add it to free index list
+            *oldindex = page->index_freelist;
+            page->index_freelist = offsetof(AvPage, nodes[node->index]);
+        }
+    }
+    src = PTR(page, page->top);
+    dest = PTR(page, newtop);
+    count = PTR_DIFF(src, node);
+    set_node_size(node, newsize);
+    if (newsize < oldsize) {
+        memmove(dest, src, (size_t)count + newsize);
+        memset(src, 0, (size_t)oldsize - newsize);
+    }
+    else {
+        unsigned diff = newsize - oldsize;
+        memmove(dest, src, (size_t)count + oldsize);
+        memset(PTR(node, (int)oldsize - (int)diff), 0, diff);
+    }
+    // Adjust index offsets
+    cur = dest;
+    while (cur < next) {
+        uint16_t* curslot = &page->nodes[cur->index];
+        *curslot = (uint16_t)((int)*curslot + ((int)oldsize - (int)newsize));
+        assert(is_node_addr_valid(NULL, cur));
+        cur = (AvNode*)PTR(cur, get_node_size(cur));
+    }
+    page->top = (uint16_t)newtop;
+    return PTR(node, (int)oldsize - (int)newsize);
+}
+
+static void free_node(AvNode* node)
+{
+    resize_node(node, 0);
+}
+
+static void delete_node(avstor *db, AvNode *node, AvStack *st)
+{
+    remove_node(db, node, st);
+    free_node(node);
+}
+
+// Bytes added to nodes of a type in files with key statistics or parent references, see AvKeyStats
+static __inline unsigned get_stats_size(avstor *db, unsigned type)
+{
+    uint32_t flags = db->cache.header->flags;
+    unsigned size = 0;
+    if (type != AVSTOR_TYPE_KEY) {
+        return (flags & (AVSTOR_FILE_KEYSTATS | AVSTOR_FILE_PARENTS)) ? (unsigned)sizeof(NodeRef) : 0;
+    }
+    if (flags & AVSTOR_FILE_KEYSTATS) {
+        size += (unsigned)sizeof(struct AvKeyStats);
+    }
+    if (flags & AVSTOR_FILE_PARENTS) {
+        size += (unsigned)sizeof(NodeRef);
+    }
+    return size;
+}
+
+// Reference of the key a value belongs to or of the parent of a key, in files that keep it
+static __inline NodeRef* get_node_owner(AvNode *node)
+{
+    return (NodeRef*)PTR(node, get_node_size(node) - sizeof(NodeRef));
+}
+
+static AvNode* create_node(avstor *db, AvPage *preferred_page, const avstor_key *key,
+                           unsigned szvalue, unsigned type, unsigned level)
+{
+    AvNode *node;
+
+    // User nodes (level > 0) whose name is in the dictionary store its id instead of the name.
+    // Internal trees are named by offsets and hashes, which are never interned.
+    uint32_t name_id = (level > 0 && key->len > sizeof(uint32_t))
+        ? find_name(db, key->buf, key->len) : NAME_ID_NONE;
+    unsigned szname = (name_id != NAME_ID_NONE) ? (unsigned)sizeof(name_id) : (unsigned)key->len;
+
+    // Offset of the fixed portion
+    // Size of header + length of name (including null termination), aligned
+    unsigned data_ofs = align_node(SIZE_NODE_HDR + szname);
+
+    // Add size of fixed portion (if any) and size of variable portion (if any)
+    // and align to get node size
+    unsigned szstats = get_stats_size(db, type);
+    unsigned node_size = align_node(data_ofs + NODE_CLASS[type].szdata + szvalue + szstats);
+
+    unsigned page_pool = (level > 127) ? 254 : (level << 1);
+    if (type != AVSTOR_TYPE_KEY) {
+        page_pool++;
+    }
+    node = alloc_node(db, preferred_page, node_size, page_pool);
+
+    set_node_type(node, type);
+    node->left = NODEREF_NULL;
+    node->right = NODEREF_NULL;
+    node->szname = (uint8_t)(data_ofs - SIZE_NODE_HDR);
+    if (name_id != NAME_ID_NONE) {
+        node->szname |= NAME_INTERNED;
+        memcpy(&node->name, &name_id, sizeof(name_id));
+    }
+    else {
+        // padding is zeroed, names without comparer are compared as stored
+        memcpy(&node->name, key->buf, key->len);
+        memset(node->name + key->len, 0, data_ofs - SIZE_NODE_HDR - key->len);
+    }
+    if (szstats) {
+        // zero statistics of a key, or no owner
+        memset(PTR(node, node_size - szstats), 0, szstats);
+    }
+
+    return node;
+}
+
+/*
+static void print_node(avstor* rb, AvNode* node, int level) {
+    char buf[256];
+    int i;
+    for (i = 0; i < level; ++i) {
+        buf[i] = ' ';
+    }
+    buf[i] = 0;
+    if (node == NULL) {
+        printf("%s<NULL>\n", buf);
+        return;
+    }
+    printf("%s%s[%i]\n", buf, get_node_name_ptr(node), BF(node));
+    print_node(rb, lock_node_ex(rb, &node->left), level + 2);
+    print_node(rb, lock_node_ex(rb, &node->right), level + 2);
+}
+
+static int check_bf(avstor* rb, AvNode* node) {
+    if (node != NULL) {
+        int h1 = check_bf(rb, lock_node_ex(rb, &node->left));
+        int h2 = check_bf(rb, lock_node_ex(rb, &node->right));
+        int bf = h2 - h1;
+        if (h1 > (h2 + 1) || h2 > (h1 + 1)) {
+            fprintf(stderr, "...AVL property violated!\n");
+        }
+        if (BF(node) != bf) {
+            fprintf(stderr, "...Balance Factor invalid for %s! %i vs actual %i\n", get_node_name_ptr(node), BF(node), bf);
+        }
+        return (h1 > h2 ? h1 : h2) + 1;
+    }
+    return 0;
+}
+*/
+
+static void insert_node(avstor *db, AvNode *item, AvStack *st)
+{
+    AvStackData *top;
+    if ((top = backtrace_top(st))) {
+        AvNode *cur = lock_node(db, top->noderef);
+        NodeRef *ref = top->comp < 0 ? &cur->left : &cur->right;
+        assert(is_nref_empty(*ref));
+
+        set_nref(item, ref);
+        set_bf(item, 0);
+        unlock_ptr(db, cur);
+        // trace back on the stack of ancestors and rebalance
+        balance_down(db, st);
+    }
+    else {
+        set_nref(item, st->root);
+        set_bf(item, 0);
+    }
+}
+
+static AvNode* find_key(avstor *db, const avstor_key *key, const NodeRef *rootref)
+{
+    AvNode *cur;
+    const NodeRef *ref = rootref;
+    AvSearchKey sk;
+    unsigned depth = 0;
+    init_search_key(db, key, &sk);
+    lock_ref(db, ref);
+    while (!is_nref_empty(*ref)) {
+        int comp;
+        cur = lock_node_ex(db, ref);
+        unlock_ptr(db, ref);
+        comp = compare_key(db, &sk, cur, ++depth);
+        if (comp == 0) {
+            return cur;
+        }
+        ref = (comp < 0) ? &cur->left : &cur->right;
+    }
+    unlock_ptr(db, ref);
+    return NULL;
+}
+
+static __inline AvPageNum get_page_num_pair(const uint32_t *pair)
+{
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    return ((AvPageNum)pair[1] << 32) | pair[0];
+#else
+    return pair[0];
+#endif
+}
+
+static __inline void set_page_num_pair(uint32_t *pair, AvPageNum page_num)
+{
+    pair[0] = (uint32_t)page_num;
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    pair[1] = (uint32_t)(page_num >> 32);
+#else
+    pair[1] = 0;
+#endif
+}
+
+// Locks a side page of the checksum tree, checking its type
+static AvPage* merkle_lock_page(avstor *db, AvPageNum page_num, unsigned type)
+{
+    AvPage *page;
+    if (page_num == 0 || page_num >= get_pagecount(db->cache.header)) {
+        THROW(AVSTOR_CORRUPT, "Invalid checksum tree page");
+    }
+    page = cache_lookup(db, page_num * PAGE_SIZE, CACHE_EXISTING);
+    if (page->type != type) {
+        unlock_db_page(db, page);
+        THROW(AVSTOR_CORRUPT, "Invalid checksum tree page");
+    }
+    return page;
+}
+
+// Writes a side page of the checksum tree modified by the caller, who locked it
+static void merkle_write_page(avstor *db, AvPage *page)
+{
+    int result;
+    set_page_dirty(page);
+    unlock_db_page(db, page);
+    if (AVSTOR_OK != (result = write_page(db, page))) {
+        THROW(result, "write_page() failed while writing checksum tree");
+    }
+}
+
+/*
+* Writes the page checksums changed since the last commit to their PAGE_MERKLE pages, allocating
+* those and the directory pages listing them as the file grows, and stores the root in the header.
+* Allocated pages add checksums of their own, so this repeats until the file stops growing. Global
+* lock must be held exclusively, and pages other than the header written.
+*/
+static void merkle_save(avstor *db)
+{
+    AvMerkle *m = db->merkle;
+    AvPage *hdr = db->cache.header;
+    AvPage *page;
+    AvPageNum count;
+    size_t i, d;
+
+    do {
+        count = m->counts[0];
+        for (i = 0; i < m->page_count; ++i) {
+            AvPageNum first = (AvPageNum)i * MERKLE_PAGE_LEAVES, leaves;
+            if (!m->dirty[i] || first >= m->counts[0]) {
+                continue;
+            }
+            if (m->pages[i]) {
+                page = merkle_lock_page(db, m->pages[i], PAGE_MERKLE);
+            }
+            else {
+                page = create_page(db, PAGE_MERKLE);
+                m->pages[i] = page->page_offset / PAGE_SIZE;
+                if (i / MERKLE_DIR_ENTRIES < m->dirs_stale) {
+                    m->dirs_stale = i / MERKLE_DIR_ENTRIES;
+                }
+            }
+            leaves = m->counts[0] - first;
+            memset(&page->merkle_next, 0, PAGE_SIZE - offsetof(AvPage, merkle_next));
+            memcpy(page->merkle_items, m->hashes[0] + first,
+                   (size_t)(leaves < MERKLE_PAGE_LEAVES ? leaves : MERKLE_PAGE_LEAVES) * sizeof(uint32_t));
+            m->dirty[i] = 0;
+            merkle_write_page(db, page);
+        }
+
+        // directory pages from the first one listing a page allocated above
+        for (d = m->dirs_stale; d < (m->page_count + MERKLE_DIR_ENTRIES - 1) / MERKLE_DIR_ENTRIES
+                                && m->pages[d * MERKLE_DIR_ENTRIES]; ++d) {
+            if (d == m->dir_count) {
+                AvPageNum *dirs = realloc(m->dirs, (d + 1) * sizeof(AvPageNum));
+                if (!dirs) {
+                    THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+                }
+                m->dirs = dirs;
+                page = create_page(db, PAGE_MERKLE_DIR);
+                m->dirs[m->dir_count++] = page->page_offset / PAGE_SIZE;
+                if (d > 0) {
+                    AvPage *prev = merkle_lock_page(db, m->dirs[d - 1], PAGE_MERKLE_DIR);
+                    set_page_num_pair(prev->merkle_next, m->dirs[d]);
+                    merkle_write_page(db, prev);
+                }
+            }
+            else {
+                page = merkle_lock_page(db, m->dirs[d], PAGE_MERKLE_DIR);
+            }
+            memset(&page->merkle_next, 0, PAGE_SIZE - offsetof(AvPage, merkle_next));
+            if (d + 1 < m->dir_count) {
+                set_page_num_pair(page->merkle_next, m->dirs[d + 1]);
+            }
+            for (i = 0; i < MERKLE_DIR_ENTRIES && d * MERKLE_DIR_ENTRIES + i < m->page_count; ++i) {
+                set_page_num_pair(&page->merkle_items[i * 2], m->pages[d * MERKLE_DIR_ENTRIES + i]);
+            }
+            merkle_write_page(db, page);
+        }
+        m->dirs_stale = (size_t)-1;
+    } while (count != m->counts[0]);
+
+    if (!(hdr->flags & AVSTOR_FILE_MERKLE) || hdr->merkle_root != m->hashes[m->levels - 1][0]
+        || get_page_num_pair(hdr->merkle_dir) != m->dirs[0]) {
+        hdr->flags |= AVSTOR_FILE_MERKLE;
+        hdr->merkle_root = m->hashes[m->levels - 1][0];
+        set_page_num_pair(hdr->merkle_dir, m->dirs[0]);
+        set_page_dirty(hdr);
+    }
+}
+
+// Loads the page checksums from the PAGE_MERKLE pages listed by the directory pages
+static void merkle_load(avstor *db)
+{
+    AvMerkle *m = db->merkle;
+    AvPageNum dir = get_page_num_pair(db->cache.header->merkle_dir), first;
+    AvPage *page;
+    size_t i = 0;
+
+    while (dir != 0) {
+        unsigned j;
+        AvPageNum *dirs = realloc(m->dirs, (m->dir_count + 1) * sizeof(AvPageNum));
+        if (!dirs) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        m->dirs = dirs;
+        m->dirs[m->dir_count++] = dir;
+        page = merkle_lock_page(db, dir, PAGE_MERKLE_DIR);
+        for (j = 0; j < MERKLE_DIR_ENTRIES && i < m->page_count; ++j, ++i) {
+            m->pages[i] = get_page_num_pair(&page->merkle_items[j * 2]);
+        }
+        dir = get_page_num_pair(page->merkle_next);
+        unlock_db_page(db, page);
+    }
+    for (i = 0; i < m->page_count; ++i) {
+        AvPageNum count;
+        first = (AvPageNum)i * MERKLE_PAGE_LEAVES;
+        count = m->counts[0] - first;
+        page = merkle_lock_page(db, m->pages[i], PAGE_MERKLE);
+        memcpy(m->hashes[0] + first, page->merkle_items,
+               (size_t)(count < MERKLE_PAGE_LEAVES ? count : MERKLE_PAGE_LEAVES) * sizeof(uint32_t));
+        unlock_db_page(db, page);
+        m->dirty[i] = 0;
+    }
+    merkle_update_levels(m, 0);
+}
+
+// Computes the page checksums by reading every page, for files without a checksum tree
+static void merkle_scan(avstor *db)
+{
+    AvMerkle *m = db->merkle;
+    union {
+        AvPage page;
+        char data[PAGE_SIZE];
+    } buf;
+    AvPageNum page_num;
+    int result;
+
+    for (page_num = 1; page_num < m->counts[0]; ++page_num) {
+        if (AVSTOR_OK != (result = read_page(db, page_num * PAGE_SIZE, &buf.page))) {
+            THROW(result, "read_page() failed while computing checksum tree");
+        }
+        m->hashes[0][page_num] = buf.page.type == PAGE_KEYS ? buf.page.checksum : 0;
+    }
+    merkle_update_levels(m, 0);
+}
+
+// Sets up the checksum tree of a file opened with AVSTOR_OPEN_MERKLE or that has one
+static void merkle_open(avstor *db)
+{
+    if (!(db->merkle = calloc(1, sizeof(AvMerkle)))) {
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    db->merkle->dirs_stale = (size_t)-1;
+    if (!merkle_resize(db->merkle, get_pagecount(db->cache.header))) {
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    if (db->cache.header->flags & AVSTOR_FILE_MERKLE) {
+        merkle_load(db);
+    }
+    else {
+        // the side pages are written with the next commit
+        merkle_scan(db);
+        db->merkle->dirs_stale = 0;
+    }
+}
+
+// Global lock must be held exclusively
+static int commit_locked(avstor *db, int flush)
+{
+    PageCache *cache;
+    unsigned i;
+    int result;
+
+    TRY(ex)
+    {
+        cache = &db->cache;
+        arenas_release(db, 1);
+        if (AVSTOR_OK != (result = map_write_pages(db))) {
+            THROW(result, "write_page() failed");
+        }
+
+        for (i = 0; i < cache->item_count; ++i) {
+            CacheItem *item = cache_item(cache, i);
+            if (item->key != 0 && AVSTOR_OK != (result = write_page(db, item->page))) {
+                THROW(result, "write_page() failed");
+            }
+        }
+        if (db->merkle && !(db->oflags & AVSTOR_OPEN_READONLY)) {
+            merkle_save(db);
+        }
+        if (AVSTOR_OK != (result = write_page(db, cache->header))) {
+            THROW(result, "write_page() failed while writing header");
+        }
+        if (flush && !io_commit(db->file)) {
+            THROW(AVSTOR_IOERR, "commit() failed");
+        }
+        if (flush && db->wbuf && !io_commit(db->wbuf->file)) {
+            THROW(AVSTOR_IOERR, "commit() failed on write buffer log");
+        }
+        // save header for rollback purposes
+        memcpy(cache->old_header, cache->header, PAGE_SIZE);
+        db->names_committed = db->name_count;
+        map_file(db);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        result = ex.err;
+    }
+    END_TRY(ex);
+    return result;
+}
+
+/* Note that errors here are not YET recoverable */
+int AVCALL avstor_commit(avstor *db, int flush)
+{
+    int result;
+
+    CHECK_PARAM(db);
+    rwl_lock_exclusive(&db->global_rwl);
+    result = commit_locked(db, flush);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+/*
+* Returns the root of the page checksum tree, the number of its levels and the number of pages it
+* covers. The tree reflects the pages as last written to the file, so the root of two files should
+* be compared after a commit. Evictions may write pages meanwhile, hence the cache lock.
+*/
+int AVCALL avstor_merkle_root(avstor *db, uint32_t *out_root, unsigned *out_levels, avstor_off *out_pages)
+{
+    AvMerkle *m;
+    CHECK_PARAM(db && out_root && out_levels && out_pages);
+    if (!(m = db->merkle)) {
+        RETURN(AVSTOR_INVOPER, "File has no page checksum tree");
+    }
+    rwl_lock_shared(&db->global_rwl);
+    avmtx_lock(&db->cache.lock);
+    *out_root = m->hashes[m->levels - 1][0];
+    *out_levels = m->levels;
+    *out_pages = m->counts[0];
+    avmtx_unlock(&db->cache.lock);
+    rwl_release(&db->global_rwl);
+    return AVSTOR_OK;
+}
+
+// Copies up to count hashes of a level of the page checksum tree from index first on. Level 0
+// holds page checksums, 0 for the header and the pages of the tree, and a hash of level n + 1
+// covers AVSTOR_MERKLE_FANOUT hashes of level n. out_count is 0 past the end of the level.
+int AVCALL avstor_merkle_hashes(avstor *db, unsigned level, avstor_off first, uint32_t *out_hashes,
+                                unsigned count, unsigned *out_count)
+{
+    AvMerkle *m;
+    CHECK_PARAM(db && out_hashes && out_count);
+    if (!(m = db->merkle)) {
+        RETURN(AVSTOR_INVOPER, "File has no page checksum tree");
+    }
+    rwl_lock_shared(&db->global_rwl);
+    avmtx_lock(&db->cache.lock);
+    *out_count = 0;
+    if (level < m->levels && first < m->counts[level]) {
+        if (count > m->counts[level] - first) {
+            count = (unsigned)(m->counts[level] - first);
+        }
+        memcpy(out_hashes, m->hashes[level] + first, count * sizeof(uint32_t));
+        *out_count = count;
+    }
+    avmtx_unlock(&db->cache.lock);
+    rwl_release(&db->global_rwl);
+    return AVSTOR_OK;
+}
+
+// Checks that no cached page is locked and that the page table holds exactly the loaded items
+int AVCALL avs_check_cache_consistency(avstor *db)
+{
+    PageCache *cache = &db->cache;
+    unsigned i, filed = 0, slots = 0;
+    int result = AVSTOR_OK;
+
+    avmtx_lock(&cache->lock);
+    for (i = 0; i < cache->item_count; ++i) {
+        CacheItem *item = cache_item(cache, i);
+        if (atomic_load_int_acquire(&item->page->lock_count) != 0)  {
+            result = AVSTOR_CORRUPT;
+        }
+        if (item->key != 0) {
+            filed++;
+            if (cache_find(cache, item->key) != item || item->offset != item->key
+                || atomic_load_int_acquire(&item->tag) != cache_tag(item->key)) {
+                result = AVSTOR_CORRUPT;
+            }
+        }
+    }
+    for (i = 0; i <= cache->table->mask; ++i) {
+        slots += cache->table->slots[i] != NULL;
+    }
+    avmtx_unlock(&cache->lock);
+    return filed == slots ? result : AVSTOR_CORRUPT;
+}
+
+// Overwrites the file flags in the header, used by tests to produce files of older revisions
+int AVCALL avs_set_file_flags(avstor *db, uint32_t flags)
+{
+    CHECK_PARAM(db);
+    rwl_lock_exclusive(&db->global_rwl);
+    db->cache.header->flags = flags;
+    set_page_dirty(db->cache.header);
+    rwl_release(&db->global_rwl);
+    return AVSTOR_OK;
+}
+
+// Returns the page number of the insertion page of a page pool, 0 if it has none, used by tests
+int AVCALL avs_get_pool_page(avstor *db, unsigned page_pool, avstor_off *out_page)
+{
+    CHECK_PARAM(db && page_pool < 256 && out_page);
+    rwl_lock_shared(&db->global_rwl);
+    *out_page = get_pool_page(db->cache.header, page_pool);
+    rwl_release(&db->global_rwl);
+    return AVSTOR_OK;
+}
+
+static size_t pagemap_size(const AvPageMap *map)
+{
+    return map->items ? (map->mask + 1) * sizeof(AvPageMapItem) : 0;
+}
+
+/*
+* Reports the memory allocated for an open file. Page buffers are allocated in blocks and never
+* released while the file is open; pool_used counts the buffers handed out to the cache.
+*/
+int AVCALL avstor_memory_usage(avstor *db, avstor_memory *out)
+{
+    PageCache *cache;
+    CacheTable *table;
+    AvArena *arena;
+
+    CHECK_PARAM(db && out);
+    cache = &db->cache;
+    memset(out, 0, sizeof(*out));
+    rwl_lock_shared(&db->global_rwl);
+
+    avmtx_lock(&db->bpool.lock);
+    out->pool_bytes = (size_t)db->bpool.count * DEFAULT_BLOCK_SIZE * 1024;
+    out->pool_used = ((size_t)(db->bpool.count - 1) * PAGES_PER_BLOCK + db->bpool.next_page) * PAGE_SIZE;
+    out->limit = (size_t)db->bpool.max_count * DEFAULT_BLOCK_SIZE * 1024;
+    out->other = db->bpool.capacity * sizeof(AvPage*);
+    avmtx_unlock(&db->bpool.lock);
+
+    avmtx_lock(&cache->lock);
+    out->cache_capacity = cache->item_count;
+    out->cache_items = (size_t)cache->chunk_count * CACHE_CHUNK_ITEMS * sizeof(CacheItem);
+    for (table = cache->table; table; table = table->retired) {
+        out->cache_items += sizeof(CacheTable) + table->mask * sizeof(CacheItem*);
+    }
+    avmtx_unlock(&cache->lock);
+
+    // header and its copy for rollback, cache chunk list, mount table, tier and pin tables, names,
+    // arenas, write buffer, lookup cache, page checksum tree
+    out->other += sizeof(avstor) + PAGE_SIZE * 2 + cache->chunk_count * sizeof(CacheItem*)
+        + db->mount_count * sizeof(AvMount) + pagemap_size(&db->pins)
+        + db->name_capacity * sizeof(AvName) + db->names_bytes + pagemap_size(&db->name_index)
+        + db->arena_count * sizeof(AvArena);
+    if (db->map_touched) {
+        out->other += ((size_t)(db->map_size / PAGE_SIZE / 32) + 1) * sizeof(uint32_t)
+            + (size_t)(db->map_size / PAGE_SIZE) * sizeof(*db->map_locks);
+    }
+    out->mapped_bytes = (size_t)db->map_size;
+    for (arena = db->arenas; arena; arena = arena->next) {
+        out->other += pagemap_size(&arena->pools);
+    }
+    if (db->tier) {
+        out->other += sizeof(AvTier) + pagemap_size(&db->tier->map)
+            + db->tier->extent_count * sizeof(*db->tier->access_time);
+    }
+    if (db->wbuf) {
+        avmtx_lock(&db->wbuf->lock);
+        out->other += sizeof(AvWriteBuffer) + db->wbuf->bytes
+            + (db->wbuf->capacity + db->wbuf->merge_count) * sizeof(AvBufEntry*);
+        avmtx_unlock(&db->wbuf->lock);
+    }
+    if (db->lookups) {
+        out->other += sizeof(AvLookupCache);
+    }
+    if (db->merkle) {
+        AvPageNum n = db->merkle->capacity;
+        unsigned level;
+        out->other += sizeof(AvMerkle) + db->merkle->page_count * (sizeof(AvPageNum) + 1)
+            + db->merkle->dir_count * sizeof(AvPageNum);
+        for (level = 0; level < MERKLE_MAX_LEVELS && n > 0; ++level) {
+            out->other += (size_t)n * sizeof(uint32_t);
+            n = (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+        }
+    }
+    rwl_release(&db->global_rwl);
+    out->total = out->pool_bytes + out->cache_items + out->other;
+    return AVSTOR_OK;
+}
+
+/*
+* Limits the memory used for page buffers to limit bytes, rounded down to whole blocks but at
+* least one block, or removes the limit if limit is 0. Once the limit is reached, pages are evicted
+* instead of allocating more buffers, and operations fail with AVSTOR_NOMEM if nothing in the cache
+* can be evicted, such as when it is filled with locked or pinned pages. Buffers already allocated
+* are not released. Pages accessed through the file mapping of AVSTOR_OPEN_MMAP are not buffers and
+* are not counted: the system can drop them and read them again, except those modified by writers,
+* which are private until the next commit.
+*/
+int AVCALL avstor_set_memory_limit(avstor *db, size_t limit)
+{
+    size_t blocks = limit / (DEFAULT_BLOCK_SIZE * 1024);
+
+    CHECK_PARAM(db);
+    avmtx_lock(&db->bpool.lock);
+    db->bpool.max_count = limit == 0 ? 0 : (blocks == 0 ? 1 : (unsigned)blocks);
+    avmtx_unlock(&db->bpool.lock);
+    return AVSTOR_OK;
+}
+
+static AvNode* lock_noderef(const avstor_node *parent)
+{
+    AvNode *result = NULL;
+    if (parent->ref == 0) {
+        THROW(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    result = lock_node(parent->db, parent->ref);
+    assert(is_node_addr_valid(parent->db, result));
+    return result;
+}
+
+static __inline AvNode* lock_keyref(const avstor_node *parent)
+{
+    AvNode* result = lock_noderef(parent);
+    if (NODE_TYPE(result) != AVSTOR_TYPE_KEY) {
+        unlock_ptr(parent->db, result);
+        THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
+    }
+    return result;
+}
+
+// Type of node as seen by the user, deduplicated values are reported as binary values
+static __inline unsigned get_user_type(const AvNode *node)
+{
+    unsigned type = NODE_TYPE(node);
+    return type == NODE_BLOBREF ? AVSTOR_TYPE_BINARY : type;
+}
+
+static __inline AvNode* lock_valueref(const avstor_node *parent, unsigned type)
+{
+    AvNode* result = lock_noderef(parent);
+    if (get_user_type(result) != type) {
+        unlock_ptr(parent->db, result);
+        THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
+    }
+    return result;
+}
+
+/*
+* Lookup cache. avstor_find files each node it finds in a slot chosen by parent and name hash,
+* replacing the previous node of the slot. A later lookup of the same name only locks the cached
+* node and compares its name. Nodes keep their offset until deleted: avstor_delete drops the slot
+* of the node it deletes, and a rollback, which may free nodes created since the last commit,
+* empties the cache.
+*/
+
+// Hashes a name like hash_name, ignoring trailing zero bytes since compare_bytes does. Values and
+// keys of the same name under a parent are told apart by the low bit.
+static uint32_t lookup_hash(const void *buf, size_t len, int isvalue)
+{
+    const unsigned char *cp = (const unsigned char*)buf;
+    while (len > 0 && cp[len - 1] == 0) {
+        --len;
+    }
+    return (hash_name(buf, len) & ~1u) | (isvalue ? 1u : 0u);
+}
+
+static __inline unsigned lookup_slot(avstor_off parent, uint32_t hash)
+{
+    return ((fold_page_num(parent) * 2654435761u) ^ hash) & (LOOKUP_SLOTS - 1);
+}
+
+// Returns the cached node named by sk under parent, locked, or NULL. Names sharing a hash share
+// a slot, so the name of the node is compared with the key.
+static AvNode* lookup_find(avstor *db, avstor_off parent, const AvSearchKey *sk, uint32_t hash)
+{
+    AvLookupCache *lc = db->lookups;
+    unsigned i = lookup_slot(parent, hash);
+    avstor_off ofs;
+    AvNode *node;
+
+    avmtx_lock(&lc->locks[i % LOOKUP_STRIPES]);
+    ofs = (lc->slots[i].parent == parent && lc->slots[i].hash == hash) ? lc->slots[i].node : 0;
+    avmtx_unlock(&lc->locks[i % LOOKUP_STRIPES]);
+    if (ofs == 0) {
+        return NULL;
+    }
+    node = lock_node(db, ofs);
+    if (compare_key(db, sk, node, 1) != 0) {
+        unlock_ptr(db, node);
+        return NULL;
+    }
+    return node;
+}
+
+static void lookup_store(avstor *db, avstor_off parent, uint32_t hash, avstor_off node)
+{
+    AvLookupCache *lc = db->lookups;
+    unsigned i = lookup_slot(parent, hash);
+
+    avmtx_lock(&lc->locks[i % LOOKUP_STRIPES]);
+    lc->slots[i].parent = parent;
+    lc->slots[i].node = node;
+    lc->slots[i].hash = hash;
+    avmtx_unlock(&lc->locks[i % LOOKUP_STRIPES]);
+}
+
+// Drops a node about to be deleted from the lookup cache. Its stored name is hashed rather than
+// the key it was deleted by, which a comparer may have matched to it.
+static void lookup_forget(avstor *db, avstor_off parent, const AvNode *node, int isvalue)
+{
+    AvLookupCache *lc = db->lookups;
+    size_t szname = (node->szname & NAME_INTERNED) ? get_interned_name(db, node)->len : node->szname;
+    unsigned i = lookup_slot(parent, lookup_hash(get_node_name_ptr(db, node), szname, isvalue));
+
+    avmtx_lock(&lc->locks[i % LOOKUP_STRIPES]);
+    if (lc->slots[i].node == get_ofs(node)) {
+        lc->slots[i].node = 0;
+    }
+    avmtx_unlock(&lc->locks[i % LOOKUP_STRIPES]);
+}
+
+static void rollback(avstor *db)
+{
+    unsigned i;
+    PageCache *cache = &db->cache;
+    (void)rwl_upgrade_or_lock_exclusive(&db->global_rwl);
+    if (db->lookups) {
+        // no lookup runs while the global lock is held exclusively
+        memset(db->lookups->slots, 0, sizeof(db->lookups->slots));
+    }
+
+    avmtx_lock(&cache->lock);
+    for (i = 0; i < cache->item_count; ++i) {
+        CacheItem *item = cache_item(cache, i);
+        atomic_store_int_release(&item->page->lock_count, 0);
+        if (item->key != 0 && is_page_dirty(item->page)) {
+            // invalidate modified cache item
+            cache_drop_item(cache, item);
+        }
+    }
+    avmtx_unlock(&cache->lock);
+
+    map_restore_pages(db);
+
+    // restore unmodified header
+    memcpy(cache->header, cache->old_header, PAGE_SIZE);
+    if (db->merkle) {
+        (void)merkle_resize(db->merkle, get_pagecount(cache->header));
+    }
+    truncate_names(db, db->names_committed);
+    arenas_release(db, 0);
+}
+
+static __inline AvNodeData* get_node_data(AvNode *node)
+{
+    return (AvNodeData*)PTR(node, SIZE_NODE_HDR + get_name_size(node));
+}
+
+static __inline struct AvKeyStats* get_key_stats(AvNode *node)
+{
+    return (struct AvKeyStats*)PTR(get_node_data(node), sizeof(struct AvKey));
+}
+
+static __inline uint64_t get_stats_bytes(const struct AvKeyStats *stats)
+{
+    return ((uint64_t)stats->value_bytes[1] << 32) | stats->value_bytes[0];
+}
+
+// Adds to the statistics of a key, or of the root if key_node is NULL, in files that keep them.
+// Exclusive global lock must be held.
+static void key_stats_add(avstor *db, AvNode *key_node, int subkeys, int values, int64_t bytes)
+{
+    struct AvKeyStats *stats;
+    uint64_t total;
+    if (!(db->cache.header->flags & AVSTOR_FILE_KEYSTATS)) {
+        return;
+    }
+    if (!key_node) {
+        db->cache.header->root_subkeys += subkeys;
+        set_page_dirty(db->cache.header);
+        return;
+    }
+    stats = get_key_stats(key_node);
+    total = get_stats_bytes(stats) + (uint64_t)bytes;
+    stats->subkeys += subkeys;
+    stats->values += values;
+    stats->value_bytes[0] = (uint32_t)total;
+    stats->value_bytes[1] = (uint32_t)(total >> 32);
+    set_ptr_dirty(key_node);
+}
+
+static __inline void avstor_node_set(avstor_node *node, const avstor_off off, avstor *db)
+{
+    node->db = db;
+    node->ref = off;
+}
+
+// Returns the mount table entry for a key, or NULL. Global lock must be held.
+static AvMount* find_mount(avstor *db, avstor_off key)
+{
+    unsigned i;
+    for (i = 0; i < db->mount_count; ++i) {
+        if (db->mounts[i].key == key) {
+            return &db->mounts[i];
+        }
+    }
+    return NULL;
+}
+
+// If parent is a mount point, returns the root of the mounted file in root when accessing subkeys.
+// Otherwise returns parent unchanged. Callers keep the result in a volatile local rather than in
+// parent, which would be set twice and live across the setjmp of TRY.
+static const avstor_node* resolve_mount(const avstor_node *parent, int flags, avstor_node *root)
+{
+    avstor *db = parent->db;
+    AvMount *mount;
+
+    // mount_count only changes under exclusive lock, an unlocked zero check is only a shortcut
+    if (parent->ref == 0 || (flags & AVSTOR_VALUES) || db->mount_count == 0) {
+        return parent;
+    }
+    rwl_lock_shared(&db->global_rwl);
+    if ((mount = find_mount(db, parent->ref))) {
+        avstor_node_set(root, 0, mount->db);
+        parent = root;
+    }
+    rwl_release(&db->global_rwl);
+    return parent;
+}
+
+int AVCALL avstor_node_init(avstor *db, avstor_node *node)
+{
+    CHECK_PARAM(db && node);
+    node->db = db;
+    node->ref = 0;
+    return AVSTOR_OK;
+}
+
+void AVCALL avstor_node_destroy(avstor_node *node)
+{
+    CHECK_PARAM(node);
+    node->db = NULL;
+    node->ref = 0;
+}
+
+#define BLOB_HASH_LEN           (2 * sizeof(uint32_t))
+
+static int blob_comparer(const void* v1, const void* v2)
+{
+    return memcmp(v1, v2, BLOB_HASH_LEN);
+}
+
+// Blobs are named by an FNV-1a and an Adler-32 hash of their content
+static void hash_blob(const void *data, unsigned len, uint32_t *hash)
+{
+    const unsigned char *cp = (const unsigned char*)data;
+    uint32_t fnv = 2166136261u, a = 1, b = 0;
+    while (len--) {
+        fnv = (fnv ^ *cp) * 16777619u;
+        a = (a + *cp++) % MOD_ADLER;
+        b = (b + a) % MOD_ADLER;
+    }
+    hash[0] = fnv;
+    hash[1] = (b << 16) | a;
+}
+
+// Returns the blob with the given content after adding a reference to it, creating it if
+// necessary. Returns 0 if a blob with different content has the same hash.
+static avstor_off blob_acquire(avstor *db, const void *data, unsigned len)
+{
+    AvStack st;
+    AvNode *volatile node = NULL;
+    NodeRef *volatile last_ref = NULL;
+    uint32_t hash[2];
+    avstor_key key;
+    // volatile because modified in TRY and returned after it
+    volatile avstor_off result = 0;
+
+    hash_blob(data, len, hash);
+    key.buf = hash;
+    key.len = BLOB_HASH_LEN;
+    key.comparer = &blob_comparer;
+
+    TRY(ex)
+    {
+        AvNodeData *ndata;
+        if ((node = find_node_with_backtrace(db, &key, &st, &db->cache.header->root_blobs, &last_ref))) {
+            ndata = get_node_data(node);
+            if (ndata->vBlob.length == len
+                && memcmp(PTR(ndata, NODE_CLASS[NODE_BLOB].szdata), data, len) == 0) {
+                ndata->vBlob.refcount++;
+                set_ptr_dirty(node);
+                result = get_ofs(node);
+            }
+        }
+        else {
+            node = create_node(db, get_ptr_page(last_ref), &key, len, NODE_BLOB, 0);
+            ndata = get_node_data(node);
+            ndata->vBlob.length = (uint8_t)len;
+            ndata->vBlob.refcount = 1;
+            memcpy(PTR(ndata, NODE_CLASS[NODE_BLOB].szdata), data, len);
+            insert_node(db, node, &st);
+            result = get_ofs(node);
+        }
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+    }
+    END_TRY(ex);
+    return result;
+}
+
+// Drops a reference to a blob and deletes the blob when it is no longer referenced
+static void blob_release(avstor *db, avstor_off blob_ofs)
+{
+    AvNode *volatile node = NULL, *volatile found = NULL;
+
+    TRY(ex)
+    {
+        AvNodeData *ndata;
+        node = lock_node(db, blob_ofs);
+        ndata = get_node_data(node);
+        if (NODE_TYPE(node) != NODE_BLOB || ndata->vBlob.refcount == 0) {
+            THROW(AVSTOR_CORRUPT, "Invalid blob reference");
+        }
+        ndata->vBlob.refcount--;
+        set_ptr_dirty(node);
+        if (ndata->vBlob.refcount == 0) {
+            AvStack st;
+            avstor_key key;
+            key.buf = node->name;
+            key.len = BLOB_HASH_LEN;
+            key.comparer = &blob_comparer;
+            found = find_node_with_backtrace(db, &key, &st, &db->cache.header->root_blobs, NULL);
+            if (found == node) {
+                delete_node(db, node, &st);
+            }
+            else {
+                // blob of an imported file that lost a hash collision, it is not in the tree
+                free_node(node);
+            }
+        }
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, found);
+        unlock_ptr_checked(db, node);
+    }
+    END_TRY(ex);
+}
+
+// Returns the blob of a deduplicated value locked in place of the value node, which is unlocked
+static AvNode* lock_blob_data(avstor *db, AvNode *node)
+{
+    if (NODE_TYPE(node) == NODE_BLOBREF) {
+        AvNode *blob = lock_node_ex(db, &get_node_data(node)->vBlobRef.blob);
+        unlock_ptr(db, node);
+        return blob;
+    }
+    return node;
+}
+
+// Length of the data of a value, that of the shared blob if it is deduplicated
+static uint32_t get_value_length(avstor *db, AvNode *node)
+{
+    const AvNodeClass *node_class = &NODE_CLASS[NODE_TYPE(node)];
+    uint32_t length;
+    if (NODE_TYPE(node) == NODE_BLOBREF) {
+        AvNode *blob = lock_node_ex(db, &get_node_data(node)->vBlobRef.blob);
+        length = get_node_data(blob)->vBlob.length;
+        unlock_ptr(db, blob);
+    }
+    else if (node_class->flags & NODE_FLAG_VAR) {
+        length = get_node_data(node)->vvar.length;
+    }
+    else if (node_class->flags & NODE_FLAG_LONGVAR) {
+        length = get_node_data(node)->vlongvar.length;
+    }
+    else {
+        length = node_class->szdata;
+    }
+    return length;
+}
+
+// Counts a value created under key_node (sign 1) or deleted from it (sign -1) in files with key
+// statistics, and records key_node as the owner of a new value in files that keep it
+static void key_stats_value(avstor *db, AvNode *key_node, AvNode *node, int sign)
+{
+    uint32_t flags = db->cache.header->flags;
+    if (sign > 0 && (flags & (AVSTOR_FILE_KEYSTATS | AVSTOR_FILE_PARENTS))) {
+        *get_node_owner(node) = ofs_to_nref(get_ofs(key_node));
+    }
+    if (flags & AVSTOR_FILE_KEYSTATS) {
+        key_stats_add(db, key_node, 0, sign, sign * (int64_t)get_value_length(db, node));
+    }
+}
+
+enum {
+    ROLLUP_ADD,
+    ROLLUP_REMOVE,
+    ROLLUP_UPDATE
+};
+
+static void rollup_load(AvNode *rec, avstor_rollup *r)
+{
+    const struct AvRollupValue *rv = &get_node_data(rec)->vRollup;
+    memcpy(&r->sum, rv->sum, sizeof(int64_t));
+    memcpy(&r->min, rv->min, sizeof(int64_t));
+    memcpy(&r->max, rv->max, sizeof(int64_t));
+    memcpy(&r->count, rv->count, sizeof(uint64_t));
+}
+
+static void rollup_store(AvNode *rec, const avstor_rollup *r)
+{
+    struct AvRollupValue *rv = &get_node_data(rec)->vRollup;
+    memcpy(rv->sum, &r->sum, sizeof(int64_t));
+    memcpy(rv->min, &r->min, sizeof(int64_t));
+    memcpy(rv->max, &r->max, sizeof(int64_t));
+    memcpy(rv->count, &r->count, sizeof(uint64_t));
+    set_ptr_dirty(rec);
+}
+
+// Keys of the tree of rollups are named by the offset of the key the rollups belong to
+static __inline void rollup_tree_key(avstor_key *key, const avstor_off *ofs)
+{
+    key->buf = (void*)ofs;
+    key->len = sizeof(avstor_off);
+    key->comparer = offset_comparer;
+}
+
+// Value of an int32 or int64 node, the types rollups cover. Returns 0 for other types.
+static int get_int_value(AvNode *node, int64_t *out)
+{
+    switch (NODE_TYPE(node)) {
+    case AVSTOR_TYPE_INT32:
+        *out = get_node_data(node)->v32.value;
+        return 1;
+    case AVSTOR_TYPE_INT64:
+        memcpy(out, &get_node_data(node)->v64.value, sizeof(int64_t));
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void rollup_fold(avstor_rollup *r, int64_t value)
+{
+    if (r->count == 0 || value < r->min) {
+        r->min = value;
+    }
+    if (r->count == 0 || value > r->max) {
+        r->max = value;
+    }
+    // sums wrap around instead of overflowing
+    r->sum = (int64_t)((uint64_t)r->sum + (uint64_t)value);
+    r->count++;
+}
+
+static void rollup_scan_tree(avstor *db, avstor_off ofs, const avstor_key *name, avstor_rollup *r);
+
+// Folds the values named name of a key and of all keys below it into a rollup
+static void rollup_scan_key(avstor *db, avstor_off ofs, const avstor_key *name, avstor_rollup *r)
+{
+    AvNode *node = lock_node(db, ofs);
+    AvNode *value = find_key(db, name, &get_node_data(node)->vkey.value_root);
+    avstor_off subkeys = nref_to_ofs(get_node_data(node)->vkey.subkey_root);
+    int64_t v;
+    if (value) {
+        if (get_int_value(value, &v)) {
+            rollup_fold(r, v);
+        }
+        unlock_ptr(db, value);
+    }
+    unlock_ptr(db, node);
+    rollup_scan_tree(db, subkeys, name, r);
+}
+
+static void rollup_scan_tree(avstor *db, avstor_off ofs, const avstor_key *name, avstor_rollup *r)
+{
+    while (ofs != 0) {
+        AvNode *node = lock_node(db, ofs);
+        avstor_off left = nref_to_ofs(node->left);
+        avstor_off right = nref_to_ofs(node->right);
+        unlock_ptr(db, node);
+        rollup_scan_key(db, ofs, name, r);
+        rollup_scan_tree(db, left, name, r);
+        ofs = right;
+    }
+}
+
+// Applies the change of a value named name below a key to the rollup of that name of the key, if
+// there is one. Values leaving the rollup as its minimum or maximum make it rescan the subtree.
+// Rollups are found and rescanned by the bytes of the name, which must have no comparer for a
+// value the rollup covers.
+static void rollup_change(avstor *db, avstor_off key_ofs, const avstor_key *name, int change,
+                          int64_t old_value, int64_t new_value)
+{
+    AvNode *volatile rkey = NULL, *volatile rec = NULL;
+    avstor_key rollup_key, rec_name;
+    rollup_tree_key(&rollup_key, &key_ofs);
+    rec_name = *name;
+    rec_name.comparer = NULL;
+
+    TRY(ex)
+    {
+        avstor_rollup r;
+        int rescan = 0;
+        if ((rkey = find_key(db, &rollup_key, &db->cache.header->root_rollups))
+            && (rec = find_key(db, &rec_name, &get_node_data(rkey)->vkey.value_root))) {
+            if (name->comparer) {
+                THROW(AVSTOR_INVOPER, "Values covered by a rollup must be named without comparer");
+            }
+            rollup_load(rec, &r);
+            switch (change) {
+            case ROLLUP_ADD:
+                rollup_fold(&r, new_value);
+                break;
+            case ROLLUP_REMOVE:
+                if (r.count <= 1) {
+                    memset(&r, 0, sizeof(r));
+                }
+                else if (old_value == r.min || old_value == r.max) {
+                    rescan = 1;
+                }
+                else {
+                    r.sum = (int64_t)((uint64_t)r.sum - (uint64_t)old_value);
+                    r.count--;
+                }
+                break;
+            default:
+                if ((old_value == r.min && new_value > old_value) || (old_value == r.max && new_value < old_value)) {
+                    rescan = 1;
+                }
+                else {
+                    r.sum = (int64_t)((uint64_t)r.sum - (uint64_t)old_value + (uint64_t)new_value);
+                    r.min = new_value < r.min ? new_value : r.min;
+                    r.max = new_value > r.max ? new_value : r.max;
+                }
+                break;
+            }
+            if (rescan) {
+                memset(&r, 0, sizeof(r));
+                rollup_scan_key(db, key_ofs, &rec_name, &r);
+            }
+            rollup_store(rec, &r);
+        }
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, rec);
+        unlock_ptr_checked(db, rkey);
+    }
+    END_TRY(ex);
+}
+
+// Applies the change of a value named name of key_node to the rollups of the key and of its
+// ancestors, found through the parent references. key_node must be locked.
+static void rollup_apply(avstor *db, AvNode *key_node, const avstor_key *name, int change,
+                         int64_t old_value, int64_t new_value)
+{
+    AvNode *volatile node = NULL;
+    if (is_nref_empty(db->cache.header->root_rollups)) {
+        return;
+    }
+    TRY(ex)
+    {
+        avstor_off ofs = get_ofs(key_node);
+        while (ofs != 0) {
+            avstor_off parent;
+            unsigned flags;
+            node = lock_node(db, ofs);
+            flags = get_node_data(node)->vkey.flags;
+            parent = nref_to_ofs(*get_node_owner(node));
+            unlock_ptr(db, node);
+            node = NULL;
+            if (flags & KEY_FLAG_ROLLUPS) {
+                rollup_change(db, ofs, name, change, old_value, new_value);
+            }
+            ofs = parent;
+        }
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, node);
+    }
+    END_TRY(ex);
+}
+
+// Applies the update of an integer value node to the rollups above it. The node must be locked.
+static void rollup_update(avstor *db, AvNode *node, int64_t old_value, int64_t new_value)
+{
+    AvNode *volatile owner = NULL;
+    unsigned char buf[256];
+    avstor_key name;
+    size_t szname = (node->szname & NAME_INTERNED) ? get_interned_name(db, node)->len : node->szname;
+
+    if (is_nref_empty(db->cache.header->root_rollups) || old_value == new_value) {
+        return;
+    }
+    memcpy(buf, get_node_name_ptr(db, node), szname);
+    name.buf = buf;
+    name.len = szname;
+    name.comparer = NULL;
+    TRY(ex)
+    {
+        owner = lock_node(db, nref_to_ofs(*get_node_owner(node)));
+        rollup_apply(db, owner, &name, ROLLUP_UPDATE, old_value, new_value);
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, owner);
+    }
+    END_TRY(ex);
+}
+
+// Deletes the rollups of a key being deleted. It has no values or subkeys, so there is nothing to
+// apply to the rollups of its ancestors.
+static void rollup_forget(avstor *db, avstor_off key_ofs)
+{
+    AvStack st;
+    AvNode *volatile rkey = NULL, *volatile rec = NULL;
+    avstor_key rollup_key;
+    rollup_tree_key(&rollup_key, &key_ofs);
+
+    TRY(ex)
+    {
+        if ((rkey = find_node_with_backtrace(db, &rollup_key, &st, &db->cache.header->root_rollups, NULL))) {
+            NodeRef *rootref = &get_node_data(rkey)->vkey.value_root;
+            // records are created after their key, so deleting them does not move it
+            while (!is_nref_empty(*rootref)) {
+                AvStack st_rec;
+                unsigned char buf[256];
+                avstor_key name;
+                rec = lock_node_ex(db, rootref);
+                memcpy(buf, rec->name, rec->szname);
+                name.buf = buf;
+                name.len = rec->szname;
+                name.comparer = NULL;
+                unlock_ptr(db, rec);
+                rec = NULL;
+                if ((rec = find_node_with_backtrace(db, &name, &st_rec, rootref, NULL))) {
+                    delete_node(db, rec, &st_rec);
+                    unlock_ptr(db, rec);
+                    rec = NULL;
+                }
+            }
+            delete_node(db, rkey, &st);
+            unlock_ptr(db, rkey);
+            rkey = NULL;
+        }
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, rec);
+        unlock_ptr_checked(db, rkey);
+    }
+    END_TRY(ex);
+}
+
+// Rescans the rollups of a tree of rollup records of a key
+static void rollup_refresh_tree(avstor *db, avstor_off key_ofs, avstor_off ofs)
+{
+    while (ofs != 0) {
+        unsigned char buf[256];
+        avstor_key name;
+        avstor_rollup r;
+        AvNode *rec = lock_node(db, ofs);
+        avstor_off left = nref_to_ofs(rec->left);
+        avstor_off right = nref_to_ofs(rec->right);
+        memcpy(buf, rec->name, rec->szname);
+        name.buf = buf;
+        name.len = rec->szname;
+        name.comparer = NULL;
+        unlock_ptr(db, rec);
+
+        memset(&r, 0, sizeof(r));
+        rollup_scan_key(db, key_ofs, &name, &r);
+        rec = lock_node(db, ofs);
+        rollup_store(rec, &r);
+        unlock_ptr(db, rec);
+        rollup_refresh_tree(db, key_ofs, left);
+        ofs = right;
+    }
+}
+
+// Rescans the rollups of a key and of its ancestors, after a subtree was added below it at once
+static void rollup_refresh(avstor *db, avstor_off ofs)
+{
+    if (is_nref_empty(db->cache.header->root_rollups)) {
+        return;
+    }
+    while (ofs != 0) {
+        AvNode *node = lock_node(db, ofs);
+        avstor_off parent = nref_to_ofs(*get_node_owner(node));
+        unsigned flags = get_node_data(node)->vkey.flags;
+        unlock_ptr(db, node);
+        if (flags & KEY_FLAG_ROLLUPS) {
+            avstor_key rollup_key;
+            AvNode *rkey;
+            rollup_tree_key(&rollup_key, &ofs);
+            if ((rkey = find_key(db, &rollup_key, &db->cache.header->root_rollups))) {
+                avstor_off records = nref_to_ofs(get_node_data(rkey)->vkey.value_root);
+                unlock_ptr(db, rkey);
+                rollup_refresh_tree(db, ofs, records);
+            }
+        }
+        ofs = parent;
+    }
+}
+
+static __inline int is_dedup_value(avstor *db, unsigned type, unsigned valuesz)
+{
+    return (db->oflags & AVSTOR_OPEN_DEDUP) && type == AVSTOR_TYPE_BINARY && valuesz >= MIN_DEDUP_LEN;
+}
+
+static int name_id_comparer(const void* v1, const void* v2)
+{
+    uint32_t id1, id2;
+    memcpy(&id1, v1, sizeof(id1));
+    memcpy(&id2, v2, sizeof(id2));
+    return id1 > id2 ? 1 : id1 < id2 ? -1 : 0;
+}
+
+// Loads the name dictionary of a file. Entries are named by id, so they are visited in id order.
+static void load_names(avstor *db, avstor_off ofs)
+{
+    while (ofs != 0) {
+        char buf[MAX_KEY_LEN];
+        AvNode *node = lock_node(db, ofs);
+        AvNodeData *ndata = get_node_data(node);
+        avstor_off left = nref_to_ofs(node->left);
+        avstor_off right = nref_to_ofs(node->right);
+        uint32_t id = get_name_id(node);
+        unsigned len = ndata->vName.length;
+        if (NODE_TYPE(node) != NODE_NAME || len > MAX_KEY_LEN) {
+            unlock_ptr(db, node);
+            THROW(AVSTOR_CORRUPT, "Invalid name dictionary");
+        }
+        memcpy(buf, PTR(ndata, NODE_CLASS[NODE_NAME].szdata), len);
+        unlock_ptr(db, node);
+
+        load_names(db, left);
+        if (id != db->name_count) {
+            THROW(AVSTOR_CORRUPT, "Invalid name dictionary");
+        }
+        add_name(db, buf, len);
+        ofs = right;
+    }
+}
+
+// Adds a name to the dictionary of the file, returns its id
+static uint32_t intern_name(avstor *db, const void *buf, unsigned len)
+{
+    AvStack st;
+    AvNode *volatile node = NULL;
+    NodeRef *volatile last_ref = NULL;
+    uint32_t id = db->name_count;
+    avstor_key key;
+
+    key.buf = &id;
+    key.len = sizeof(id);
+    key.comparer = &name_id_comparer;
+
+    TRY(ex)
+    {
+        AvNodeData *ndata;
+        if ((node = find_node_with_backtrace(db, &key, &st, &db->cache.header->root_names, &last_ref))) {
+            THROW(AVSTOR_CORRUPT, "Invalid name dictionary");
+        }
+        node = create_node(db, get_ptr_page(last_ref), &key, len, NODE_NAME, 0);
+        ndata = get_node_data(node);
+        ndata->vName.length = (uint8_t)len;
+        memcpy(PTR(ndata, NODE_CLASS[NODE_NAME].szdata), buf, len);
+        insert_node(db, node, &st);
+        add_name(db, buf, len);
+        db->cache.header->flags |= AVSTOR_FILE_NAMES;
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+    }
+    END_TRY(ex);
+    return id;
+}
+
+/*
+* Adds a name to the name dictionary of the file. Nodes created afterwards with a name equal to it
+* byte for byte, including its length, store its 4-byte id instead, and finding them compares ids
+* before calling the comparer. Names of 4 bytes or less are not worth an id and are ignored, as are
+* names whose hash equals that of a name already in the dictionary. The dictionary only grows, and
+* like other changes, names added since the last commit are dropped on rollback.
+*/
+int AVCALL avstor_intern(avstor *db, const avstor_key *name)
+{
+    int result;
+
+    CHECK_PARAM(db && name && name->buf);
+    if (name->len == 0 || is_invalid_avstor_key(name)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        if (name->len > sizeof(uint32_t) && !pagemap_find(&db->name_index, hash_name(name->buf, name->len))) {
+            (void)intern_name(db, name->buf, (unsigned)name->len);
+        }
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+/*
+* Returns the AVSTOR_FILE_* flags of the file. Files of a 64-bit build that were written before page
+* counts had 64 bits lack AVSTOR_FILE_PAGE64 until they are committed while open for writing.
+*/
+int AVCALL avstor_get_file_flags(avstor *db, uint32_t *out_flags)
+{
+    CHECK_PARAM(db && out_flags);
+    rwl_lock_shared(&db->global_rwl);
+    *out_flags = db->cache.header->flags;
+    rwl_release(&db->global_rwl);
+    return AVSTOR_OK;
+}
+
+// Adds the statistics of the keys of the AVL tree at ofs, which are depth levels below the key
+// whose statistics are summed, and of all keys below them
+static void stats_tree(avstor *db, avstor_off ofs, unsigned depth, avstor_stats *out)
+{
+    while (ofs != 0) {
+        AvNode *node = lock_node(db, ofs);
+        const struct AvKeyStats *stats = get_key_stats(node);
+        avstor_off left = nref_to_ofs(node->left);
+        avstor_off right = nref_to_ofs(node->right);
+        avstor_off subkeys = nref_to_ofs(get_node_data(node)->vkey.subkey_root);
+        out->subkeys += stats->subkeys;
+        out->values += stats->values;
+        out->value_bytes += get_stats_bytes(stats);
+        unlock_ptr(db, node);
+
+        if (subkeys != 0 && out->height < depth + 1) {
+            out->height = depth + 1;
+        }
+        stats_tree(db, left, depth, out);
+        stats_tree(db, subkeys, depth + 1, out);
+        ofs = right;
+    }
+}
+
+/*
+* Returns the number of subkeys and values of a key and the total length of the values, kept up
+* to date by every write in files created with AVSTOR_OPEN_KEYSTATS, so this takes a single node
+* lookup. With AVSTOR_STATS_RECURSIVE, the statistics of all keys below are summed, which visits
+* those keys but none of the values. Mounted files are not followed.
+*/
+int AVCALL avstor_key_stats(const avstor_node *node, int flags, avstor_stats *out_stats)
+{
+    avstor *db;
+    AvNode *volatile key_node = NULL;
+    int result;
+
+    CHECK_PARAM(node && node->db && out_stats);
+    db = node->db;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        avstor_off subkey_root;
+        memset(out_stats, 0, sizeof(*out_stats));
+        if (!(db->cache.header->flags & AVSTOR_FILE_KEYSTATS)) {
+            THROW(AVSTOR_INVOPER, "File does not keep key statistics");
+        }
+        if (node->ref == 0) {
+            out_stats->subkeys = db->cache.header->root_subkeys;
+            subkey_root = nref_to_ofs(db->cache.header->root);
+        }
+        else {
+            const struct AvKeyStats *stats;
+            key_node = lock_keyref(node);
+            stats = get_key_stats(key_node);
+            out_stats->subkeys = stats->subkeys;
+            out_stats->values = stats->values;
+            out_stats->value_bytes = get_stats_bytes(stats);
+            out_stats->depth = get_node_data(key_node)->vkey.level;
+            subkey_root = nref_to_ofs(get_node_data(key_node)->vkey.subkey_root);
+            unlock_ptr(db, key_node);
+            key_node = NULL;
+        }
+        if ((flags & AVSTOR_STATS_RECURSIVE) && subkey_root != 0) {
+            out_stats->height = 1;
+            stats_tree(db, subkey_root, 1, out_stats);
+        }
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, key_node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+/*
+* Declares a rollup on a key: the sum, count, minimum and maximum of the int32 and int64 values
+* named name of the key and of all keys below it. It is computed by one scan of the subtree, then
+* kept up to date by every create, update and delete of such values, which adjust the rollups of
+* all ancestors of the value through the parent references. Reading it with avstor_rollup_get
+* takes two node lookups. The file must have been created with AVSTOR_OPEN_PARENTS. Values are
+* found by the bytes of their name, so those of the name of a rollup must be named without comparer;
+* creating or deleting one with a comparer below the key fails with AVSTOR_INVOPER. Rollups are not
+* carried over by avstor_import_file and do not cover mounted files.
+*/
+int AVCALL avstor_rollup_declare(const avstor_node *node, const avstor_key *name)
+{
+    avstor *db;
+    AvNode *volatile key_node = NULL, *volatile rkey = NULL, *volatile rec = NULL;
+    NodeRef *volatile last_ref = NULL;
+    int result;
+
+    CHECK_PARAM(node && node->db && name);
+    if (is_invalid_avstor_key(name) || name->comparer || node->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = node->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        AvStack st;
+        AvNodeData *rdata;
+        avstor_key rollup_key;
+        avstor_rollup r;
+        avstor_off key_ofs = node->ref;
+
+        if (!(db->cache.header->flags & AVSTOR_FILE_PARENTS)) {
+            THROW(AVSTOR_INVOPER, "File does not keep parent references");
+        }
+        key_node = lock_keyref(node);
+        rollup_tree_key(&rollup_key, &key_ofs);
+        if (!(rkey = find_node_with_backtrace(db, &rollup_key, &st, &db->cache.header->root_rollups, &last_ref))) {
+            rkey = create_node(db, get_ptr_page(last_ref), &rollup_key, 0, AVSTOR_TYPE_KEY, 0);
+            rdata = get_node_data(rkey);
+            rdata->vkey.level = 0;
+            rdata->vkey.flags = 0;
+            rdata->vkey.pad = 0;
+            rdata->vkey.subkey_root = NODEREF_NULL;
+            rdata->vkey.value_root = NODEREF_NULL;
+            insert_node(db, rkey, &st);
+        }
+        unlock_ptr_checked(db, last_ref);
+        last_ref = NULL;
+
+        rdata = get_node_data(rkey);
+        if ((rec = find_node_with_backtrace(db, name, &st, &rdata->vkey.value_root, &last_ref))) {
+            THROW(AVSTOR_EXISTS, "Rollup already exists");
+        }
+        rec = create_node(db, get_ptr_page(last_ref), name, 0, NODE_ROLLUP, 0);
+        insert_node(db, rec, &st);
+        unlock_ptr_checked(db, last_ref);
+        last_ref = NULL;
+
+        memset(&r, 0, sizeof(r));
+        rollup_scan_key(db, key_ofs, name, &r);
+        rollup_store(rec, &r);
+        get_node_data(key_node)->vkey.flags |= KEY_FLAG_ROLLUPS;
+        set_ptr_dirty(key_node);
+        unlock_ptr(db, rec);
+        unlock_ptr(db, rkey);
+        unlock_ptr(db, key_node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, rec);
+        unlock_ptr_checked(db, rkey);
+        unlock_ptr_checked(db, key_node);
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+// Removes a rollup declared by avstor_rollup_declare. Returns AVSTOR_NOTFOUND if there is none.
+int AVCALL avstor_rollup_remove(const avstor_node *node, const avstor_key *name)
+{
+    avstor *db;
+    AvNode *volatile key_node = NULL, *volatile rkey = NULL, *volatile rec = NULL;
+    int result;
+
+    CHECK_PARAM(node && node->db && name);
+    if (is_invalid_avstor_key(name) || name->comparer || node->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = node->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        AvStack st, st_rec;
+        avstor_key rollup_key;
+        avstor_off key_ofs = node->ref;
+
+        key_node = lock_keyref(node);
+        rollup_tree_key(&rollup_key, &key_ofs);
+        result = AVSTOR_NOTFOUND;
+        if ((rkey = find_node_with_backtrace(db, &rollup_key, &st, &db->cache.header->root_rollups, NULL))
+            && (rec = find_node_with_backtrace(db, name, &st_rec, &get_node_data(rkey)->vkey.value_root, NULL))) {
+            delete_node(db, rec, &st_rec);
+            unlock_ptr(db, rec);
+            rec = NULL;
+            if (is_nref_empty(get_node_data(rkey)->vkey.value_root)) {
+                // last rollup of the key
+                delete_node(db, rkey, &st);
+                get_node_data(key_node)->vkey.flags &= (uint8_t)~KEY_FLAG_ROLLUPS;
+                set_ptr_dirty(key_node);
+            }
+            result = AVSTOR_OK;
+        }
+        unlock_ptr_checked(db, rkey);
+        unlock_ptr(db, key_node);
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, rec);
+        unlock_ptr_checked(db, rkey);
+        unlock_ptr_checked(db, key_node);
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+// Reads a rollup declared by avstor_rollup_declare. Returns AVSTOR_NOTFOUND if there is none.
+int AVCALL avstor_rollup_get(const avstor_node *node, const avstor_key *name, avstor_rollup *out_rollup)
+{
+    avstor *db;
+    AvNode *volatile key_node = NULL, *volatile rkey = NULL, *volatile rec = NULL;
+    int result;
+
+    CHECK_PARAM(node && node->db && name && out_rollup);
+    if (is_invalid_avstor_key(name) || name->comparer || node->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = node->db;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        avstor_key rollup_key;
+        avstor_off key_ofs = node->ref;
+
+        memset(out_rollup, 0, sizeof(*out_rollup));
+        key_node = lock_keyref(node);
+        unlock_ptr(db, key_node);
+        key_node = NULL;
+        rollup_tree_key(&rollup_key, &key_ofs);
+        result = AVSTOR_NOTFOUND;
+        if ((rkey = find_key(db, &rollup_key, &db->cache.header->root_rollups))
+            && (rec = find_key(db, name, &get_node_data(rkey)->vkey.value_root))) {
+            rollup_load(rec, out_rollup);
+            unlock_ptr(db, rec);
+            rec = NULL;
+            result = AVSTOR_OK;
+        }
+        unlock_ptr_checked(db, rkey);
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, rec);
+        unlock_ptr_checked(db, rkey);
+        unlock_ptr_checked(db, key_node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_create_key(const avstor_node *parent, const avstor_key *key, avstor_node *out_key)
+{
+    avstor *db;
+    avstor_node mount_root;
+    const avstor_node *volatile resolved; // volatile because set twice when parent is a mount point
+    // volatile because modified in TRY and referenced in CATCH
+    AvNode *volatile node = NULL, *volatile parent_node = NULL;
+    NodeRef *volatile last_ref = NULL;
+    int result;
+    unsigned level;
+
+    CHECK_PARAM(parent && parent->db && key);
+    if (is_invalid_avstor_key(key)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    resolved = resolve_mount(parent, AVSTOR_KEYS, &mount_root);
+    db = resolved->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        AvStack st;
+        NodeRef *rootref;
+        AvNodeData *ndata;
+        if (resolved->ref != 0) {
+            AvNodeData *pdata;
+            parent_node = lock_keyref(resolved);
+            pdata = get_node_data(parent_node);
+            level = pdata->vkey.level + 1;
+            rootref = &pdata->vkey.subkey_root;
+        }
+        else {
+            level = 1; // level 0 is reserved
+            rootref = &db->cache.header->root;
+        }
+
+        if ((node = find_node_with_backtrace(db, key, &st, rootref, &last_ref))) {
+            if (out_key) {
+                avstor_node_set(out_key, get_ofs(node), db);
+            }
+            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+        }
+        node = create_node(db, get_ptr_page(last_ref), key, 0, AVSTOR_TYPE_KEY, level);
+        ndata = get_node_data(node);
+        ndata->vkey.value_root = NODEREF_NULL;
+        ndata->vkey.subkey_root = NODEREF_NULL;
+        ndata->vkey.level = (uint16_t)level;
+        ndata->vkey.flags = 0;
+        ndata->vkey.pad = 0;
+        if (db->cache.header->flags & AVSTOR_FILE_PARENTS) {
+            *get_node_owner(node) = ofs_to_nref(resolved->ref);
+        }
+
+        insert_node(db, node, &st);
+        key_stats_add(db, parent_node, 1, 0, 0);
+        if (out_key) {
+            avstor_node_set(out_key, get_ofs(node), db);
+        }
+        unlock_ptr(db, node);
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, parent_node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+        unlock_ptr_checked(db, parent_node);
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+// Creates the value named key under parent_node, which the caller locked with the global lock held
+// exclusively. value holds valuesz bytes, 4 or 8 for the fixed size types.
+static void insert_value(avstor *db, AvNode *parent_node, const avstor_key *key, unsigned type,
+                         const void *value, unsigned valuesz, avstor_node *out_value)
+{
+    AvNode *volatile node = NULL;
+    NodeRef *volatile last_ref = NULL;
+
+    TRY(ex)
+    {
+        AvStack st;
+        AvNode *fnode;
+        AvNodeData *ndata, *pdata = get_node_data(parent_node);
+        avstor_off blob;
+        int64_t int_value;
+
+        if ((fnode = find_node_with_backtrace(db, key, &st, &pdata->vkey.value_root, &last_ref))) {
+            unlock_ptr(db, fnode);
+            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+        }
+
+        switch (type) {
+        case AVSTOR_TYPE_INT32:
+            node = create_node(db, get_ptr_page(last_ref), key, 0, type, pdata->vkey.level);
+            memcpy(&get_node_data(node)->v32.value, value, sizeof(int32_t));
+            break;
+        case AVSTOR_TYPE_INT64:
+        case AVSTOR_TYPE_DOUBLE:
+            node = create_node(db, get_ptr_page(last_ref), key, 0, type, pdata->vkey.level);
+            memcpy(&get_node_data(node)->v64.value, value, sizeof(int64_t));
+            break;
+        default:
+            if (is_dedup_value(db, type, valuesz) && (blob = blob_acquire(db, value, valuesz)) != 0) {
+                node = create_node(db, get_ptr_page(last_ref), key, 0, NODE_BLOBREF, pdata->vkey.level);
+                get_node_data(node)->vBlobRef.blob = ofs_to_nref(blob);
+            }
+            else {
+                node = create_node(db, get_ptr_page(last_ref), key, valuesz, type, pdata->vkey.level);
+                ndata = get_node_data(node);
+                ndata->vvar.length = (uint8_t)valuesz;
+                memcpy(PTR(ndata, NODE_CLASS[type].szdata), value, valuesz);
+            }
+        }
+        insert_node(db, node, &st);
+        key_stats_value(db, parent_node, node, 1);
+        if (get_int_value(node, &int_value)) {
+            rollup_apply(db, parent_node, key, ROLLUP_ADD, 0, int_value);
+        }
+        if (out_value) {
+            avstor_node_set(out_value, get_ofs(node), db);
+        }
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+    }
+    END_TRY(ex);
+}
+
+static int create_value(const avstor_node *parent, const avstor_key *key, unsigned type,
+                        const void *value, unsigned valuesz, avstor_node *out_value)
+{
+    avstor *db;
+    AvNode *volatile parent_node = NULL;
+    int result;
+
+    CHECK_PARAM(parent && parent->db && key && value);
+    if (is_invalid_avstor_key(key)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = parent->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        parent_node = lock_keyref(parent);
+        insert_value(db, parent_node, key, type, value, valuesz, out_value);
+        unlock_ptr(db, parent_node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, parent_node);
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_create_string(const avstor_node *parent, const avstor_key *key,
+                                const char *value, avstor_node *out_value)
+{
+    size_t len;
+    CHECK_PARAM(value);
+    len = strlen_l(value, MAX_STRING_LEN + 1) + 1;
+    if (len == (MAX_STRING_LEN + 1)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    return create_value(parent, key, AVSTOR_TYPE_STRING, value, (unsigned)len, out_value);
+}
+
+int AVCALL avstor_create_binary(const avstor_node *parent, const avstor_key *key,
+                                const void *value, size_t szvalue, avstor_node *out_value)
+{
+    if (szvalue > MAX_BINARY_LEN) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    return create_value(parent, key, AVSTOR_TYPE_BINARY, value, (unsigned)szvalue, out_value);
+}
+
+int AVCALL avstor_create_int32(const avstor_node *parent, const avstor_key *key,
+                               int32_t value, avstor_node *out_value)
+{
+    return create_value(parent, key, AVSTOR_TYPE_INT32, &value, sizeof(value), out_value);
+}
+
+int AVCALL avstor_create_int64(const avstor_node *parent, const avstor_key *key,
+                               int64_t value, avstor_node *out_value)
+{
+    return create_value(parent, key, AVSTOR_TYPE_INT64, &value, sizeof(value), out_value);
+}
+
+int AVCALL avstor_create_double(const avstor_node *parent, const avstor_key *key,
+                                double value, avstor_node *out_value)
+{
+    return create_value(parent, key, AVSTOR_TYPE_DOUBLE, &value, sizeof(value), out_value);
+}
+
+static void create_backlink(avstor *db, AvStack *st, avstor_off link, avstor_off target)
+{
+    NodeRef *volatile last_ref = NULL;
+    AvNode *volatile node = NULL, *volatile link_node = NULL;
+    avstor_key link_key;
+    link_key.buf = &target;
+    link_key.len = sizeof(avstor_off);
+    link_key.comparer = &offset_comparer;
+
+    TRY(ex)
+    {
+        AvNodeData *ndata;
+        if (!(node = find_node_with_backtrace(db, &link_key, st, &db->cache.header->root_links, &last_ref))) {
+            node = create_node(db, get_ptr_page(last_ref), &link_key, 0, AVSTOR_TYPE_KEY, 0);
+            ndata = get_node_data(node);
+            ndata->vkey.level = 0;
+            ndata->vkey.flags = 0;
+            ndata->vkey.pad = 0;
+            ndata->vkey.subkey_root = NODEREF_NULL;
+            ndata->vkey.value_root = NODEREF_NULL;
+            insert_node(db, node, st);
+        }
+        else {
+            ndata = get_node_data(node);
+        }
+        unlock_ptr_checked(db, last_ref);
+        last_ref = NULL;
+
+        link_key.buf = &link;
+        if ((link_node = find_node_with_backtrace(db, &link_key, st, &ndata->vkey.value_root, &last_ref))) {
+            THROW(AVSTOR_INTERNAL, "Back link reference already exists");
+        }
+        link_node = create_node(db, get_ptr_page(last_ref), &link_key, 0, AVSTOR_TYPE_LINK, 0);
+        get_node_data(link_node)->vLink.link = ofs_to_nref(link);
+        insert_node(db, link_node, st);
+    }
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, link_node);
+        unlock_ptr_checked(db, node);
+    }
+    END_TRY(ex);
+}
+
+int AVCALL avstor_create_link(const avstor_node *parent, const avstor_key *key,
+                              const avstor_node *target, avstor_node *out_value)
+{
+    avstor *db;
+    AvNode *volatile node = NULL, *volatile parent_node = NULL;
+    NodeRef *volatile last_ref = NULL;
+    int result;
+
+    CHECK_PARAM(parent && parent->db && key && target && (parent->db == target->db));
+    if (is_invalid_avstor_key(key) || (target->ref == 0)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = parent->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        AvStack st;
+        AvNode *fnode;
+        AvNodeData *pdata;
+        avstor_off ofs;
+
+        parent_node = lock_keyref(parent);
+        pdata = get_node_data(parent_node);
+        if ((fnode = find_node_with_backtrace(db, key, &st, &pdata->vkey.value_root , &last_ref))) {
+            unlock_ptr(db, fnode);
+            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+        }
+        node = create_node(db, get_ptr_page(last_ref), key, 0, AVSTOR_TYPE_LINK, pdata->vkey.level);
+        get_node_data(node)->vLink.link = ofs_to_nref(target->ref);
+        insert_node(db, node, &st);
+        key_stats_value(db, parent_node, node, 1);
+        ofs = get_ofs(node);
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr(db, node);
+        last_ref = NULL; node = NULL;
+
+        create_backlink(db, &st, ofs, target->ref);
+
+        if (out_value) {
+            avstor_node_set(out_value, ofs, db);
+        }
+        unlock_ptr(db, parent_node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+        unlock_ptr_checked(db, parent_node);
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_get_int32(const avstor_node *value, int32_t *out_val)
+{
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(value && value->db && out_val);
+    rwl_lock_shared(&value->db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_valueref(value, AVSTOR_TYPE_INT32);
+
+        *out_val = get_node_data(node)->v32.value;
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+static int get_fixed64_value(const avstor_node *value, unsigned type, int64_t *out_val)
+{
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(value && value->db && out_val);
+    rwl_lock_shared(&value->db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_valueref(value, type);
+
+        memcpy(out_val, &get_node_data(node)->v64.value, sizeof(int64_t));
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_get_int64(const avstor_node *value, int64_t *out_val)
+{
+    return get_fixed64_value(value, AVSTOR_TYPE_INT64, out_val);
+}
+
+int AVCALL avstor_get_double(const avstor_node *value, double *out_val)
+{
+    return get_fixed64_value(value, AVSTOR_TYPE_DOUBLE, &((AvValue64*)out_val)->as_int64);
+}
+
+static int get_var_value(const avstor_node* value, void* buf,
+                         size_t szbuf, unsigned type, size_t *out_bytes, uint32_t *out_length)
+{
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(value && value->db && buf && out_bytes && out_length);
+    rwl_lock_shared(&value->db->global_rwl);
+    TRY(ex)
+    {
+        const AvNodeData *ndata;
+        size_t bytes_copied;
+        node = lock_valueref(value, type);
+        node = lock_blob_data(value->db, node);
+        ndata = get_node_data(node);
+        bytes_copied = ndata->vvar.length > szbuf ? szbuf : (size_t)ndata->vvar.length;
+        *out_length = ndata->vvar.length;
+        *out_bytes = bytes_copied;
+        memcpy(buf, CONST_PTR(ndata, NODE_CLASS[NODE_TYPE(node)].szdata), bytes_copied);
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_get_string(const avstor_node* value, char* buf,
+                             size_t szbuf, uint32_t *out_length)
+{
+    size_t out_bytes = 0;
+    int res = get_var_value(value, buf, szbuf, AVSTOR_TYPE_STRING, &out_bytes, out_length);
+    if (res != AVSTOR_OK) {
+        return res;
+    }
+    if (szbuf > 0) {
+        if (out_bytes == szbuf) {
+            out_bytes = szbuf - 1;
+        }
+        buf[out_bytes] = 0;
+    }
+    (*out_length)--;
+    return AVSTOR_OK;
+}
+
+int AVCALL avstor_get_binary(const avstor_node* value, void* buf,
+                             size_t szbuf, size_t *out_bytes, uint32_t *out_length)
+{
+    return get_var_value(value, buf, szbuf, AVSTOR_TYPE_BINARY, out_bytes, out_length);
+}
+
+int AVCALL avstor_get_link(const avstor_node *value, avstor_node *out_target)
+{
+    avstor *db;
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(value && value->db && out_target);
+    db = value->db;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_valueref(value, AVSTOR_TYPE_LINK);
+        avstor_node_set(out_target, nref_to_ofs(get_node_data(node)->vLink.link), db);
+        unlock_ptr(db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_get_value(const avstor_node* value, void* buf,
+                            size_t szbuf, unsigned *out_type, size_t *out_bytes, uint32_t *out_length)
+{
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(value && value->db && buf && out_bytes && out_length);
+    rwl_lock_shared(&value->db->global_rwl);
+    TRY(ex)
+    {
+        unsigned node_type, szdata, data_offset;
+        const AvNodeClass *node_class;
+        const AvNodeData *ndata;
+        size_t bytes_copied = 0;
+        node = lock_noderef(value);
+        node_type = get_user_type(node);
+        if (node_type == AVSTOR_TYPE_KEY) {
+            THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
+        }
+        node = lock_blob_data(value->db, node);
+        ndata = get_node_data(node);
+        node_class = &NODE_CLASS[NODE_TYPE(node)];
+        szdata = node_class->szdata;
+        if (node_class->flags & NODE_FLAG_VAR) {
+            // Node with variable sized data
+            data_offset = szdata;
+            bytes_copied = ndata->vvar.length > szbuf ? szbuf : (size_t)ndata->vvar.length;
+            *out_length = ndata->vvar.length;
+        }
+        else {
+            // Node with fixed size data only
+            data_offset = 0;
+            bytes_copied = szdata <= szbuf ? szdata : szbuf;
+            *out_length = szdata;
+        }
+        memcpy(buf, CONST_PTR(ndata, data_offset), bytes_copied);
+        *out_bytes = bytes_copied;
+        *out_type = node_type;
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+// Sets the value of a locked int32, int64 or double node to the 4 or 8 bytes at new_value, the
+// global lock held exclusively
+static void update_fixed_node(avstor *db, AvNode *node, const void *new_value)
+{
+    int64_t old_val, new_val;
+    int counted = get_int_value(node, &old_val);
+    if (NODE_TYPE(node) == AVSTOR_TYPE_INT32) {
+        memcpy(&get_node_data(node)->v32.value, new_value, sizeof(int32_t));
+    }
+    else {
+        memcpy(&get_node_data(node)->v64.value, new_value, sizeof(int64_t));
+    }
+    set_ptr_dirty(node);
+    if (counted && get_int_value(node, &new_val)) {
+        rollup_update(db, node, old_val, new_val);
+    }
+}
+
+int AVCALL avstor_update_int32(const avstor_node *value, int32_t new_val)
+{
+    AvNode *volatile node = NULL;
+    volatile int written = 0;
+    int result;
+
+    CHECK_PARAM(value && value->db);
+    rwl_lock_exclusive(&value->db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_valueref(value, AVSTOR_TYPE_INT32);
+        written = 1;
+        update_fixed_node(value->db, node, &new_val);
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        if (written) {
+            // rollups may have been partly updated
+            rollback(value->db);
+        }
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+static int update_fixed64_value(const avstor_node *value, unsigned type, int64_t new_val)
+{
+    AvNode *volatile node = NULL;
+    volatile int written = 0;
+    int result;
+
+    CHECK_PARAM(value && value->db);
+    rwl_lock_exclusive(&value->db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_valueref(value, type);
+        written = 1;
+        update_fixed_node(value->db, node, &new_val);
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        if (written) {
+            // rollups may have been partly updated
+            rollback(value->db);
+        }
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_update_int64(const avstor_node *value, int64_t new_val)
+{
+    return update_fixed64_value(value, AVSTOR_TYPE_INT64, new_val);
+}
+
+int AVCALL avstor_update_double(const avstor_node *value, double new_val)
+{
+    AvValue64 v;
+    v.as_dbl = new_val;
+    return update_fixed64_value(value, AVSTOR_TYPE_DOUBLE, v.as_int64);
+}
+
+// Sets the value of the string or binary node locked in *pnode, the global lock held exclusively.
+// The node is unlocked and *pnode cleared once it is written.
+static void update_var_node(avstor *db, AvNode *volatile *pnode, const void *buf, unsigned szbuf, unsigned type)
+{
+    AvNode *node = *pnode;
+    AvNodeData *ndata = get_node_data(node);
+    unsigned szdata = NODE_CLASS[type].szdata;
+    unsigned szstats = get_stats_size(db, type);
+    avstor_off old_blob = 0, new_blob = 0;
+    uint32_t old_length = 0;
+    NodeRef owner = NODEREF_NULL;
+    if (szstats) {
+        owner = *get_node_owner(node);
+        old_length = get_value_length(db, node);
+    }
+    if (NODE_TYPE(node) == NODE_BLOBREF) {
+        old_blob = nref_to_ofs(ndata->vBlobRef.blob);
+    }
+    // a deduplicated value stays so without AVSTOR_OPEN_DEDUP, since its small node can rarely
+    // grow in place
+    if (is_dedup_value(db, type, szbuf) || (old_blob && type == AVSTOR_TYPE_BINARY && szbuf >= MIN_DEDUP_LEN)) {
+        new_blob = blob_acquire(db, buf, szbuf);
+    }
+    if (new_blob) {
+        if (!old_blob) {
+            node = resize_node(node, align_node(SIZE_NODE_HDR + get_name_size(node)
+                                                + NODE_CLASS[NODE_BLOBREF].szdata + szstats));
+            set_node_type(node, NODE_BLOBREF);
+        }
+        get_node_data(node)->vBlobRef.blob = ofs_to_nref(new_blob);
+    }
+    else {
+        if (old_blob || szbuf != ndata->vvar.length) {
+            node = resize_node(node, align_node(SIZE_NODE_HDR + get_name_size(node) + szdata + szbuf + szstats));
+            set_node_type(node, type);
+            ndata = get_node_data(node);
+            ndata->vvar.length = (uint8_t)szbuf;
+        }
+        memcpy(PTR(ndata, szdata), buf, szbuf);
+    }
+    if (szstats) {
+        *get_node_owner(node) = owner;
+    }
+    set_ptr_dirty(node);
+    unlock_ptr(db, node);
+    *pnode = NULL;
+    if (szstats && old_length != szbuf && !is_nref_empty(owner)) {
+        *pnode = lock_node(db, nref_to_ofs(owner));
+        key_stats_add(db, *pnode, 0, 0, (int64_t)szbuf - old_length);
+        unlock_ptr(db, *pnode);
+        *pnode = NULL;
+    }
+    // released last since deleting the blob may move nodes in the page of the value
+    if (old_blob) {
+        blob_release(db, old_blob);
+    }
+}
+
+static int update_var_value(const avstor_node* value, const void* buf,
+                            unsigned szbuf, unsigned type)
+{
+    avstor *db;
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(value && value->db && buf);
+    db = value->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_valueref(value, type);
+        update_var_node(db, &node, buf, szbuf, type);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, node);
+        rollback(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&value->db->global_rwl);
+    return result;
+}
+
+
+int AVCALL avstor_update_string(const avstor_node* value, const char* new_value)
+{
+    size_t len;
+
+    CHECK_PARAM(new_value);
+    len = strlen_l(new_value, MAX_STRING_LEN + 1) + 1;
+    if (len == (MAX_STRING_LEN + 1)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    return update_var_value(value, new_value, (unsigned)len, AVSTOR_TYPE_STRING);
+}
+
+int AVCALL avstor_update_binary(const avstor_node* value, const void* new_value, size_t szvalue)
+{
+    if (szvalue > MAX_BINARY_LEN) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    return update_var_value(value, new_value, (unsigned)szvalue, AVSTOR_TYPE_BINARY);
+}
+
+static void AVCALL db_open_file(avstor *db, const char* filename, int oflags)
+{
+    AvPage hdr;
+    int bytes_read, result;
+
+    result = io_open(filename, oflags);
+    if (result == AVSTOR_INVALID_HANDLE) {
+        THROW(AVSTOR_IOERR, "Failed to open file");
+    }
+    db->file = result;
+    bytes_read = io_read(db, db->file, &hdr, 0, (unsigned)SIZE_PAGE_HDR);
+    if (bytes_read < 0) {
+        THROW(AVSTOR_IOERR, "Failed to read header.");
+    }
+    if (bytes_read < (int)SIZE_PAGE_HDR) {
+        THROW(AVSTOR_CORRUPT, "Invalid header.");
+    }
+    /*if (memcmp(&hdr.id, &FILE_ID, sizeof(FILE_ID)) != 0) {
+        THROW(AVSTOR_CORRUPT, "page id is not 'AVST'.");
+    }*/
+
+    if (hdr.pagesize != PAGE_SIZE) {
+        THROW(AVSTOR_CORRUPT, "Invalid page size.");
+    }
+    if (AVSTOR_OK != (result = read_page(db, 0, db->cache.header))) {
+        THROW(result, "read_page() failed while reading header.");
+    }
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    // files written before page counts had 64 bits leave the high words undefined; they are
+    // upgraded with the next commit
+    if (!(db->cache.header->flags & AVSTOR_FILE_PAGE64)) {
+        AvPage *header = db->cache.header;
+        memset(&header->pagecount_hi, 0, SIZE_PAGE_HDR - offsetof(AvPage, pagecount_hi));
+        if (oflags & AVSTOR_OPEN_READWRITE) {
+            header->flags |= AVSTOR_FILE_PAGE64;
+        }
+    }
+#endif
+    memcpy(db->cache.old_header, db->cache.header, PAGE_SIZE);
+}
+
+static void AVCALL db_create_file(avstor *db, const char* filename, int oflags)
+{
+    AvPage *hdr = NULL;
+    int result;
+
+    result = io_create(filename, oflags);
+    if (result == AVSTOR_INVALID_HANDLE) {
+        THROW(AVSTOR_IOERR, "Failed to create file");
+    }
+    db->file = result;
+
+    hdr = db->cache.header;
+    memset(hdr, 0, PAGE_SIZE);
+    //memcpy(&hdr->id, &FILE_ID, sizeof(FILE_ID));
+    hdr->page_offset = 0;
+    hdr->type = PAGE_HDR;
+    set_page_dirty(hdr);
+    set_pagecount(hdr, 1);
+    hdr->pagesize = PAGE_SIZE;
+    hdr->root = NODEREF_NULL;
+#if defined(AVSTOR_CONFIG_FILE_64BIT)
+    hdr->flags = AVSTOR_FILE_64BIT | AVSTOR_FILE_PAGE64;
+#endif
+    if (oflags & AVSTOR_OPEN_KEYSTATS) {
+        hdr->flags |= AVSTOR_FILE_KEYSTATS;
+    }
+    if (oflags & AVSTOR_OPEN_PARENTS) {
+        hdr->flags |= AVSTOR_FILE_PARENTS;
+    }
+    if (AVSTOR_OK != (result = avstor_commit(db, 1))) {
+        THROW(result, "Failed to initialize file");
+    }
+}
+
+#if defined(__OS2__) && defined(AVSTOR_CONFIG_THREAD_SAFE)
+
+once_flag init_tls_flag = ONCE_FLAG_INIT;
+
+static void avstor_destroy_tls(void* tls_data)
+{
+    if (tls_data) {
+        free(tls_data);
+    }
+}
+
+static void avstor_init_tls(void)
+{
+    AvTLSData *ptr;
+
+    if (tss_create(&tls_idx, avstor_destroy_tls) != thrd_success) {
+        fprintf(stderr, "libavstor: FATAL: Failed to initialize TLS index\n");
+        abort();
+    }
+    if (!(ptr = malloc(sizeof(*ptr)))) {
+        tss_delete(tls_idx);
+        fprintf(stderr, "libavstor: FATAL: Failed to allocate TLS storage\n");
+        abort();
+    }
+    tss_set(tls_idx, ptr);
+    init_tls_vars();
+}
+#endif
+
+int AVCALL avstor_open(avstor **pdb, const char* filename, unsigned szcache, int oflags)
+{
+    avstor *db;
+    int result;
+
+#if defined(__OS2__) && defined(AVSTOR_CONFIG_THREAD_SAFE)
+    call_once(&init_tls_flag, avstor_init_tls);
+#endif
+
+    CHECK_PARAM(pdb && filename);
+    if (((oflags & AVSTOR_OPEN_CREATE) && (oflags & AVSTOR_OPEN_READONLY))
+        || (!(oflags & AVSTOR_OPEN_READWRITE) && !(oflags & AVSTOR_OPEN_READONLY))) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_FLAGS_COMBINATION);
+    }
+
+    szcache = mask_to_power_of_two(szcache);
+    if (szcache < 64) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_ATTRIBUTE);
+    }
+#if defined(DOS16)
+    /* 16-bit DOS limited to 512K of cache since it has to be in conventional memory */
+    if (szcache > 512) {
+        szcache = 512;
+    }
+#endif
+    if (!avstor_init(&db, szcache)) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+
+    db->oflags = oflags;
+
+    TRY(ex)
+    {
+        if ((oflags & AVSTOR_OPEN_LOOKUP_CACHE) && !(db->lookups = lookup_create())) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        if (oflags & AVSTOR_OPEN_CREATE) {
+            db_create_file(db, filename, oflags);
+        }
+        else {
+            db_open_file(db, filename, oflags);
+            load_names(db, nref_to_ofs(db->cache.header->root_names));
+            db->names_committed = db->name_count;
+            map_file(db);
+        }
+        if ((oflags & AVSTOR_OPEN_MERKLE) || (db->cache.header->flags & AVSTOR_FILE_MERKLE)) {
+            merkle_open(db);
+        }
+        *pdb = db;
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        avstor_destroy(db);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    return result;
+}
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+
+/*
+* Maintenance scheduler. A single pool of worker threads per process runs background tasks of all
+* open files, highest priority first. Tasks charge their I/O to a shared budget with
+* sched_throttle, which also blocks them while the scheduler is paused, and tells them to stop once
+* their file is being closed.
+*/
+typedef struct AvTask AvTask;
+typedef int (*AvTaskProc)(avstor *db, unsigned param);
+
+struct AvTask {
+    AvTask              *next;
+    avstor              *db;
+    AvTaskProc          proc;
+    unsigned            param;
+};
+
+enum {
+    sched_stopped = 0,
+    sched_running,
+    sched_stopping
+};
+
+typedef struct AvScheduler {
+    AvMutex             mtx;
+    AvCnd               cv;         // workers wait on this for tasks and for resume
+    AvCnd               cv_done;    // signaled when a task finishes or a worker exits
+    thrd_t              *workers;
+    unsigned            worker_count;
+    unsigned            active_workers;
+    int                 state;
+    int                 paused;
+
+    // FIFO queue per priority
+    AvTask              *head[AVSTOR_TASK_HIGH + 1];
+    AvTask              *tail[AVSTOR_TASK_HIGH + 1];
+
+    // I/O budget, 0 if unlimited. Tokens accumulate for up to a second.
+    unsigned            kb_per_sec;
+    unsigned            iops;
+    uint64_t            byte_tokens;
+    uint32_t            io_tokens;
+    uint32_t            last_refill;
+} AvScheduler;
+
+static AvScheduler sched;
+static once_flag sched_once = ONCE_FLAG_INIT;
+// Set once by sched_init. Atomic since the paths that must not create the scheduler objects read
+// it without call_once.
+static volatile atomic_int sched_initialized;
+
+static void sched_init(void)
+{
+    if (avmtx_init(&sched.mtx)) {
+        if (avcnd_init(&sched.cv)) {
+            if (avcnd_init(&sched.cv_done)) {
+                atomic_store_int_release(&sched_initialized, 1);
+                return;
+            }
+            avcnd_destroy(&sched.cv);
+        }
+        avmtx_destroy(&sched.mtx);
+    }
+}
+
+static __inline uint32_t sched_now_ms(void)
+{
+    return (uint32_t)(clock_us() / 1000);
+}
+
+static void sched_sleep_ms(uint32_t ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    thrd_sleep(&ts, NULL);
+}
+
+// Scheduler mutex must be held
+static void sched_refill(void)
+{
+    uint32_t now = sched_now_ms();
+    uint32_t elapsed = now - sched.last_refill;
+    if (elapsed > 1000) {
+        elapsed = 1000;
+    }
+    sched.last_refill = now;
+    if (sched.kb_per_sec) {
+        uint64_t max_tokens = (uint64_t)sched.kb_per_sec * 1024;
+        sched.byte_tokens += max_tokens * elapsed / 1000;
+        if (sched.byte_tokens > max_tokens) {
+            sched.byte_tokens = max_tokens;
+        }
+    }
+    if (sched.iops) {
+        sched.io_tokens += (uint32_t)((uint64_t)sched.iops * elapsed / 1000);
+        if (sched.io_tokens > sched.iops) {
+            sched.io_tokens = sched.iops;
+        }
+    }
+}
+
+// Waits until the I/O budget allows the given number of bytes and operations, and while paused.
+// Requests larger than a second of budget wait for a full second. Returns AVSTOR_ABORT without
+// waiting further once db is being closed, otherwise AVSTOR_OK.
+static int sched_throttle(avstor *db, unsigned bytes, unsigned ios)
+{
+    int result = AVSTOR_OK;
+    avmtx_lock(&sched.mtx);
+    while (sched.state == sched_running) {
+        uint32_t wait_ms = 0;
+        if (db->task_cancelled) {
+            result = AVSTOR_ABORT;
+            break;
+        }
+        if (sched.paused) {
+            avcnd_wait(&sched.cv, &sched.mtx);
+            continue;
+        }
+        sched_refill();
+        if (sched.kb_per_sec) {
+            uint64_t max_tokens = (uint64_t)sched.kb_per_sec * 1024;
+            uint64_t needed = bytes < max_tokens ? bytes : max_tokens;
+            if (sched.byte_tokens < needed) {
+                wait_ms = (uint32_t)((needed - sched.byte_tokens) * 1000 / max_tokens) + 1;
+            }
+        }
+        if (sched.iops) {
+            uint32_t needed = ios < sched.iops ? ios : sched.iops;
+            if (sched.io_tokens < needed) {
+                uint32_t io_wait = (needed - sched.io_tokens) * 1000 / sched.iops + 1;
+                wait_ms = io_wait > wait_ms ? io_wait : wait_ms;
+            }
+        }
+        if (wait_ms == 0) {
+            sched.byte_tokens = sched.byte_tokens > bytes ? sched.byte_tokens - bytes : 0;
+            sched.io_tokens = sched.io_tokens > ios ? sched.io_tokens - ios : 0;
+            break;
+        }
+        // sleep in slices to notice the file being closed
+        avmtx_unlock(&sched.mtx);
+        sched_sleep_ms(wait_ms < SCHED_CANCEL_POLL_MS ? wait_ms : SCHED_CANCEL_POLL_MS);
+        avmtx_lock(&sched.mtx);
+    }
+    avmtx_unlock(&sched.mtx);
+    return result;
+}
+
+// Scheduler mutex must be held
+static AvTask* sched_dequeue(void)
+{
+    int priority;
+    for (priority = AVSTOR_TASK_HIGH; priority >= AVSTOR_TASK_LOW; --priority) {
+        AvTask *task = sched.head[priority];
+        if (task) {
+            if (!(sched.head[priority] = task->next)) {
+                sched.tail[priority] = NULL;
+            }
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// Scheduler mutex must be held
+static void sched_task_done(AvTask *task, int result)
+{
+    if (result != AVSTOR_OK && task->db->task_result == AVSTOR_OK) {
+        task->db->task_result = result;
+    }
+    task->db->task_count--;
+    free(task);
+    avcnd_broadcast(&sched.cv_done);
+}
+
+static int sched_worker(void *arg)
+{
+    (void)arg;
+    avmtx_lock(&sched.mtx);
+    while (sched.state == sched_running) {
+        AvTask *task = sched.paused ? NULL : sched_dequeue();
+        int result;
+        if (!task) {
+            avcnd_wait(&sched.cv, &sched.mtx);
+            continue;
+        }
+        avmtx_unlock(&sched.mtx);
+        result = task->proc(task->db, task->param);
+        avmtx_lock(&sched.mtx);
+        sched_task_done(task, result);
+    }
+    sched.active_workers--;
+    avcnd_broadcast(&sched.cv_done);
+    avmtx_unlock(&sched.mtx);
+    return 0;
+}
+
+static int sched_submit(avstor *db, AvTaskProc proc, unsigned param, int priority)
+{
+    AvTask *task;
+    int result = AVSTOR_OK;
+
+    if (priority < AVSTOR_TASK_LOW || priority > AVSTOR_TASK_HIGH) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    if (!(task = malloc(sizeof(*task)))) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    task->next = NULL;
+    task->db = db;
+    task->proc = proc;
+    task->param = param;
+    call_once(&sched_once, sched_init);
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        free(task);
+        RETURN(AVSTOR_INVOPER, "Maintenance scheduler is not running");
+    }
+    avmtx_lock(&sched.mtx);
+    if (sched.state != sched_running) {
+        free(task);
+        result = AVSTOR_INVOPER;
+    }
+    else {
+        if (sched.tail[priority]) {
+            sched.tail[priority]->next = task;
+        }
+        else {
+            sched.head[priority] = task;
+        }
+        sched.tail[priority] = task;
+        db->task_count++;
+        avcnd_signal(&sched.cv);
+    }
+    avmtx_unlock(&sched.mtx);
+    if (result != AVSTOR_OK) {
+        RETURN(result, "Maintenance scheduler is not running");
+    }
+    return result;
+}
+
+// Drops the queued tasks of db, or of all files if db is NULL. Scheduler mutex must be held.
+static void sched_drop_tasks(avstor *db)
+{
+    int priority;
+    for (priority = AVSTOR_TASK_LOW; priority <= AVSTOR_TASK_HIGH; ++priority) {
+        AvTask *task = sched.head[priority], *prev = NULL;
+        while (task) {
+            AvTask *next = task->next;
+            if (!db || task->db == db) {
+                if (prev) {
+                    prev->next = next;
+                }
+                else {
+                    sched.head[priority] = next;
+                }
+                if (sched.tail[priority] == task) {
+                    sched.tail[priority] = prev;
+                }
+                sched_task_done(task, AVSTOR_ABORT);
+            }
+            else {
+                prev = task;
+            }
+            task = next;
+        }
+    }
+}
+
+// Returns nonzero if the scheduler accepts tasks
+static int sched_is_running(void)
+{
+    int running = 0;
+    if (atomic_load_int_acquire(&sched_initialized)) {
+        avmtx_lock(&sched.mtx);
+        running = sched.state == sched_running;
+        avmtx_unlock(&sched.mtx);
+    }
+    return running;
+}
+
+// Drops the queued tasks of a file being closed, tells its running tasks to stop at their next
+// sched_throttle and waits for them
+static void sched_cancel(avstor *db)
+{
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        return;
+    }
+    avmtx_lock(&sched.mtx);
+    sched_drop_tasks(db);
+    db->task_cancelled = 1;
+    avcnd_broadcast(&sched.cv);
+    while (db->task_count != 0) {
+        avcnd_wait(&sched.cv_done, &sched.mtx);
+    }
+    avmtx_unlock(&sched.mtx);
+}
+#else
+#define sched_throttle(db, bytes, ios)  ((void)(db), AVSTOR_OK)
+#endif
+
+/*
+* Starts the maintenance scheduler with thread_count worker threads shared by all open files.
+* Background tasks, such as avstor_tier_migrate_async, can only be queued while it is running.
+* Only available in thread-safe builds.
+*/
+int AVCALL avstor_sched_start(unsigned thread_count)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    int result = AVSTOR_OK;
+    unsigned i;
+
+    if (thread_count == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    call_once(&sched_once, sched_init);
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    avmtx_lock(&sched.mtx);
+    if (sched.state != sched_stopped) {
+        result = AVSTOR_INVOPER;
+    }
+    else if (!(sched.workers = calloc(thread_count, sizeof(thrd_t)))) {
+        result = AVSTOR_NOMEM;
+    }
+    else {
+        sched.state = sched_running;
+        sched.paused = 0;
+        sched.last_refill = sched_now_ms();
+        for (i = 0; i < thread_count; ++i) {
+            if (thrd_create(&sched.workers[i], &sched_worker, NULL) != thrd_success) {
+                break;
+            }
+        }
+        sched.worker_count = sched.active_workers = i;
+        if (i == 0) {
+            free(sched.workers);
+            sched.workers = NULL;
+            sched.state = sched_stopped;
+            result = AVSTOR_NOMEM;
+        }
+    }
+    avmtx_unlock(&sched.mtx);
+    if (result != AVSTOR_OK) {
+        RETURN(result, "Failed to start maintenance scheduler");
+    }
+    return result;
+#else
+    (void)thread_count;
+    RETURN(AVSTOR_INVOPER, "Maintenance scheduler requires a thread-safe build");
+#endif
+}
+
+/*
+* Stops the maintenance scheduler. Queued tasks are dropped and reported as AVSTOR_ABORT by
+* avstor_sched_wait, running tasks are finished first.
+*/
+int AVCALL avstor_sched_stop(void)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    unsigned i;
+
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        RETURN(AVSTOR_INVOPER, "Maintenance scheduler is not running");
+    }
+    avmtx_lock(&sched.mtx);
+    if (sched.state != sched_running) {
+        avmtx_unlock(&sched.mtx);
+        RETURN(AVSTOR_INVOPER, "Maintenance scheduler is not running");
+    }
+    sched.state = sched_stopping;
+    sched_drop_tasks(NULL);
+    avcnd_broadcast(&sched.cv);
+    while (sched.active_workers != 0) {
+        avcnd_wait(&sched.cv_done, &sched.mtx);
+    }
+    avmtx_unlock(&sched.mtx);
+
+    for (i = 0; i < sched.worker_count; ++i) {
+        thrd_join(sched.workers[i], NULL);
+    }
+    avmtx_lock(&sched.mtx);
+    free(sched.workers);
+    sched.workers = NULL;
+    sched.worker_count = 0;
+    sched.state = sched_stopped;
+    avmtx_unlock(&sched.mtx);
+    return AVSTOR_OK;
+#else
+    RETURN(AVSTOR_INVOPER, "Maintenance scheduler requires a thread-safe build");
+#endif
+}
+
+// Limits the I/O of maintenance tasks to kb_per_sec kilobytes and iops operations per second.
+// 0 means no limit.
+int AVCALL avstor_sched_set_budget(unsigned kb_per_sec, unsigned iops)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    call_once(&sched_once, sched_init);
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    avmtx_lock(&sched.mtx);
+    sched.kb_per_sec = kb_per_sec;
+    sched.iops = iops;
+    sched.byte_tokens = 0;
+    sched.io_tokens = 0;
+    sched.last_refill = sched_now_ms();
+    avmtx_unlock(&sched.mtx);
+    return AVSTOR_OK;
+#else
+    (void)kb_per_sec;
+    (void)iops;
+    RETURN(AVSTOR_INVOPER, "Maintenance scheduler requires a thread-safe build");
+#endif
+}
+
+// Pauses (paused != 0) or resumes maintenance. Paused tasks stop at their next I/O.
+int AVCALL avstor_sched_pause(int paused)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    call_once(&sched_once, sched_init);
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    avmtx_lock(&sched.mtx);
+    sched.paused = paused != 0;
+    if (!sched.paused) {
+        avcnd_broadcast(&sched.cv);
+    }
+    avmtx_unlock(&sched.mtx);
+    return AVSTOR_OK;
+#else
+    (void)paused;
+    RETURN(AVSTOR_INVOPER, "Maintenance scheduler requires a thread-safe build");
+#endif
+}
+
+// Waits until no maintenance tasks are queued or running for db. Returns the first error returned
+// by a task since the previous call, or AVSTOR_OK.
+int AVCALL avstor_sched_wait(avstor *db)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    int result;
+
+    CHECK_PARAM(db);
+    if (!atomic_load_int_acquire(&sched_initialized)) {
+        return AVSTOR_OK;
+    }
+    avmtx_lock(&sched.mtx);
+    while (db->task_count != 0) {
+        avcnd_wait(&sched.cv_done, &sched.mtx);
+    }
+    result = db->task_result;
+    db->task_result = AVSTOR_OK;
+    avmtx_unlock(&sched.mtx);
+    return result;
+#else
+    CHECK_PARAM(db);
+    (void)db;
+    return AVSTOR_OK;
+#endif
+}
+
+int AVCALL avstor_close(avstor *db)
+{
+    CHECK_PARAM(db);
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    sched_cancel(db);
+#endif
+    if (db->file != AVSTOR_INVALID_HANDLE) {
+        io_close(db->file);
+        db->file = AVSTOR_INVALID_HANDLE;
+    }
+
+    avstor_destroy(db);
+    return AVSTOR_OK;
+}
+
+int AVCALL avstor_find(const avstor_node *parent, const avstor_key *key,
+                       int flags, avstor_node *out_key)
+{
+    avstor *db;
+    avstor_node mount_root;
+    const avstor_node *volatile resolved; // volatile because set twice when parent is a mount point
+    AvNode *volatile parent_node = NULL;
+    AvNode *out_node = NULL;
+    int result;
+    int isvalue = (flags & AVSTOR_VALUES);
+
+    CHECK_PARAM(parent && parent->db && key && out_key);
+    if (is_invalid_avstor_key(key) || (isvalue && parent->ref == 0)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    resolved = resolve_mount(parent, flags, &mount_root);
+    db = resolved->db;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        NodeRef *ref;
+        AvSearchKey sk;
+        uint32_t hash = 0;
+        // keys with a comparer may match names other than their bytes, they are not cached
+        if (db->lookups && !key->comparer) {
+            init_search_key(db, key, &sk);
+            hash = lookup_hash(key->buf, key->len, isvalue);
+            if ((out_node = lookup_find(db, resolved->ref, &sk, hash)) && cur_trace) {
+                cur_trace->lookup_hits++;
+            }
+        }
+        if (!out_node) {
+            if (resolved->ref != 0) {
+                parent_node = lock_keyref(resolved);
+            }
+
+            if (isvalue) {
+                ref = &get_node_data(parent_node)->vkey.value_root;
+            }
+            else {
+                ref = !parent_node ? &db->cache.header->root : &get_node_data(parent_node)->vkey.subkey_root;
+            }
+            if ((out_node = find_key(db, key, ref)) && hash) {
+                lookup_store(db, resolved->ref, hash, get_ofs(out_node));
+            }
+        }
+
+        if (out_node) {
+            if (out_key) {
+                avstor_node_set(out_key, get_ofs(out_node), db);
+            }
+            unlock_ptr(db, out_node);
+            result = AVSTOR_OK;
+        }
+        else {
+            result = AVSTOR_NOTFOUND;
+        }
+        unlock_ptr_checked(db, parent_node);
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, parent_node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_get_name(const avstor_node *value, avstor_key *key)
+{
+    AvNode *volatile node = NULL;
+    int result;
+    avstor *db;
+    CHECK_PARAM(value && value->db && key);
+    db = value->db;
+
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        size_t szname;
+        node = lock_noderef(value);
+        szname = (node->szname & NAME_INTERNED) ? get_interned_name(db, node)->len : node->szname;
+        if (szname > key->len) {
+            THROW(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+        }
+        memcpy(key->buf, get_node_name_ptr(db, node), szname);
+        unlock_ptr(db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+// Offset of the key a node belongs to, 0 for keys under the root. Sets *out_depth to the level of
+// the node, counting keys under the root as 1, if out_depth is not NULL.
+static avstor_off get_node_parent(avstor *db, avstor_off ofs, unsigned *out_depth)
+{
+    AvNode *node = lock_node(db, ofs);
+    avstor_off parent = nref_to_ofs(*get_node_owner(node));
+    int iskey = NODE_TYPE(node) == AVSTOR_TYPE_KEY;
+    unsigned level = iskey ? get_node_data(node)->vkey.level : 0;
+    unlock_ptr(db, node);
+    if (!iskey && parent == 0) {
+        THROW(AVSTOR_CORRUPT, "Value without parent reference");
+    }
+    if (out_depth) {
+        if (!iskey) {
+            node = lock_node(db, parent);
+            level = get_node_data(node)->vkey.level + 1u;
+            unlock_ptr(db, node);
+        }
+        *out_depth = level;
+    }
+    return parent;
+}
+
+/*
+* Returns the key a key or value belongs to, the root for keys directly under it, from the parent
+* reference kept in files created with AVSTOR_OPEN_PARENTS. References stay valid when nodes move
+* within or between pages, and are relocated by avstor_import_file. The parent of a key under the
+* root of a mounted file is that root, not the mount point.
+*/
+int AVCALL avstor_get_parent(const avstor_node *node, avstor_node *out_parent)
+{
+    avstor *db;
+    int result;
+
+    CHECK_PARAM(node && node->db && out_parent);
+    if (node->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = node->db;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        if (!(db->cache.header->flags & AVSTOR_FILE_PARENTS)) {
+            THROW(AVSTOR_INVOPER, "File does not keep parent references");
+        }
+        avstor_node_set(out_parent, get_node_parent(db, node->ref, NULL), db);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+/*
+* Stores the keys from the root down to node into out_path, the key under the root first and node
+* itself last, and their count into *out_depth. Takes one node lookup per level, see
+* avstor_get_parent. Their names give the path of node, see avstor_get_name. If size is less than
+* the depth of node, returns AVSTOR_PARAM with *out_depth set to the depth.
+*/
+int AVCALL avstor_get_path(const avstor_node *node, avstor_node *out_path, unsigned size, unsigned *out_depth)
+{
+    avstor *db;
+    int result;
+
+    CHECK_PARAM(node && node->db && (out_path || size == 0) && out_depth);
+    if (node->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = node->db;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        unsigned depth, i;
+        avstor_off ofs = node->ref;
+        if (!(db->cache.header->flags & AVSTOR_FILE_PARENTS)) {
+            THROW(AVSTOR_INVOPER, "File does not keep parent references");
+        }
+        (void)get_node_parent(db, ofs, &depth);
+        *out_depth = depth;
+        if (depth > size) {
+            THROW(AVSTOR_PARAM, "Path buffer too small");
+        }
+        for (i = depth; i > 0 && ofs != 0; --i) {
+            avstor_node_set(&out_path[i - 1], ofs, db);
+            ofs = get_node_parent(db, ofs, NULL);
+        }
+        if (i != 0 || ofs != 0) {
+            THROW(AVSTOR_CORRUPT, "Parent references do not match key levels");
+        }
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_get_type(const avstor_node* value, unsigned *out_type)
+{
+    AvNode *volatile node = NULL;
+    int result;
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    avstor *db;
+    CHECK_PARAM(value && value->db && out_type);
+    db = value->db;
+#else
+    CHECK_PARAM(value && value->db && out_type);
+#endif
+
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        node = lock_noderef(value);
+
+        *out_type = get_user_type(node);
+        unlock_ptr(value->db, node);
+        result = AVSTOR_OK;
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(value->db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+static int exists_link_to_node(avstor *db, AvNode *target)
+{
+    AvNode *link_node;
+    avstor_off link_ofs = get_ofs(target);
+    int result;
+    avstor_key link_key;
+    link_key.buf = &link_ofs;
+    link_key.len = sizeof(link_ofs);
+    link_key.comparer = offset_comparer;
+
+    link_node = find_key(db, &link_key, &db->cache.header->root_links);
+    result = link_node != NULL;
+    unlock_ptr_checked(db, link_node);
+    return result;
+}
+
+static void delete_backlink(avstor *db, AvNode *node)
+{
+    AvStack st;
+    AvNode *volatile link_node = NULL, *volatile link_value = NULL;
+    avstor_off link_ofs = nref_to_ofs(get_node_data(node)->vLink.link);
+    avstor_key link_key;
+    link_key.buf = &link_ofs;
+    link_key.len = sizeof(link_ofs);
+    link_key.comparer = offset_comparer;
+
+    TRY(ex)
+    {
+        if ((link_node = find_node_with_backtrace(db, &link_key, &st, &db->cache.header->root_links, NULL))) {
+            AvStack st_link;
+            AvNodeData *lk_data = get_node_data(link_node);
+
+            link_ofs = get_ofs(node);
+            if ((link_value = find_node_with_backtrace(db, &link_key, &st_link, &lk_data->vkey.value_root, NULL))) {
+                delete_node(db, link_value, &st_link);
+                unlock_ptr(db, link_value);
+                link_value = NULL;
+            }
+            if (is_nref_empty(lk_data->vkey.value_root)) {
+                // If we have deleted the last value, delete the parent key as well
+                delete_node(db, link_node, &st);
+                unlock_ptr(db, link_node);
+                link_node = NULL;
+            }
+        }
     }
-    else {
-        set_nref(item, st->root);
-        set_bf(item, 0);
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, link_value);
+        unlock_ptr_checked(db, link_node);
     }
+    END_TRY(ex);
 }
 
-static AvNode* find_key(avstor *db, const avstor_key *key, const NodeRef *rootref)
+// Deletes a node found with find_node_with_backtrace under parent_node, the key at parent or the
+// root if parent is 0, with the global lock held exclusively. The node is unlocked and *pnode
+// cleared once it is freed.
+static void delete_found_node(avstor *db, avstor_off parent, AvNode *parent_node, AvNode *volatile *pnode,
+                              AvStack *st, const avstor_key *key, int isvalue)
 {
-    AvNode *cur;
-    const NodeRef *ref = rootref;
-    lock_ref(ref);
-    while (!is_nref_empty(*ref)) {
-        int comp;
-        cur = lock_node_ex(db, ref);
-        unlock_ptr(ref);
-        comp = key->comparer(key->buf, cur->name);
-        if (comp == 0) {
-            return cur;
+    AvNode *node = *pnode;
+    avstor_off blob;
+    int64_t old_value = 0;
+    int counted = 0;
+
+    if (NODE_TYPE(node) == AVSTOR_TYPE_LINK) {
+        /* if deleting link, we must also delete backlink */
+        delete_backlink(db, node);
+    }
+    if (db->lookups) {
+        lookup_forget(db, parent, node, isvalue);
+    }
+    if (isvalue) {
+        key_stats_value(db, parent_node, node, -1);
+        counted = get_int_value(node, &old_value);
+    }
+    else {
+        key_stats_add(db, parent_node, -1, 0, 0);
+        if (get_node_data(node)->vkey.flags & KEY_FLAG_ROLLUPS) {
+            rollup_forget(db, get_ofs(node));
         }
-        ref = (comp < 0) ? &cur->left : &cur->right;
     }
-    unlock_ptr(ref);
-    return NULL;
+    blob = NODE_TYPE(node) == NODE_BLOBREF ? nref_to_ofs(get_node_data(node)->vBlobRef.blob) : 0;
+    delete_node(db, node, st);
+    unlock_ptr(db, node);
+    *pnode = NULL;
+    if (blob) {
+        blob_release(db, blob);
+    }
+    if (counted) {
+        rollup_apply(db, parent_node, key, ROLLUP_REMOVE, old_value, 0);
+    }
 }
 
-/* Note that errors here are not YET recoverable */
-int AVCALL avstor_commit(avstor *db, int flush)
+int AVCALL avstor_delete(const avstor_node *parent, int flags, const avstor_key *key)
 {
-    PageCache *cache;
-    unsigned row, col;
+    AvStack st;
+    avstor *db;
+    avstor_node mount_root;
+    const avstor_node *volatile resolved; // volatile because set twice when parent is a mount point
+    AvNode *volatile node = NULL, *volatile parent_node = NULL;
+    NodeRef *volatile last_ref = NULL;
+    NodeRef *rootref;
     int result;
+    int isvalue = flags & AVSTOR_VALUES;
 
-    CHECK_PARAM(db);
-    rwl_lock_exclusive(&db->global_rwl);
+    CHECK_PARAM(parent && parent->db && key && key);
+    if (is_invalid_avstor_key(key) || (isvalue && parent->ref == 0)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    resolved = resolve_mount(parent, flags, &mount_root);
+    db = resolved->db;
     TRY(ex)
     {
-        cache = &db->cache;
+        while (1) {
+            rwl_lock_shared(&db->global_rwl);
+            if (resolved->ref != 0) {
+                parent_node = lock_keyref(resolved);
+            }
 
-        for (row = 0; row < cache->l2_len; ++row) {
-            CacheRow *line = &cache->rows[row];
-            for (col = 0; col < line->capacity; ++col) {
-                AvPage *page = line->items[col].page;
-                if (!page) {
-                    break;
-                }
-                else {
-                    if (AVSTOR_OK != (result = write_page(db, page))) {
-                        THROW(result, "write_page() failed");
+            if (isvalue) {
+                rootref = &get_node_data(parent_node)->vkey.value_root;
+            }
+            else {
+                rootref = !parent_node ? &db->cache.header->root : &get_node_data(parent_node)->vkey.subkey_root;
+            }
+            if ((node = find_node_with_backtrace(db, key, &st, rootref, &last_ref))) {
+                if (NODE_TYPE(node) == AVSTOR_TYPE_KEY) {
+                    AvNodeData *ndata = get_node_data(node);
+                    if (!is_nref_empty(ndata->vkey.subkey_root) || !is_nref_empty(ndata->vkey.value_root)) {
+                        THROW(AVSTOR_INVOPER, "Node has subkeys and/or values, unable to delete");
                     }
+                    if (find_mount(db, get_ofs(node))) {
+                        THROW(AVSTOR_INVOPER, "Node is a mount point, unable to delete");
+                    }
+                }
+                if (exists_link_to_node(db, node)) {
+                    THROW(AVSTOR_INVOPER, "Node is a target of a link reference, unable to delete");
+                }
+#ifdef AVSTOR_CONFIG_THREAD_SAFE
+                if (!rwl_upgrade(&db->global_rwl)) {
+                    unlock_ptr_checked(db, last_ref);
+                    unlock_ptr_checked(db, node);
+                    unlock_ptr_checked(db, parent_node);
+                    parent_node = NULL;
+                    node = NULL;
+                    last_ref = NULL;
+                    rwl_release(&db->global_rwl);
+                    continue;
                 }
+                // pages locked before the upgrade were not recorded as touched by a writer
+                map_touch_ptr(db, last_ref);
+                map_touch_ptr(db, node);
+                map_touch_ptr(db, parent_node);
+#endif
+                delete_found_node(db, resolved->ref, parent_node, &node, &st, key, isvalue);
+                result = AVSTOR_OK;
             }
+            else {
+                unlock_ptr_checked(db, last_ref);
+                result = AVSTOR_NOTFOUND;
+            }
+            break;
         }
-        if (AVSTOR_OK != (result = write_page(db, cache->header))) {
-            THROW(result, "write_page() failed while writing header");
-        }
-        if (flush && !io_commit(db->file)) {
-            THROW(AVSTOR_IOERR, "commit() failed");
-        }
-        // save header for rollback purposes
-        memcpy(cache->old_header, cache->header, PAGE_SIZE);
-        result = AVSTOR_OK;
+        unlock_ptr_checked(db, parent_node);
     }
     CATCH_ANY(ex)
     {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+        unlock_ptr_checked(db, parent_node);
+        rollback(db);
         result = ex.err;
     }
     END_TRY(ex);
@@ -2484,166 +7394,353 @@ int AVCALL avstor_commit(avstor *db, int flush)
     return result;
 }
 
-int AVCALL avs_check_cache_consistency(avstor *db)
+//static __inline void inorder_state_init(avstor_inorder *st, int flags)
+//{
+//    st->top = -1;
+//    st->flags = flags;
+//}
+
+static __inline int inorder_state_isempty(avstor_inorder *st)
 {
-    PageCache *cache = &db->cache;
-    unsigned row, col;
-    for (row = 0; row < cache->l2_len; ++row) {
-        CacheRow *line = &cache->rows[row];
-        for (col = 0; col < line->capacity; ++col) {
-            AvPage *page = line->items[col].page;
-            if (!page) {
-                break;
-            }
-            else if (atomic_load_int_acquire(&page->lock_count) != 0)  {
-                return AVSTOR_CORRUPT;
-            }
-        }
-    }
-    return AVSTOR_OK;
+    return st->top < 0;
 }
 
-static AvNode* lock_noderef(const avstor_node *parent)
+static __inline int inorder_state_push(avstor_inorder *st, avstor_off item)
 {
-    AvNode *result = NULL;
-    if (parent->ref == 0) {
-        THROW(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    if (st->top < AVSTOR_AVL_HEIGHT - 1) {
+        st->ref[++st->top] = item;
+        return 1;
+    }
+    else {
+        return 0;
     }
-    result = lock_node(parent->db, parent->ref);
-    assert(is_node_addr_valid(parent->db, result));
-    return result;
 }
 
-static __inline AvNode* lock_keyref(const avstor_node *parent)
+static __inline avstor_off inorder_state_pop(avstor_inorder *st)
 {
-    AvNode* result = lock_noderef(parent);
-    if (NODE_TYPE(result) != AVSTOR_TYPE_KEY) {
-        unlock_ptr(result);
-        THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
+    assert(st->top >= 0);
+    return st->ref[st->top--];
+}
+
+static __inline avstor_off inorder_state_top(avstor_inorder *st)
+{
+    assert(st->top >= 0);
+    return st->ref[st->top];
+}
+
+static __inline unsigned inorder_cache_flags(const avstor_inorder *st)
+{
+    return (st->flags & AVSTOR_SCAN) ? (CACHE_EXISTING | CACHE_SCAN) : CACHE_EXISTING;
+}
+
+static avstor_off find_node_for_inorder(avstor_inorder *st, const avstor_key *key, avstor_off ofs)
+{
+    AvNode *cur = NULL;
+    avstor_off result = 0;
+    int is_descending = (st->flags & AVSTOR_DESCENDING);
+    avstor *db = st->db;
+
+    if (ofs != 0) {
+        AvSearchKey sk;
+        int comp;
+        init_search_key(db, key, &sk);
+        cur = lock_unlock_node(db, ofs, NULL, inorder_cache_flags(st));
+        comp = compare_key(db, &sk, cur, (unsigned)(st->top + 2));
+
+        while (1) {
+            if (((is_descending ? -comp : comp) <= 0) && !inorder_state_push(st, ofs)) {
+                // Push node if greater than or equal to name
+                unlock_ptr(db, cur);
+                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_OVERFLOW);
+            }
+            if (comp == 0) {
+                result = ofs;
+                break;  // Node found
+            }
+            ofs = nref_to_ofs((comp < 0) ? cur->left : cur->right);
+            if (ofs == 0) {
+                break;  // Node not found
+            }
+            cur = lock_unlock_node(db, ofs, cur, inorder_cache_flags(st));
+            comp = compare_key(db, &sk, cur, (unsigned)(st->top + 2));
+        }
+        unlock_ptr(db, cur);
     }
     return result;
 }
 
-static __inline AvNode* lock_valueref(const avstor_node *parent, unsigned type)
+static int inorder_next(avstor_inorder *st, avstor_off ofs, avstor_node *out_node)
 {
-    AvNode* result = lock_noderef(parent);
-    if (NODE_TYPE(result) != type) {
-        unlock_ptr(result);
-        THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
+    AvNode *node = NULL;
+    int is_descending = (st->flags & AVSTOR_DESCENDING);
+    while (st->top >= 0 || ofs != 0) {
+        if (ofs != 0) {
+            if (!inorder_state_push(st, ofs)) {
+                unlock_ptr_checked(st->db, node);
+                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_OVERFLOW);
+            }
+            node = lock_unlock_node(st->db, ofs, node, inorder_cache_flags(st));
+            ofs = nref_to_ofs(is_descending ? node->right : node->left);
+        }
+        else {
+            if (inorder_state_isempty(st)) {
+                unlock_ptr_checked(st->db, node);
+                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_UNDERFLOW);
+            }
+            unlock_ptr_checked(st->db, node);
+            avstor_node_set(out_node, inorder_state_top(st), st->db);
+            return AVSTOR_OK;
+        }
     }
-    return result;
+    unlock_ptr_checked(st->db, node);
+    st->top = -1;
+    return AVSTOR_NOTFOUND;
 }
 
-static void rollback(avstor *db)
+int AVCALL avstor_inorder_first(avstor_inorder *st, const avstor_node *parent, const avstor_key *key,
+                                int flags, avstor_node *out_node)
 {
-    unsigned row, col;
-    PageCache *cache = &db->cache;
-    (void)rwl_upgrade_or_lock_exclusive(&db->global_rwl);
+    avstor *db;
+    avstor_node mount_root;
+    const avstor_node *volatile resolved; // volatile because set twice when parent is a mount point
+    AvNode *volatile parent_node = NULL;
+    int result;
+    int isvalue = (flags & AVSTOR_VALUES);
+
+    CHECK_PARAM(st && parent && parent->db && out_node);
+    if ((key && is_invalid_avstor_key(key)) || (isvalue && parent->ref == 0)) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    resolved = resolve_mount(parent, flags, &mount_root);
+    db = resolved->db;
 
-    for (row = 0; row < cache->l2_len; ++row) {
-        CacheRow *line = &cache->rows[row];
-        for (col = 0; col < line->capacity; ++col) {
-            AvPage *page = line->items[col].page;
-            if (page && page->page_offset != 0) {
-                if (is_page_dirty(page)) {
-                    // invalidate modified cache item
-                    //page->page_offset = 0;
-                    line->items[col].offset = 0;
+    st->db = db;
+    st->top = -1;
+    st->flags = flags;
+    rwl_lock_shared(&db->global_rwl);
+    TRY(ex)
+    {
+        avstor_off ofs;
+        if (resolved->ref != 0) {
+            // the parent of a scan is typically a node returned by an enclosing scan
+            parent_node = lock_unlock_node(db, resolved->ref, NULL, inorder_cache_flags(st));
+            if (NODE_TYPE(parent_node) != AVSTOR_TYPE_KEY) {
+                THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
+            }
+        }
+        if (isvalue) {
+            ofs = nref_to_ofs(get_node_data(parent_node)->vkey.value_root);
+        }
+        else {
+            ofs = nref_to_ofs(!parent_node ? db->cache.header->root : get_node_data(parent_node)->vkey.subkey_root);
+        }
+        unlock_ptr_checked(db, parent_node);
+        parent_node = NULL;
+        if (key) {
+            avstor_off fref = find_node_for_inorder(st, key, ofs);
+            if (fref != 0) {
+                avstor_node_set(out_node, fref, db);
+                result = AVSTOR_OK;
+            }
+            else {
+                // if node not found, next highest (or lowest) one is on the top of the stack
+                if (!inorder_state_isempty(st)) {
+                    //don't pop yet, right (or left) subtree needs to be traversed.
+                    avstor_node_set(out_node, inorder_state_top(st), db);
+                    result = AVSTOR_OK;
+                }
+                else {
+                    result = AVSTOR_NOTFOUND;
                 }
-                atomic_store_int_release(&page->lock_count, 0);
             }
         }
+        else {
+            result = inorder_next(st, ofs, out_node);
+        }
+    }
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(db, parent_node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
+}
+
+int AVCALL avstor_inorder_next(avstor_inorder *st, avstor_node *out_node)
+{
+    AvNode *volatile node = NULL;
+    int result;
+
+    CHECK_PARAM(st && out_node);
+    if (inorder_state_isempty(st)) {
+        avstor_node_set(out_node, 0, st->db);
+        return AVSTOR_NOTFOUND;
+    }
+    rwl_lock_shared(&st->db->global_rwl);
+    TRY(ex)
+    {
+        avstor_off ofs;
+        node = lock_unlock_node(st->db, inorder_state_pop(st), NULL, inorder_cache_flags(st));
+        ofs = nref_to_ofs((st->flags & AVSTOR_DESCENDING) ? node->left : node->right);
+        unlock_ptr(st->db, node);
+        node = NULL;
+        result = inorder_next(st, ofs, out_node);
     }
-
-    // restore unmodified header
-    memcpy(cache->header, cache->old_header, PAGE_SIZE);
+    CATCH_ANY(ex)
+    {
+        unlock_ptr_checked(st->db, node);
+        result = ex.err;
+    }
+    END_TRY(ex);
+    rwl_release(&st->db->global_rwl);
+    return result;
 }
 
-static __inline AvNodeData* get_node_data(AvNode *node)
+// Random numbers of avstor_sample, xorshift64*
+static __inline uint64_t sample_next(uint64_t *state)
 {
-    return (AvNodeData*)PTR(node, SIZE_NODE_HDR + (node)->szname);
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * UINT64_C(0x2545F4914F6CDD1D);
 }
 
-static __inline void avstor_node_set(avstor_node *node, const avstor_off off, avstor *db)
+// Uniform in [0, 1)
+static __inline double sample_uniform(uint64_t *state)
 {
-    node->db = db;
-    node->ref = off;
+    return (double)(sample_next(state) >> 11) * (1.0 / 9007199254740992.0);
 }
 
-int AVCALL avstor_node_init(avstor *db, avstor_node *node)
-{
-    CHECK_PARAM(db && node);
-    node->db = db;
-    node->ref = 0;
-    return AVSTOR_OK;
-}
+/*
+* Picks a node of a tree of the given height by descending from its root at random. Nodes have no
+* subtree sizes, so every subtree of height h is weighted by the capacity 2^h - 1 of a complete tree
+* of that height, the heights of children being known from the balance factors. The probability
+* of a node is then that of a complete tree scaled by the ratios of actual to complete capacity on
+* its path, which is undone by accepting it with the product of those ratios. Sets *accepted if
+* the node is accepted, the nodes accepted are uniformly distributed.
+*/
+static avstor_off sample_descend(avstor *db, avstor_off ofs, unsigned height, const double *capacity,
+                                 uint64_t *rng, int *accepted)
+{
+    double accept = 1.0;
+    unsigned h = height;
+    while (1) {
+        AvNode *node;
+        avstor_off left, right;
+        unsigned hl, hr;
+        double total, u;
+        int bf;
+        if (ofs == 0) {
+            THROW(AVSTOR_CORRUPT, "Invalid balance factor");
+        }
+        node = lock_node(db, ofs);
+        bf = BF(node);
+        left = nref_to_ofs(node->left);
+        right = nref_to_ofs(node->right);
+        unlock_ptr(db, node);
+        if (h < (bf != 0 ? 2u : 1u)) {
+            THROW(AVSTOR_CORRUPT, "Invalid balance factor");
+        }
+        hl = bf > 0 ? h - 2 : h - 1;
+        hr = bf < 0 ? h - 2 : h - 1;
+        total = 1.0 + capacity[hl] + capacity[hr];
 
-void AVCALL avstor_node_destroy(avstor_node *node)
-{
-    CHECK_PARAM(node);
-    node->db = NULL;
-    node->ref = 0;
+        if (h != height) {
+            accept *= total / capacity[h];
+        }
+        u = sample_uniform(rng) * total;
+        if (u < 1.0) {
+            break;
+        }
+        if (u < 1.0 + capacity[hl]) {
+            ofs = left;
+            h = hl;
+        }
+        else {
+            ofs = right;
+            h = hr;
+        }
+    }
+    *accepted = sample_uniform(rng) < accept;
+    return ofs;
 }
 
-int AVCALL avstor_create_key(const avstor_node *parent, const avstor_key *key, avstor_node *out_key)
+/*
+* Picks n children of parent (keys, or values with AVSTOR_VALUES) at random, with replacement,
+* and stores them in out_nodes. Each pick is a random descent of O(log size) nodes, see
+* sample_descend. A descent that is not accepted is repeated up to SAMPLE_ATTEMPTS times, then the
+* last node is taken, which keeps the cost bounded on trees far from complete at the price of a
+* slight bias. The same rng_seed gives the same picks on the same tree. Returns AVSTOR_NOTFOUND
+* if parent has no children of the kind asked for.
+*/
+int AVCALL avstor_sample(const avstor_node *parent, int flags, unsigned n, avstor_node *out_nodes,
+                         uint64_t rng_seed)
 {
     avstor *db;
-    // volatile because modified in TRY and referenced in CATCH
-    AvNode *volatile node = NULL, *volatile parent_node = NULL;
-    NodeRef *volatile last_ref = NULL;
+    avstor_node mount_root;
+    const avstor_node *volatile resolved; // volatile because set twice when parent is a mount point
+    AvNode *volatile parent_node = NULL;
     int result;
-    unsigned level;
+    int isvalue = (flags & AVSTOR_VALUES);
 
-    CHECK_PARAM(parent && parent->db && key);
-    if (is_invalid_avstor_key(key)) {
+    CHECK_PARAM(parent && parent->db && (out_nodes || n == 0));
+    if (isvalue && parent->ref == 0) {
         RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-    db = parent->db;
-    rwl_lock_exclusive(&db->global_rwl);
+    resolved = resolve_mount(parent, flags, &mount_root);
+    db = resolved->db;
+    rwl_lock_shared(&db->global_rwl);
     TRY(ex)
     {
-        AvStack st;
-        NodeRef *rootref;
-        AvNodeData *ndata;
-        if (parent->ref != 0) {
-            AvNodeData *pdata;
-            parent_node = lock_keyref(parent);
-            pdata = get_node_data(parent_node);
-            level = pdata->vkey.level + 1;
-            rootref = &pdata->vkey.subkey_root;
+        double capacity[AVSTOR_AVL_HEIGHT + 1];
+        uint64_t rng = rng_seed ? rng_seed : UINT64_C(0x9E3779B97F4A7C15);
+        avstor_off root, ofs;
+        unsigned i, height = 0;
+
+        if (resolved->ref != 0) {
+            parent_node = lock_keyref(resolved);
+        }
+        if (isvalue) {
+            root = nref_to_ofs(get_node_data(parent_node)->vkey.value_root);
         }
         else {
-            level = 1; // level 0 is reserved
-            rootref = &db->cache.header->root;
+            root = nref_to_ofs(!parent_node ? db->cache.header->root : get_node_data(parent_node)->vkey.subkey_root);
         }
+        unlock_ptr_checked(db, parent_node);
+        parent_node = NULL;
 
-        if ((node = find_node_with_backtrace(db, key, &st, rootref, &last_ref))) {
-            if (out_key) {
-                avstor_node_set(out_key, get_ofs(node), db);
+        // height of the tree, along the taller child
+        for (ofs = root; ofs != 0; ++height) {
+            AvNode *node = lock_node(db, ofs);
+            if (height >= AVSTOR_AVL_HEIGHT) {
+                unlock_ptr(db, node);
+                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_OVERFLOW);
             }
-            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+            ofs = nref_to_ofs(BF(node) > 0 ? node->right : node->left);
+            unlock_ptr(db, node);
+        }
+        capacity[0] = 0.0;
+        for (i = 1; i <= height; ++i) {
+            capacity[i] = 2.0 * capacity[i - 1] + 1.0;
         }
-        node = create_node(db, get_ptr_page(last_ref), key, 0, AVSTOR_TYPE_KEY, level);
-        ndata = get_node_data(node);
-        ndata->vkey.value_root = NODEREF_NULL;
-        ndata->vkey.subkey_root = NODEREF_NULL;
-        ndata->vkey.level = (uint16_t)level;
 
-        insert_node(db, node, &st);
-        if (out_key) {
-            avstor_node_set(out_key, get_ofs(node), db);
+        for (i = 0; i < n && root != 0; ++i) {
+            unsigned attempt;
+            int accepted = 0;
+            for (attempt = 0; attempt < SAMPLE_ATTEMPTS && !accepted; ++attempt) {
+                ofs = sample_descend(db, root, height, capacity, &rng, &accepted);
+            }
+            avstor_node_set(&out_nodes[i], ofs, db);
         }
-        unlock_ptr(node);
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(parent_node);
-        result = AVSTOR_OK;
+        result = root != 0 ? AVSTOR_OK : AVSTOR_NOTFOUND;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(node);
-        unlock_ptr_checked(parent_node);
-        rollback(db);
+        unlock_ptr_checked(db, parent_node);
         result = ex.err;
     }
     END_TRY(ex);
@@ -2651,53 +7748,47 @@ int AVCALL avstor_create_key(const avstor_node *parent, const avstor_key *key, a
     return result;
 }
 
-static int create_var_value(const avstor_node *parent, const avstor_key *key,
-                            const void *value, unsigned valuesz, unsigned type, avstor_node *out_value)
+/*
+* Mounts the root of another open file at key, which must not have subkeys. Subkey lookups,
+* creation, deletion and traversal below key are redirected to src until unmounted, and the
+* returned node handles refer to src. Values of key itself stay in the parent file. Each file
+* is committed separately, and src must stay open while mounted.
+*/
+int AVCALL avstor_mount(const avstor_node *key, avstor *src)
 {
     avstor *db;
-    AvNode *volatile node = NULL, *volatile parent_node = NULL;
-    NodeRef *volatile last_ref = NULL;
+    AvNode *volatile node = NULL;
     int result;
 
-    CHECK_PARAM(parent && parent->db && key && value);
-    if (is_invalid_avstor_key(key)) {
+    CHECK_PARAM(key && key->db && src);
+    if (key->ref == 0 || key->db == src) {
         RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-    db = parent->db;
+    db = key->db;
     rwl_lock_exclusive(&db->global_rwl);
     TRY(ex)
     {
-        AvStack st;
-        AvNodeData *ndata;
-        AvNode *fnode;
-        AvNodeData *pdata;
-        parent_node = lock_keyref(parent);
-        pdata = get_node_data(parent_node);
-
-        if ((fnode = find_node_with_backtrace(db, key, &st, &pdata->vkey.value_root, &last_ref))) {
-            unlock_ptr(fnode);
-            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+        AvMount *mounts;
+        node = lock_keyref(key);
+        if (!is_nref_empty(get_node_data(node)->vkey.subkey_root)) {
+            THROW(AVSTOR_INVOPER, "Mount point has subkeys");
         }
-
-        node = create_node(db, get_ptr_page(last_ref), key, valuesz, type, pdata->vkey.level);
-        ndata = get_node_data(node);
-        ndata->vvar.length = (uint8_t)valuesz;
-        memcpy(PTR(ndata, NODE_CLASS[type].szdata), value, valuesz);
-        insert_node(db, node, &st);
-        if (out_value) {
-            avstor_node_set(out_value, get_ofs(node), db);
+        if (find_mount(db, key->ref)) {
+            THROW(AVSTOR_EXISTS, "A file is already mounted at key");
+        }
+        if (!(mounts = realloc(db->mounts, (db->mount_count + 1) * sizeof(*mounts)))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
         }
-        unlock_ptr_checked(last_ref);
-        unlock_ptr(node);
-        unlock_ptr(parent_node);
+        mounts[db->mount_count].key = key->ref;
+        mounts[db->mount_count].db = src;
+        db->mounts = mounts;
+        db->mount_count++;
+        unlock_ptr(db, node);
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(node);
-        unlock_ptr_checked(parent_node);
-        rollback(db);
+        unlock_ptr_checked(db, node);
         result = ex.err;
     }
     END_TRY(ex);
@@ -2705,1139 +7796,2103 @@ static int create_var_value(const avstor_node *parent, const avstor_key *key,
     return result;
 }
 
-int AVCALL avstor_create_string(const avstor_node *parent, const avstor_key *key,
-                                const char *value, avstor_node *out_value)
+int AVCALL avstor_unmount(const avstor_node *key)
 {
-    size_t len;
-    CHECK_PARAM(value);
-    len = strlen_l(value, MAX_STRING_LEN + 1) + 1;
-    if (len == (MAX_STRING_LEN + 1)) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    avstor *db;
+    AvMount *mount;
+    int result = AVSTOR_NOTFOUND;
+
+    CHECK_PARAM(key && key->db);
+    db = key->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    if ((mount = find_mount(db, key->ref))) {
+        *mount = db->mounts[--db->mount_count];
+        result = AVSTOR_OK;
     }
-    return create_var_value(parent, key, value, (unsigned)len, AVSTOR_TYPE_STRING, out_value);
+    rwl_release(&db->global_rwl);
+    return result;
 }
 
-int AVCALL avstor_create_binary(const avstor_node *parent, const avstor_key *key,
-                                const void *value, size_t szvalue, avstor_node *out_value)
+static __inline void relocate_nref(NodeRef *ref, avstor_off delta)
 {
-    if (szvalue > MAX_BINARY_LEN) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    if (!is_nref_empty(*ref)) {
+        *ref = ofs_to_nref(nref_to_ofs(*ref) + delta);
     }
-    return create_var_value(parent, key, value, (unsigned)szvalue, AVSTOR_TYPE_BINARY, out_value);
 }
 
-int AVCALL avstor_create_int32(const avstor_node *parent, const avstor_key *key,
-                               int32_t value, avstor_node *out_value)
+// Moves a page of an imported file to page_ofs, adding delta to every reference and level_delta
+// to the level of keys. Back link index keys (level 0) keep their level. file_flags tells which
+// nodes end with the reference of their key or parent, see AvKeyStats. Rollups are not imported,
+// and the entries of the name dictionary are freed, import_names adds the names that are missing.
+static void relocate_page(AvPage *page, avstor_off page_ofs, avstor_off delta, unsigned level_delta,
+                          uint32_t file_flags)
 {
-    avstor *db;
-    AvNode *volatile node = NULL, *volatile parent_node = NULL;
-    NodeRef *volatile last_ref = NULL;
-    int result;
-
-    CHECK_PARAM(parent && parent->db && key);
-    if (is_invalid_avstor_key(key)) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    unsigned i;
+    if (page->type == PAGE_MERKLE || page->type == PAGE_MERKLE_DIR) {
+        // the checksum tree of the imported file is not carried over, its pages are left empty
+        memset(&page->top, 0, PAGE_SIZE - offsetof(AvPage, top));
+        page->type = PAGE_KEYS;
+        page->page_flags = 0;
+        page->top = PAGE_SIZE;
+        page->index_freelist = INVALID_INDEX;
+    }
+    if (page->type != PAGE_KEYS || page->top > PAGE_SIZE
+        || (void*)&page->nodes[page->index_count] > PTR(page, page->top)) {
+        THROW(AVSTOR_CORRUPT, MSG_PAGE_CORRUPTED);
+    }
+    page->page_offset = page_ofs;
+    page->status = 0;
+    atomic_store_int_release(&page->lock_count, 0);
+    for (i = 0; i < page->index_count; ++i) {
+        AvNode *node;
+        AvNodeData *ndata;
+        // free index slots hold either 0 or the offset of the next free slot, both below top
+        if (page->nodes[i] < page->top) {
+            continue;
+        }
+        node = PTR(page, page->nodes[i]);
+        relocate_nref(&node->left, delta);
+        relocate_nref(&node->right, delta);
+        ndata = get_node_data(node);
+        switch (NODE_TYPE(node)) {
+        case AVSTOR_TYPE_KEY:
+            relocate_nref(&ndata->vkey.subkey_root, delta);
+            relocate_nref(&ndata->vkey.value_root, delta);
+            if (ndata->vkey.level != 0) {
+                ndata->vkey.level = (uint16_t)(ndata->vkey.level + level_delta);
+            }
+            ndata->vkey.flags &= (uint8_t)~KEY_FLAG_ROLLUPS;
+            break;
+        case AVSTOR_TYPE_LONGSTRING:
+        case AVSTOR_TYPE_LONGBINARY:
+            relocate_nref(&ndata->vlongvar.root, delta);
+            break;
+        case AVSTOR_TYPE_LINK:
+            relocate_nref(&ndata->vLink.link, delta);
+            break;
+        case NODE_BLOBREF:
+            relocate_nref(&ndata->vBlobRef.blob, delta);
+            break;
+        case NODE_NAME:
+            // the nodes below it in the page move up and their slots are adjusted
+            free_node(node);
+            continue;
+        case NODE_BLOB:
+        case NODE_ROLLUP:
+        case AVSTOR_TYPE_INT32:
+        case AVSTOR_TYPE_INT64:
+        case AVSTOR_TYPE_DOUBLE:
+        case AVSTOR_TYPE_STRING:
+        case AVSTOR_TYPE_BINARY:
+            break;
+        default:
+            THROW(AVSTOR_CORRUPT, "Invalid node type");
+        }
+        if (NODE_TYPE(node) == AVSTOR_TYPE_KEY ? (file_flags & AVSTOR_FILE_PARENTS)
+            : (file_flags & (AVSTOR_FILE_KEYSTATS | AVSTOR_FILE_PARENTS))) {
+            relocate_nref(get_node_owner(node), delta);
+        }
     }
-    db = parent->db;
-    rwl_lock_exclusive(&db->global_rwl);
-    TRY(ex)
-    {
-        AvStack st;
-        AvNode *fnode;
-        AvNodeData *pdata;
-        parent_node = lock_keyref(parent);
-        pdata = get_node_data(parent_node);
+    update_page_checksum(page);
+}
 
-        if ((fnode = find_node_with_backtrace(db, key, &st, &pdata->vkey.value_root , &last_ref))) {
-            unlock_ptr(fnode);
-            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+// Recreates the back links of an imported file by walking its back link index. The keys of the
+// index are link targets, their values the links. target is 0 while walking the keys.
+static void import_backlinks(avstor *db, avstor *src, avstor_off ofs, avstor_off target, avstor_off delta)
+{
+    while (ofs != 0) {
+        AvStack st;
+        AvNode *node = lock_node(src, ofs);
+        avstor_off left = nref_to_ofs(node->left);
+        avstor_off right = nref_to_ofs(node->right);
+        avstor_off values = 0;
+        avstor_off name;
+        memcpy(&name, node->name, sizeof(name));
+        if (target == 0) {
+            values = nref_to_ofs(get_node_data(node)->vkey.value_root);
         }
+        unlock_ptr(src, node);
 
-        node = create_node(db, get_ptr_page(last_ref), key, 0, AVSTOR_TYPE_INT32, pdata->vkey.level);
-        get_node_data(node)->v32.value = value;
-        insert_node(db, node, &st);
-        if (out_value) {
-            avstor_node_set(out_value, get_ofs(node), db);
+        import_backlinks(db, src, left, target, delta);
+        if (target == 0) {
+            import_backlinks(db, src, values, name, delta);
         }
-        unlock_ptr_checked(last_ref);
-        unlock_ptr(node);
-        unlock_ptr(parent_node);
-        result = AVSTOR_OK;
+        else {
+            create_backlink(db, &st, name + delta, target + delta);
+        }
+        ofs = right;
     }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(node);
-        unlock_ptr_checked(parent_node);
-        rollback(db);
-        result = ex.err;
+}
+
+// Adds the blobs of an imported file to the blob tree. A blob whose hash is already in the tree
+// stays outside of it, still shared by the imported values referencing it.
+static void import_blobs(avstor *db, avstor *src, avstor_off root, avstor_off delta)
+{
+    // volatile because advanced after each TRY in the loop
+    volatile avstor_off ofs = root;
+
+    while (ofs != 0) {
+        AvStack st;
+        AvNode *found;
+        AvNode *volatile blob = NULL;
+        NodeRef *volatile last_ref = NULL;
+        AvNode *node = lock_node(src, ofs);
+        avstor_off left = nref_to_ofs(node->left);
+        avstor_off right = nref_to_ofs(node->right);
+        uint32_t hash[2];
+        avstor_key key;
+        memcpy(hash, node->name, BLOB_HASH_LEN);
+        unlock_ptr(src, node);
+
+        import_blobs(db, src, left, delta);
+        key.buf = hash;
+        key.len = BLOB_HASH_LEN;
+        key.comparer = &blob_comparer;
+        if ((found = find_node_with_backtrace(db, &key, &st, &db->cache.header->root_blobs, &last_ref))) {
+            unlock_ptr(db, found);
+        }
+        else {
+            TRY(ex)
+            {
+                blob = lock_node(db, ofs + delta);
+                assign_nref(NODEREF_NULL, &blob->left);
+                assign_nref(NODEREF_NULL, &blob->right);
+                insert_node(db, blob, &st);
+            }
+            FINALLY(ex)
+            {
+                unlock_ptr_checked(db, blob);
+                unlock_ptr_checked(db, last_ref);
+            }
+            END_TRY(ex);
+        }
+        ofs = right;
     }
-    END_TRY(ex);
-    rwl_release(&db->global_rwl);
-    return result;
 }
 
-static int create_fixed64_value(const avstor_node *parent, const avstor_key *key,
-                                int64_t value, unsigned type, avstor_node *out_value)
+// Appends the data pages of src to the end of the file, relocated, and returns the new location
+// of its root. Pages are copied in blocks, bypassing the cache.
+static NodeRef import_pages(avstor *db, avstor *src, unsigned level_delta)
 {
-    avstor *db;
-    AvNode *volatile node = NULL, *volatile parent_node = NULL;
-    NodeRef *volatile last_ref = NULL;
-    int result;
+    AvPage *volatile buf = NULL;
+    AvPage *hdr = db->cache.header;
+    AvPageNum src_count = get_pagecount(src->cache.header);
+    AvPageNum batch = PAGES_PER_BLOCK;
+    AvPageNum page_num;
+    avstor_off delta;
+    NodeRef result;
 
-    CHECK_PARAM(parent && parent->db && key);
-    if (is_invalid_avstor_key(key)) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    if (src_count < 1 || (MAX_FILE_PAGES - get_pagecount(hdr)) < src_count - 1) {
+        THROW(AVSTOR_INVOPER, "Maximum allowable file size exceeded");
     }
-    db = parent->db;
-    rwl_lock_exclusive(&db->global_rwl);
+    delta = (get_pagecount(hdr) - 1) * PAGE_SIZE;
+
     TRY(ex)
     {
-        AvStack st;
-        AvNode *fnode;
-        AvNodeData *pdata;
-        parent_node = lock_keyref(parent);
-        pdata = get_node_data(parent_node);
-        if ((fnode = find_node_with_backtrace(db, key, &st, &pdata->vkey.value_root , &last_ref))) {
-            unlock_ptr(fnode);
-            THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
+        if (!(buf = avs_aligned_malloc(batch * PAGE_SIZE, PAGE_SIZE))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
         }
-        node = create_node(db, get_ptr_page(last_ref), key, 0, type, pdata->vkey.level);
-        memcpy(&get_node_data(node)->v64.value, &value, sizeof(int64_t));
-        insert_node(db, node, &st);
-        if (out_value) {
-            avstor_node_set(out_value, get_ofs(node), db);
+        if (db->merkle && !merkle_resize(db->merkle, get_pagecount(hdr) + src_count - 1)) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
         }
-        unlock_ptr_checked(last_ref);
-        unlock_ptr(node);
-        unlock_ptr(parent_node);
-        result = AVSTOR_OK;
+        for (page_num = 1; page_num < src_count; page_num += batch) {
+            unsigned i, count = (unsigned)(src_count - page_num < batch ? src_count - page_num : batch);
+            unsigned bytes = count * PAGE_SIZE;
+            avstor_off src_ofs = page_num * PAGE_SIZE;
+
+            if (io_read(src, src->file, buf, src_ofs, bytes) != (int)bytes) {
+                THROW(AVSTOR_IOERR, "Failed to read imported file");
+            }
+            for (i = 0; i < count; ++i) {
+                AvPage *page = PTR(buf, i * PAGE_SIZE);
+                if (!is_page_checksum_valid(page)) {
+                    THROW(AVSTOR_CORRUPT, "page checksum error.");
+                }
+                relocate_page(page, src_ofs + delta + i * PAGE_SIZE, delta, level_delta, hdr->flags);
+                cache_invalidate(db, src_ofs + delta + i * PAGE_SIZE);
+            }
+            if (io_write(db, db->file, buf, src_ofs + delta, bytes) != (int)bytes) {
+                THROW(AVSTOR_IOERR, "io_write() failed.");
+            }
+            for (i = 0; db->merkle && i < count; ++i) {
+                merkle_set_leaf(db->merkle, (src_ofs + delta) / PAGE_SIZE + i, ((AvPage*)PTR(buf, i * PAGE_SIZE))->checksum);
+            }
+        }
+        set_pagecount(hdr, get_pagecount(hdr) + src_count - 1);
+        set_page_dirty(hdr);
+
+        import_backlinks(db, src, nref_to_ofs(src->cache.header->root_links), 0, delta);
+        import_blobs(db, src, nref_to_ofs(src->cache.header->root_blobs), delta);
+        result = src->cache.header->root;
+        relocate_nref(&result, delta);
     }
-    CATCH_ANY(ex)
+    FINALLY(ex)
     {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(node);
-        unlock_ptr_checked(parent_node);
-        rollback(db);
-        result = ex.err;
+        if (buf) {
+            avs_aligned_free(buf);
+        }
     }
     END_TRY(ex);
-    rwl_release(&db->global_rwl);
     return result;
 }
 
-int AVCALL avstor_create_int64(const avstor_node *parent, const avstor_key *key,
-                               int64_t value, avstor_node *out_value)
-{
-    return create_fixed64_value(parent, key, value, AVSTOR_TYPE_INT64, out_value);
-}
-
-int AVCALL avstor_create_double(const avstor_node *parent, const avstor_key *key,
-                                double value, avstor_node *out_value)
+// Sets the parent of the imported keys directly below the import point, which are under the root
+// in the imported file
+static void set_tree_parent(avstor *db, avstor_off ofs, avstor_off parent)
 {
-    AvValue64 v;
-    v.as_dbl = value;
-    return create_fixed64_value(parent, key, v.as_int64, AVSTOR_TYPE_DOUBLE, out_value);
+    while (ofs != 0) {
+        AvNode *node = lock_node(db, ofs);
+        avstor_off left = nref_to_ofs(node->left);
+        *get_node_owner(node) = ofs_to_nref(parent);
+        ofs = nref_to_ofs(node->right);
+        set_ptr_dirty(node);
+        unlock_ptr(db, node);
+        set_tree_parent(db, left, parent);
+    }
 }
 
-static void create_backlink(avstor *db, AvStack *st, avstor_off link, avstor_off target)
+// Imported nodes keep the name ids of the source file, so the dictionary of one file must start
+// with that of the other. Names only the source file has are added.
+static void import_names(avstor *db, avstor *src)
 {
-    NodeRef *volatile last_ref = NULL;
-    AvNode *volatile node = NULL, *volatile link_node = NULL;
-    avstor_key link_key;
-    link_key.buf = &target;
-    link_key.len = sizeof(avstor_off);
-    link_key.comparer = &offset_comparer;
-
-    TRY(ex)
-    {
-        AvNodeData *ndata;
-        if (!(node = find_node_with_backtrace(db, &link_key, st, &db->cache.header->root_links, &last_ref))) {
-            node = create_node(db, get_ptr_page(last_ref), &link_key, 0, AVSTOR_TYPE_KEY, 0);
-            ndata = get_node_data(node);
-            ndata->vkey.level = 0;
-            ndata->vkey.subkey_root = NODEREF_NULL;
-            ndata->vkey.value_root = NODEREF_NULL;
-            insert_node(db, node, st);
-        }
-        else {
-            ndata = get_node_data(node);
-        }
-        unlock_ptr_checked(last_ref);
-        last_ref = NULL;
-
-        link_key.buf = &link;
-        if ((link_node = find_node_with_backtrace(db, &link_key, st, &ndata->vkey.value_root, &last_ref))) {
-            THROW(AVSTOR_INTERNAL, "Back link reference already exists");
+    unsigned i;
+    for (i = 0; i < src->name_count && i < db->name_count; ++i) {
+        if (src->names[i].len != db->names[i].len
+            || memcmp(src->names[i].buf, db->names[i].buf, db->names[i].len) != 0) {
+            THROW(AVSTOR_MISMATCH, "Imported file has a different name dictionary");
         }
-        link_node = create_node(db, get_ptr_page(last_ref), &link_key, 0, AVSTOR_TYPE_LINK, 0);
-        get_node_data(link_node)->vLink.link = ofs_to_nref(link);
-        insert_node(db, link_node, st);
     }
-    FINALLY(ex)
-    {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(link_node);
-        unlock_ptr_checked(node);
+    for (; i < src->name_count; ++i) {
+        (void)intern_name(db, src->names[i].buf, src->names[i].len);
     }
-    END_TRY(ex);
 }
 
-int AVCALL avstor_create_link(const avstor_node *parent, const avstor_key *key,
-                              const avstor_node *target, avstor_node *out_value)
+/*
+* Creates key under parent and imports the whole hierarchy of the file src_path below it. The data
+* pages of the file are appended in bulk and their references are relocated, so the cost depends
+* on the size of the file, not on the number of nodes. The source file must have been created with
+* the same configuration (32 or 64-bit). Its back link index is rebuilt in the destination file;
+* the old index pages remain as unused space. Its name dictionary must match the start of the
+* destination's, or the other way around, see avstor_intern.
+*/
+int AVCALL avstor_import_file(const avstor_node *parent, const avstor_key *key, const char *src_path)
 {
-    avstor *db;
+    avstor *db, *src;
+    avstor_node mount_root;
+    const avstor_node *volatile resolved; // volatile because set twice when parent is a mount point
     AvNode *volatile node = NULL, *volatile parent_node = NULL;
     NodeRef *volatile last_ref = NULL;
     int result;
+    unsigned level;
 
-    CHECK_PARAM(parent && parent->db && key && target && (parent->db == target->db));
-    if (is_invalid_avstor_key(key) || (target->ref == 0)) {
+    CHECK_PARAM(parent && parent->db && key && src_path);
+    if (is_invalid_avstor_key(key)) {
         RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-    db = parent->db;
+    resolved = resolve_mount(parent, AVSTOR_KEYS, &mount_root);
+    db = resolved->db;
+    if (AVSTOR_OK != (result = avstor_open(&src, src_path, 64, AVSTOR_OPEN_READONLY))) {
+        return result;
+    }
     rwl_lock_exclusive(&db->global_rwl);
     TRY(ex)
     {
         AvStack st;
-        AvNode *fnode;
-        AvNodeData *pdata;
-        avstor_off ofs;
+        NodeRef *rootref;
+        AvNodeData *ndata;
+        NodeRef root;
+        uint32_t file_flags = AVSTOR_FILE_64BIT | AVSTOR_FILE_BIGENDIAN | AVSTOR_FILE_KEYSTATS
+                              | AVSTOR_FILE_PARENTS;
 
-        parent_node = lock_keyref(parent);
-        pdata = get_node_data(parent_node);
-        if ((fnode = find_node_with_backtrace(db, key, &st, &pdata->vkey.value_root , &last_ref))) {
-            unlock_ptr(fnode);
+        if ((src->cache.header->flags & file_flags) != (db->cache.header->flags & file_flags)) {
+            THROW(AVSTOR_MISMATCH, "Imported file has a different format");
+        }
+        import_names(db, src);
+        if (resolved->ref != 0) {
+            AvNodeData *pdata;
+            parent_node = lock_keyref(resolved);
+            pdata = get_node_data(parent_node);
+            level = pdata->vkey.level + 1;
+            rootref = &pdata->vkey.subkey_root;
+        }
+        else {
+            level = 1;
+            rootref = &db->cache.header->root;
+        }
+
+        if ((node = find_node_with_backtrace(db, key, &st, rootref, &last_ref))) {
             THROW(AVSTOR_EXISTS, MSG_NODE_EXISTS);
         }
-        node = create_node(db, get_ptr_page(last_ref), key, 0, AVSTOR_TYPE_LINK, pdata->vkey.level);
-        get_node_data(node)->vLink.link = ofs_to_nref(target->ref);
+        node = create_node(db, get_ptr_page(last_ref), key, 0, AVSTOR_TYPE_KEY, level);
+        ndata = get_node_data(node);
+        ndata->vkey.value_root = NODEREF_NULL;
+        ndata->vkey.subkey_root = NODEREF_NULL;
+        ndata->vkey.level = (uint16_t)level;
+        ndata->vkey.flags = 0;
+        ndata->vkey.pad = 0;
+        if (db->cache.header->flags & AVSTOR_FILE_PARENTS) {
+            *get_node_owner(node) = ofs_to_nref(resolved->ref);
+        }
         insert_node(db, node, &st);
-        ofs = get_ofs(node);
-        unlock_ptr_checked(last_ref);
-        unlock_ptr(node);
-        last_ref = NULL; node = NULL;
-
-        create_backlink(db, &st, ofs, target->ref);
+        key_stats_add(db, parent_node, 1, 0, 0);
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, parent_node);
+        last_ref = NULL;
+        parent_node = NULL;
 
-        if (out_value) {
-            avstor_node_set(out_value, ofs, db);
+        root = import_pages(db, src, level);
+        assign_nref(root, &get_node_data(node)->vkey.subkey_root);
+        key_stats_add(db, node, (int)src->cache.header->root_subkeys, 0, 0);
+        if (db->cache.header->flags & AVSTOR_FILE_PARENTS) {
+            set_tree_parent(db, nref_to_ofs(root), get_ofs(node));
         }
-        unlock_ptr(parent_node);
+        unlock_ptr(db, node);
+        node = NULL;
+        rollup_refresh(db, resolved->ref);
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(node);
-        unlock_ptr_checked(parent_node);
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+        unlock_ptr_checked(db, parent_node);
         rollback(db);
         result = ex.err;
     }
     END_TRY(ex);
     rwl_release(&db->global_rwl);
+    avstor_close(src);
     return result;
 }
 
-int AVCALL avstor_get_int32(const avstor_node *value, int32_t *out_val)
+// Returns nonzero if a page read from the file is a punched out hole, which reads as zeros
+static int is_page_hole(const AvPage *page)
 {
-    AvNode *volatile node = NULL;
-    int result;
+    const uint32_t *words = (const uint32_t*)page;
+    unsigned i;
+    for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); ++i) {
+        if (words[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Loads the locations of pages in a tier file. The file is a log of page copies, so later copies
+// of a page override earlier ones. Pages are read from the tier file only where the file has a
+// hole, since a page written again after it was moved is more recent in the file.
+static void tier_load(avstor *db, AvTier *tier)
+{
+    AvPage *volatile buf = NULL;
+    uint32_t batch = PAGES_PER_BLOCK;
 
-    CHECK_PARAM(value && value->db && out_val);
-    rwl_lock_shared(&value->db->global_rwl);
     TRY(ex)
     {
-        node = lock_valueref(value, AVSTOR_TYPE_INT32);
-
-        *out_val = get_node_data(node)->v32.value;
-        unlock_ptr(node);
-        result = AVSTOR_OK;
+        int numread;
+        unsigned i;
+        if (!(buf = avs_aligned_malloc(batch * PAGE_SIZE, PAGE_SIZE))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        do {
+            uint32_t count;
+            numread = io_read(db, tier->file, buf, (avstor_off)tier->slot_count * PAGE_SIZE, batch * PAGE_SIZE);
+            if (numread < 0) {
+                THROW(AVSTOR_IOERR, "Failed to read tier file");
+            }
+            count = (uint32_t)numread / PAGE_SIZE;
+            for (i = 0; i < count; ++i) {
+                AvPage *page = PTR(buf, i * PAGE_SIZE);
+                if (page->type == PAGE_KEYS && page->page_offset != 0 && (page->page_offset % PAGE_SIZE) == 0
+                    && is_page_checksum_valid(page)
+                    && !pagemap_put(&tier->map, page->page_offset / PAGE_SIZE, tier->slot_count + i)) {
+                    THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+                }
+            }
+            tier->slot_count += count;
+        } while ((unsigned)numread == batch * PAGE_SIZE);
+        if (tier->slot_count >= TIER_SLOT_HOLE) {
+            THROW(AVSTOR_CORRUPT, "Tier file is too large");
+        }
+        for (i = 0; tier->map.items && i <= tier->map.mask; ++i) {
+            AvPageMapItem *slot = &tier->map.items[i];
+            if (slot->page != 0) {
+                numread = io_read(db, db->file, buf, slot->page * PAGE_SIZE, PAGE_SIZE);
+                if (numread < 0) {
+                    THROW(AVSTOR_IOERR, "io_read() failed.");
+                }
+                slot->value = numread == PAGE_SIZE && is_page_hole(buf) ? slot->value | TIER_SLOT_HOLE : TIER_SLOT_NONE;
+            }
+        }
     }
-    CATCH_ANY(ex)
+    FINALLY(ex)
     {
-        unlock_ptr_checked(node);
-        result = ex.err;
+        if (buf) {
+            avs_aligned_free(buf);
+        }
     }
     END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
-    return result;
 }
 
-static int get_fixed64_value(const avstor_node *value, unsigned type, int64_t *out_val)
+/*
+* Attaches a secondary file for cold pages, creating it if it doesn't exist. Pages moved there by
+* avstor_tier_migrate are read from it transparently, so it must be attached whenever the file is
+* opened after a migration.
+*/
+int AVCALL avstor_tier_open(avstor *db, const char *filename)
 {
-    AvNode *volatile node = NULL;
+    AvTier *volatile tier = NULL;
     int result;
 
-    CHECK_PARAM(value && value->db && out_val);
-    rwl_lock_shared(&value->db->global_rwl);
+    CHECK_PARAM(db && filename);
+    rwl_lock_exclusive(&db->global_rwl);
     TRY(ex)
     {
-        node = lock_valueref(value, type);
-
-        memcpy(out_val, &get_node_data(node)->v64.value, sizeof(int64_t));
-        unlock_ptr(node);
+        if (db->tier) {
+            THROW(AVSTOR_INVOPER, "Tier file is already open");
+        }
+        if (db->oflags & AVSTOR_OPEN_MMAP) {
+            THROW(AVSTOR_INVOPER, "Tier file cannot be used with a mapped file");
+        }
+        if (!(tier = calloc(1, sizeof(AvTier)))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        tier->base_time = time(NULL);
+        tier->file = io_open(filename, db->oflags);
+        if (tier->file == AVSTOR_INVALID_HANDLE && !(db->oflags & AVSTOR_OPEN_READONLY)) {
+            tier->file = io_create(filename, db->oflags);
+        }
+        if (tier->file == AVSTOR_INVALID_HANDLE) {
+            THROW(AVSTOR_IOERR, "Failed to open tier file");
+        }
+        tier_load(db, tier);
+        db->tier = tier;
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(node);
+        if (tier) {
+            tier_destroy(tier);
+        }
         result = ex.err;
     }
     END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
+    rwl_release(&db->global_rwl);
     return result;
 }
 
-int AVCALL avstor_get_int64(const avstor_node *value, int64_t *out_val)
+#if defined(IO_PUNCH_HOLE)
+static int cache_is_dirty(avstor *db, avstor_off page_ofs)
 {
-    return get_fixed64_value(value, AVSTOR_TYPE_INT64, out_val);
+    CacheItem *item;
+    int result;
+    avmtx_lock(&db->cache.lock);
+    item = cache_find(&db->cache, page_ofs);
+    result = item && is_page_dirty(item->page);
+    avmtx_unlock(&db->cache.lock);
+    return result;
 }
 
-int AVCALL avstor_get_double(const avstor_node *value, double *out_val)
+static __inline int tier_is_cold(AvTier *tier, uint32_t extent, uint32_t now, unsigned idle_seconds)
 {
-    return get_fixed64_value(value, AVSTOR_TYPE_DOUBLE, &((AvValue64*)out_val)->as_int64);
+    uint32_t access = (uint32_t)atomic_load_int_acquire(&tier->access_time[extent]);
+    return now - (access ? access : 1) >= idle_seconds;
 }
 
-static int get_var_value(const avstor_node* value, void* buf,
-                         size_t szbuf, unsigned type, size_t *out_bytes, uint32_t *out_length)
+// Marks the pages of a run punched out of the file as read from the tier file
+static void tier_set_holes(AvTier *tier, AvPageNum run_start, AvPageNum run_len)
 {
-    AvNode *volatile node = NULL;
-    int result;
+    AvPageNum page_num;
+    for (page_num = run_start; page_num < run_start + run_len; ++page_num) {
+        pagemap_find(&tier->map, page_num)->value |= TIER_SLOT_HOLE;
+    }
+}
+
+// Copies the pages of cold extents to the tier file, then punches holes for them in the primary
+// file once the tier file is flushed. Returns the number of pages moved. The global lock must be
+// held exclusively. If throttled, it is released between extents to wait for the I/O budget of
+// the maintenance scheduler. A throttled migration of a file being closed stops copying, moves the
+// pages copied so far and throws AVSTOR_ABORT.
+static uint32_t tier_migrate(avstor *db, unsigned idle_seconds, int throttled)
+{
+    AvTier *tier = db->tier;
+    AvPage *volatile page = NULL;
+    // volatile because modified in TRY and referenced after it
+    volatile int cancelled = 0;
+    AvPageNum pagecount = get_pagecount(db->cache.header);
+    uint32_t first_slot = tier->slot_count;
+    uint32_t now = tier_now(tier);
+    uint32_t extent_count = (uint32_t)((pagecount + TIER_EXTENT_PAGES - 1) / TIER_EXTENT_PAGES);
+    uint32_t extent;
+    AvPageNum page_num, run_start, run_len;
+
+    // start tracking extents created since the last migration
+    if (extent_count > tier->extent_count) {
+        void *access_time = realloc((void*)tier->access_time, extent_count * sizeof(*tier->access_time));
+        if (!access_time) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        tier->access_time = access_time;
+        while (tier->extent_count < extent_count) {
+            atomic_store_int_release(&tier->access_time[tier->extent_count++], (int)now);
+        }
+    }
 
-    CHECK_PARAM(value && value->db && buf && out_bytes && out_length);
-    rwl_lock_shared(&value->db->global_rwl);
     TRY(ex)
     {
-        const AvNodeData *ndata;
-        size_t bytes_copied;
-        node = lock_valueref(value, type);
-        ndata = get_node_data(node);
-        bytes_copied = ndata->vvar.length > szbuf ? szbuf : (size_t)ndata->vvar.length;
-        *out_length = ndata->vvar.length;
-        *out_bytes = bytes_copied;
-        memcpy(buf, CONST_PTR(ndata, NODE_CLASS[type].szdata), bytes_copied);
-        unlock_ptr(node);
-        result = AVSTOR_OK;
+        if (!(page = avs_aligned_malloc(PAGE_SIZE, PAGE_SIZE))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        for (extent = 0; extent < extent_count; ++extent) {
+            uint32_t copied = tier->slot_count;
+            AvPageNum end = (AvPageNum)(extent + 1) * TIER_EXTENT_PAGES;
+            if (!tier_is_cold(tier, extent, now, idle_seconds)) {
+                continue;
+            }
+            for (page_num = extent == 0 ? 1 : (AvPageNum)extent * TIER_EXTENT_PAGES; page_num < end && page_num < pagecount; ++page_num) {
+                avstor_off page_ofs = page_num * PAGE_SIZE;
+                if (tier_hole_slot(tier, page_num) != TIER_SLOT_NONE || cache_is_dirty(db, page_ofs)) {
+                    continue;   // already moved, or to be written again
+                }
+                if (tier->slot_count >= TIER_SLOT_HOLE) {
+                    THROW(AVSTOR_INVOPER, "Maximum tier file size exceeded");
+                }
+                if (io_read(db, db->file, page, page_ofs, PAGE_SIZE) != PAGE_SIZE) {
+                    THROW(AVSTOR_IOERR, "io_read() failed.");
+                }
+                if (page->type != PAGE_KEYS) {
+                    continue;   // side pages of the checksum tree, which are not loaded from the tier file
+                }
+                if (!is_page_checksum_valid(page)) {
+                    THROW(AVSTOR_CORRUPT, "page checksum error.");
+                }
+                if (io_write(db, tier->file, page, (avstor_off)tier->slot_count * PAGE_SIZE, PAGE_SIZE) != PAGE_SIZE) {
+                    THROW(AVSTOR_IOERR, "Failed to write tier file");
+                }
+                if (!pagemap_put(&tier->map, page_num, tier->slot_count)) {
+                    THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+                }
+                tier->slot_count++;
+            }
+            copied = tier->slot_count - copied;
+            if (throttled && copied != 0) {
+                rwl_release(&db->global_rwl);
+                cancelled = sched_throttle(db, copied * PAGE_SIZE * 2, copied * 2) != AVSTOR_OK;
+                rwl_lock_exclusive(&db->global_rwl);
+                if (cancelled) {
+                    break;
+                }
+            }
+        }
     }
-    CATCH_ANY(ex)
+    FINALLY(ex)
     {
-        unlock_ptr_checked(node);
-        result = ex.err;
+        if (page) {
+            avs_aligned_free(page);
+        }
     }
     END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
-    return result;
-}
 
-int AVCALL avstor_get_string(const avstor_node* value, char* buf,
-                             size_t szbuf, uint32_t *out_length)
-{
-    size_t out_bytes = 0;
-    int res = get_var_value(value, buf, szbuf, AVSTOR_TYPE_STRING, &out_bytes, out_length);
-    if (res != AVSTOR_OK) {
-        return res;
+    if (tier->slot_count == first_slot) {
+        return 0;
     }
-    if (szbuf > 0) {
-        if (out_bytes == szbuf) {
-            out_bytes = szbuf - 1;
-        }
-        buf[out_bytes] = 0;
+    if (!io_commit(tier->file)) {
+        THROW(AVSTOR_IOERR, "Failed to flush tier file");
     }
-    (*out_length)--;
-    return AVSTOR_OK;
-}
 
-int AVCALL avstor_get_binary(const avstor_node* value, void* buf,
-                             size_t szbuf, size_t *out_bytes, uint32_t *out_length)
-{
-    return get_var_value(value, buf, szbuf, AVSTOR_TYPE_BINARY, out_bytes, out_length);
+    // pages copied in this run are punched out in runs of consecutive pages, unless written again
+    // while the lock was released
+    run_start = run_len = 0;
+    for (page_num = 1; page_num <= pagecount; ++page_num) {
+        AvPageMapItem *slot = page_num < pagecount ? pagemap_find(&tier->map, page_num) : NULL;
+        if (slot && !(slot->value & TIER_SLOT_HOLE) && slot->value >= first_slot) {
+            if (run_len == 0) {
+                run_start = page_num;
+            }
+            run_len++;
+        }
+        else if (run_len != 0) {
+            if (!io_punch_hole(db->file, run_start * PAGE_SIZE, run_len * PAGE_SIZE)) {
+                THROW(AVSTOR_IOERR, "Failed to punch hole in file");
+            }
+            tier_set_holes(tier, run_start, run_len);
+            run_len = 0;
+        }
+    }
+    if (cancelled) {
+        THROW(AVSTOR_ABORT, "Maintenance task cancelled");
+    }
+    return tier->slot_count - first_slot;
 }
 
-int AVCALL avstor_get_link(const avstor_node *value, avstor_node *out_target)
+static int tier_migrate_locked(avstor *db, unsigned idle_seconds, int throttled, uint32_t *out_pages)
 {
-    avstor *db;
-    AvNode *volatile node = NULL;
     int result;
+    // volatile because modified in TRY and referenced after it
+    volatile uint32_t pages = 0;
 
-    CHECK_PARAM(value && value->db && out_target);
-    db = value->db;
-    rwl_lock_shared(&db->global_rwl);
+    if (!db->tier || (db->oflags & AVSTOR_OPEN_READONLY)) {
+        RETURN(AVSTOR_INVOPER, "No tier file open or file is read only");
+    }
+    rwl_lock_exclusive(&db->global_rwl);
     TRY(ex)
     {
-        node = lock_valueref(value, AVSTOR_TYPE_LINK);
-        avstor_node_set(out_target, nref_to_ofs(get_node_data(node)->vLink.link), db);
-        unlock_ptr(node);
+        pages = tier_migrate(db, idle_seconds, throttled);
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(node);
         result = ex.err;
     }
     END_TRY(ex);
     rwl_release(&db->global_rwl);
+    if (out_pages) {
+        *out_pages = pages;
+    }
     return result;
 }
+#endif
+
+/*
+* Moves the pages of extents not accessed for at least idle_seconds from the file to the attached
+* tier file, leaving holes in the file. Extents are TIER_EXTENT_PAGES pages, and access times are
+* only tracked while the file is open; extents created after the previous migration count as
+* accessed at that time. Modified pages are skipped until committed. Only supported on platforms
+* that can deallocate parts of a file.
+*/
+int AVCALL avstor_tier_migrate(avstor *db, unsigned idle_seconds, uint32_t *out_pages)
+{
+#if defined(IO_PUNCH_HOLE)
+    CHECK_PARAM(db);
+    return tier_migrate_locked(db, idle_seconds, 0, out_pages);
+#else
+    (void)db;
+    (void)idle_seconds;
+    (void)out_pages;
+    RETURN(AVSTOR_INVOPER, "Tier migration is not supported on this platform");
+#endif
+}
 
-int AVCALL avstor_get_value(const avstor_node* value, void* buf,
-                            size_t szbuf, unsigned *out_type, size_t *out_bytes, uint32_t *out_length)
+#if defined(IO_PUNCH_HOLE) && defined(AVSTOR_CONFIG_THREAD_SAFE)
+static int tier_migrate_task(avstor *db, unsigned idle_seconds)
 {
-    AvNode *volatile node = NULL;
-    int result;
+    return tier_migrate_locked(db, idle_seconds, 1, NULL);
+}
+#endif
 
-    CHECK_PARAM(value && value->db && buf && out_bytes && out_length);
-    rwl_lock_shared(&value->db->global_rwl);
-    TRY(ex)
-    {
-        unsigned node_type, szdata, data_offset;
-        const AvNodeClass *node_class;
-        const AvNodeData *ndata;
-        size_t bytes_copied = 0;
-        node = lock_noderef(value);
-        node_type = NODE_TYPE(node);
-        if (node_type == AVSTOR_TYPE_KEY) {
-            THROW(AVSTOR_MISMATCH, MSG_TYPE_MISMATCH);
-        }
-        ndata = get_node_data(node);
-        node_class = &NODE_CLASS[node_type];
-        szdata = node_class->szdata;
-        if (node_class->flags & NODE_FLAG_VAR) {
-            // Node with variable sized data
-            data_offset = szdata;
-            bytes_copied = ndata->vvar.length > szbuf ? szbuf : (size_t)ndata->vvar.length;
-            *out_length = ndata->vvar.length;
+// Queues avstor_tier_migrate as a maintenance task, see avstor_sched_start. The lock on the file is
+// released between extents while waiting for the I/O budget. Closing the file stops the task there,
+// even while the scheduler is paused.
+int AVCALL avstor_tier_migrate_async(avstor *db, unsigned idle_seconds, int priority)
+{
+#if defined(IO_PUNCH_HOLE) && defined(AVSTOR_CONFIG_THREAD_SAFE)
+    CHECK_PARAM(db);
+    if (!db->tier || (db->oflags & AVSTOR_OPEN_READONLY)) {
+        RETURN(AVSTOR_INVOPER, "No tier file open or file is read only");
+    }
+    return sched_submit(db, &tier_migrate_task, idle_seconds, priority);
+#else
+    (void)db;
+    (void)idle_seconds;
+    (void)priority;
+    RETURN(AVSTOR_INVOPER, "Tier migration is not supported on this platform");
+#endif
+}
+
+static void pin_page(avstor *db, avstor_off page_ofs, uint32_t priority)
+{
+    if (!pagemap_put(&db->pins, page_ofs / PAGE_SIZE, priority)) {
+        THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    cache_set_priority(db, page_ofs, priority);
+}
+
+static void pin_tree(avstor *db, avstor_off ofs, uint32_t priority);
+
+// Sets the cache priority of the page holding a node and of the pages of everything below it
+static void pin_node(avstor *db, avstor_off ofs, uint32_t priority)
+{
+    avstor_off children[2] = { 0, 0 };
+    AvNode *node = lock_node(db, ofs);
+    AvNodeData *data = get_node_data(node);
+
+    switch (NODE_TYPE(node)) {
+    case AVSTOR_TYPE_KEY:
+        children[0] = nref_to_ofs(data->vkey.subkey_root);
+        children[1] = nref_to_ofs(data->vkey.value_root);
+        break;
+    case AVSTOR_TYPE_LONGSTRING:
+    case AVSTOR_TYPE_LONGBINARY:
+        children[0] = nref_to_ofs(data->vlongvar.root);
+        break;
+    case NODE_BLOBREF:
+        // only the blob node itself belongs to the value
+        pin_page(db, nref_to_ofs(data->vBlobRef.blob) & OFFSET_MASK, priority);
+        break;
+    }
+    unlock_ptr(db, node);
+    pin_page(db, ofs & OFFSET_MASK, priority);
+    pin_tree(db, children[0], priority);
+    pin_tree(db, children[1], priority);
+}
+
+// Pins all nodes of the AVL tree at ofs
+static void pin_tree(avstor *db, avstor_off ofs, uint32_t priority)
+{
+    while (ofs != 0) {
+        AvNode *node = lock_node(db, ofs);
+        avstor_off left = nref_to_ofs(node->left);
+        avstor_off right = nref_to_ofs(node->right);
+        unlock_ptr(db, node);
+
+        pin_tree(db, left, priority);
+        pin_node(db, ofs, priority);
+        ofs = right;
+    }
+}
+
+/*
+* Sets the cache priority of the pages currently holding node and all nodes below it.
+* AVSTOR_PRIORITY_HIGH pages are evicted only when no normal page can be, AVSTOR_PRIORITY_PINNED
+* pages are never evicted and the cache grows beyond its configured size if needed.
+* AVSTOR_PRIORITY_NORMAL removes a previous pin. Pages are loaded into the cache as the subtree is
+* visited. Nodes added to the subtree later may go to other pages, so call again after large
+* updates. Pins are not stored in the file and mounted files are not followed.
+*/
+int AVCALL avstor_pin_subtree(const avstor_node *node, int priority)
+{
+    avstor *db;
+    int result;
+
+    CHECK_PARAM(node && node->db);
+    if (priority < AVSTOR_PRIORITY_NORMAL || priority > AVSTOR_PRIORITY_PINNED) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    }
+    db = node->db;
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        if (node->ref == 0) {
+            pin_tree(db, nref_to_ofs(db->cache.header->root), (uint32_t)priority);
         }
         else {
-            // Node with fixed size data only
-            data_offset = 0;
-            bytes_copied = szdata <= szbuf ? szdata : szbuf;
-            *out_length = szdata;
+            pin_node(db, node->ref, (uint32_t)priority);
         }
-        memcpy(buf, CONST_PTR(ndata, data_offset), bytes_copied);
-        *out_bytes = bytes_copied;
-        *out_type = node_type;
-        unlock_ptr(node);
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(node);
         result = ex.err;
     }
     END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
+    rwl_release(&db->global_rwl);
     return result;
 }
 
-int AVCALL avstor_update_int32(const avstor_node *value, int32_t new_val)
+#define SIZE_BUF_ENTRY          offsetof(AvBufEntry, data)
+#define BUFFER_DELETE           0xFFu
+#define BUFFER_MERGE_ENTRIES    4096u   // Entries at which a merge is started
+#define BUFFER_MAX_ENTRIES      (4u * BUFFER_MERGE_ENTRIES) // Puts merge themselves past this
+
+static uint32_t buffer_checksum(const AvBufEntry *e)
 {
-    AvNode *volatile node = NULL;
-    int result;
+    uint32_t hash[2];
+    hash_blob(&e->size, e->size - (unsigned)sizeof(e->checksum), hash);
+    return hash[0];
+}
 
-    CHECK_PARAM(value && value->db);
-    rwl_lock_exclusive(&value->db->global_rwl);
-    TRY(ex)
-    {
-        node = lock_valueref(value, AVSTOR_TYPE_INT32);
-        get_node_data(node)->v32.value = new_val;
-        set_ptr_dirty(node);
-        unlock_ptr(node);
-        result = AVSTOR_OK;
+// Compares a key under parent with the key of an entry. Keys are ordered bytewise, like keys
+// without comparer in the tree, so names differing only in trailing zero bytes are equal.
+static int buffer_compare(avstor_off parent, const void *key, size_t len, const AvBufEntry *e)
+{
+    const unsigned char *kp = (const unsigned char*)key, *ep = (const unsigned char*)e->data;
+    size_t common = len < e->key_len ? len : e->key_len, i;
+    int comp;
+
+    if (parent != e->parent) {
+        return parent < e->parent ? -1 : 1;
     }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(node);
-        result = ex.err;
+    if ((comp = memcmp(kp, ep, common)) != 0) {
+        return comp;
     }
-    END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
-    return result;
+    for (i = common; i < len; ++i) {
+        if (kp[i]) {
+            return 1;
+        }
+    }
+    for (i = common; i < e->key_len; ++i) {
+        if (ep[i]) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-static int update_fixed64_value(const avstor_node *value, unsigned type, int64_t new_val)
+// Returns the index of the entry for key under parent, or where it would be inserted
+static unsigned buffer_search(AvBufEntry **entries, unsigned count, avstor_off parent,
+                              const void *key, size_t len, int *out_found)
 {
-    AvNode *volatile node = NULL;
+    unsigned lo = 0, hi = count;
+    *out_found = 0;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        int comp = buffer_compare(parent, key, len, entries[mid]);
+        if (comp == 0) {
+            *out_found = 1;
+            return mid;
+        }
+        if (comp < 0) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// Returns the newest entry for key under parent, or NULL. Buffer lock must be held
+static const AvBufEntry* buffer_lookup(const AvWriteBuffer *wb, avstor_off parent, const void *key, size_t len)
+{
+    int found;
+    unsigned i = buffer_search(wb->entries, wb->count, parent, key, len, &found);
+    if (found) {
+        return wb->entries[i];
+    }
+    i = buffer_search(wb->merging, wb->merge_count, parent, key, len, &found);
+    return found ? wb->merging[i] : NULL;
+}
+
+// Makes room for one more entry. Buffer lock must be held
+static int buffer_reserve(AvWriteBuffer *wb)
+{
+    if (wb->count == wb->capacity) {
+        unsigned capacity = wb->capacity ? wb->capacity * 2 : 64;
+        AvBufEntry **entries = realloc(wb->entries, capacity * sizeof(AvBufEntry*));
+        if (!entries) {
+            return 0;
+        }
+        wb->entries = entries;
+        wb->capacity = capacity;
+    }
+    return 1;
+}
+
+// Adds an entry, replacing an older one for the same key. Room must have been reserved and the
+// buffer lock must be held.
+static void buffer_insert(AvWriteBuffer *wb, AvBufEntry *e)
+{
+    int found;
+    unsigned i = buffer_search(wb->entries, wb->count, e->parent, e->data, e->key_len, &found);
+    if (found) {
+        wb->bytes -= wb->entries[i]->size;
+        free(wb->entries[i]);
+    }
+    else {
+        memmove(&wb->entries[i + 1], &wb->entries[i], (wb->count - i) * sizeof(AvBufEntry*));
+        wb->count++;
+    }
+    wb->entries[i] = e;
+    wb->bytes += e->size;
+}
+
+// Reads the records of the log not merged yet into the buffer. Reading stops at the first record
+// that is torn or left over from before the log was last restarted.
+static void buffer_load(avstor *db, AvWriteBuffer *wb)
+{
+    union {
+        AvBufEntry entry;
+        char data[SIZE_BUF_ENTRY + MAX_KEY_LEN + MAX_BINARY_LEN + MAX_KEY_LEN];
+    } buf;
+    AvBufEntry *e;
+    uint64_t merged = get_buffer_seq(db->cache.header);
+
+    wb->seq = merged;
+    while (io_read(db, wb->file, &buf, wb->log_size, (unsigned)SIZE_BUF_ENTRY) == (int)SIZE_BUF_ENTRY) {
+        unsigned size = buf.entry.size;
+        if (size < SIZE_BUF_ENTRY || size > sizeof(buf) || buf.entry.key_len > MAX_KEY_LEN
+            || buf.entry.value_len > MAX_BINARY_LEN || buf.entry.parent_len > MAX_KEY_LEN
+            || size != SIZE_BUF_ENTRY + buf.entry.key_len + buf.entry.value_len + buf.entry.parent_len
+            || io_read(db, wb->file, buf.entry.data, wb->log_size + SIZE_BUF_ENTRY,
+                       size - (unsigned)SIZE_BUF_ENTRY) != (int)(size - SIZE_BUF_ENTRY)
+            || buf.entry.checksum != buffer_checksum(&buf.entry)) {
+            break;
+        }
+        wb->log_size += size;
+        if (buf.entry.seq <= merged) {
+            continue;
+        }
+        if (!buffer_reserve(wb) || !(e = malloc(size))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        memcpy(e, &buf, size);
+        buffer_insert(wb, e);
+        if (e->seq > wb->seq) {
+            wb->seq = e->seq;
+        }
+    }
+}
+
+/*
+* Attaches a write buffer to the file, backed by a log file which is created if it doesn't exist.
+* Value mutations made with avstor_buffer_put and avstor_buffer_delete are appended to the log and
+* kept in memory, sorted by key, until they are merged into the tree in key order. Mutations left
+* in the log when the file was last closed are loaded again, so the same log must be attached
+* whenever the file is opened. Mutations under a key that is deleted before they are merged are
+* dropped, as are mutations that cannot be applied, such as replacing a value that is the target of
+* a link; avstor_buffer_merge then returns the error of the first one.
+*/
+int AVCALL avstor_buffer_open(avstor *db, const char *filename)
+{
+    AvWriteBuffer *volatile wb = NULL;
     int result;
 
-    CHECK_PARAM(value && value->db);
-    rwl_lock_exclusive(&value->db->global_rwl);
+    CHECK_PARAM(db && filename);
+    rwl_lock_exclusive(&db->global_rwl);
     TRY(ex)
     {
-        node = lock_valueref(value, type);
-        memcpy(&get_node_data(node)->v64.value, &new_val, sizeof(int64_t));
-        set_ptr_dirty(node);
-        unlock_ptr(node);
+        if (db->wbuf) {
+            THROW(AVSTOR_INVOPER, "Write buffer is already open");
+        }
+        if (!(wb = calloc(1, sizeof(AvWriteBuffer)))) {
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        wb->file = AVSTOR_INVALID_HANDLE;
+        if (!avmtx_init(&wb->lock)) {
+            free(wb);
+            wb = NULL;
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        if (!avmtx_init(&wb->merge_lock)) {
+            avmtx_destroy(&wb->lock);
+            free(wb);
+            wb = NULL;
+            THROW(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+        }
+        wb->file = io_open(filename, db->oflags);
+        if (wb->file == AVSTOR_INVALID_HANDLE && !(db->oflags & AVSTOR_OPEN_READONLY)) {
+            wb->file = io_create(filename, db->oflags);
+        }
+        if (wb->file == AVSTOR_INVALID_HANDLE) {
+            THROW(AVSTOR_IOERR, "Failed to open write buffer log");
+        }
+        buffer_load(db, wb);
+        db->wbuf = wb;
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(node);
+        if (wb) {
+            buffer_destroy(wb);
+        }
         result = ex.err;
     }
     END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
+    rwl_release(&db->global_rwl);
     return result;
 }
 
-int AVCALL avstor_update_int64(const avstor_node *value, int64_t new_val)
+static __inline const char* buffer_parent_name(const AvBufEntry *e)
 {
-    return update_fixed64_value(value, AVSTOR_TYPE_INT64, new_val);
+    return e->data + e->key_len + e->value_len;
 }
 
-int AVCALL avstor_update_double(const avstor_node *value, double new_val)
+// Name of a key node without the zero padding it is stored with, or NULL if its dictionary id is
+// invalid. Names differing only in trailing zero bytes are the same key, see buffer_compare.
+static const void* buffer_key_name(const avstor *db, const AvNode *node, unsigned *out_len)
 {
-    AvValue64 v;
-    v.as_dbl = new_val;
-    return update_fixed64_value(value, AVSTOR_TYPE_DOUBLE, v.as_int64);
+    const unsigned char *name = (const unsigned char*)node->name;
+    unsigned len = get_name_size(node);
+
+    if (node->szname & NAME_INTERNED) {
+        uint32_t id = get_name_id(node);
+        if (id >= db->name_count) {
+            return NULL;
+        }
+        name = (const unsigned char*)db->names[id].buf;
+        len = db->names[id].len;
+    }
+    while (len > 0 && name[len - 1] == 0) {
+        --len;
+    }
+    *out_len = len;
+    return name;
 }
 
-static int update_var_value(const avstor_node* value, const void* buf,
-                            unsigned szbuf, unsigned type)
+// Copies the name of the key parent into name, which holds MAX_KEY_LEN bytes. It is recorded with
+// the entries buffered under parent, see buffer_parent_exists.
+static int buffer_parent_name_of(const avstor_node *parent, char *name, unsigned *out_len)
 {
-    AvNode *volatile node = NULL;
+    avstor *db = parent->db;
+    AvNode *volatile parent_node = NULL;
     int result;
 
-    CHECK_PARAM(value && value->db && buf);
-    rwl_lock_exclusive(&value->db->global_rwl);
+    rwl_lock_shared(&db->global_rwl);
     TRY(ex)
     {
-        AvNodeData *ndata;
-        unsigned szdata = NODE_CLASS[type].szdata;
-        node = lock_valueref(value, type);
-        ndata = get_node_data(node);
-        if (szbuf != ndata->vvar.length) {
-            node = resize_node(node, align_node(SIZE_NODE_HDR + node->szname + szdata + szbuf));
-            ndata = get_node_data(node);
-            ndata->vvar.length = (uint8_t)szbuf;
+        const void *buf;
+        unsigned len;
+        parent_node = lock_keyref(parent);
+        if (!(buf = buffer_key_name(db, parent_node, &len)) || len > MAX_KEY_LEN) {
+            THROW(AVSTOR_CORRUPT, "Invalid name id");
         }
-        memcpy(PTR(ndata, szdata), buf, szbuf);
-        set_ptr_dirty(node);
-        unlock_ptr(node);
+        memcpy(name, buf, len);
+        *out_len = len;
+        unlock_ptr(db, parent_node);
         result = AVSTOR_OK;
     }
     CATCH_ANY(ex)
     {
-        unlock_ptr_checked(node);
+        unlock_ptr_checked(db, parent_node);
         result = ex.err;
     }
     END_TRY(ex);
-    rwl_release(&value->db->global_rwl);
+    rwl_release(&db->global_rwl);
     return result;
 }
 
+// Returns whether two entries were buffered under the same key
+static int buffer_same_parent(const AvBufEntry *a, const AvBufEntry *b)
+{
+    return a->parent == b->parent && a->parent_len == b->parent_len
+        && memcmp(buffer_parent_name(a), buffer_parent_name(b), a->parent_len) == 0;
+}
 
-int AVCALL avstor_update_string(const avstor_node* value, const char* new_value)
+// Returns whether the key an entry was buffered under still exists. Its offset may have been
+// reused since it was deleted, so the node there must be a key with the name the put recorded.
+// Global lock must be held exclusively.
+static int buffer_parent_exists(avstor *db, const AvBufEntry *e)
 {
-    size_t len;
+    avstor_off page_ofs = e->parent & OFFSET_MASK;
+    unsigned slot = (unsigned)(e->parent & ~OFFSET_MASK), index, len;
+    const void *name;
+    AvPage *page;
+    AvNode *node;
+    int result;
 
-    CHECK_PARAM(new_value);
-    len = strlen_l(new_value, MAX_STRING_LEN + 1) + 1;
-    if (len == (MAX_STRING_LEN + 1)) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    if (page_ofs == 0 || page_ofs / PAGE_SIZE >= get_pagecount(db->cache.header)
+        || slot < offsetof(AvPage, nodes) || (slot - offsetof(AvPage, nodes)) % sizeof(uint16_t) != 0) {
+        return 0;
     }
-    return update_var_value(value, new_value, (unsigned)len, AVSTOR_TYPE_STRING);
+    index = (slot - (unsigned)offsetof(AvPage, nodes)) / (unsigned)sizeof(uint16_t);
+    page = get_page(db, page_ofs);
+    // free index slots hold either 0 or the offset of the next free slot, both below top
+    if (page->type != PAGE_KEYS || index >= page->index_count
+        || page->nodes[index] < page->top || page->nodes[index] >= PAGE_SIZE) {
+        unlock_db_page(db, page);
+        return 0;
+    }
+    node = PTR(page, page->nodes[index]);
+    result = NODE_TYPE(node) == AVSTOR_TYPE_KEY && (name = buffer_key_name(db, node, &len)) != NULL
+        && len == e->parent_len && memcmp(name, buffer_parent_name(e), len) == 0;
+    unlock_db_page(db, page);
+    return result;
 }
 
-int AVCALL avstor_update_binary(const avstor_node* value, const void* new_value, size_t szvalue)
+// Returns whether the string or binary value of node can be set to len bytes without growing it
+static int buffer_fits_node(avstor *db, AvNode *node, unsigned type, unsigned len)
 {
-    if (szvalue > MAX_BINARY_LEN) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
-    }
-    return update_var_value(value, new_value, (unsigned)szvalue, AVSTOR_TYPE_BINARY);
+    return NODE_TYPE(node) != NODE_BLOBREF
+        && align_node(SIZE_NODE_HDR + get_name_size(node) + NODE_CLASS[type].szdata + len
+                      + get_stats_size(db, type)) <= get_node_size(node);
 }
 
-static void AVCALL db_open_file(avstor *db, const char* filename, int oflags)
+// Applies an entry under its key, which buffer_parent_exists found. A value of the same type is
+// updated in place unless it grows, which a full page may not allow; otherwise the value is
+// replaced. Applying it again has no further effect, so a merge that did not commit can be
+// repeated. Global lock must be held exclusively.
+static void buffer_apply(avstor *db, const AvBufEntry *e)
 {
-    AvPage hdr;
-    int bytes_read, result;
-
-    result = io_open(filename, oflags);
-    if (result == AVSTOR_INVALID_HANDLE) {
-        THROW(AVSTOR_IOERR, "Failed to open file");
-    }
-    db->file = result;
-    bytes_read = io_read(db, &hdr, 0, (unsigned)SIZE_PAGE_HDR);
-    if (bytes_read < 0) {
-        THROW(AVSTOR_IOERR, "Failed to read header.");
-    }
-    if (bytes_read < (int)SIZE_PAGE_HDR) {
-        THROW(AVSTOR_CORRUPT, "Invalid header.");
-    }
-    /*if (memcmp(&hdr.id, &FILE_ID, sizeof(FILE_ID)) != 0) {
-        THROW(AVSTOR_CORRUPT, "page id is not 'AVST'.");
-    }*/
+    AvNode *volatile parent_node = NULL, *volatile node = NULL;
+    NodeRef *volatile last_ref = NULL;
+    const void *value = e->data + e->key_len;
+    avstor_key key;
 
-    if (hdr.pagesize != PAGE_SIZE) {
-        THROW(AVSTOR_CORRUPT, "Invalid page size.");
+    key.buf = (void*)e->data;
+    key.len = e->key_len;
+    key.comparer = NULL;
+    TRY(ex)
+    {
+        AvStack st;
+        parent_node = lock_node(db, e->parent);
+        node = find_node_with_backtrace(db, &key, &st, &get_node_data(parent_node)->vkey.value_root, &last_ref);
+        if (node && get_user_type(node) == e->type
+            && ((e->type != AVSTOR_TYPE_STRING && e->type != AVSTOR_TYPE_BINARY)
+                || buffer_fits_node(db, node, e->type, e->value_len))) {
+            // resizing the value may move the key within its page
+            unlock_ptr(db, parent_node);
+            parent_node = NULL;
+            if (e->type == AVSTOR_TYPE_STRING || e->type == AVSTOR_TYPE_BINARY) {
+                update_var_node(db, &node, value, e->value_len, e->type);
+            }
+            else {
+                update_fixed_node(db, node, value);
+            }
+        }
+        else {
+            if (node) {
+                if (exists_link_to_node(db, node)) {
+                    THROW(AVSTOR_INVOPER, "Node is a target of a link reference, unable to delete");
+                }
+                delete_found_node(db, e->parent, parent_node, &node, &st, &key, 1);
+                // freeing the value may move the key within its page
+                parent_node = lock_unlock_node(db, e->parent, parent_node, CACHE_EXISTING);
+            }
+            else {
+                unlock_ptr_checked(db, last_ref);
+                last_ref = NULL;
+            }
+            if (e->type != BUFFER_DELETE) {
+                insert_value(db, parent_node, &key, e->type, value, e->value_len, NULL);
+            }
+        }
     }
-    if (AVSTOR_OK != (result = read_page(db, 0, db->cache.header))) {
-        THROW(result, "read_page() failed while reading header.");
+    FINALLY(ex)
+    {
+        unlock_ptr_checked(db, last_ref);
+        unlock_ptr_checked(db, node);
+        unlock_ptr_checked(db, parent_node);
     }
-    memcpy(db->cache.old_header, db->cache.header, PAGE_SIZE);
+    END_TRY(ex);
 }
 
-static void AVCALL db_create_file(avstor *db, const char* filename, int oflags)
+/*
+* Applies the entries taken from the buffer in key order and commits them together with the
+* sequence number of the last one, or seq if higher, so that they are not loaded from the log
+* again. The global lock is held exclusively throughout, a merge that fails is rolled back whole.
+* Entries under a key that was deleted are skipped. The index of the entry that could not be
+* applied is stored in *out_failed, count if the merge failed otherwise.
+*/
+static int buffer_merge_entries(avstor *db, AvBufEntry **entries, unsigned count, uint64_t seq,
+                                unsigned *out_failed)
 {
-    AvPage *hdr = NULL;
     int result;
 
-    result = io_create(filename, oflags);
-    if (result == AVSTOR_INVALID_HANDLE) {
-        THROW(AVSTOR_IOERR, "Failed to create file");
+    rwl_lock_exclusive(&db->global_rwl);
+    TRY(ex)
+    {
+        uint64_t last = seq;
+        unsigned i;
+        int exists = 0;
+        for (i = 0; i < count; ++i) {
+            // entries under the same key are next to each other, the key is checked once for them
+            if (i == 0 || !buffer_same_parent(entries[i - 1], entries[i])) {
+                exists = buffer_parent_exists(db, entries[i]);
+            }
+            if (exists) {
+                *out_failed = i;
+                buffer_apply(db, entries[i]);
+            }
+            if (entries[i]->seq > last) {
+                last = entries[i]->seq;
+            }
+        }
+        *out_failed = count;
+        set_buffer_seq(db->cache.header, last);
+        set_page_dirty(db->cache.header);
+        result = commit_locked(db, 1);
     }
-    db->file = result;
-
-    hdr = db->cache.header;
-    memset(hdr, 0, PAGE_SIZE);
-    //memcpy(&hdr->id, &FILE_ID, sizeof(FILE_ID));
-    hdr->page_offset = 0;
-    hdr->type = PAGE_HDR;
-    set_page_dirty(hdr);
-    hdr->pagecount = 1;
-    hdr->pagesize = PAGE_SIZE;
-    hdr->root = NODEREF_NULL;
-#if defined(AVSTOR_CONFIG_FILE_64BIT)
-    hdr->flags = AVSTOR_FILE_64BIT;
-#endif
-    if (AVSTOR_OK != (result = avstor_commit(db, 1))) {
-        THROW(result, "Failed to initialize file");
+    CATCH_ANY(ex)
+    {
+        rollback(db);
+        result = ex.err;
     }
+    END_TRY(ex);
+    rwl_release(&db->global_rwl);
+    return result;
 }
 
-#if defined(__OS2__) && defined(AVSTOR_CONFIG_THREAD_SAFE)
+/*
+* Merges the entries left by a failed merge, then those in the buffer. An entry that cannot be
+* applied is dropped and the others are merged again; the error of the first one dropped is
+* returned once the rest is merged. Entries are kept for the next merge if memory or the file
+* fails. The log is restarted once everything written to it is merged.
+*/
+static int buffer_merge(avstor *db)
+{
+    AvWriteBuffer *wb = db->wbuf;
+    uint64_t seq = 0;
+    int pass, result = AVSTOR_OK, dropped = AVSTOR_OK;
+
+    avmtx_lock(&wb->merge_lock);
+    // entries left by a failed merge go first, they are older than those in the buffer
+    for (pass = 0; pass < 2 && result == AVSTOR_OK; ++pass) {
+        AvBufEntry *e;
+        unsigned i, failed;
+        avmtx_lock(&wb->lock);
+        wb->merge_queued = 0;
+        if (!wb->merging) {
+            wb->merging = wb->entries;
+            wb->merge_count = wb->count;
+            wb->entries = NULL;
+            wb->count = wb->capacity = 0;
+        }
+        avmtx_unlock(&wb->lock);
+        if (wb->merge_count == 0) {
+            break;
+        }
 
-once_flag init_tls_flag = ONCE_FLAG_INIT;
+        // an entry is dropped for errors of its own, the merge is retried later if the file fails
+        while (AVSTOR_OK != (result = buffer_merge_entries(db, wb->merging, wb->merge_count, seq, &failed))
+               && failed < wb->merge_count && result != AVSTOR_NOMEM && result != AVSTOR_IOERR
+               && result != AVSTOR_CORRUPT) {
+            avmtx_lock(&wb->lock);
+            e = wb->merging[failed];
+            memmove(&wb->merging[failed], &wb->merging[failed + 1], (wb->merge_count - failed - 1) * sizeof(AvBufEntry*));
+            wb->merge_count--;
+            wb->bytes -= e->size;
+            avmtx_unlock(&wb->lock);
+            // not loaded from the log again once the others are merged
+            if (e->seq > seq) {
+                seq = e->seq;
+            }
+            free(e);
+            if (dropped == AVSTOR_OK) {
+                dropped = result;
+            }
+        }
 
-static void avstor_destroy_tls(void* tls_data)
-{
-    if (tls_data) {
-        free(tls_data);
+        avmtx_lock(&wb->lock);
+        if (result == AVSTOR_OK) {
+            for (i = 0; i < wb->merge_count; ++i) {
+                wb->bytes -= wb->merging[i]->size;
+                free(wb->merging[i]);
+            }
+            free(wb->merging);
+            wb->merging = NULL;
+            wb->merge_count = 0;
+            if (wb->count == 0) {
+                wb->log_size = 0;
+            }
+        }
+        avmtx_unlock(&wb->lock);
     }
+    avmtx_unlock(&wb->merge_lock);
+    return result != AVSTOR_OK ? result : dropped;
 }
-
-static void avstor_init_tls(void)
-{
-    AvTLSData *ptr;
-
-    if (tss_create(&tls_idx, avstor_destroy_tls) != thrd_success) {
-        fprintf(stderr, "libavstor: FATAL: Failed to initialize TLS index\n");
-        abort();
-    }
-    if (!(ptr = malloc(sizeof(*ptr)))) {
-        tss_delete(tls_idx);
-        fprintf(stderr, "libavstor: FATAL: Failed to allocate TLS storage\n");
-        abort();
-    }
-    tss_set(tls_idx, ptr);
-    init_tls_vars();
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+static int buffer_merge_task(avstor *db, unsigned param)
+{
+    (void)param;
+    return buffer_merge(db);
 }
 #endif
 
-int AVCALL avstor_open(avstor **pdb, const char* filename, unsigned szcache, int oflags)
+static int buffer_put(const avstor_node *parent, const avstor_key *key, unsigned type,
+                      const void *value, size_t len)
 {
-    avstor *db;
-    int result;
+    avstor *db = parent->db;
+    AvWriteBuffer *wb = db->wbuf;
+    AvBufEntry *e;
+    char name[MAX_KEY_LEN];
+    unsigned name_len;
+    int merge, result;
 
-#if defined(__OS2__) && defined(AVSTOR_CONFIG_THREAD_SAFE)
-    call_once(&init_tls_flag, avstor_init_tls);
-#endif
+    if (!wb || (db->oflags & AVSTOR_OPEN_READONLY)) {
+        RETURN(AVSTOR_INVOPER, "No write buffer open or file is read only");
+    }
+    if (AVSTOR_OK != (result = buffer_parent_name_of(parent, name, &name_len))) {
+        return result;
+    }
 
-    CHECK_PARAM(pdb && filename);
-    if (((oflags & AVSTOR_OPEN_CREATE) && (oflags & AVSTOR_OPEN_READONLY))
-        || (!(oflags & AVSTOR_OPEN_READWRITE) && !(oflags & AVSTOR_OPEN_READONLY))) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_FLAGS_COMBINATION);
+    if (!(e = malloc(SIZE_BUF_ENTRY + key->len + len + name_len))) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
     }
+    e->size = (uint32_t)(SIZE_BUF_ENTRY + key->len + len + name_len);
+    e->parent = parent->ref;
+    e->key_len = (uint32_t)key->len;
+    e->value_len = (uint32_t)len;
+    e->type = type;
+    e->parent_len = name_len;
+    memcpy(e->data, key->buf, key->len);
+    if (len) {
+        memcpy(e->data + key->len, value, len);
+    }
+    memcpy(e->data + key->len + len, name, name_len);
+
+    avmtx_lock(&wb->lock);
+    if (!buffer_reserve(wb)) {
+        avmtx_unlock(&wb->lock);
+        free(e);
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    e->seq = wb->seq + 1;
+    e->checksum = buffer_checksum(e);
+    if (io_write(db, wb->file, e, wb->log_size, e->size) != (int)e->size) {
+        avmtx_unlock(&wb->lock);
+        free(e);
+        RETURN(AVSTOR_IOERR, "Failed to write to write buffer log");
+    }
+    wb->seq = e->seq;
+    wb->log_size += e->size;
+    buffer_insert(wb, e);
+    // 1 to start a merge, 2 if the merge fell behind and the put has to wait for it
+    merge = wb->count >= BUFFER_MAX_ENTRIES ? 2 : (wb->count >= BUFFER_MERGE_ENTRIES && !wb->merge_queued);
+    if (merge) {
+        wb->merge_queued = 1;
+    }
+    avmtx_unlock(&wb->lock);
 
-    szcache = mask_to_power_of_two(szcache);
-    if (szcache < 64) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_ATTRIBUTE);
+    if (!merge) {
+        return AVSTOR_OK;
     }
-#if defined(DOS16)
-    /* 16-bit DOS limited to 512K of cache since it has to be in conventional memory */
-    if (szcache > 512) {
-        szcache = 512;
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    // the merge runs in the background while the scheduler is running
+    if (merge == 1 && sched_is_running()
+        && AVSTOR_OK == sched_submit(db, &buffer_merge_task, 0, AVSTOR_TASK_NORMAL)) {
+        return AVSTOR_OK;
     }
 #endif
-    if (!avstor_init(&db, szcache)) {
-        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
-    }
+    return buffer_merge(db);
+}
 
-    db->oflags = oflags;
+/*
+* Buffers setting the value of type named key under parent, replacing a value of any type with
+* the same name. value holds len bytes: 4 for AVSTOR_TYPE_INT32, 8 for AVSTOR_TYPE_INT64 and
+* AVSTOR_TYPE_DOUBLE, the string with its terminating null for AVSTOR_TYPE_STRING, or up to 250
+* bytes for AVSTOR_TYPE_BINARY. Keys have no comparer and are ordered bytewise. The mutation is
+* visible to avstor_buffer_get at once, and to other functions once merged. It is durable after
+* avstor_commit with flush set or after the merge. A merge starts when enough mutations are
+* buffered, in the background if the maintenance scheduler is running.
+*/
+int AVCALL avstor_buffer_put(const avstor_node *parent, const avstor_key *key, unsigned type,
+                             const void *value, size_t len)
+{
+    int valid;
 
-    TRY(ex)
-    {
-        if (oflags & AVSTOR_OPEN_CREATE) {
-            db_create_file(db, filename, oflags);
-        }
-        else {
-            db_open_file(db, filename, oflags);
-        }
-        *pdb = db;
-        result = AVSTOR_OK;
+    CHECK_PARAM(parent && parent->db && key && (value || len == 0));
+    switch (type) {
+    case AVSTOR_TYPE_INT32:
+        valid = len == sizeof(int32_t);
+        break;
+    case AVSTOR_TYPE_INT64:
+    case AVSTOR_TYPE_DOUBLE:
+        valid = len == sizeof(int64_t);
+        break;
+    case AVSTOR_TYPE_STRING:
+        valid = len != 0 && len <= MAX_STRING_LEN && strlen_l((const char*)value, len) == len - 1;
+        break;
+    case AVSTOR_TYPE_BINARY:
+        valid = len <= MAX_BINARY_LEN;
+        break;
+    default:
+        valid = 0;
     }
-    CATCH_ANY(ex)
-    {
-        avstor_destroy(db);
-        result = ex.err;
+    if (!valid || is_invalid_avstor_key(key) || key->comparer || parent->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-    END_TRY(ex);
-    return result;
+    return buffer_put(parent, key, type, value, len);
 }
 
-int AVCALL avstor_close(avstor *db)
+// Buffers deleting the value named key under parent, see avstor_buffer_put
+int AVCALL avstor_buffer_delete(const avstor_node *parent, const avstor_key *key)
 {
-    CHECK_PARAM(db);
-    if (db->file != AVSTOR_INVALID_HANDLE) {
-        io_close(db->file);
-        db->file = AVSTOR_INVALID_HANDLE;
+    CHECK_PARAM(parent && parent->db && key);
+    if (is_invalid_avstor_key(key) || key->comparer || parent->ref == 0) {
+        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-
-    avstor_destroy(db);
-    return AVSTOR_OK;
+    return buffer_put(parent, key, BUFFER_DELETE, NULL, 0);
 }
 
-int AVCALL avstor_find(const avstor_node *parent, const avstor_key *key,
-                       int flags, avstor_node *out_key)
-{
-    avstor *db;
-    AvNode *volatile parent_node = NULL;
-    AvNode *out_node = NULL;
+/*
+* Gets the value named key under parent like avstor_get_value, from the write buffer if a mutation
+* of it is buffered, otherwise from the tree. Returns AVSTOR_NOTFOUND if there is no value or its
+* deletion is buffered.
+*/
+int AVCALL avstor_buffer_get(const avstor_node *parent, const avstor_key *key, void *buf, size_t szbuf,
+                             unsigned *out_type, size_t *out_bytes, uint32_t *out_length)
+{
+    AvWriteBuffer *wb;
+    const AvBufEntry *e;
+    avstor_node node;
+    char name[MAX_KEY_LEN];
+    unsigned name_len;
     int result;
-    int isvalue = (flags & AVSTOR_VALUES);
 
-    CHECK_PARAM(parent && parent->db && key && out_key);
-    if (is_invalid_avstor_key(key) || (isvalue && parent->ref == 0)) {
+    CHECK_PARAM(parent && parent->db && key && buf && out_type && out_bytes && out_length);
+    if (is_invalid_avstor_key(key) || key->comparer || parent->ref == 0) {
         RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-    db = parent->db;
-    rwl_lock_shared(&db->global_rwl);
-    TRY(ex)
-    {
-        NodeRef *ref;
-        if (parent->ref != 0) {
-            parent_node = lock_keyref(parent);
-        }
-
-        if (isvalue) {
-            ref = &get_node_data(parent_node)->vkey.value_root;
-        }
-        else {
-            ref = !parent_node ? &db->cache.header->root : &get_node_data(parent_node)->vkey.subkey_root;
-        }
-
-        if ((out_node = find_key(db, key, ref))) {
-            if (out_key) {
-                avstor_node_set(out_key, get_ofs(out_node), db);
-            }
-            unlock_ptr(out_node);
+    if (!(wb = parent->db->wbuf)) {
+        RETURN(AVSTOR_INVOPER, "No write buffer open");
+    }
+    if (AVSTOR_OK != (result = buffer_parent_name_of(parent, name, &name_len))) {
+        return result;
+    }
+    avmtx_lock(&wb->lock);
+    e = buffer_lookup(wb, parent->ref, key->buf, key->len);
+    // entries under a deleted key whose offset parent reuses are dropped by the merge
+    if (e && (e->parent_len != name_len || memcmp(buffer_parent_name(e), name, name_len) != 0)) {
+        e = NULL;
+    }
+    if (e) {
+        result = AVSTOR_NOTFOUND;
+        if (e->type != BUFFER_DELETE) {
+            *out_bytes = e->value_len > szbuf ? szbuf : e->value_len;
+            *out_length = e->value_len;
+            *out_type = e->type;
+            memcpy(buf, e->data + e->key_len, *out_bytes);
             result = AVSTOR_OK;
         }
-        else {
-            result = AVSTOR_NOTFOUND;
-        }
-        unlock_ptr_checked(parent_node);
+        avmtx_unlock(&wb->lock);
+        return result;
     }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(parent_node);
-        result = ex.err;
+    avmtx_unlock(&wb->lock);
+    if (AVSTOR_OK != (result = avstor_find(parent, key, AVSTOR_VALUES, &node))) {
+        return result;
     }
-    END_TRY(ex);
-    rwl_release(&db->global_rwl);
-    return result;
+    return avstor_get_value(&node, buf, szbuf, out_type, out_bytes, out_length);
 }
 
-int AVCALL avstor_get_name(const avstor_node *value, avstor_key *key)
+// Merges all buffered mutations into the tree and commits the file, see avstor_buffer_open
+int AVCALL avstor_buffer_merge(avstor *db)
 {
-    AvNode *volatile node = NULL;
-    int result;
-#if defined(AVSTOR_CONFIG_THREAD_SAFE)
-    avstor *db;
-    CHECK_PARAM(value && value->db && key);
-    db = value->db;
-#else
-    CHECK_PARAM(value && value->db && key);
-#endif
-
-    rwl_lock_shared(&db->global_rwl);
-    TRY(ex)
-    {
-        size_t szname;
-        node = lock_noderef(value);
-        szname = node->szname;
-        if (szname > key->len) {
-            THROW(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
-        }
-        memcpy(key->buf, node->name, szname);
-        unlock_ptr(node);
-        result = AVSTOR_OK;
-    }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(node);
-        result = ex.err;
+    CHECK_PARAM(db);
+    if (!db->wbuf || (db->oflags & AVSTOR_OPEN_READONLY)) {
+        RETURN(AVSTOR_INVOPER, "No write buffer open or file is read only");
     }
-    END_TRY(ex);
-    rwl_release(&db->global_rwl);
-    return result;
+    return buffer_merge(db);
 }
 
-int AVCALL avstor_get_type(const avstor_node* value, unsigned *out_type)
+// Queues avstor_buffer_merge as a maintenance task, see avstor_sched_start
+int AVCALL avstor_buffer_merge_async(avstor *db, int priority)
 {
-    AvNode *volatile node = NULL;
-    int result;
 #if defined(AVSTOR_CONFIG_THREAD_SAFE)
-    avstor *db;
-    CHECK_PARAM(value && value->db && out_type);
-    db = value->db;
+    CHECK_PARAM(db);
+    if (!db->wbuf || (db->oflags & AVSTOR_OPEN_READONLY)) {
+        RETURN(AVSTOR_INVOPER, "No write buffer open or file is read only");
+    }
+    return sched_submit(db, &buffer_merge_task, 0, priority);
 #else
-    CHECK_PARAM(value && value->db && out_type);
+    (void)db;
+    (void)priority;
+    RETURN(AVSTOR_INVOPER, "Maintenance scheduler requires a thread-safe build");
 #endif
+}
 
-    rwl_lock_shared(&db->global_rwl);
-    TRY(ex)
-    {
-        node = lock_noderef(value);
+typedef struct DiffCursor {
+    avstor_inorder      st;
+    avstor_node         node;
+    avstor_key          name;
+    int                 result;
+    char                buf[MAX_KEY_LEN];
+} DiffCursor;
 
-        *out_type = (unsigned)NODE_TYPE(node);
-        unlock_ptr(node);
-        return AVSTOR_OK;
-    }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(node);
-        result = ex.err;
+typedef struct DiffContext {
+    int                 (*comparer)(const void *, const void *);
+    avstor_diff_callback callback;
+    void                *ctx;
+} DiffContext;
+
+// Loads the name of the current node of the cursor, if any
+static int diff_cursor_load(DiffCursor *c)
+{
+    if (c->result == AVSTOR_OK) {
+        // names are zero padded in the file, so clear the buffer to get the same bytes on both sides
+        memset(c->buf, 0, sizeof(c->buf));
+        return avstor_get_name(&c->node, &c->name);
     }
-    END_TRY(ex);
-    rwl_release(&db->global_rwl);
-    return result;
+    return c->result == AVSTOR_NOTFOUND ? AVSTOR_OK : c->result;
 }
 
-static int exists_link_to_node(avstor *db, AvNode *target)
+static int diff_cursor_first(DiffCursor *c, const avstor_node *parent, int flags)
 {
-    AvNode *link_node;
-    avstor_off link_ofs = get_ofs(target);
-    int result;
-    avstor_key link_key;
-    link_key.buf = &link_ofs;
-    link_key.len = sizeof(link_ofs);
-    link_key.comparer = offset_comparer;
-
-    link_node = find_key(db, &link_key, &db->cache.header->root_links);
-    result = link_node != NULL;
-    unlock_ptr_checked(link_node);
-    return result;
+    c->name.buf = c->buf;
+    c->name.len = sizeof(c->buf);
+    c->name.comparer = NULL;
+    if ((flags & AVSTOR_VALUES) && parent->ref == 0) {
+        // the root of the file has no values
+        c->result = AVSTOR_NOTFOUND;
+    }
+    else {
+        c->result = avstor_inorder_first(&c->st, parent, NULL, flags | AVSTOR_SCAN, &c->node);
+    }
+    return diff_cursor_load(c);
 }
 
-static void delete_backlink(avstor *db, AvNode *node)
+static int diff_cursor_next(DiffCursor *c)
 {
-    AvStack st;
-    AvNode *volatile link_node = NULL, *volatile link_value = NULL;
-    avstor_off link_ofs = nref_to_ofs(get_node_data(node)->vLink.link);
-    avstor_key link_key;
-    link_key.buf = &link_ofs;
-    link_key.len = sizeof(link_ofs);
-    link_key.comparer = offset_comparer;
+    c->result = avstor_inorder_next(&c->st, &c->node);
+    return diff_cursor_load(c);
+}
 
-    TRY(ex)
-    {
-        if ((link_node = find_node_with_backtrace(db, &link_key, &st, &db->cache.header->root_links, NULL))) {
-            AvStack st_link;
-            AvNodeData *lk_data = get_node_data(link_node);
+static int diff_values(const avstor_node *a, const avstor_node *b, int *out_changed)
+{
+    unsigned char buf_a[MAX_BINARY_LEN], buf_b[MAX_BINARY_LEN];
+    unsigned type_a, type_b;
+    size_t bytes_a, bytes_b;
+    uint32_t len_a, len_b;
+    int result;
 
-            link_ofs = get_ofs(node);
-            if ((link_value = find_node_with_backtrace(db, &link_key, &st_link, &lk_data->vkey.value_root, NULL))) {
-                delete_node(db, link_value, &st_link);
-                unlock_ptr(link_value);
-                link_value = NULL;
-            }
-            if (is_nref_empty(lk_data->vkey.value_root)) {
-                // If we have deleted the last value, delete the parent key as well
-                delete_node(db, link_node, &st);
-                unlock_ptr(link_node);
-                link_node = NULL;
-            }
-        }
+    if (AVSTOR_OK != (result = avstor_get_value(a, buf_a, sizeof(buf_a), &type_a, &bytes_a, &len_a))
+        || AVSTOR_OK != (result = avstor_get_value(b, buf_b, sizeof(buf_b), &type_b, &bytes_b, &len_b))) {
+        return result;
     }
-    FINALLY(ex)
-    {
-        unlock_ptr_checked(link_value);
-        unlock_ptr_checked(link_node);
+    *out_changed = type_a != type_b || len_a != len_b || bytes_a != bytes_b
+                   || memcmp(buf_a, buf_b, bytes_a) != 0;
+    return AVSTOR_OK;
+}
+
+static int diff_level(const avstor_node *a, const avstor_node *b, int flags, DiffContext *dc);
+
+static int diff_keys(const avstor_node *a, const avstor_node *b, DiffContext *dc)
+{
+    int result = diff_level(a, b, AVSTOR_VALUES, dc);
+    if (result == AVSTOR_OK) {
+        result = diff_level(a, b, AVSTOR_KEYS, dc);
     }
-    END_TRY(ex);
+    return result;
 }
 
-int AVCALL avstor_delete(const avstor_node *parent, int flags, const avstor_key *key)
+// Merge-walks the children (keys or values) of a and b in key order
+static int diff_level(const avstor_node *a, const avstor_node *b, int flags, DiffContext *dc)
 {
-    AvStack st;
-    avstor *db;
-    AvNode *volatile node = NULL, *volatile parent_node = NULL;
-    NodeRef *volatile last_ref = NULL;
-    NodeRef *rootref;
+    DiffCursor *ca, *cb;
     int result;
-    int isvalue = flags & AVSTOR_VALUES;
 
-    CHECK_PARAM(parent && parent->db && key && key);
-    if (is_invalid_avstor_key(key) || (isvalue && parent->ref == 0)) {
-        RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
+    // cursors are allocated on the heap since this function recurses once per hierarchy level
+    if (!(ca = malloc(sizeof(DiffCursor) * 2))) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
     }
-    db = parent->db;
-    TRY(ex)
-    {
-        while (1) {
-            rwl_lock_shared(&db->global_rwl);
-            if (parent->ref != 0) {
-                parent_node = lock_keyref(parent);
-            }
+    cb = &ca[1];
+    if (AVSTOR_OK != (result = diff_cursor_first(ca, a, flags))
+        || AVSTOR_OK != (result = diff_cursor_first(cb, b, flags))) {
+        goto done;
+    }
+    while (ca->result == AVSTOR_OK || cb->result == AVSTOR_OK) {
+        int comp;
+        if (ca->result != AVSTOR_OK) {
+            comp = 1;
+        }
+        else if (cb->result != AVSTOR_OK) {
+            comp = -1;
+        }
+        else {
+            comp = dc->comparer ? dc->comparer(ca->buf, cb->buf) : memcmp(ca->buf, cb->buf, sizeof(ca->buf));
+        }
 
-            if (isvalue) {
-                rootref = &get_node_data(parent_node)->vkey.value_root;
-            }
-            else {
-                rootref = !parent_node ? &db->cache.header->root : &get_node_data(parent_node)->vkey.subkey_root;
+        if (comp < 0) {
+            if (dc->callback(dc->ctx, AVSTOR_DIFF_REMOVED, &ca->node, NULL)) {
+                result = AVSTOR_ABORT;
+                goto done;
             }
-            if ((node = find_node_with_backtrace(db, key, &st, rootref, &last_ref))) {
-                if (NODE_TYPE(node) == AVSTOR_TYPE_KEY) {
-                    AvNodeData *ndata = get_node_data(node);
-                    if (!is_nref_empty(ndata->vkey.subkey_root) || !is_nref_empty(ndata->vkey.value_root)) {
-                        THROW(AVSTOR_INVOPER, "Node has subkeys and/or values, unable to delete");
-                    }
-                }
-                if (exists_link_to_node(db, node)) {
-                    THROW(AVSTOR_INVOPER, "Node is a target of a link reference, unable to delete");
-                }
-#ifdef AVSTOR_CONFIG_THREAD_SAFE
-                if (!rwl_upgrade(&db->global_rwl)) {
-                    unlock_ptr_checked(last_ref);
-                    unlock_ptr_checked(node);
-                    unlock_ptr_checked(parent_node);
-                    parent_node = NULL;
-                    node = NULL;
-                    last_ref = NULL;
-                    rwl_release(&db->global_rwl);
-                    continue;
+            result = diff_cursor_next(ca);
+        }
+        else if (comp > 0) {
+            if (dc->callback(dc->ctx, AVSTOR_DIFF_ADDED, NULL, &cb->node)) {
+                result = AVSTOR_ABORT;
+                goto done;
+            }
+            result = diff_cursor_next(cb);
+        }
+        else {
+            if (flags & AVSTOR_VALUES) {
+                int changed;
+                if (AVSTOR_OK != (result = diff_values(&ca->node, &cb->node, &changed))) {
+                    goto done;
                 }
-#endif
-                if (NODE_TYPE(node) == AVSTOR_TYPE_LINK) {
-                    /* if deleting link, we must also delete backlink */
-                    delete_backlink(db, node);
+                if (changed && dc->callback(dc->ctx, AVSTOR_DIFF_CHANGED, &ca->node, &cb->node)) {
+                    result = AVSTOR_ABORT;
+                    goto done;
                 }
-                delete_node(db, node, &st);
-                unlock_ptr(node);
-                result = AVSTOR_OK;
             }
-            else {
-                unlock_ptr_checked(last_ref);
-                result = AVSTOR_NOTFOUND;
+            else if (AVSTOR_OK != (result = diff_keys(&ca->node, &cb->node, dc))) {
+                goto done;
+            }
+            if (AVSTOR_OK == (result = diff_cursor_next(ca))) {
+                result = diff_cursor_next(cb);
             }
-            break;
         }
-        unlock_ptr_checked(parent_node);
-    }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(last_ref);
-        unlock_ptr_checked(node);
-        unlock_ptr_checked(parent_node);
-        rollback(db);
-        result = ex.err;
+        if (result != AVSTOR_OK) {
+            goto done;
+        }
     }
-    END_TRY(ex);
-    rwl_release(&db->global_rwl);
+done:
+    free(ca);
     return result;
 }
 
-//static __inline void inorder_state_init(avstor_inorder *st, int flags)
-//{
-//    st->top = -1;
-//    st->flags = flags;
-//}
-
-static __inline int inorder_state_isempty(avstor_inorder *st)
-{
-    return st->top < 0;
-}
+/*
+* Compares the hierarchies below node_a and node_b (which may belong to different files) and
+* reports added, removed and changed nodes through the callback. Children are merge-walked in key
+* order, so both hierarchies must be ordered by the supplied comparer, or bytewise if comparer is
+* NULL. Only the topmost node of an added or removed subtree is reported.
+*/
+int AVCALL avstor_diff(const avstor_node *node_a, const avstor_node *node_b,
+                       int (*comparer)(const void *, const void *),
+                       avstor_diff_callback callback, void *ctx)
+{
+    DiffContext dc;
+
+    CHECK_PARAM(node_a && node_a->db && node_b && node_b->db && callback);
+    dc.comparer = comparer;
+    dc.callback = callback;
+    dc.ctx = ctx;
+    return diff_keys(node_a, node_b, &dc);
+}
+
+// Children of one side of avstor_join, walked in key order
+typedef struct JoinCursor {
+    avstor_inorder      st;
+    avstor_off          root;
+    avstor_off          cur;        // current node, 0 past the last one
+    AvSearchKey         sk;         // name of the current node, to compare with the other side
+    avstor_key          name;
+    unsigned char       buf[256];
+} JoinCursor;
+
+#define JOIN_BATCH              64u     // pairs found by avstor_join between callbacks
+#define JOIN_STEPS              8u      // steps of a cursor behind the other before it seeks
+
+// Pairs reported by a join mode
+#define JOIN_ONLY_A             1u
+#define JOIN_ONLY_B             2u
+#define JOIN_BOTH               4u
+
+static const unsigned JOIN_MODES[] = {
+    0,
+    JOIN_BOTH,                                  // AVSTOR_JOIN_INTERSECT
+    JOIN_ONLY_A | JOIN_ONLY_B | JOIN_BOTH,      // AVSTOR_JOIN_UNION
+    JOIN_ONLY_A,                                // AVSTOR_JOIN_DIFFERENCE
+    JOIN_ONLY_A | JOIN_ONLY_B                   // AVSTOR_JOIN_SYMMETRIC
+};
 
-static __inline int inorder_state_push(avstor_inorder *st, avstor_off item)
+// Loads the name of the current node, or marks the cursor as ended if there is none
+static void join_load(JoinCursor *c)
 {
-    if (st->top < AVSTOR_AVL_HEIGHT - 1) {
-        st->ref[++st->top] = item;
-        return 1;
+    AvNode *node;
+    size_t szname;
+    if (inorder_state_isempty(&c->st)) {
+        c->cur = 0;
+        return;
+    }
+    c->cur = inorder_state_top(&c->st);
+    node = lock_unlock_node(c->st.db, c->cur, NULL, inorder_cache_flags(&c->st));
+    szname = (node->szname & NAME_INTERNED) ? get_interned_name(c->st.db, node)->len : node->szname;
+    memcpy(c->buf, get_node_name_ptr(c->st.db, node), szname);
+    unlock_ptr(c->st.db, node);
+    c->name.len = szname;
+    c->sk.prefix = get_name_prefix(c->buf, szname);
+}
+
+static void join_first(JoinCursor *c, avstor *db, const avstor_node *parent, int flags)
+{
+    AvNode *parent_node = NULL;
+    avstor_node out;
+    c->st.db = db;
+    c->st.top = -1;
+    c->st.flags = flags;
+    c->name.buf = c->buf;
+    c->name.comparer = NULL;
+    c->sk.key = &c->name;
+    c->sk.id = NAME_ID_NONE;
+    if (parent->ref != 0) {
+        parent_node = lock_keyref(parent);
+    }
+    if (flags & AVSTOR_VALUES) {
+        c->root = nref_to_ofs(get_node_data(parent_node)->vkey.value_root);
     }
     else {
-        return 0;
+        c->root = nref_to_ofs(!parent_node ? db->cache.header->root : get_node_data(parent_node)->vkey.subkey_root);
     }
+    unlock_ptr_checked(db, parent_node);
+    (void)inorder_next(&c->st, c->root, &out);
+    join_load(c);
 }
 
-static __inline avstor_off inorder_state_pop(avstor_inorder *st)
+static void join_next(JoinCursor *c)
 {
-    assert(st->top >= 0);
-    return st->ref[st->top--];
+    avstor_node out;
+    AvNode *node = lock_unlock_node(c->st.db, inorder_state_pop(&c->st), NULL, inorder_cache_flags(&c->st));
+    avstor_off ofs = nref_to_ofs(node->right);
+    unlock_ptr(c->st.db, node);
+    (void)inorder_next(&c->st, ofs, &out);
+    join_load(c);
 }
 
-static __inline avstor_off inorder_state_top(avstor_inorder *st)
+// Compares the current names of two cursors that have not ended
+static __inline int join_compare(const JoinCursor *a, const JoinCursor *b)
 {
-    assert(st->top >= 0);
-    return st->ref[st->top];
+    return compare_bytes(&a->sk, b->buf, b->name.len);
 }
 
-static avstor_off find_node_for_inorder(avstor_inorder *st, const avstor_key *key, avstor_off ofs)
+// Moves a cursor to the first name not less than that of the other cursor. A few steps are taken
+// first, the cursor seeks from the root of its tree if the other one is further ahead.
+static void join_skip(JoinCursor *c, const JoinCursor *target)
 {
-    AvNode *cur = NULL;
-    avstor_off result = 0;
-    int is_descending = (st->flags & AVSTOR_DESCENDING);
-    avstor *db = st->db;
-
-    if (ofs != 0) {
-        int comp;
-        cur = lock_node(db, ofs);
-        comp = key->comparer(key->buf, cur->name);
-
-        while (1) {
-            if (((is_descending ? -comp : comp) <= 0) && !inorder_state_push(st, ofs)) {
-                // Push node if greater than or equal to name
-                unlock_ptr(cur);
-                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_OVERFLOW);
-            }
-            if (comp == 0) {
-                result = ofs;
-                break;  // Node found
-            }
-            ofs = nref_to_ofs((comp < 0) ? cur->left : cur->right);
-            if (ofs == 0) {
-                break;  // Node not found
-            }
-            cur = lock_unlock_node(db, ofs, cur);
-            comp = key->comparer(key->buf, cur->name);
+    unsigned i;
+    for (i = 0; i < JOIN_STEPS; ++i) {
+        if (c->cur == 0 || join_compare(c, target) >= 0) {
+            return;
         }
-        unlock_ptr(cur);
+        join_next(c);
+    }
+    if (c->cur != 0 && join_compare(c, target) < 0) {
+        c->st.top = -1;
+        (void)find_node_for_inorder(&c->st, &target->name, c->root);
+        join_load(c);
     }
-    return result;
 }
 
-static int inorder_next(avstor_inorder *st, avstor_off ofs, avstor_node *out_node)
+// Merge-walks both cursors until count pairs of the mode are found or the result is complete
+static unsigned join_batch(JoinCursor *a, JoinCursor *b, unsigned mode, avstor_node *pairs, unsigned count)
 {
-    AvNode *node = NULL;
-    int is_descending = (st->flags & AVSTOR_DESCENDING);
-    while (st->top >= 0 || ofs != 0) {
-        if (ofs != 0) {
-            if (!inorder_state_push(st, ofs)) {
-                unlock_ptr_checked(node);
-                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_OVERFLOW);
+    unsigned n = 0;
+    while (n < count) {
+        int comp;
+        if ((a->cur == 0 && (b->cur == 0 || !(mode & JOIN_ONLY_B))) || (b->cur == 0 && !(mode & JOIN_ONLY_A))) {
+            break;
+        }
+        comp = a->cur == 0 ? 1 : b->cur == 0 ? -1 : join_compare(a, b);
+        if (comp < 0) {
+            if (mode & JOIN_ONLY_A) {
+                avstor_node_set(&pairs[n * 2], a->cur, a->st.db);
+                avstor_node_set(&pairs[n * 2 + 1], 0, NULL);
+                n++;
+                join_next(a);
+            }
+            else {
+                join_skip(a, b);
+            }
+        }
+        else if (comp > 0) {
+            if (mode & JOIN_ONLY_B) {
+                avstor_node_set(&pairs[n * 2], 0, NULL);
+                avstor_node_set(&pairs[n * 2 + 1], b->cur, b->st.db);
+                n++;
+                join_next(b);
+            }
+            else {
+                join_skip(b, a);
             }
-            node = lock_unlock_node(st->db, ofs, node);
-            ofs = nref_to_ofs(is_descending ? node->right : node->left);
         }
         else {
-            if (inorder_state_isempty(st)) {
-                unlock_ptr_checked(node);
-                THROW(AVSTOR_CORRUPT, MSG_BACKTRACE_UNDERFLOW);
+            if (mode & JOIN_BOTH) {
+                avstor_node_set(&pairs[n * 2], a->cur, a->st.db);
+                avstor_node_set(&pairs[n * 2 + 1], b->cur, b->st.db);
+                n++;
             }
-            unlock_ptr_checked(node);
-            avstor_node_set(out_node, inorder_state_top(st), st->db);
-            return AVSTOR_OK;
+            join_next(a);
+            join_next(b);
         }
     }
-    unlock_ptr_checked(node);
-    st->top = -1;
-    return AVSTOR_NOTFOUND;
+    return n;
 }
 
-int AVCALL avstor_inorder_first(avstor_inorder *st, const avstor_node *parent, const avstor_key *key,
-                                int flags, avstor_node *out_node)
-{
-    avstor *db;
-    AvNode *volatile parent_node = NULL;
-    int result;
-    int isvalue = (flags & AVSTOR_VALUES);
-
-    CHECK_PARAM(st && parent && parent->db && out_node);
-    if ((key && is_invalid_avstor_key(key)) || (isvalue && parent->ref == 0)) {
+/*
+* Computes a set operation (AVSTOR_JOIN_*) on the names of the children (keys, or values with
+* AVSTOR_VALUES) of node_a and node_b, which may belong to different files, and reports the names
+* in the result through the callback in bytewise order. Both trees are walked once in order. When
+* only names of one side can be in the result, the other side seeks ahead with a search from its
+* root instead of stepping through names that cannot match, so the cost of an intersection of a
+* small and a large tree depends little on the larger one. The shared locks of the files are
+* released every JOIN_BATCH pairs to run the callbacks, which may read but should not modify the
+* children being joined.
+*/
+int AVCALL avstor_join(const avstor_node *node_a, const avstor_node *node_b, int mode, int flags,
+                       avstor_join_callback callback, void *ctx)
+{
+    avstor_node mount_a, mount_b, pairs[JOIN_BATCH * 2];
+    // volatile because set twice when a node is a mount point
+    const avstor_node *volatile resolved_a, *volatile resolved_b;
+    JoinCursor *cursors;
+    avstor *db_a, *db_b;
+    unsigned count, i;
+    // volatile because modified in TRY and CATCH and referenced after them
+    volatile int result = AVSTOR_OK;
+    volatile int started = 0;
+
+    CHECK_PARAM(node_a && node_a->db && node_b && node_b->db && callback);
+    if (mode < AVSTOR_JOIN_INTERSECT || mode > AVSTOR_JOIN_SYMMETRIC
+        || ((flags & AVSTOR_VALUES) && (node_a->ref == 0 || node_b->ref == 0))) {
         RETURN(AVSTOR_PARAM, MSG_INVALID_PARAMETER);
     }
-    db = parent->db;
-
-    st->db = db;
-    st->top = -1;
-    st->flags = flags;
-    rwl_lock_shared(&db->global_rwl);
-    TRY(ex)
-    {
-        avstor_off ofs;
-        if (parent->ref != 0) {
-            parent_node = lock_keyref(parent);
+    flags &= AVSTOR_VALUES | AVSTOR_SCAN;
+    resolved_a = resolve_mount(node_a, flags, &mount_a);
+    resolved_b = resolve_mount(node_b, flags, &mount_b);
+    db_a = resolved_a->db;
+    db_b = resolved_b->db;
+    if (!(cursors = malloc(sizeof(JoinCursor) * 2))) {
+        RETURN(AVSTOR_NOMEM, MSG_OUT_OF_MEMORY);
+    }
+    do {
+        // files are locked in a fixed order, so that joins in opposite directions cannot deadlock
+        rwl_lock_shared(&((uintptr_t)db_a < (uintptr_t)db_b ? db_a : db_b)->global_rwl);
+        if (db_b != db_a) {
+            rwl_lock_shared(&((uintptr_t)db_a < (uintptr_t)db_b ? db_b : db_a)->global_rwl);
         }
-        if (isvalue) {
-            ofs = nref_to_ofs(get_node_data(parent_node)->vkey.value_root);
+        TRY(ex)
+        {
+            if (!started) {
+                join_first(&cursors[0], db_a, resolved_a, flags);
+                join_first(&cursors[1], db_b, resolved_b, flags);
+                started = 1;
+            }
+            count = join_batch(&cursors[0], &cursors[1], JOIN_MODES[mode], pairs, JOIN_BATCH);
         }
-        else {
-            ofs = nref_to_ofs(!parent_node ? db->cache.header->root : get_node_data(parent_node)->vkey.subkey_root);
+        CATCH_ANY(ex)
+        {
+            count = 0;
+            result = ex.err;
         }
-        unlock_ptr_checked(parent_node);
-        parent_node = NULL;
-        if (key) {
-            avstor_off fref = find_node_for_inorder(st, key, ofs);
-            if (fref != 0) {
-                avstor_node_set(out_node, fref, db);
-                result = AVSTOR_OK;
-            }
-            else {
-                // if node not found, next highest (or lowest) one is on the top of the stack
-                if (!inorder_state_isempty(st)) {
-                    //don't pop yet, right (or left) subtree needs to be traversed.
-                    avstor_node_set(out_node, inorder_state_top(st), db);
-                    result = AVSTOR_OK;
-                }
-                else {
-                    result = AVSTOR_NOTFOUND;
-                }
+        END_TRY(ex);
+        if (db_b != db_a) {
+            rwl_release(&db_b->global_rwl);
+        }
+        rwl_release(&db_a->global_rwl);
+
+        for (i = 0; i < count && result == AVSTOR_OK; ++i) {
+            if (callback(ctx, pairs[i * 2].db ? &pairs[i * 2] : NULL, pairs[i * 2 + 1].db ? &pairs[i * 2 + 1] : NULL)) {
+                result = AVSTOR_ABORT;
             }
         }
-        else {
-            result = inorder_next(st, ofs, out_node);
+    } while (result == AVSTOR_OK && count == JOIN_BATCH);
+    free(cursors);
+    return result;
+}
+
+/*
+* Tuple keys. Fields are encoded so that comparing encoded tuples byte by byte, as keys without a
+* comparer are (see avstor_key), orders them field by field:
+* - each field starts with its type, so fields of different types order by type
+* - integers are stored big-endian with the sign bit flipped
+* - doubles are stored big-endian with the sign bit flipped if positive, all bits if negative
+* - bytes are terminated by 0x00, a 0x00 byte in the data is escaped as 0x00 0xFF
+* No field starts with 0x00 or 0xFF, so a tuple followed by 0xFF is greater than all tuples that
+* start with its fields, see avstor_tuple_range_end.
+*/
+#define TUPLE_ESCAPE            0xFFu
+
+// Initializes a tuple to be encoded into buf
+void AVCALL avstor_tuple_init(avstor_tuple *tuple, void *buf, size_t size)
+{
+    CHECK_PARAM(tuple && buf);
+    tuple->buf = (unsigned char*)buf;
+    tuple->size = size;
+    tuple->len = 0;
+    tuple->pos = 0;
+}
+
+// Initializes a tuple to decode the len bytes of an encoded tuple, such as a name
+void AVCALL avstor_tuple_parse(avstor_tuple *tuple, const void *buf, size_t len)
+{
+    CHECK_PARAM(tuple && buf);
+    tuple->buf = (unsigned char*)buf;
+    tuple->size = len;
+    tuple->len = len;
+    tuple->pos = 0;
+}
+
+static int tuple_add_uint64(avstor_tuple *tuple, unsigned type, uint64_t value)
+{
+    unsigned i;
+    if (tuple->size - tuple->len < 1 + sizeof(value)) {
+        RETURN(AVSTOR_PARAM, "Tuple buffer too small");
+    }
+    tuple->buf[tuple->len++] = (unsigned char)type;
+    for (i = 0; i < sizeof(value); ++i) {
+        tuple->buf[tuple->len++] = (unsigned char)(value >> (56 - i * 8));
+    }
+    return AVSTOR_OK;
+}
+
+int AVCALL avstor_tuple_add_int64(avstor_tuple *tuple, int64_t value)
+{
+    CHECK_PARAM(tuple);
+    return tuple_add_uint64(tuple, AVSTOR_TUPLE_INT64, (uint64_t)value ^ ((uint64_t)1 << 63));
+}
+
+int AVCALL avstor_tuple_add_double(avstor_tuple *tuple, double value)
+{
+    uint64_t bits;
+    CHECK_PARAM(tuple);
+    memcpy(&bits, &value, sizeof(bits));
+    bits = (bits >> 63) ? ~bits : bits ^ ((uint64_t)1 << 63);
+    return tuple_add_uint64(tuple, AVSTOR_TUPLE_DOUBLE, bits);
+}
+
+int AVCALL avstor_tuple_add_bytes(avstor_tuple *tuple, const void *value, size_t len)
+{
+    const unsigned char *cp = (const unsigned char*)value;
+    size_t i, enclen = len + 2;
+
+    CHECK_PARAM(tuple && (value || len == 0));
+    for (i = 0; i < len; ++i) {
+        if (cp[i] == 0) {
+            enclen++;
         }
     }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(parent_node);
-        result = ex.err;
+    if (tuple->size - tuple->len < enclen) {
+        RETURN(AVSTOR_PARAM, "Tuple buffer too small");
+    }
+    tuple->buf[tuple->len++] = AVSTOR_TUPLE_BYTES;
+    for (i = 0; i < len; ++i) {
+        tuple->buf[tuple->len++] = cp[i];
+        if (cp[i] == 0) {
+            tuple->buf[tuple->len++] = TUPLE_ESCAPE;
+        }
+    }
+    tuple->buf[tuple->len++] = 0;
+    return AVSTOR_OK;
+}
+
+// Adds a string without its terminating null
+int AVCALL avstor_tuple_add_string(avstor_tuple *tuple, const char *value)
+{
+    CHECK_PARAM(value);
+    return avstor_tuple_add_bytes(tuple, value, strlen(value));
+}
+
+/*
+* Turns a tuple into the exclusive upper bound of the range of tuples that start with its fields.
+* The tuple itself is the lower bound: a scan from avstor_inorder_first with the tuple before this
+* call visits the range until a name is not less than the tuple after it.
+*/
+int AVCALL avstor_tuple_range_end(avstor_tuple *tuple)
+{
+    CHECK_PARAM(tuple);
+    if (tuple->len == tuple->size) {
+        RETURN(AVSTOR_PARAM, "Tuple buffer too small");
+    }
+    tuple->buf[tuple->len++] = TUPLE_ESCAPE;
+    return AVSTOR_OK;
+}
+
+// Sets key to the encoded tuple, ordered bytewise
+void AVCALL avstor_tuple_key(const avstor_tuple *tuple, avstor_key *key)
+{
+    CHECK_PARAM(tuple && key);
+    key->buf = tuple->buf;
+    key->len = tuple->len;
+    key->comparer = NULL;
+}
+
+// Returns the type of the next field, AVSTOR_TUPLE_END if there are no more fields. Names read
+// with avstor_get_name are zero padded, which reads as the end of the tuple.
+int AVCALL avstor_tuple_type(const avstor_tuple *tuple)
+{
+    CHECK_PARAM(tuple);
+    return tuple->pos < tuple->len ? tuple->buf[tuple->pos] : AVSTOR_TUPLE_END;
+}
+
+static int tuple_get_uint64(avstor_tuple *tuple, unsigned type, uint64_t *out_val)
+{
+    uint64_t value = 0;
+    unsigned i;
+    int next = avstor_tuple_type(tuple);
+    if (next == AVSTOR_TUPLE_END) {
+        return AVSTOR_NOTFOUND;
+    }
+    if ((unsigned)next != type) {
+        RETURN(AVSTOR_MISMATCH, "Tuple field type mismatch");
+    }
+    if (tuple->len - tuple->pos < 1 + sizeof(value)) {
+        RETURN(AVSTOR_CORRUPT, "Truncated tuple");
+    }
+    tuple->pos++;
+    for (i = 0; i < sizeof(value); ++i) {
+        value = (value << 8) | tuple->buf[tuple->pos++];
+    }
+    *out_val = value;
+    return AVSTOR_OK;
+}
+
+// Decoders return AVSTOR_NOTFOUND after the last field and AVSTOR_MISMATCH if the next field has
+// another type, without moving to the next field
+int AVCALL avstor_tuple_get_int64(avstor_tuple *tuple, int64_t *out_val)
+{
+    uint64_t bits;
+    int result;
+    CHECK_PARAM(tuple && out_val);
+    if (AVSTOR_OK == (result = tuple_get_uint64(tuple, AVSTOR_TUPLE_INT64, &bits))) {
+        bits ^= (uint64_t)1 << 63;
+        memcpy(out_val, &bits, sizeof(bits));
     }
-    END_TRY(ex);
-    rwl_release(&db->global_rwl);
     return result;
 }
 
-int AVCALL avstor_inorder_next(avstor_inorder *st, avstor_node *out_node)
+int AVCALL avstor_tuple_get_double(avstor_tuple *tuple, double *out_val)
 {
-    AvNode *volatile node = NULL;
+    uint64_t bits;
     int result;
+    CHECK_PARAM(tuple && out_val);
+    if (AVSTOR_OK == (result = tuple_get_uint64(tuple, AVSTOR_TUPLE_DOUBLE, &bits))) {
+        bits = (bits >> 63) ? bits ^ ((uint64_t)1 << 63) : ~bits;
+        memcpy(out_val, &bits, sizeof(bits));
+    }
+    return result;
+}
 
-    CHECK_PARAM(st && out_node);
-    if (inorder_state_isempty(st)) {
-        avstor_node_set(out_node, 0, st->db);
+// Copies the data of a bytes field to buf and its length to *out_len. Returns AVSTOR_PARAM if
+// szbuf is too small, in which case *out_len is the length needed.
+int AVCALL avstor_tuple_get_bytes(avstor_tuple *tuple, void *buf, size_t szbuf, size_t *out_len)
+{
+    unsigned char *dest = (unsigned char*)buf;
+    size_t pos, len = 0;
+    int next;
+
+    CHECK_PARAM(tuple && (buf || szbuf == 0) && out_len);
+    if ((next = avstor_tuple_type(tuple)) == AVSTOR_TUPLE_END) {
         return AVSTOR_NOTFOUND;
     }
-    rwl_lock_shared(&st->db->global_rwl);
-    TRY(ex)
-    {
-        avstor_off ofs;
-        node = lock_node(st->db, inorder_state_pop(st));
-        ofs = nref_to_ofs((st->flags & AVSTOR_DESCENDING) ? node->left : node->right);
-        unlock_ptr(node);
-        node = NULL;
-        result = inorder_next(st, ofs, out_node);
+    if (next != AVSTOR_TUPLE_BYTES) {
+        RETURN(AVSTOR_MISMATCH, "Tuple field type mismatch");
     }
-    CATCH_ANY(ex)
-    {
-        unlock_ptr_checked(node);
-        result = ex.err;
+    for (pos = tuple->pos + 1; pos < tuple->len; ++pos) {
+        unsigned char c = tuple->buf[pos];
+        if (c == 0) {
+            if (pos + 1 >= tuple->len || tuple->buf[pos + 1] != TUPLE_ESCAPE) {
+                break;
+            }
+            pos++;
+        }
+        if (len < szbuf) {
+            dest[len] = c;
+        }
+        len++;
+    }
+    if (pos >= tuple->len) {
+        RETURN(AVSTOR_CORRUPT, "Truncated tuple");
+    }
+    *out_len = len;
+    if (len > szbuf) {
+        RETURN(AVSTOR_PARAM, "Buffer too small");
+    }
+    tuple->pos = pos + 1;
+    return AVSTOR_OK;
+}
+
+// Copies a bytes field to buf as a null terminated string
+int AVCALL avstor_tuple_get_string(avstor_tuple *tuple, char *buf, size_t szbuf)
+{
+    size_t len;
+    int result;
+    CHECK_PARAM(buf && szbuf > 0);
+    if (AVSTOR_OK == (result = avstor_tuple_get_bytes(tuple, buf, szbuf - 1, &len))) {
+        buf[len] = 0;
     }
-    END_TRY(ex);
-    rwl_release(&st->db->global_rwl);
     return result;
 }
 
+/*
+* Starts recording a trace of the library calls made by the calling thread into trace, which is
+* cleared first and must stay valid until avstor_trace_end. Recorded are the deepest tree level
+* reached by key lookups, key comparisons, cache hits and misses per page, bytes read and time
+* spent waiting for locks (thread-safe builds only).
+*/
+void AVCALL avstor_trace_begin(avstor_trace *trace)
+{
+    CHECK_PARAM(trace);
+    memset(trace, 0, sizeof(*trace));
+    cur_trace = trace;
+}
+
+// Stops recording the trace started by avstor_trace_begin on the calling thread
+void AVCALL avstor_trace_end(void)
+{
+    cur_trace = NULL;
+}
+
 const char* AVCALL avstor_get_errstr(void)
 {
     return last_err_msg;
@@ -0,0 +1,157 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <avstor.h>
+
+#include "timer.h"
+
+#define AVSCMP_CACHE_SIZE (32 * 1024)
+
+struct cmp_state {
+    avstor      *db_a;
+    avstor      *db_b;
+    avstor_off  pages;      // pages of the shorter file, those past it are extra
+    long        exchanges;
+    long        differing;
+    int         verbose;
+};
+
+/* Compares the children of a hash that differs, descending into those that differ as well */
+static int compare_children(struct cmp_state *st, unsigned level, avstor_off index)
+{
+    uint32_t hashes_a[AVSTOR_MERKLE_FANOUT], hashes_b[AVSTOR_MERKLE_FANOUT];
+    avstor_off first = index * AVSTOR_MERKLE_FANOUT;
+    unsigned count_a, count_b, i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_merkle_hashes(st->db_a, level - 1, first, hashes_a,
+                                                 AVSTOR_MERKLE_FANOUT, &count_a))
+        || AVSTOR_OK != (res = avstor_merkle_hashes(st->db_b, level - 1, first, hashes_b,
+                                                    AVSTOR_MERKLE_FANOUT, &count_b))) {
+        return res;
+    }
+    st->exchanges++;
+    for (i = 0; i < count_a && i < count_b; i++) {
+        if (hashes_a[i] == hashes_b[i]) {
+            continue;
+        }
+        if (level - 1 > 0) {
+            if (AVSTOR_OK != (res = compare_children(st, level - 1, first + i))) {
+                return res;
+            }
+        }
+        else if (first + i < st->pages) {
+            st->differing++;
+            if (st->verbose) printf("* page %lu\n", (unsigned long)(first + i));
+        }
+    }
+    return AVSTOR_OK;
+}
+
+static void show_copyright(void)
+{
+    printf("libavstor Database Compare Utility\n"
+           "BSD 3-Clause License\n"
+           "Copyright (c) 2025 Tamas Fejerpataky\n"
+           "See project at https://github.com/obseedian2024/libavstor\n\n");
+}
+
+static void show_help(void)
+{
+    printf("Usage: avscmp [-q] <filename1> <filename2>\n"
+           "\tcompares two files page by page using their page checksum trees and lists\n"
+           "\tthe pages that differ. Files without a checksum tree are read to build one.\n"
+           "\t-q only prints the number of differences.\n\n"
+           "Example: avscmp replica1.db replica2.db\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Timer tm;
+    struct cmp_state st;
+    uint32_t root_a, root_b;
+    unsigned levels_a, levels_b;
+    avstor_off pages_a, pages_b;
+    int res, arg = 1;
+
+    show_copyright();
+
+    st.exchanges = st.differing = 0;
+    st.verbose = 1;
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'q' && argv[1][2] == 0) {
+        st.verbose = 0;
+        arg++;
+    }
+    if (argc - arg != 2) {
+        show_help();
+        return 0;
+    }
+
+    timer_start(&tm);
+    if (AVSTOR_OK != (res = avstor_open(&st.db_a, argv[arg], AVSCMP_CACHE_SIZE,
+                                        AVSTOR_OPEN_READONLY | AVSTOR_OPEN_MERKLE))) {
+        fprintf(stderr, "avstor_open failed on %s with %i\n", argv[arg], res);
+        return 1;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&st.db_b, argv[arg + 1], AVSCMP_CACHE_SIZE,
+                                        AVSTOR_OPEN_READONLY | AVSTOR_OPEN_MERKLE))) {
+        fprintf(stderr, "avstor_open failed on %s with %i\n", argv[arg + 1], res);
+        avstor_close(st.db_a);
+        return 1;
+    }
+
+    if (AVSTOR_OK == (res = avstor_merkle_root(st.db_a, &root_a, &levels_a, &pages_a))
+        && AVSTOR_OK == (res = avstor_merkle_root(st.db_b, &root_b, &levels_b, &pages_b))) {
+        st.pages = pages_a < pages_b ? pages_a : pages_b;
+        st.exchanges = 1;
+        if (root_a != root_b || levels_a != levels_b) {
+            /* hashes of a level cover the same pages in both files, and the shorter file has a
+               single hash at its top level, so the descent starts there */
+            res = compare_children(&st, (levels_a < levels_b ? levels_a : levels_b) - 1, 0);
+        }
+    }
+    timer_stop(&tm);
+
+    if (res != AVSTOR_OK) {
+        fprintf(stderr, "Comparison failed with %i\n", res);
+    }
+    else {
+        printf("Done in %f seconds.\n%li pages differ, %lu extra pages, %li hash exchanges\n",
+               tm.secs, st.differing,
+               (unsigned long)(pages_a > pages_b ? pages_a - pages_b : pages_b - pages_a), st.exchanges);
+    }
+    avstor_close(st.db_b);
+    avstor_close(st.db_a);
+    return res == AVSTOR_OK ? 0 : 1;
+}
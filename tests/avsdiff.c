@@ -0,0 +1,152 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "timer.h"
+
+#define AVSDIFF_CACHE_SIZE (32 * 1024)
+
+struct diff_counts {
+    long        added;
+    long        removed;
+    long        changed;
+    int         verbose;
+};
+
+static void print_node(const char *prefix, const avstor_node *node)
+{
+    AvsDbIntRec name;
+    avstor_key key;
+    unsigned type;
+
+    key.buf = &name;
+    key.len = sizeof(name);
+    key.comparer = NULL;
+    if (AVSTOR_OK != avstor_get_name(node, &key) || AVSTOR_OK != avstor_get_type(node, &type)) {
+        printf("%s <unreadable node>\n", prefix);
+        return;
+    }
+    printf("%s %s %li (data %li)\n", prefix, type == AVSTOR_TYPE_KEY ? "key" : "value",
+           (long)name.key, (long)name.data);
+}
+
+static int diff_callback(void *ctx, int change, const avstor_node *node_a, const avstor_node *node_b)
+{
+    struct diff_counts *counts = (struct diff_counts*)ctx;
+    switch (change) {
+    case AVSTOR_DIFF_ADDED:
+        counts->added++;
+        if (counts->verbose) print_node("+", node_b);
+        break;
+    case AVSTOR_DIFF_REMOVED:
+        counts->removed++;
+        if (counts->verbose) print_node("-", node_a);
+        break;
+    default:
+        counts->changed++;
+        if (counts->verbose) print_node("*", node_a);
+        break;
+    }
+    return 0;
+}
+
+static void show_copyright(void)
+{
+    printf("libavstor Database Diff Utility\n"
+           "BSD 3-Clause License\n"
+           "Copyright (c) 2025 Tamas Fejerpataky\n"
+           "See project at https://github.com/obseedian2024/libavstor\n\n");
+}
+
+static void show_help(void)
+{
+    printf("Usage: avsdiff [-q] <filename1> <filename2>\n"
+           "\tcompares two files created by avscrdb and lists the keys and values\n"
+           "\tthat were added, removed or changed in the second file.\n"
+           "\t-q only prints the number of differences.\n\n"
+           "Example: avsdiff old.db new.db\n");
+}
+
+int main(int argc, char *argv[])
+{
+    Timer tm;
+    avstor *db_a, *db_b;
+    avstor_node root_a, root_b;
+    struct diff_counts counts;
+    int res, arg = 1;
+
+    show_copyright();
+
+    counts.added = counts.removed = counts.changed = 0;
+    counts.verbose = 1;
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'q' && argv[1][2] == 0) {
+        counts.verbose = 0;
+        arg++;
+    }
+    if (argc - arg != 2) {
+        show_help();
+        return 0;
+    }
+
+    if (AVSTOR_OK != (res = avstor_open(&db_a, argv[arg], AVSDIFF_CACHE_SIZE, AVSTOR_OPEN_READONLY))) {
+        fprintf(stderr, "avstor_open failed on %s with %i\n", argv[arg], res);
+        return 1;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&db_b, argv[arg + 1], AVSDIFF_CACHE_SIZE, AVSTOR_OPEN_READONLY))) {
+        fprintf(stderr, "avstor_open failed on %s with %i\n", argv[arg + 1], res);
+        avstor_close(db_a);
+        return 1;
+    }
+    avstor_node_init(db_a, &root_a);
+    avstor_node_init(db_b, &root_b);
+
+    timer_start(&tm);
+    res = avstor_diff(&root_a, &root_b, &AvsIntNode_comparer, &diff_callback, &counts);
+    timer_stop(&tm);
+
+    if (res != AVSTOR_OK) {
+        fprintf(stderr, "avstor_diff failed with %i\n", res);
+    }
+    else {
+        printf("Done in %f seconds.\n%li added, %li removed, %li changed\n",
+               tm.secs, counts.added, counts.removed, counts.changed);
+    }
+    avstor_node_destroy(&root_a);
+    avstor_node_destroy(&root_b);
+    avstor_close(db_b);
+    avstor_close(db_a);
+    return res == AVSTOR_OK ? 0 : 1;
+}
@@ -218,9 +218,57 @@ void avstest_print_err(const char *msg)
 int is_term;
 
 IMPORT_TESTS(DFS);
+IMPORT_TESTS(DIFF);
+IMPORT_TESTS(MOUNT);
+IMPORT_TESTS(IMPORT);
+IMPORT_TESTS(DEDUP);
+IMPORT_TESTS(TIER);
+IMPORT_TESTS(PIN);
+IMPORT_TESTS(MEMORY);
+IMPORT_TESTS(SCHED);
+IMPORT_TESTS(TRACE);
+IMPORT_TESTS(NAMES);
+IMPORT_TESTS(PREFIX);
+IMPORT_TESTS(TUPLE);
+IMPORT_TESTS(ARENA);
+IMPORT_TESTS(PAGE64);
+IMPORT_TESTS(MMAP);
+IMPORT_TESTS(CACHE);
+IMPORT_TESTS(WBUF);
+IMPORT_TESTS(LOOKUP);
+IMPORT_TESTS(MERKLE);
+IMPORT_TESTS(KEYSTATS);
+IMPORT_TESTS(ROLLUP);
+IMPORT_TESTS(SAMPLE);
+IMPORT_TESTS(JOIN);
+IMPORT_TESTS(PARENTS);
 
 static const AvsTests* ALL_TESTS[] = {
     &DFS_TESTS,
+    &DIFF_TESTS,
+    &MOUNT_TESTS,
+    &IMPORT_TESTS,
+    &DEDUP_TESTS,
+    &TIER_TESTS,
+    &PIN_TESTS,
+    &MEMORY_TESTS,
+    &SCHED_TESTS,
+    &TRACE_TESTS,
+    &NAMES_TESTS,
+    &PREFIX_TESTS,
+    &TUPLE_TESTS,
+    &ARENA_TESTS,
+    &PAGE64_TESTS,
+    &MMAP_TESTS,
+    &CACHE_TESTS,
+    &WBUF_TESTS,
+    &LOOKUP_TESTS,
+    &MERKLE_TESTS,
+    &KEYSTATS_TESTS,
+    &ROLLUP_TESTS,
+    &SAMPLE_TESTS,
+    &JOIN_TESTS,
+    &PARENTS_TESTS,
     NULL
 };
 
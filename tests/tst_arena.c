@@ -0,0 +1,404 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+#if (defined(__STDC_VERSION__) && (__STDC_VERSION__ >=201112L))
+#include <threads.h>
+#else
+#include "../threads/threads.h"
+#endif
+#endif
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define ARENA_DB "arena.db"
+#define ARENA_MERGE_DB "arena_merge.db"
+#define ARENA_WRITERS 4
+#define ARENA_VALUE_COUNT 2000
+#define ARENA_PAGE_SIZE 4096
+#define ARENA_ROUNDS 8
+#define ARENA_ROUND_VALUES 100
+
+/* Pages allowed to hold values of several writers: the page of the writers' keys, and without
+   threads, the last page of each writer, which the next one continues in the same arena */
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+#define ARENA_MAX_SHARED 1
+#else
+#define ARENA_MAX_SHARED ARENA_WRITERS
+#endif
+
+struct arena_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+struct arena_writer {
+    avstor      *db;
+    int32_t     id;
+    int32_t     count;      /* values to create */
+    int         result;
+    avstor_off  *pages;     /* page of each value created */
+};
+
+/* Creates a key and values under it, one value per call */
+static int arena_write(void *arg)
+{
+    struct arena_writer *w = (struct arena_writer*)arg;
+    avstor_node root, node, value;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+
+    avstor_node_init(w->db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.key = w->id;
+    rec.data = w->id;
+    if (AVSTOR_OK != (w->result = avstor_create_key(&root, &key, &node))) {
+        return 0;
+    }
+    for (i = 0; i < w->count; i++) {
+        rec.key = i;
+        if (AVSTOR_OK != (w->result = avstor_create_int32(&node, &key, i, &value))) {
+            return 0;
+        }
+        w->pages[i] = value.ref / ARENA_PAGE_SIZE;
+    }
+    return 0;
+}
+
+static int arena_page_used(const struct arena_writer *w, avstor_off page)
+{
+    int32_t i;
+    for (i = 0; i < w->count; i++) {
+        if (w->pages[i] == page) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Allocates the page lists of writers creating count values each */
+static int arena_init_writers(avstor *db, struct arena_writer *writers, int n, int32_t count)
+{
+    int j;
+    memset(writers, 0, n * sizeof(*writers));
+    for (j = 0; j < n; j++) {
+        writers[j].db = db;
+        writers[j].id = j;
+        writers[j].count = count;
+        if (!(writers[j].pages = calloc(ARENA_VALUE_COUNT, sizeof(avstor_off)))) {
+            printf("%sERROR: out of memory%s\n", YEL, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void arena_free_writers(struct arena_writer *writers, int n)
+{
+    int j;
+    for (j = 0; j < n; j++) {
+        free(writers[j].pages);
+    }
+}
+
+/* Runs writers in threads of their own, or one after the other without threads */
+static int arena_run(struct arena_writer *writers, int n)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    thrd_t threads[ARENA_WRITERS];
+#endif
+    int j;
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    for (j = 0; j < n; j++) {
+        if (thrd_create(&threads[j], &arena_write, &writers[j]) != thrd_success) {
+            printf("%sERROR: thrd_create failed%s\n", YEL, CRESET);
+            while (j-- > 0) {
+                thrd_join(threads[j], NULL);
+            }
+            return 0;
+        }
+    }
+    for (j = 0; j < n; j++) {
+        thrd_join(threads[j], NULL);
+    }
+#else
+    for (j = 0; j < n; j++) {
+        arena_write(&writers[j]);
+    }
+#endif
+    for (j = 0; j < n; j++) {
+        if (writers[j].result != AVSTOR_OK) {
+            printf("%sERROR: writer %i failed with %i%s\n", YEL, j, writers[j].result, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Writers running at the same time insert their values into pages of their own */
+static int arena_concurrent(void *param)
+{
+    struct arena_param *p = (struct arena_param*)param;
+    struct arena_writer writers[ARENA_WRITERS];
+    avstor *db;
+    int32_t i;
+    int j, k, res, shared = 0, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_ARENAS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!arena_init_writers(db, writers, ARENA_WRITERS, ARENA_VALUE_COUNT)) {
+        goto cleanup;
+    }
+    if (!arena_run(writers, ARENA_WRITERS)) {
+        goto cleanup;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto cleanup;
+    }
+
+    for (j = 0; j < ARENA_WRITERS; j++) {
+        for (i = 0; i < ARENA_VALUE_COUNT; i++) {
+            if (i > 0 && writers[j].pages[i] == writers[j].pages[i - 1]) {
+                continue;
+            }
+            for (k = j + 1; k < ARENA_WRITERS; k++) {
+                if (arena_page_used(&writers[k], writers[j].pages[i])) {
+                    shared++;
+                    break;
+                }
+            }
+        }
+    }
+    if (shared > ARENA_MAX_SHARED) {
+        printf("%sERROR: %i pages hold values of several writers%s\n", YEL, shared, CRESET);
+        goto cleanup;
+    }
+    result = 1;
+cleanup:
+    arena_free_writers(writers, ARENA_WRITERS);
+    avstor_close(db);
+    return result;
+}
+
+/* The values written are all there after reopening without arenas */
+static int arena_verify(void *param)
+{
+    struct arena_param *p = (struct arena_param*)param;
+    avstor *db;
+    avstor_node root, node, value;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i, data;
+    int j, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (j = 0; j < ARENA_WRITERS; j++) {
+        rec.key = j;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            printf("%sERROR: key of writer %i not found (%i)%s\n", YEL, j, res, CRESET);
+            goto close_and_return;
+        }
+        for (i = 0; i < ARENA_VALUE_COUNT; i++) {
+            rec.key = i;
+            if (AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value))
+                || AVSTOR_OK != (res = avstor_get_int32(&value, &data)) || data != i) {
+                printf("%sERROR: value %i of writer %i mismatch (%i)%s\n", YEL, i, j, res, CRESET);
+                goto close_and_return;
+            }
+        }
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Values of all writers in a page */
+static int32_t arena_page_values(const struct arena_writer *writers, int n, avstor_off page)
+{
+    int32_t i, count = 0;
+    int j;
+    for (j = 0; j < n; j++) {
+        for (i = 0; i < writers[j].count; i++) {
+            count += writers[j].pages[i] == page;
+        }
+    }
+    return count;
+}
+
+/* Of the last pages of the writers, the file keeps the one with the fewest values to insert into
+   after the commit */
+static int arena_merge(void *param)
+{
+    struct arena_param *p = (struct arena_param*)param;
+    struct arena_writer writers[ARENA_WRITERS];
+    avstor *db;
+    avstor_off page = 0;
+    int32_t least = -1, count;
+    unsigned page_pool;
+    int j, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_ARENAS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!arena_init_writers(db, writers, ARENA_WRITERS, 0)) {
+        goto cleanup;
+    }
+    for (j = 0; j < ARENA_WRITERS; j++) {
+        writers[j].count = ARENA_VALUE_COUNT - j * 37;
+    }
+    if (!arena_run(writers, ARENA_WRITERS)) {
+        goto cleanup;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto cleanup;
+    }
+
+    for (j = 0; j < ARENA_WRITERS; j++) {
+        count = arena_page_values(writers, ARENA_WRITERS, writers[j].pages[writers[j].count - 1]);
+        if (least < 0 || count < least) {
+            least = count;
+        }
+    }
+    for (page_pool = 0; page_pool < 256 && page == 0; page_pool++) {
+        if (AVSTOR_OK != (res = avs_get_pool_page(db, page_pool, &page))) {
+            printf("%sERROR: avs_get_pool_page failed with %i%s\n", YEL, res, CRESET);
+            goto cleanup;
+        }
+        if (page != 0 && arena_page_values(writers, ARENA_WRITERS, page) == 0) {
+            page = 0;
+        }
+    }
+    if (page == 0) {
+        printf("%sERROR: no insertion page holds values%s\n", YEL, CRESET);
+        goto cleanup;
+    }
+    if ((count = arena_page_values(writers, ARENA_WRITERS, page)) != least) {
+        printf("%sERROR: insertion page holds %i values, expected %i%s\n", YEL, count, least, CRESET);
+        goto cleanup;
+    }
+    result = 1;
+cleanup:
+    arena_free_writers(writers, ARENA_WRITERS);
+    avstor_close(db);
+    return result;
+}
+
+/* The arenas of writers that finished are freed by the next commit */
+static int arena_release(void *param)
+{
+    struct arena_param *p = (struct arena_param*)param;
+    struct arena_writer writers[ARENA_WRITERS];
+    avstor *db;
+    avstor_memory mem;
+    size_t base;
+    int j, round, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_ARENAS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!arena_init_writers(db, writers, ARENA_WRITERS, ARENA_ROUND_VALUES)) {
+        goto cleanup;
+    }
+    /* the first write allocates cache items, which count as other memory too */
+    writers[0].id = ARENA_ROUNDS * ARENA_WRITERS;
+    arena_write(&writers[0]);
+    if (writers[0].result != AVSTOR_OK || AVSTOR_OK != (res = avstor_commit(db, 1))
+        || AVSTOR_OK != (res = avstor_memory_usage(db, &mem))) {
+        printf("%sERROR: first write failed with %i%s\n", YEL, writers[0].result != AVSTOR_OK
+               ? writers[0].result : res, CRESET);
+        goto cleanup;
+    }
+    base = mem.other;
+    for (round = 0; round < ARENA_ROUNDS; round++) {
+        for (j = 0; j < ARENA_WRITERS; j++) {
+            writers[j].id = round * ARENA_WRITERS + j;
+        }
+        if (!arena_run(writers, ARENA_WRITERS)) {
+            goto cleanup;
+        }
+        if (AVSTOR_OK != (res = avstor_commit(db, 1))
+            || AVSTOR_OK != (res = avstor_memory_usage(db, &mem))) {
+            printf("%sERROR: commit of round %i failed with %i%s\n", YEL, round, res, CRESET);
+            goto cleanup;
+        }
+        if (mem.other > base) {
+            printf("%sERROR: %u bytes more in use after round %i%s\n", YEL,
+                   (unsigned)(mem.other - base), round, CRESET);
+            goto cleanup;
+        }
+    }
+    result = 1;
+cleanup:
+    arena_free_writers(writers, ARENA_WRITERS);
+    avstor_close(db);
+    return result;
+}
+
+static const struct arena_param ARENA_PARAM = { ARENA_DB, 1024 };
+static const struct arena_param ARENA_MERGE_PARAM = { ARENA_MERGE_DB, 1024 };
+
+DEFINE_TEST_LIST(ARENA) {
+    { "Write from several threads with arenas", &arena_concurrent, AVSTEST_MUST_PASS, (void*)&ARENA_PARAM },
+    { "Read back values written with arenas", &arena_verify, 0, (void*)&ARENA_PARAM },
+    { "Keep the insertion page with the most free space at commit", &arena_merge, 0, (void*)&ARENA_MERGE_PARAM },
+    { "Free the arenas of finished writers at commit", &arena_release, 0, (void*)&ARENA_MERGE_PARAM }
+};
+
+DEFINE_TESTS(ARENA);
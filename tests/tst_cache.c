@@ -0,0 +1,351 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+#if (defined(__STDC_VERSION__) && (__STDC_VERSION__ >=201112L))
+#include <threads.h>
+#else
+#include "../threads/threads.h"
+#endif
+#endif
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define CACHE_DB "cache.db"
+#define CACHE_KEY_COUNT 20000
+#define CACHE_READERS 4
+#define CACHE_READS 5000
+#define CACHE_HOT_KEYS 2400
+#define CACHE_PAGE_KB 4
+
+struct cache_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+struct cache_reader {
+    avstor      *db;
+    uint32_t    seed;
+    int         result;
+    int32_t     failed;     /* key whose value was wrong */
+};
+
+static int cache_create_db(void *param)
+{
+    struct cache_param *p = (struct cache_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    remove(p->filename);
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < CACHE_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &key, i, NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+/* Reads the value of key i, which is i */
+static int cache_read(avstor *db, int32_t i)
+{
+    avstor_node root, node, value;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t data;
+    int res;
+
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.key = i;
+    rec.data = 0;
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+        || AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value))
+        || AVSTOR_OK != (res = avstor_get_int32(&value, &data))) {
+        return res;
+    }
+    return data == i ? AVSTOR_OK : AVSTOR_CORRUPT;
+}
+
+/* Reads random keys, so that the pages of some are hit while others are evicted or loaded */
+static int cache_read_random(void *arg)
+{
+    struct cache_reader *r = (struct cache_reader*)arg;
+    uint32_t x = r->seed;
+    int n;
+
+    for (n = 0; n < CACHE_READS; n++) {
+        int32_t i;
+        x = x * 1103515245u + 12345u;
+        i = (int32_t)((x >> 8) % CACHE_KEY_COUNT);
+        if (AVSTOR_OK != (r->result = cache_read(r->db, i))) {
+            r->failed = i;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+struct cache_readers {
+    struct cache_reader     r[CACHE_READERS];
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    thrd_t                  threads[CACHE_READERS];
+#endif
+    int                     started;
+};
+
+/* Starts the readers on threads of their own in thread-safe builds, otherwise they run when joined */
+static int cache_start_readers(avstor *db, struct cache_readers *rs)
+{
+    int j;
+
+    memset(rs, 0, sizeof(*rs));
+    for (j = 0; j < CACHE_READERS; j++) {
+        rs->r[j].db = db;
+        rs->r[j].seed = 7919u * (uint32_t)(j + 1);
+    }
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    for (; rs->started < CACHE_READERS; rs->started++) {
+        if (thrd_create(&rs->threads[rs->started], &cache_read_random, &rs->r[rs->started]) != thrd_success) {
+            printf("%sERROR: thrd_create failed%s\n", YEL, CRESET);
+            return 0;
+        }
+    }
+#endif
+    return 1;
+}
+
+/* Waits for the readers started, returning whether all of them read the right values */
+static int cache_join_readers(struct cache_readers *rs)
+{
+    int j, result = 1;
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    for (j = 0; j < rs->started; j++) {
+        thrd_join(rs->threads[j], NULL);
+    }
+    if (rs->started < CACHE_READERS) {
+        return 0;
+    }
+#else
+    for (j = 0; j < CACHE_READERS; j++) {
+        cache_read_random(&rs->r[j]);
+    }
+#endif
+    for (j = 0; j < CACHE_READERS; j++) {
+        if (rs->r[j].result != AVSTOR_OK) {
+            printf("%sERROR: reader %i failed with %i on key %i%s\n", YEL, j, rs->r[j].result,
+                   rs->r[j].failed, CRESET);
+            result = 0;
+        }
+    }
+    return result;
+}
+
+/* Readers hit pages of a cache much smaller than the file while other readers evict pages */
+static int cache_hits_racing_eviction(void *param)
+{
+    struct cache_param *p = (struct cache_param*)param;
+    struct cache_readers readers;
+    avstor *db;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    res = cache_start_readers(db, &readers);
+    if (!cache_join_readers(&readers) || !res) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avs_check_cache_consistency(db))) {
+        printf("%sERROR: cache inconsistent after concurrent reads%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Reads the first count keys, returning the cache misses */
+static int cache_read_first(avstor *db, int32_t count, unsigned *misses)
+{
+    avstor_trace trace;
+    int32_t i;
+    int res = AVSTOR_OK;
+
+    avstor_trace_begin(&trace);
+    for (i = 0; i < count && res == AVSTOR_OK; i++) {
+        res = cache_read(db, i);
+    }
+    avstor_trace_end();
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: reading key %i failed with %i%s\n", YEL, i - 1, res, CRESET);
+        return 0;
+    }
+    *misses = trace.cache_misses;
+    return 1;
+}
+
+/* Pages that fit in the cache together all stay cached, whatever their offsets */
+static int cache_working_set(void *param)
+{
+    struct cache_param *p = (struct cache_param*)param;
+    avstor *db;
+    unsigned cold, warm, pages = p->cache_size / CACHE_PAGE_KB;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!cache_read_first(db, CACHE_HOT_KEYS, &cold) || !cache_read_first(db, CACHE_HOT_KEYS, &warm)) {
+        goto close_and_return;
+    }
+    /* the working set must fill most of the cache for the test to tell anything */
+    if (cold < pages / 2 || cold > pages) {
+        printf("%sERROR: working set of %u pages does not fit a cache of %u%s\n", YEL, cold, pages, CRESET);
+        goto close_and_return;
+    }
+    if (warm != 0) {
+        printf("%sERROR: %u of %u pages of the working set evicted%s\n", YEL, warm, cold, CRESET);
+        goto close_and_return;
+    }
+    result = AVSTOR_OK == avs_check_cache_consistency(db);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Pins every key while readers run. The cache grows past its size to hold the pinned pages, and
+   its page table is replaced several times, by the pins and by readers that find no page to evict. */
+static int cache_table_growth(void *param)
+{
+    struct cache_param *p = (struct cache_param*)param;
+    struct cache_readers readers;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    avstor_memory usage;
+    unsigned misses;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res, started, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.data = 0;
+    started = cache_start_readers(db, &readers);
+    for (i = 0, res = AVSTOR_OK; i < CACHE_KEY_COUNT && started && res == AVSTOR_OK; i++) {
+        rec.key = i;
+        if (AVSTOR_OK == (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            res = avstor_pin_subtree(&node, AVSTOR_PRIORITY_PINNED);
+        }
+    }
+    if (!cache_join_readers(&readers) || !started) {
+        goto close_and_return;
+    }
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: pinning key %i failed with %i%s\n", YEL, i - 1, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_memory_usage(db, &usage);
+    if (usage.cache_capacity <= 8 * (p->cache_size / CACHE_PAGE_KB)) {
+        printf("%sERROR: cache did not grow past %u pages%s\n", YEL, usage.cache_capacity, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avs_check_cache_consistency(db))) {
+        printf("%sERROR: cache inconsistent after growing%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+    /* every page is pinned, so all of them are found through the grown table */
+    if (!cache_read_first(db, CACHE_KEY_COUNT, &misses)) {
+        goto close_and_return;
+    }
+    if (misses != 0) {
+        printf("%sERROR: %u pinned pages not found after the cache grew%s\n", YEL, misses, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct cache_param CACHE_PARAM = { CACHE_DB, 128 };
+static const struct cache_param CACHE_WORKING_SET_PARAM = { CACHE_DB, 256 };
+static const struct cache_param CACHE_GROWTH_PARAM = { CACHE_DB, 64 };
+
+DEFINE_TEST_LIST(CACHE) {
+    { "Create DB for cache", &cache_create_db, AVSTEST_MUST_PASS, (void*)&CACHE_PARAM },
+    { "Hit pages while other readers evict", &cache_hits_racing_eviction, 0, (void*)&CACHE_PARAM },
+    { "Keep a working set that fits in the cache", &cache_working_set, 0, (void*)&CACHE_WORKING_SET_PARAM },
+    { "Grow the page table while readers use it", &cache_table_growth, 0, (void*)&CACHE_GROWTH_PARAM }
+};
+
+DEFINE_TESTS(CACHE);
@@ -0,0 +1,250 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define DEDUP_DB "dedup.db"
+#define DEDUP_PLAIN_DB "dedup_plain.db"
+#define DEDUP_KEY_COUNT 2000
+#define DEDUP_VALUE_LEN 200
+
+struct dedup_param {
+    const char  *filename;
+    const char  *plain_filename;
+    unsigned    cache_size;
+};
+
+static long dedup_file_size(const char *filename)
+{
+    long size = -1;
+    FILE *f = fopen(filename, "rb");
+    if (f) {
+        if (fseek(f, 0, SEEK_END) == 0) {
+            size = ftell(f);
+        }
+        fclose(f);
+    }
+    return size;
+}
+
+/* Every key gets the same binary value, except every 10th key which gets a unique one */
+static int dedup_create_db(const char *filename, unsigned cache_size, int oflags)
+{
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    unsigned char value[DEDUP_VALUE_LEN];
+    int32_t i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, filename, cache_size, oflags | AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < DEDUP_KEY_COUNT; i++) {
+        memset(value, 'x', sizeof(value));
+        if (i % 10 == 0) {
+            memcpy(value, &i, sizeof(i));
+        }
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_binary(&node, &key, value, sizeof(value), NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+static int dedup_create(void *param)
+{
+    struct dedup_param *p = (struct dedup_param*)param;
+    long size, plain_size;
+    if (!dedup_create_db(p->filename, p->cache_size, AVSTOR_OPEN_DEDUP)
+        || !dedup_create_db(p->plain_filename, p->cache_size, 0)) {
+        return 0;
+    }
+    size = dedup_file_size(p->filename);
+    plain_size = dedup_file_size(p->plain_filename);
+    if (size <= 0 || size * 2 > plain_size) {
+        printf("%sERROR: deduplicated file is not smaller (%li vs %li bytes)%s\n", YEL, size, plain_size, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Reads back, updates and deletes all values */
+static int dedup_modify(void *param)
+{
+    struct dedup_param *p = (struct dedup_param*)param;
+    avstor *db;
+    avstor_node root, node, value_node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    unsigned char expected[DEDUP_VALUE_LEN], value[DEDUP_VALUE_LEN], update[DEDUP_VALUE_LEN];
+    size_t bytes;
+    uint32_t length;
+    unsigned type;
+    int32_t i;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_DEDUP))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    memset(update, 'y', sizeof(update));
+    for (i = 0; i < DEDUP_KEY_COUNT; i++) {
+        memset(expected, 'x', sizeof(expected));
+        if (i % 10 == 0) {
+            memcpy(expected, &i, sizeof(i));
+        }
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value_node))
+            || AVSTOR_OK != (res = avstor_get_value(&value_node, value, sizeof(value), &type, &bytes, &length))
+            || type != AVSTOR_TYPE_BINARY || length != DEDUP_VALUE_LEN
+            || memcmp(value, expected, sizeof(value)) != 0) {
+            printf("%sERROR: value mismatch at %i (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+        /* odd keys get a shorter value that is not deduplicated */
+        if (AVSTOR_OK != (res = avstor_update_binary(&value_node, update, (i & 1) ? 1 : sizeof(update)))
+            || AVSTOR_OK != (res = avstor_get_binary(&value_node, value, sizeof(value), &bytes, &length))
+            || value[0] != 'y' || length != ((i & 1) ? 1 : DEDUP_VALUE_LEN)) {
+            printf("%sERROR: update failed at %i (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    for (i = 0; i < DEDUP_KEY_COUNT; i++) {
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_delete(&node, AVSTOR_VALUES, &key))) {
+            printf("%sERROR: delete failed at %i (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Deduplicated values can be updated after reopening the file without AVSTOR_OPEN_DEDUP */
+static int dedup_reopen(void *param)
+{
+    struct dedup_param *p = (struct dedup_param*)param;
+    avstor *db;
+    avstor_node root, node, value_node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    unsigned char value[DEDUP_VALUE_LEN], update[DEDUP_VALUE_LEN];
+    size_t bytes;
+    uint32_t length;
+    int32_t i;
+    int res, result = 0;
+
+    if (!dedup_create_db(p->filename, p->cache_size, AVSTOR_OPEN_DEDUP)) {
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    memset(update, 'z', sizeof(update));
+    for (i = 0; i < DEDUP_KEY_COUNT; i++) {
+        memcpy(update, &i, sizeof(i));
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value_node))
+            || AVSTOR_OK != (res = avstor_update_binary(&value_node, update, sizeof(update)))) {
+            printf("%sERROR: update failed at %i (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < DEDUP_KEY_COUNT; i++) {
+        memcpy(update, &i, sizeof(i));
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value_node))
+            || AVSTOR_OK != (res = avstor_get_binary(&value_node, value, sizeof(value), &bytes, &length))
+            || length != DEDUP_VALUE_LEN || memcmp(value, update, sizeof(value)) != 0) {
+            printf("%sERROR: value mismatch at %i (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct dedup_param DEDUP_PARAM = { DEDUP_DB, DEDUP_PLAIN_DB, 1024 };
+
+DEFINE_TEST_LIST(DEDUP) {
+    { "Create DBs with duplicate values", &dedup_create, AVSTEST_MUST_PASS, (void*)&DEDUP_PARAM },
+    { "Read, update and delete duplicate values", &dedup_modify, 0, (void*)&DEDUP_PARAM },
+    { "Update duplicate values after reopening without deduplication", &dedup_reopen, 0, (void*)&DEDUP_PARAM }
+};
+
+DEFINE_TESTS(DEDUP);
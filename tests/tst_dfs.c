@@ -53,6 +53,7 @@ struct dfs_traversal_param {
     const char  *filename;
     unsigned    cache_size;
     int         max_levels;
+    int         inorder_flags;
 };
 
 long actual_node_total;
@@ -201,7 +202,7 @@ static int dfs_traversal_proc(avstor *db, avstor_node *parent,
     key.comparer = NULL;
     key.buf = &key_name;
 
-    top->result = avstor_inorder_first(&top->inorder_st, parent, NULL, AVSTOR_KEYS, &top->node);
+    top->result = avstor_inorder_first(&top->inorder_st, parent, NULL, param->inorder_flags, &top->node);
     if (top->result != AVSTOR_OK && top->result != AVSTOR_NOTFOUND) {
         printf("%sERROR: avstor_inorder_first failed with %i%s\n", YEL, top->result, CRESET);
         result = 0;
@@ -231,7 +232,7 @@ static int dfs_traversal_proc(avstor *db, avstor_node *parent,
             /* but process subtree of previous node first */
             if (level < param->max_levels - 1) {
                 top = &st[++level];
-                top->result = avstor_inorder_first(&top->inorder_st, &prev_node, NULL, AVSTOR_KEYS, &top->node);
+                top->result = avstor_inorder_first(&top->inorder_st, &prev_node, NULL, param->inorder_flags, &top->node);
                 if (top->result != AVSTOR_OK && top->result != AVSTOR_NOTFOUND) {
                     printf("%sERROR: avstor_inorder_first failed with %i%s\n", YEL, res, CRESET);
                     result = 0;
@@ -291,15 +292,118 @@ static int dfs_traversal_st(void *param)
 }
 
 static const long NODECOUNT_LIST[LEVEL_COUNT] = { 100, 100, 100 };
+
+/* Finds the top level keys and the children of the first one, a hot set of a few pages, and
+   returns the number of cache misses */
+static int dfs_find_hot_set(avstor *db, long top_count, unsigned *misses)
+{
+    avstor_trace trace;
+    avstor_node root, node, child;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res = AVSTOR_OK;
+
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.data = 0;
+    avstor_trace_begin(&trace);
+    for (i = 0; i < top_count && res == AVSTOR_OK; i++) {
+        rec.key = i;
+        res = avstor_find(&root, &key, AVSTOR_KEYS, &node);
+    }
+    rec.key = 0;
+    if (res == AVSTOR_OK && AVSTOR_OK == (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+        for (i = 0; i < top_count && res == AVSTOR_OK; i++) {
+            rec.key = i;
+            res = avstor_find(&node, &key, AVSTOR_KEYS, &child);
+        }
+    }
+    avstor_trace_end();
+    *misses = trace.cache_misses;
+    return res;
+}
+
+/* Warms the hot set in a newly opened database, traverses the file and returns the hot set misses
+   after the traversal */
+static int dfs_traversal_after_hot_set(struct dfs_traversal_param* p, unsigned *misses, int64_t *sum_values)
+{
+    avstor_node parent;
+    avstor *db;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &parent);
+    if (AVSTOR_OK != (res = dfs_find_hot_set(db, NODECOUNT_LIST[0], misses))
+        || AVSTOR_OK != (res = dfs_find_hot_set(db, NODECOUNT_LIST[0], misses)) || *misses != 0) {
+        printf("%sERROR: hot set does not fit in the cache (%i, %u misses)%s\n", YEL, res, *misses, CRESET);
+        goto close_and_return;
+    }
+    *sum_values = 0;
+    if (!dfs_traversal_proc(db, &parent, p, sum_values)
+        || AVSTOR_OK != (res = dfs_find_hot_set(db, NODECOUNT_LIST[0], misses))) {
+        printf("%sERROR: traversal failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Traverses the file with and without the scan hint in a cache much smaller than the file,
+   checking that only the scan with the hint leaves the hot set in the cache */
+static int dfs_traversal_scan(void *param)
+{
+    struct dfs_traversal_param* p = (struct dfs_traversal_param*)param;
+    struct dfs_traversal_param plain = *p;
+    unsigned misses, plain_misses;
+    int64_t actual_sum_values = 0;
+    int64_t expected_sum_values = (int64_t)actual_node_total * ((int64_t)actual_node_total - 1) / 2;
+
+    /* without the hint, the traversal evicts the hot set */
+    plain.inorder_flags &= ~AVSTOR_SCAN;
+    if (!dfs_traversal_after_hot_set(&plain, &plain_misses, &actual_sum_values)) {
+        return 0;
+    }
+    if (plain_misses == 0) {
+        printf("%sERROR: traversal without scan hint did not evict the hot set%s\n", YEL, CRESET);
+        return 0;
+    }
+    /* with the hint, it is still in the cache */
+    if (!dfs_traversal_after_hot_set(p, &misses, &actual_sum_values)) {
+        return 0;
+    }
+    if (misses != 0) {
+        printf("%sERROR: traversal with scan hint evicted the hot set (%u misses, %u without hint)%s\n",
+               YEL, misses, plain_misses, CRESET);
+        return 0;
+    }
+    if (expected_sum_values != actual_sum_values) {
+        printf("%sERROR: Unexpected sum of node values%s\n", YEL, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
 static const struct dfs_create_db_param
 DFS_CREATE_DB_PARAM = { TEST_DB, 4096, LEVEL_COUNT, (long*)&NODECOUNT_LIST };
 
 static const struct dfs_traversal_param
-DFS_TRAVERSAL_ST = { TEST_DB, 4096, LEVEL_COUNT };
+DFS_TRAVERSAL_ST = { TEST_DB, 4096, LEVEL_COUNT, AVSTOR_KEYS };
+
+static const struct dfs_traversal_param
+DFS_TRAVERSAL_SCAN = { TEST_DB, 256, LEVEL_COUNT, AVSTOR_KEYS | AVSTOR_SCAN };
 
 DEFINE_TEST_LIST(DFS) {
     { "Create DB for DFS", &dfs_create_db, 0, (void*)&DFS_CREATE_DB_PARAM },
-    { "DFS Traversal (Single Threaded)", &dfs_traversal_st, 0, (void*)&DFS_TRAVERSAL_ST }
+    { "DFS Traversal (Single Threaded)", &dfs_traversal_st, 0, (void*)&DFS_TRAVERSAL_ST },
+    { "DFS Traversal with scan hint (Single Threaded)", &dfs_traversal_scan, 0, (void*)&DFS_TRAVERSAL_SCAN }
 };
 
 DEFINE_TESTS(DFS);
@@ -0,0 +1,172 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define DIFF_DB_A "diff_a.db"
+#define DIFF_DB_B "diff_b.db"
+#define DIFF_KEY_COUNT 500
+
+struct diff_param {
+    const char  *filename_a;
+    const char  *filename_b;
+    unsigned    cache_size;
+};
+
+struct diff_counts {
+    long        added;
+    long        removed;
+    long        changed;
+};
+
+/* Creates DIFF_KEY_COUNT keys, each with one int32 value and one subkey. The first file
+   is the base, the second one omits key 10, adds key DIFF_KEY_COUNT, changes the value of
+   key 20 and adds a subkey to key 30. */
+static int diff_create_db(const char *filename, unsigned cache_size, int is_b)
+{
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i, count = is_b ? DIFF_KEY_COUNT + 1 : DIFF_KEY_COUNT;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, filename, cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+
+    for (i = 0; i < count; i++) {
+        if (is_b && i == 10) {
+            continue;
+        }
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &key, (is_b && i == 20) ? -i : i, NULL))
+            || AVSTOR_OK != (res = avstor_create_key(&node, &key, NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+        if (is_b && i == 30) {
+            rec.key = 1;
+            if (AVSTOR_OK != (res = avstor_create_key(&node, &key, NULL))) {
+                printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+                avstor_close(db);
+                return 0;
+            }
+        }
+        avstor_node_destroy(&node);
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+static int diff_create(void *param)
+{
+    struct diff_param *p = (struct diff_param*)param;
+    return diff_create_db(p->filename_a, p->cache_size, 0) && diff_create_db(p->filename_b, p->cache_size, 1);
+}
+
+static int diff_callback(void *ctx, int change, const avstor_node *node_a, const avstor_node *node_b)
+{
+    struct diff_counts *counts = (struct diff_counts*)ctx;
+    (void)node_a;
+    (void)node_b;
+    if (change == AVSTOR_DIFF_ADDED) counts->added++;
+    else if (change == AVSTOR_DIFF_REMOVED) counts->removed++;
+    else counts->changed++;
+    return 0;
+}
+
+static int diff_files(void *param)
+{
+    struct diff_param *p = (struct diff_param*)param;
+    struct diff_counts counts = { 0, 0, 0 };
+    avstor *db_a, *db_b;
+    avstor_node root_a, root_b;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db_a, p->filename_a, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&db_b, p->filename_b, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db_a);
+        return 0;
+    }
+    avstor_node_init(db_a, &root_a);
+    avstor_node_init(db_b, &root_b);
+
+    if (AVSTOR_OK != (res = avstor_diff(&root_a, &root_b, &AvsIntNode_comparer, &diff_callback, &counts))) {
+        printf("%sERROR: avstor_diff failed with %i%s\n", YEL, res, CRESET);
+    }
+    else if (counts.added != 2 || counts.removed != 1 || counts.changed != 1) {
+        printf("%sERROR: unexpected differences: %li added, %li removed, %li changed%s\n", YEL,
+               counts.added, counts.removed, counts.changed, CRESET);
+    }
+    else {
+        /* a file compared to itself has no differences */
+        res = avstor_diff(&root_a, &root_a, &AvsIntNode_comparer, &diff_callback, &counts);
+        result = res == AVSTOR_OK && counts.added == 2 && counts.removed == 1 && counts.changed == 1;
+        if (!result) {
+            printf("%sERROR: file differs from itself%s\n", YEL, CRESET);
+        }
+    }
+    avstor_close(db_b);
+    avstor_close(db_a);
+    return result;
+}
+
+static const struct diff_param DIFF_PARAM = { DIFF_DB_A, DIFF_DB_B, 1024 };
+
+DEFINE_TEST_LIST(DIFF) {
+    { "Create DBs for diff", &diff_create, AVSTEST_MUST_PASS, (void*)&DIFF_PARAM },
+    { "Diff two files", &diff_files, 0, (void*)&DIFF_PARAM }
+};
+
+DEFINE_TESTS(DIFF);
@@ -0,0 +1,332 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define IMPORT_DB "import.db"
+#define IMPORT_SRC_DB "import_src.db"
+#define IMPORT_NAMES_DB "import_names.db"
+#define IMPORT_NAMES_SRC_DB "import_names_src.db"
+#define IMPORT_KEY_COUNT 2000
+#define IMPORT_VALUE_NAME "imported_value_name"
+
+struct import_param {
+    const char  *filename;
+    const char  *src_filename;
+    unsigned    cache_size;
+};
+
+static int import_names_comparer(const void *x, const void *y)
+{
+    return strcmp((const char*)x, (const char*)y);
+}
+
+static void import_set_name(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name) + 1;
+    key->comparer = &import_names_comparer;
+}
+
+/* Creates IMPORT_KEY_COUNT keys, each with an int32 value. Key 0 gets a link to the last key. */
+static int import_create_src(void *param)
+{
+    struct import_param *p = (struct import_param*)param;
+    avstor *db;
+    avstor_node root, node, target;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->src_filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < IMPORT_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &key, i, NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    rec.key = 0;
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db);
+        return 0;
+    }
+    rec.key = IMPORT_KEY_COUNT - 1;
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &target))) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db);
+        return 0;
+    }
+    rec.key = -1;
+    if (AVSTOR_OK != (res = avstor_create_link(&node, &key, &target, NULL))) {
+        printf("%sERROR: avstor_create_link failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db);
+        return 0;
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+/* Checks the hierarchy imported under key import_key */
+static int import_verify(avstor *db, int32_t import_key)
+{
+    avstor_node root, parent, node, link, target;
+    avstor_inorder st;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t value, count = 0;
+    int res;
+
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.key = import_key;
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &parent))) {
+        printf("%sERROR: imported key not found (%i)%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    res = avstor_inorder_first(&st, &parent, NULL, AVSTOR_KEYS, &node);
+    while (res == AVSTOR_OK) {
+        rec.key = count;
+        if (AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &link))
+            || AVSTOR_OK != (res = avstor_get_int32(&link, &value)) || value != count) {
+            printf("%sERROR: imported value mismatch at %i%s\n", YEL, count, CRESET);
+            return 0;
+        }
+        count++;
+        res = avstor_inorder_next(&st, &node);
+    }
+    if (res != AVSTOR_NOTFOUND || count != IMPORT_KEY_COUNT) {
+        printf("%sERROR: imported key count mismatch (%i)%s\n", YEL, count, CRESET);
+        return 0;
+    }
+
+    /* the link must point to the relocated target, which is protected by its back link */
+    rec.key = 0;
+    if (AVSTOR_OK != (res = avstor_find(&parent, &key, AVSTOR_KEYS, &node))) {
+        return 0;
+    }
+    rec.key = -1;
+    if (AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &link))
+        || AVSTOR_OK != (res = avstor_get_link(&link, &target))
+        || AVSTOR_OK != (res = avstor_get_name(&target, &key))
+        || rec.key != IMPORT_KEY_COUNT - 1) {
+        printf("%sERROR: imported link is invalid (%i)%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_INVOPER != (res = avstor_delete(&parent, AVSTOR_KEYS, &key))) {
+        printf("%sERROR: imported back link is missing (%i)%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+static int import_file(void *param)
+{
+    struct import_param *p = (struct import_param*)param;
+    avstor *db;
+    avstor_node root;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.data = 0;
+    for (rec.key = 1; rec.key <= 2; rec.key++) {
+        if (AVSTOR_OK != (res = avstor_import_file(&root, &key, p->src_filename))) {
+            printf("%sERROR: avstor_import_file failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    result = import_verify(db, 1) && import_verify(db, 2);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Imports a file whose values are named by its name dictionary, twice, and finds them by name */
+static int import_file_with_names(void *param)
+{
+    struct import_param *p = (struct import_param*)param;
+    avstor *db;
+    avstor_node root, parent, node, value_node;
+    avstor_key key, name, out_name;
+    AvsDbIntRec rec;
+    char buf[64];
+    int32_t i, value;
+    int res, result = 0;
+
+    /* the source interns the name of its values */
+    if (AVSTOR_OK != (res = avstor_open(&db, p->src_filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.data = 0;
+    import_set_name(&name, IMPORT_VALUE_NAME);
+    res = avstor_intern(db, &name);
+    for (i = 0; i < IMPORT_KEY_COUNT && res == AVSTOR_OK; i++) {
+        rec.key = i;
+        if (AVSTOR_OK == (res = avstor_create_key(&root, &key, &node))) {
+            res = avstor_create_int32(&node, &name, i, NULL);
+        }
+    }
+    if (res != AVSTOR_OK || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: creating the source failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db);
+        return 0;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    for (rec.key = 1; rec.key <= 2; rec.key++) {
+        if (AVSTOR_OK != (res = avstor_import_file(&root, &key, p->src_filename))) {
+            printf("%sERROR: avstor_import_file failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    out_name.buf = buf;
+    out_name.len = sizeof(buf);
+    out_name.comparer = NULL;
+    for (rec.key = 1; rec.key <= 2; rec.key++) {
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &parent))) {
+            printf("%sERROR: imported key not found (%i)%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+        for (i = 0; i < IMPORT_KEY_COUNT; i++) {
+            AvsDbIntRec child_rec;
+            avstor_key child_key;
+            child_rec.key = i;
+            child_rec.data = 0;
+            child_key.buf = &child_rec;
+            child_key.len = sizeof(child_rec);
+            child_key.comparer = &AvsIntNode_comparer;
+            memset(buf, 0, sizeof(buf));
+            if (AVSTOR_OK != (res = avstor_find(&parent, &child_key, AVSTOR_KEYS, &node))
+                || AVSTOR_OK != (res = avstor_find(&node, &name, AVSTOR_VALUES, &value_node))
+                || AVSTOR_OK != (res = avstor_get_int32(&value_node, &value)) || value != i
+                || AVSTOR_OK != (res = avstor_get_name(&value_node, &out_name))
+                || strcmp(buf, IMPORT_VALUE_NAME) != 0) {
+                printf("%sERROR: imported named value mismatch at %i (%i)%s\n", YEL, i, res, CRESET);
+                goto close_and_return;
+            }
+        }
+    }
+    /* the dictionary of the destination still takes new names */
+    import_set_name(&out_name, "added_after_import");
+    rec.key = 1;
+    if (AVSTOR_OK != (res = avstor_intern(db, &out_name))
+        || AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+        || AVSTOR_OK != (res = avstor_create_int32(&node, &out_name, -1, NULL))
+        || AVSTOR_OK != (res = avstor_find(&node, &out_name, AVSTOR_VALUES, &value_node))
+        || AVSTOR_OK != (res = avstor_get_int32(&value_node, &value)) || value != -1
+        || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: value with a name added after importing failed (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct import_param IMPORT_PARAM = { IMPORT_DB, IMPORT_SRC_DB, 1024 };
+static const struct import_param IMPORT_NAMES_PARAM = { IMPORT_NAMES_DB, IMPORT_NAMES_SRC_DB, 1024 };
+
+DEFINE_TEST_LIST(IMPORT) {
+    { "Create DB to import", &import_create_src, AVSTEST_MUST_PASS, (void*)&IMPORT_PARAM },
+    { "Import file into subtree", &import_file, 0, (void*)&IMPORT_PARAM },
+    { "Import file with interned names", &import_file_with_names, 0, (void*)&IMPORT_NAMES_PARAM }
+};
+
+DEFINE_TESTS(IMPORT);
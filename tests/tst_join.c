@@ -0,0 +1,277 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define JOIN_DB "join.db"
+#define JOIN_DENSE_DB "join_dense.db"
+#define JOIN_NAMES 6000
+#define JOIN_DENSE 20000
+#define JOIN_SPARSE 20
+
+struct join_param {
+    const char  *filename;
+    const char  *dense_filename;
+    unsigned    cache_size;
+};
+
+struct join_result {
+    unsigned    count;
+    int         last;       // number of the last name reported
+    int         error;
+    unsigned    stop_after; // stop the join after this many names if not 0
+    int         b_empty;    // the second side has no children
+};
+
+static void join_set_key(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name);
+    key->comparer = NULL;
+}
+
+/* Number of a child named n%05i */
+static int join_number(const avstor_node *node)
+{
+    char name[16];
+    avstor_key key;
+    memset(name, 0, sizeof(name));
+    key.buf = name;
+    key.len = sizeof(name) - 1;
+    key.comparer = NULL;
+    if (AVSTOR_OK != avstor_get_name(node, &key) || name[0] != 'n') {
+        return -1;
+    }
+    return atoi(name + 1);
+}
+
+/* Checks that names come in order and that each side is set if the name is under that side, the
+   first side having the multiples of 2 and the second those of 3 or none */
+static int join_check(void *ctx, const avstor_node *node_a, const avstor_node *node_b)
+{
+    struct join_result *r = (struct join_result*)ctx;
+    int n = join_number(node_a ? node_a : node_b);
+    if (n <= r->last || (node_b && join_number(node_b) != n)
+        || (node_a != NULL) != (n % 2 == 0) || (node_b != NULL) != (n % 3 == 0 && !r->b_empty)) {
+        r->error = 1;
+        return 1;
+    }
+    r->last = n;
+    r->count++;
+    return r->stop_after && r->count == r->stop_after;
+}
+
+static int join_run(const char *what, const avstor_node *a, const avstor_node *b, int b_empty, int mode,
+                    int flags, unsigned expected)
+{
+    struct join_result r;
+    int res;
+    memset(&r, 0, sizeof(r));
+    r.last = -1;
+    r.b_empty = b_empty;
+    if (AVSTOR_OK != (res = avstor_join(a, b, mode, flags, &join_check, &r)) || r.error) {
+        printf("%sERROR: %s failed with %i%s\n", YEL, what, r.error ? AVSTOR_INTERNAL : res, CRESET);
+        return 0;
+    }
+    if (r.count != expected) {
+        printf("%sERROR: %s reported %u names, expected %u%s\n", YEL, what, r.count, expected, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Each set operation reports the expected names, in order, keys and values alike */
+static int join_modes(void *param)
+{
+    const struct join_param *p = (const struct join_param*)param;
+    struct join_result r;
+    avstor *db;
+    avstor_node root, a, b, empty, node;
+    avstor_key key;
+    char name[16];
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    join_set_key(&key, "a");
+    res = avstor_create_key(&root, &key, &a);
+    join_set_key(&key, "b");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&root, &key, &b);
+    join_set_key(&key, "empty");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&root, &key, &empty);
+    for (i = 0; i < JOIN_NAMES && res == AVSTOR_OK; i++) {
+        sprintf(name, "n%05i", i);
+        join_set_key(&key, name);
+        if (i % 2 == 0) {
+            res = avstor_create_key(&a, &key, &node);
+            res = res != AVSTOR_OK ? res : avstor_create_int32(&a, &key, i, &node);
+        }
+        if (i % 3 == 0 && res == AVSTOR_OK) {
+            res = avstor_create_key(&b, &key, &node);
+            res = res != AVSTOR_OK ? res : avstor_create_int32(&b, &key, i, &node);
+        }
+    }
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: creating children failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!join_run("intersection of keys", &a, &b, 0, AVSTOR_JOIN_INTERSECT, AVSTOR_KEYS, JOIN_NAMES / 6)
+        || !join_run("union of keys", &a, &b, 0, AVSTOR_JOIN_UNION, AVSTOR_KEYS, JOIN_NAMES * 2 / 3)
+        || !join_run("difference of keys", &a, &b, 0, AVSTOR_JOIN_DIFFERENCE, AVSTOR_KEYS, JOIN_NAMES / 3)
+        || !join_run("symmetric difference of keys", &a, &b, 0, AVSTOR_JOIN_SYMMETRIC, AVSTOR_KEYS, JOIN_NAMES / 2)
+        || !join_run("intersection of values", &a, &b, 0, AVSTOR_JOIN_INTERSECT, AVSTOR_VALUES, JOIN_NAMES / 6)
+        || !join_run("difference of values", &a, &b, 0, AVSTOR_JOIN_DIFFERENCE, AVSTOR_VALUES, JOIN_NAMES / 3)
+        || !join_run("intersection with an empty key", &a, &empty, 1, AVSTOR_JOIN_INTERSECT, AVSTOR_KEYS, 0)
+        || !join_run("difference with an empty key", &a, &empty, 1, AVSTOR_JOIN_DIFFERENCE, AVSTOR_KEYS, JOIN_NAMES / 2)
+        || !join_run("difference of an empty key", &empty, &b, 0, AVSTOR_JOIN_DIFFERENCE, AVSTOR_KEYS, 0)) {
+        goto close_and_return;
+    }
+
+    /* the callback stops the join */
+    memset(&r, 0, sizeof(r));
+    r.last = -1;
+    r.stop_after = 100;
+    if (AVSTOR_ABORT != (res = avstor_join(&a, &b, AVSTOR_JOIN_UNION, AVSTOR_KEYS, &join_check, &r))
+        || r.count != 100 || r.error) {
+        printf("%sERROR: stopped join returned %i after %u names%s\n", YEL, res, r.count, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_PARAM != (res = avstor_join(&a, &b, 0, AVSTOR_KEYS, &join_check, &r))
+        || AVSTOR_PARAM != (res = avstor_join(&root, &b, AVSTOR_JOIN_UNION, AVSTOR_VALUES, &join_check, &r))) {
+        printf("%sERROR: avstor_join with invalid parameters returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static int join_count(void *ctx, const avstor_node *node_a, const avstor_node *node_b)
+{
+    (void)node_a;
+    (void)node_b;
+    ++*(unsigned*)ctx;
+    return 0;
+}
+
+/* Intersecting a sparse key with a dense one in another file seeks through the dense one */
+static int join_sparse(void *param)
+{
+    const struct join_param *p = (const struct join_param*)param;
+    avstor *db, *dense_db = NULL;
+    avstor_node root, dense, sparse, node;
+    avstor_trace trace;
+    avstor_key key;
+    char name[16];
+    unsigned count = 0;
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    join_set_key(&key, "sparse");
+    res = avstor_create_key(&root, &key, &sparse);
+    for (i = 0; i < JOIN_SPARSE && res == AVSTOR_OK; i++) {
+        sprintf(name, "n%05i", i * (JOIN_DENSE / JOIN_SPARSE) + 7);
+        join_set_key(&key, name);
+        res = avstor_create_int32(&sparse, &key, i, &node);
+    }
+    if (res != AVSTOR_OK || AVSTOR_OK != (res = avstor_open(&dense_db, p->dense_filename, p->cache_size,
+                                                            AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE
+                                                            | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: creating sparse key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_node_init(dense_db, &root);
+    join_set_key(&key, "dense");
+    res = avstor_create_key(&root, &key, &dense);
+    for (i = 0; i < JOIN_DENSE && res == AVSTOR_OK; i++) {
+        sprintf(name, "n%05i", i);
+        join_set_key(&key, name);
+        res = avstor_create_int32(&dense, &key, i, &node);
+    }
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: creating dense key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    avstor_trace_begin(&trace);
+    res = avstor_join(&sparse, &dense, AVSTOR_JOIN_INTERSECT, AVSTOR_VALUES, &join_count, &count);
+    avstor_trace_end();
+    if (res != AVSTOR_OK || count != JOIN_SPARSE) {
+        printf("%sERROR: intersection returned %i with %u names%s\n", YEL, res, count, CRESET);
+        goto close_and_return;
+    }
+    /* a walk of the dense key would touch a page for each of its values */
+    if (trace.cache_hits + trace.cache_misses > JOIN_DENSE / 4) {
+        printf("%sERROR: intersection touched %u pages%s\n", YEL, trace.cache_hits + trace.cache_misses, CRESET);
+        goto close_and_return;
+    }
+    count = 0;
+    if (AVSTOR_OK != (res = avstor_join(&dense, &sparse, AVSTOR_JOIN_DIFFERENCE, AVSTOR_VALUES, &join_count, &count))
+        || count != JOIN_DENSE - JOIN_SPARSE) {
+        printf("%sERROR: difference returned %i with %u names%s\n", YEL, res, count, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    if (dense_db) {
+        avstor_close(dense_db);
+    }
+    avstor_close(db);
+    return result;
+}
+
+static const struct join_param JOIN_PARAM = { JOIN_DB, JOIN_DENSE_DB, 1024 };
+
+DEFINE_TEST_LIST(JOIN) {
+    { "Set operations on the children of two keys", &join_modes, 0, (void*)&JOIN_PARAM },
+    { "Intersection of a sparse and a dense key", &join_sparse, 0, (void*)&JOIN_PARAM }
+};
+
+DEFINE_TESTS(JOIN);
@@ -0,0 +1,280 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define KEYSTATS_DB "keystats.db"
+#define KEYSTATS_TREE_DB "keystats_tree.db"
+#define KEYSTATS_FANOUT 20
+
+struct keystats_param {
+    const char  *filename;
+    const char  *tree_filename;
+    unsigned    cache_size;
+};
+
+static void keystats_set_key(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name);
+    key->comparer = NULL;
+}
+
+/* Compares the statistics of a key with the expected ones, returns 0 on mismatch */
+static int keystats_check(const char *what, const avstor_node *node, int flags, uint64_t subkeys,
+                          uint64_t values, uint64_t value_bytes, unsigned depth, unsigned height)
+{
+    avstor_stats stats;
+    int res;
+    if (AVSTOR_OK != (res = avstor_key_stats(node, flags, &stats))) {
+        printf("%sERROR: avstor_key_stats of %s failed with %i%s\n", YEL, what, res, CRESET);
+        return 0;
+    }
+    if (stats.subkeys != subkeys || stats.values != values || stats.value_bytes != value_bytes
+        || stats.depth != depth || stats.height != height) {
+        printf("%sERROR: %s has %lu subkeys, %lu values of %lu bytes, depth %u and height %u, expected "
+               "%lu, %lu, %lu, %u and %u%s\n", YEL, what, (unsigned long)stats.subkeys,
+               (unsigned long)stats.values, (unsigned long)stats.value_bytes, stats.depth, stats.height,
+               (unsigned long)subkeys, (unsigned long)values, (unsigned long)value_bytes, depth, height,
+               CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Creating, updating and deleting children keeps the counts of their key */
+static int keystats_direct(void *param)
+{
+    const struct keystats_param *p = (const struct keystats_param*)param;
+    avstor *db;
+    avstor_node root, parent, node, str, bin;
+    avstor_key key;
+    char blob[64];
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_DEDUP
+                                        | AVSTOR_OPEN_KEYSTATS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    memset(blob, 'x', sizeof(blob));
+    keystats_set_key(&key, "parent");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &parent))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!keystats_check("new key", &parent, 0, 0, 0, 0, 1, 0)) {
+        goto close_and_return;
+    }
+    keystats_set_key(&key, "sub1");
+    res = avstor_create_key(&parent, &key, &node);
+    keystats_set_key(&key, "sub2");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&parent, &key, &node);
+    keystats_set_key(&key, "i32");
+    res = res != AVSTOR_OK ? res : avstor_create_int32(&parent, &key, 1, &node);
+    keystats_set_key(&key, "i64");
+    res = res != AVSTOR_OK ? res : avstor_create_int64(&parent, &key, 2, &node);
+    keystats_set_key(&key, "dbl");
+    res = res != AVSTOR_OK ? res : avstor_create_double(&parent, &key, 3.0, &node);
+    keystats_set_key(&key, "str");
+    res = res != AVSTOR_OK ? res : avstor_create_string(&parent, &key, "abc", &str);
+    keystats_set_key(&key, "bin");
+    res = res != AVSTOR_OK ? res : avstor_create_binary(&parent, &key, blob, sizeof(blob), &bin);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: creating children failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* strings are counted with their terminating null */
+    if (!keystats_check("key with children", &parent, 0, 2, 5, 4 + 8 + 8 + 4 + 64, 1, 0)
+        || !keystats_check("root", &root, 0, 1, 0, 0, 0, 0)) {
+        goto close_and_return;
+    }
+    /* the binary value is deduplicated, its length is that of the blob */
+    if (AVSTOR_OK != (res = avstor_update_string(&str, "abcdefgh"))
+        || AVSTOR_OK != (res = avstor_update_binary(&bin, blob, 10))
+        || AVSTOR_OK != (res = avstor_update_double(&node, 4.0))) {
+        printf("%sERROR: updating values failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!keystats_check("updated key", &parent, 0, 2, 5, 4 + 8 + 8 + 9 + 10, 1, 0)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_update_binary(&bin, blob, sizeof(blob)))) {
+        printf("%sERROR: avstor_update_binary failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    keystats_set_key(&key, "i64");
+    res = avstor_delete(&parent, AVSTOR_VALUES, &key);
+    keystats_set_key(&key, "sub2");
+    res = res != AVSTOR_OK ? res : avstor_delete(&parent, AVSTOR_KEYS, &key);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_delete failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!keystats_check("key after deletes", &parent, 0, 1, 4, 4 + 8 + 9 + 64, 1, 0)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    /* creating an existing key rolls back the value created before it */
+    keystats_set_key(&key, "rolled back");
+    if (AVSTOR_OK != (res = avstor_create_string(&parent, &key, "value", &node))
+        || !keystats_check("key before rollback", &parent, 0, 1, 5, 4 + 8 + 9 + 64 + 6, 1, 0)) {
+        goto close_and_return;
+    }
+    keystats_set_key(&key, "sub1");
+    if (AVSTOR_EXISTS != (res = avstor_create_key(&parent, &key, &node))) {
+        printf("%sERROR: avstor_create_key returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!keystats_check("key after rollback", &parent, 0, 1, 4, 4 + 8 + 9 + 64, 1, 0)) {
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    keystats_set_key(&key, "parent");
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &parent))) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = keystats_check("reopened key", &parent, 0, 1, 4, 4 + 8 + 9 + 64, 1, 0)
+        && keystats_check("reopened root", &root, 0, 1, 0, 0, 0, 0);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Recursive statistics sum those of all keys below, files without statistics have none */
+static int keystats_recursive(void *param)
+{
+    const struct keystats_param *p = (const struct keystats_param*)param;
+    avstor *db;
+    avstor_node root, top, mid, leaf, node;
+    avstor_stats stats;
+    avstor_key key;
+    char name[32];
+    int i, j, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->tree_filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_KEYSTATS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    keystats_set_key(&key, "top");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &top))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* KEYSTATS_FANOUT keys under top with KEYSTATS_FANOUT int32 values each, and one more level
+       under the first of them */
+    for (i = 0; i < KEYSTATS_FANOUT; i++) {
+        sprintf(name, "mid%i", i);
+        keystats_set_key(&key, name);
+        if (AVSTOR_OK != (res = avstor_create_key(&top, &key, &mid))) {
+            printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+        for (j = 0; j < KEYSTATS_FANOUT; j++) {
+            sprintf(name, "value%i", j);
+            keystats_set_key(&key, name);
+            if (AVSTOR_OK != (res = avstor_create_int32(&mid, &key, j, &node))) {
+                printf("%sERROR: avstor_create_int32 failed with %i%s\n", YEL, res, CRESET);
+                goto close_and_return;
+            }
+        }
+        if (i == 0) {
+            keystats_set_key(&key, "leaf");
+            if (AVSTOR_OK != (res = avstor_create_key(&mid, &key, &leaf))
+                || AVSTOR_OK != (res = avstor_create_string(&leaf, &key, "leaf", &node))) {
+                printf("%sERROR: creating leaf failed with %i%s\n", YEL, res, CRESET);
+                goto close_and_return;
+            }
+        }
+    }
+    if (!keystats_check("top", &top, 0, KEYSTATS_FANOUT, 0, 0, 1, 0)
+        || !keystats_check("top, recursive", &top, AVSTOR_STATS_RECURSIVE, KEYSTATS_FANOUT + 1,
+                           KEYSTATS_FANOUT * KEYSTATS_FANOUT + 1, KEYSTATS_FANOUT * KEYSTATS_FANOUT * 4 + 5, 1, 2)
+        || !keystats_check("root, recursive", &root, AVSTOR_STATS_RECURSIVE, KEYSTATS_FANOUT + 2,
+                           KEYSTATS_FANOUT * KEYSTATS_FANOUT + 1, KEYSTATS_FANOUT * KEYSTATS_FANOUT * 4 + 5, 0, 3)
+        || !keystats_check("last, recursive", &mid, AVSTOR_STATS_RECURSIVE, 0, KEYSTATS_FANOUT,
+                           KEYSTATS_FANOUT * 4, 2, 0)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    /* a file created without statistics has none */
+    if (AVSTOR_OK != (res = avstor_open(&db, p->tree_filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    if (AVSTOR_INVOPER != (res = avstor_key_stats(&root, 0, &stats))) {
+        printf("%sERROR: avstor_key_stats without statistics returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct keystats_param KEYSTATS_PARAM = { KEYSTATS_DB, KEYSTATS_TREE_DB, 1024 };
+
+DEFINE_TEST_LIST(KEYSTATS) {
+    { "Key statistics maintained on write", &keystats_direct, AVSTEST_MUST_PASS, (void*)&KEYSTATS_PARAM },
+    { "Recursive key statistics", &keystats_recursive, 0, (void*)&KEYSTATS_PARAM }
+};
+
+DEFINE_TESTS(KEYSTATS);
@@ -0,0 +1,236 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define LOOKUP_DB "lookup.db"
+#define LOOKUP_VALUES 200
+
+struct lookup_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+static void lookup_set_key(avstor_key *key, char *buf, int32_t i)
+{
+    sprintf(buf, "value%li", (long)i);
+    key->buf = buf;
+    key->len = (unsigned)strlen(buf);
+    key->comparer = NULL;
+}
+
+/* Finds a value and checks that it holds val, returns 0 on mismatch */
+static int lookup_check(const avstor_node *parent, int32_t i, int32_t val, avstor_trace *trace)
+{
+    avstor_node node;
+    avstor_key key;
+    char buf[32];
+    int32_t v;
+    int res;
+
+    lookup_set_key(&key, buf, i);
+    if (trace) {
+        avstor_trace_begin(trace);
+    }
+    res = avstor_find(parent, &key, AVSTOR_VALUES, &node);
+    if (trace) {
+        avstor_trace_end();
+    }
+    if (res != AVSTOR_OK || AVSTOR_OK != (res = avstor_get_int32(&node, &v)) || v != val) {
+        printf("%sERROR: value %li not found or mismatch (%i)%s\n", YEL, (long)i, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Repeated lookups are answered from the lookup cache with a single page lock */
+static int lookup_hot(void *param)
+{
+    const struct lookup_param *p = (const struct lookup_param*)param;
+    avstor *db;
+    avstor_node root, parent, node;
+    avstor_key key;
+    avstor_trace cold, warm;
+    char buf[32];
+    int32_t i;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE
+                                        | AVSTOR_OPEN_LOOKUP_CACHE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = "hot";
+    key.len = 3;
+    key.comparer = NULL;
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &parent))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < LOOKUP_VALUES; i++) {
+        lookup_set_key(&key, buf, i);
+        if (AVSTOR_OK != (res = avstor_create_int32(&parent, &key, i, &node))) {
+            printf("%sERROR: avstor_create_int32 failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    for (i = 0; i < LOOKUP_VALUES; i++) {
+        if (!lookup_check(&parent, i, i, i == LOOKUP_VALUES / 2 ? &cold : NULL)) {
+            goto close_and_return;
+        }
+    }
+    if (!lookup_check(&parent, LOOKUP_VALUES / 2, LOOKUP_VALUES / 2, &warm)) {
+        goto close_and_return;
+    }
+    if (cold.lookup_hits != 0 || cold.comparisons < 2 || warm.lookup_hits != 1 || warm.comparisons != 1
+        || warm.cache_hits != 1 || warm.cache_misses != 0) {
+        printf("%sERROR: unexpected trace: %u/%u lookup hits, %u/%u comparisons, %u page hits%s\n", YEL,
+               cold.lookup_hits, warm.lookup_hits, cold.comparisons, warm.comparisons, warm.cache_hits, CRESET);
+        goto close_and_return;
+    }
+    /* a key of the same name is not a value */
+    lookup_set_key(&key, buf, 1);
+    if (AVSTOR_NOTFOUND != (res = avstor_find(&parent, &key, AVSTOR_KEYS, &node))) {
+        printf("%sERROR: avstor_find of a key returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Deleted values and values created by a rolled back transaction are not found */
+static int lookup_invalidate(void *param)
+{
+    const struct lookup_param *p = (const struct lookup_param*)param;
+    avstor *db;
+    avstor_node root, parent, node;
+    avstor_key key;
+    char buf[32];
+    int32_t i;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_LOOKUP_CACHE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = "hot";
+    key.len = 3;
+    key.comparer = NULL;
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &parent))) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < LOOKUP_VALUES; i++) {
+        if (!lookup_check(&parent, i, i, NULL)) {
+            goto close_and_return;
+        }
+    }
+    /* delete every other value and recreate half of them with a new value */
+    for (i = 0; i < LOOKUP_VALUES; i += 2) {
+        lookup_set_key(&key, buf, i);
+        if (AVSTOR_OK != (res = avstor_delete(&parent, AVSTOR_VALUES, &key))) {
+            printf("%sERROR: avstor_delete failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+        if (i % 4 == 0 && AVSTOR_OK != (res = avstor_create_int32(&parent, &key, -i, &node))) {
+            printf("%sERROR: avstor_create_int32 failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    for (i = 0; i < LOOKUP_VALUES; i++) {
+        lookup_set_key(&key, buf, i);
+        if (i % 4 == 2) {
+            if (AVSTOR_NOTFOUND != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))) {
+                printf("%sERROR: deleted value %li found (%i)%s\n", YEL, (long)i, res, CRESET);
+                goto close_and_return;
+            }
+        }
+        else if (!lookup_check(&parent, i, i % 4 == 0 ? -i : i, NULL)) {
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    /* creating an existing key rolls back the value created before it */
+    lookup_set_key(&key, buf, LOOKUP_VALUES);
+    if (AVSTOR_OK != (res = avstor_create_int32(&parent, &key, 1, &node))) {
+        printf("%sERROR: avstor_create_int32 failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!lookup_check(&parent, LOOKUP_VALUES, 1, NULL)) {
+        goto close_and_return;
+    }
+    key.buf = "hot";
+    key.len = 3;
+    if (AVSTOR_EXISTS != (res = avstor_create_key(&root, &key, &node))) {
+        printf("%sERROR: avstor_create_key returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    lookup_set_key(&key, buf, LOOKUP_VALUES);
+    if (AVSTOR_NOTFOUND != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))) {
+        printf("%sERROR: rolled back value found (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = lookup_check(&parent, 1, 1, NULL);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct lookup_param LOOKUP_PARAM = { LOOKUP_DB, 1024 };
+
+DEFINE_TEST_LIST(LOOKUP) {
+    { "Hot lookups from the lookup cache", &lookup_hot, AVSTEST_MUST_PASS, (void*)&LOOKUP_PARAM },
+    { "Lookup cache invalidation", &lookup_invalidate, 0, (void*)&LOOKUP_PARAM }
+};
+
+DEFINE_TESTS(LOOKUP);
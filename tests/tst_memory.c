@@ -0,0 +1,140 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define MEMORY_DB "memory.db"
+#define MEMORY_KEY_COUNT 20000
+
+struct memory_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+static int memory_create_db(void *param)
+{
+    struct memory_param *p = (struct memory_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < MEMORY_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &key, i, NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+/* Pins the whole file, which doesn't fit in the cache, with and without a memory limit */
+static int memory_limit(void *param)
+{
+    struct memory_param *p = (struct memory_param*)param;
+    avstor *db;
+    avstor_node root;
+    avstor_memory before, after;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    avstor_memory_usage(db, &before);
+    if (AVSTOR_OK != (res = avstor_pin_subtree(&root, AVSTOR_PRIORITY_PINNED))) {
+        printf("%sERROR: avstor_pin_subtree failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_memory_usage(db, &after);
+    if (after.cache_capacity <= before.cache_capacity || after.pool_used <= p->cache_size * 1024
+        || after.total != after.pool_bytes + after.cache_items + after.other) {
+        printf("%sERROR: cache did not grow for pinned pages%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    avstor_set_memory_limit(db, 1);
+    avstor_memory_usage(db, &before);
+    if (AVSTOR_NOMEM != (res = avstor_pin_subtree(&root, AVSTOR_PRIORITY_PINNED))) {
+        printf("%sERROR: pinning past the memory limit returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_memory_usage(db, &after);
+    if (after.pool_bytes != before.pool_bytes || after.pool_bytes > before.limit) {
+        printf("%sERROR: page buffers grew past the limit (%lu)%s\n", YEL, (unsigned long)after.pool_bytes, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct memory_param MEMORY_PARAM = { MEMORY_DB, 64 };
+
+DEFINE_TEST_LIST(MEMORY) {
+    { "Create DB for memory limit", &memory_create_db, AVSTEST_MUST_PASS, (void*)&MEMORY_PARAM },
+    { "Memory limit for pinned pages", &memory_limit, 0, (void*)&MEMORY_PARAM }
+};
+
+DEFINE_TESTS(MEMORY);
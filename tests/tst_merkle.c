@@ -0,0 +1,360 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define MERKLE_DB "merkle.db"
+#define MERKLE_PLAIN_DB "merkle_plain.db"
+#define MERKLE_COPY_DB "merkle_copy.db"
+#define MERKLE_VALUES 50000
+#define MERKLE_CHANGED 3
+#define MERKLE_MAX_PAGES 4096
+
+struct merkle_param {
+    const char  *filename;
+    const char  *plain_filename;
+    const char  *copy_filename;
+    unsigned    cache_size;
+};
+
+/* Creates MERKLE_VALUES string values under a key and commits them */
+static int merkle_create_db(const char *filename, unsigned cache_size, int oflags)
+{
+    avstor *db;
+    avstor_node root, parent, node;
+    avstor_key key;
+    char name[32], value[64];
+    int32_t i;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, filename, cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | oflags))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = "values";
+    key.len = 6;
+    key.comparer = NULL;
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &parent))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    key.buf = name;
+    for (i = 0; i < MERKLE_VALUES; i++) {
+        sprintf(name, "value%li", (long)i);
+        sprintf(value, "string number %li of the checksum tree test", (long)i);
+        key.len = (unsigned)strlen(name);
+        if (AVSTOR_OK != (res = avstor_create_string(&parent, &key, value, &node))) {
+            printf("%sERROR: avstor_create_string failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static int merkle_copy_file(const char *from, const char *to)
+{
+    char buf[4096];
+    size_t n;
+    int result = 1;
+    FILE *in, *out;
+
+    if (!(in = fopen(from, "rb"))) {
+        return 0;
+    }
+    if (!(out = fopen(to, "wb"))) {
+        fclose(in);
+        return 0;
+    }
+    while (result && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        result = fwrite(buf, 1, n, out) == n;
+    }
+    fclose(out);
+    fclose(in);
+    return result;
+}
+
+/* Descends from the hashes of level into their children that differ, counting the exchanges */
+static int merkle_descend(avstor *a, avstor *b, unsigned level, avstor_off index, unsigned *pages,
+                          unsigned *page_count, unsigned *exchanges)
+{
+    uint32_t ha[AVSTOR_MERKLE_FANOUT], hb[AVSTOR_MERKLE_FANOUT];
+    unsigned na, nb, i;
+
+    if (AVSTOR_OK != avstor_merkle_hashes(a, level - 1, index * AVSTOR_MERKLE_FANOUT, ha, AVSTOR_MERKLE_FANOUT, &na)
+        || AVSTOR_OK != avstor_merkle_hashes(b, level - 1, index * AVSTOR_MERKLE_FANOUT, hb, AVSTOR_MERKLE_FANOUT, &nb)) {
+        return 0;
+    }
+    ++*exchanges;
+    for (i = 0; i < na && i < nb; i++) {
+        if (ha[i] == hb[i]) {
+            continue;
+        }
+        if (level > 1) {
+            if (!merkle_descend(a, b, level - 1, index * AVSTOR_MERKLE_FANOUT + i, pages, page_count, exchanges)) {
+                return 0;
+            }
+        }
+        else if (*page_count < MERKLE_MAX_PAGES) {
+            pages[(*page_count)++] = (unsigned)(index * AVSTOR_MERKLE_FANOUT + i);
+        }
+    }
+    return 1;
+}
+
+/* The root of a file created with the tree is kept in the file and is the same after reopening */
+static int merkle_persist(void *param)
+{
+    const struct merkle_param *p = (const struct merkle_param*)param;
+    avstor *db;
+    uint32_t root, root2, leaf;
+    unsigned levels, levels2, n;
+    avstor_off pages, pages2;
+    int res, result = 0;
+
+    if (!merkle_create_db(p->filename, p->cache_size, AVSTOR_OPEN_MERKLE)) {
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_merkle_root(db, &root, &levels, &pages))) {
+        printf("%sERROR: avstor_merkle_root failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (levels < 2 || pages < 2 || AVSTOR_OK != avstor_merkle_hashes(db, 0, 0, &leaf, 1, &n) || n != 1
+        || leaf != 0) {
+        printf("%sERROR: unexpected tree of %u levels over %lu pages%s\n", YEL, levels, (unsigned long)pages, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_merkle_root(db, &root2, &levels2, &pages2))) {
+        printf("%sERROR: avstor_merkle_root failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (root2 != root || levels2 != levels || pages2 != pages) {
+        printf("%sERROR: root %08lx of %u levels and %lu pages after reopening, expected %08lx, %u and %lu%s\n",
+               YEL, (unsigned long)root2, levels2, (unsigned long)pages2, (unsigned long)root, levels,
+               (unsigned long)pages, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* A tree built by reading a file without one has the checksums kept while writing the same pages */
+static int merkle_scan(void *param)
+{
+    const struct merkle_param *p = (const struct merkle_param*)param;
+    avstor *db, *plain;
+    uint32_t root, leaves[AVSTOR_MERKLE_FANOUT], plain_leaves[AVSTOR_MERKLE_FANOUT];
+    unsigned levels, n, plain_n;
+    avstor_off pages, plain_pages, first;
+    int res, result = 0;
+
+    if (!merkle_create_db(p->plain_filename, p->cache_size, 0)) {
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&plain, p->plain_filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_INVOPER != (res = avstor_merkle_root(plain, &root, &levels, &pages))) {
+        printf("%sERROR: avstor_merkle_root without a tree returned %i%s\n", YEL, res, CRESET);
+        avstor_close(plain);
+        return 0;
+    }
+    avstor_close(plain);
+    if (AVSTOR_OK != (res = avstor_open(&plain, p->plain_filename, p->cache_size,
+                                        AVSTOR_OPEN_READONLY | AVSTOR_OPEN_MERKLE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(plain);
+        return 0;
+    }
+    if (AVSTOR_OK != avstor_merkle_root(plain, &root, &levels, &plain_pages)
+        || AVSTOR_OK != avstor_merkle_root(db, &root, &levels, &pages) || plain_pages >= pages) {
+        printf("%sERROR: unexpected page counts %lu and %lu%s\n", YEL, (unsigned long)plain_pages,
+               (unsigned long)pages, CRESET);
+        goto close_and_return;
+    }
+    /* the tree pages of the other file follow the pages of the values */
+    for (first = 0; first < plain_pages; first += n) {
+        if (AVSTOR_OK != avstor_merkle_hashes(plain, 0, first, plain_leaves, AVSTOR_MERKLE_FANOUT, &plain_n)
+            || AVSTOR_OK != avstor_merkle_hashes(db, 0, first, leaves, plain_n, &n) || n != plain_n
+            || memcmp(leaves, plain_leaves, n * sizeof(uint32_t)) != 0) {
+            printf("%sERROR: page checksums differ from page %lu on%s\n", YEL, (unsigned long)first, CRESET);
+            goto close_and_return;
+        }
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    avstor_close(plain);
+    return result;
+}
+
+/* Descending the trees of two files finds the pages a full comparison of the checksums finds */
+static int merkle_compare(void *param)
+{
+    const struct merkle_param *p = (const struct merkle_param*)param;
+    avstor *db, *copy;
+    avstor_node root, parent, node;
+    avstor_key key;
+    uint32_t root_a, root_b, leaves[AVSTOR_MERKLE_FANOUT], copy_leaves[AVSTOR_MERKLE_FANOUT];
+    unsigned levels, copy_levels, n, copy_n, i, full_count = 0, page_count = 0, exchanges = 1;
+    unsigned *full_pages, *pages;
+    avstor_off total, copy_total, first;
+    char name[32];
+    int res, result = 0;
+
+    if (!merkle_copy_file(p->filename, p->copy_filename)) {
+        printf("%sERROR: could not copy %s%s\n", YEL, p->filename, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&copy, p->copy_filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(copy, &root);
+    key.buf = "values";
+    key.len = 6;
+    key.comparer = NULL;
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &parent))) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(copy);
+        return 0;
+    }
+    key.buf = name;
+    for (i = 0; i < MERKLE_CHANGED; i++) {
+        sprintf(name, "value%li", (long)(i * (MERKLE_VALUES / MERKLE_CHANGED)));
+        key.len = (unsigned)strlen(name);
+        if (AVSTOR_OK != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))
+            || AVSTOR_OK != (res = avstor_update_string(&node, "changed"))) {
+            printf("%sERROR: updating %s failed with %i%s\n", YEL, name, res, CRESET);
+            avstor_close(copy);
+            return 0;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(copy, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(copy);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(copy);
+        return 0;
+    }
+    if (!(full_pages = malloc(2 * MERKLE_MAX_PAGES * sizeof(unsigned)))) {
+        printf("%sERROR: out of memory%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+    pages = full_pages + MERKLE_MAX_PAGES;
+    if (AVSTOR_OK != avstor_merkle_root(db, &root_a, &levels, &total)
+        || AVSTOR_OK != avstor_merkle_root(copy, &root_b, &copy_levels, &copy_total)
+        || root_a == root_b || levels != copy_levels || total != copy_total) {
+        printf("%sERROR: unexpected roots %08lx and %08lx%s\n", YEL, (unsigned long)root_a,
+               (unsigned long)root_b, CRESET);
+        goto free_and_return;
+    }
+    for (first = 0; first < total; first += n) {
+        if (AVSTOR_OK != avstor_merkle_hashes(db, 0, first, leaves, AVSTOR_MERKLE_FANOUT, &n)
+            || AVSTOR_OK != avstor_merkle_hashes(copy, 0, first, copy_leaves, AVSTOR_MERKLE_FANOUT, &copy_n)
+            || n != copy_n) {
+            printf("%sERROR: avstor_merkle_hashes failed%s\n", YEL, CRESET);
+            goto free_and_return;
+        }
+        for (i = 0; i < n && full_count < MERKLE_MAX_PAGES; i++) {
+            if (leaves[i] != copy_leaves[i]) {
+                full_pages[full_count++] = (unsigned)(first + i);
+            }
+        }
+    }
+    if (!merkle_descend(db, copy, levels - 1, 0, pages, &page_count, &exchanges)) {
+        printf("%sERROR: avstor_merkle_hashes failed%s\n", YEL, CRESET);
+        goto free_and_return;
+    }
+    if (full_count == 0 || page_count != full_count
+        || memcmp(pages, full_pages, full_count * sizeof(unsigned)) != 0) {
+        printf("%sERROR: descent found %u pages, full comparison %u%s\n", YEL, page_count, full_count, CRESET);
+        goto free_and_return;
+    }
+    if (exchanges >= (total + AVSTOR_MERKLE_FANOUT - 1) / AVSTOR_MERKLE_FANOUT) {
+        printf("%sERROR: %u hash exchanges for %u differing pages of %lu%s\n", YEL, exchanges, page_count,
+               (unsigned long)total, CRESET);
+        goto free_and_return;
+    }
+    result = 1;
+free_and_return:
+    free(full_pages);
+close_and_return:
+    avstor_close(db);
+    avstor_close(copy);
+    return result;
+}
+
+static const struct merkle_param MERKLE_PARAM = { MERKLE_DB, MERKLE_PLAIN_DB, MERKLE_COPY_DB, 1024 };
+
+DEFINE_TEST_LIST(MERKLE) {
+    { "Page checksum tree persistence", &merkle_persist, AVSTEST_MUST_PASS, (void*)&MERKLE_PARAM },
+    { "Page checksum tree of a file without one", &merkle_scan, 0, (void*)&MERKLE_PARAM },
+    { "Locating differing pages", &merkle_compare, 0, (void*)&MERKLE_PARAM }
+};
+
+DEFINE_TESTS(MERKLE);
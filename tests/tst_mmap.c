@@ -0,0 +1,338 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define MMAP_DB "mmap.db"
+#define MMAP_CORRUPT_DB "mmap_corrupt.db"
+#define MMAP_PAGE_SIZE 4096
+#define MMAP_KEY_COUNT 10000
+
+struct mmap_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+static void mmap_set_keys(AvsDbIntRec *rec, avstor_key *key, avstor_key *name)
+{
+    key->buf = rec;
+    key->len = sizeof(*rec);
+    key->comparer = &AvsIntNode_comparer;
+    name->buf = "value";
+    name->len = sizeof("value");
+    name->comparer = NULL;
+}
+
+/* Creates keys [first, first + count), each with a value equal to its key times mult */
+static int mmap_add_keys(avstor *db, int32_t first, int32_t count, int32_t mult)
+{
+    avstor_node root, node;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    avstor_node_init(db, &root);
+    mmap_set_keys(&rec, &key, &name);
+    for (i = first; i < first + count; i++) {
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &name, i * mult, NULL))) {
+            printf("%sERROR: creating key %i failed with %i%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Sets the value of keys [0, count) to their key times mult, skipping deleted values as
+   mmap_check_keys does */
+static int mmap_update_keys(avstor *db, int32_t count, int32_t mult, int deleted)
+{
+    avstor_node root, node, value;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    avstor_node_init(db, &root);
+    mmap_set_keys(&rec, &key, &name);
+    for (i = 0; i < count; i++) {
+        rec.key = i;
+        if (deleted && i < MMAP_KEY_COUNT && i % 10 == 9) {
+            continue;
+        }
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_find(&node, &name, AVSTOR_VALUES, &value))
+            || AVSTOR_OK != (res = avstor_update_int32(&value, i * mult))) {
+            printf("%sERROR: updating key %i failed with %i%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Checks the values of keys [0, count); every tenth key of the first MMAP_KEY_COUNT has none if
+   deleted is set */
+static int mmap_check_keys(avstor *db, int32_t count, int32_t mult, int deleted)
+{
+    avstor_node root, node, value;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int32_t i, val;
+    int res;
+
+    avstor_node_init(db, &root);
+    mmap_set_keys(&rec, &key, &name);
+    for (i = 0; i < count; i++) {
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            printf("%sERROR: key %i not found (%i)%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+        res = avstor_find(&node, &name, AVSTOR_VALUES, &value);
+        if (deleted && i < MMAP_KEY_COUNT && i % 10 == 9) {
+            if (res != AVSTOR_NOTFOUND) {
+                printf("%sERROR: deleted value of key %i found (%i)%s\n", YEL, i, res, CRESET);
+                return 0;
+            }
+        }
+        else if (res != AVSTOR_OK || AVSTOR_OK != (res = avstor_get_int32(&value, &val)) || val != i * mult) {
+            printf("%sERROR: value of key %i mismatch (%i)%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int mmap_open(avstor **db, const struct mmap_param *p, int oflags)
+{
+    avstor_memory mem;
+    int res;
+    if (AVSTOR_OK != (res = avstor_open(db, p->filename, p->cache_size, oflags))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+#if defined(__unix__)
+    if ((oflags & AVSTOR_OPEN_MMAP) && (AVSTOR_OK != avstor_memory_usage(*db, &mem) || mem.mapped_bytes == 0)) {
+        printf("%sERROR: file is not mapped%s\n", YEL, CRESET);
+        avstor_close(*db);
+        return 0;
+    }
+#else
+    (void)mem;
+#endif
+    return 1;
+}
+
+static int mmap_create(void *param)
+{
+    struct mmap_param *p = (struct mmap_param*)param;
+    avstor *db;
+    int res, result = 0;
+
+    if (!mmap_open(&db, p, AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE)) {
+        return 0;
+    }
+    if (mmap_add_keys(db, 0, MMAP_KEY_COUNT, 1)) {
+        if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+            printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        }
+        else {
+            result = 1;
+        }
+    }
+    avstor_close(db);
+    return result;
+}
+
+/* Modifies mapped pages in place, appends pages past the mapping and deletes values */
+static int mmap_update(void *param)
+{
+    struct mmap_param *p = (struct mmap_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res, result = 0;
+
+    if (!mmap_open(&db, p, AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_MMAP)) {
+        return 0;
+    }
+    if (!mmap_update_keys(db, MMAP_KEY_COUNT, 2, 0) || !mmap_add_keys(db, MMAP_KEY_COUNT, MMAP_KEY_COUNT, 2)) {
+        goto close_and_return;
+    }
+    avstor_node_init(db, &root);
+    mmap_set_keys(&rec, &key, &name);
+    for (i = 9; i < MMAP_KEY_COUNT; i += 10) {
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_delete(&node, AVSTOR_VALUES, &name))) {
+            printf("%sERROR: deleting value of key %i failed with %i%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* the file grew, committed pages are now read from the new mapping */
+    if (!mmap_check_keys(db, MMAP_KEY_COUNT * 2, 2, 1)) {
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (!mmap_open(&db, p, AVSTOR_OPEN_READONLY)) {
+        return 0;
+    }
+    result = mmap_check_keys(db, MMAP_KEY_COUNT * 2, 2, 1);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* A failed write rolls back the pages modified in the mapping */
+static int mmap_rollback(void *param)
+{
+    struct mmap_param *p = (struct mmap_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int res, result = 0;
+
+    if (!mmap_open(&db, p, AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_MMAP)) {
+        return 0;
+    }
+    if (!mmap_update_keys(db, MMAP_KEY_COUNT * 2, -1, 1)) {
+        goto close_and_return;
+    }
+    avstor_node_init(db, &root);
+    mmap_set_keys(&rec, &key, &name);
+    rec.key = 0;
+    if (AVSTOR_EXISTS != (res = avstor_create_key(&root, &key, &node))) {
+        printf("%sERROR: creating a duplicate key returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!mmap_check_keys(db, MMAP_KEY_COUNT * 2, 2, 1)) {
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (!mmap_open(&db, p, AVSTOR_OPEN_READONLY | AVSTOR_OPEN_MMAP)) {
+        return 0;
+    }
+    result = mmap_check_keys(db, MMAP_KEY_COUNT * 2, 2, 1);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Copies the file with a byte of its first data page flipped, which only its checksum detects */
+static int mmap_copy_corrupt(const char *filename, const char *copy_filename)
+{
+    static char buf[MMAP_PAGE_SIZE];
+    FILE *in = fopen(filename, "rb"), *out = fopen(copy_filename, "wb");
+    size_t n, page_count = 0;
+    int result = in && out;
+
+    while (result && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (page_count++ == 1) {
+            buf[MMAP_PAGE_SIZE - 1] ^= 0x55;
+        }
+        result = fwrite(buf, 1, n, out) == n;
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (out) {
+        fclose(out);
+    }
+    return result && page_count > 1;
+}
+
+/* Pages are verified the first time they are accessed in the mapping */
+static int mmap_corrupt(void *param)
+{
+    struct mmap_param p = *(struct mmap_param*)param;
+    avstor *db;
+    avstor_node root, node, value;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res = AVSTOR_OK;
+
+    if (!mmap_copy_corrupt(p.filename, MMAP_CORRUPT_DB)) {
+        printf("%sERROR: copying the file failed%s\n", YEL, CRESET);
+        return 0;
+    }
+    p.filename = MMAP_CORRUPT_DB;
+    if (!mmap_open(&db, &p, AVSTOR_OPEN_READONLY | AVSTOR_OPEN_MMAP)) {
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    mmap_set_keys(&rec, &key, &name);
+    for (i = 0; i < MMAP_KEY_COUNT * 2 && res == AVSTOR_OK; i++) {
+        rec.key = i;
+        if (AVSTOR_OK == (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            res = avstor_find(&node, &name, AVSTOR_VALUES, &value);
+            res = res == AVSTOR_NOTFOUND ? AVSTOR_OK : res;
+        }
+    }
+    avstor_close(db);
+    if (res != AVSTOR_CORRUPT) {
+        printf("%sERROR: reading a corrupted page returned %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+static const struct mmap_param MMAP_PARAM = { MMAP_DB, 256 };
+
+DEFINE_TEST_LIST(MMAP) {
+    { "Create DB", &mmap_create, AVSTEST_MUST_PASS, (void*)&MMAP_PARAM },
+    { "Update pages in place in the mapping", &mmap_update, 0, (void*)&MMAP_PARAM },
+    { "Roll back pages modified in the mapping", &mmap_rollback, 0, (void*)&MMAP_PARAM },
+    { "Verify the checksums of mapped pages", &mmap_corrupt, 0, (void*)&MMAP_PARAM }
+};
+
+DEFINE_TESTS(MMAP);
@@ -0,0 +1,170 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define MOUNT_DB "mount.db"
+#define MOUNT_TENANT_DB "mount_tenant.db"
+#define MOUNT_KEY_COUNT 100
+
+struct mount_param {
+    const char  *filename;
+    const char  *tenant_filename;
+    unsigned    cache_size;
+};
+
+static int mount_create_db(const char *filename, unsigned cache_size, int32_t count)
+{
+    avstor *db;
+    avstor_node root;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, filename, cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < count; i++) {
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, NULL))) {
+            printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+static int mount_create(void *param)
+{
+    struct mount_param *p = (struct mount_param*)param;
+    return mount_create_db(p->filename, p->cache_size, 2)
+        && mount_create_db(p->tenant_filename, p->cache_size, MOUNT_KEY_COUNT);
+}
+
+static long mount_count_keys(const avstor_node *parent)
+{
+    avstor_inorder st;
+    avstor_node node;
+    long count = 0;
+    int res = avstor_inorder_first(&st, parent, NULL, AVSTOR_KEYS, &node);
+    while (res == AVSTOR_OK) {
+        count++;
+        res = avstor_inorder_next(&st, &node);
+    }
+    return res == AVSTOR_NOTFOUND ? count : -1;
+}
+
+static int mount_traverse(void *param)
+{
+    struct mount_param *p = (struct mount_param*)param;
+    avstor *db, *tenant;
+    avstor_node root, mount_point, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_open(&tenant, p->tenant_filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.key = 1;
+    rec.data = 0;
+
+    if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &mount_point))
+        || AVSTOR_OK != (res = avstor_mount(&mount_point, tenant))) {
+        printf("%sERROR: mounting failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (mount_count_keys(&mount_point) != MOUNT_KEY_COUNT) {
+        printf("%sERROR: unexpected key count below mount point%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+
+    /* keys created below the mount point go to the mounted file */
+    rec.key = MOUNT_KEY_COUNT;
+    if (AVSTOR_OK != (res = avstor_create_key(&mount_point, &key, &node)) || node.db != tenant) {
+        printf("%sERROR: creating key below mount point failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    rec.key = 1;
+    if (AVSTOR_INVOPER != (res = avstor_delete(&root, AVSTOR_KEYS, &key))) {
+        printf("%sERROR: deleting mount point returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_unmount(&mount_point))
+        || mount_count_keys(&mount_point) != 0
+        || mount_count_keys(&root) != 2) {
+        printf("%sERROR: unmounting failed%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(tenant);
+    avstor_close(db);
+    return result;
+}
+
+static const struct mount_param MOUNT_PARAM = { MOUNT_DB, MOUNT_TENANT_DB, 1024 };
+
+DEFINE_TEST_LIST(MOUNT) {
+    { "Create DBs for mount", &mount_create, AVSTEST_MUST_PASS, (void*)&MOUNT_PARAM },
+    { "Traverse mounted file", &mount_traverse, 0, (void*)&MOUNT_PARAM }
+};
+
+DEFINE_TESTS(MOUNT);
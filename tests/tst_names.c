@@ -0,0 +1,216 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define NAMES_DB "names.db"
+#define NAMES_PLAIN_DB "names_plain.db"
+#define NAMES_KEY_COUNT 2000
+#define NAMES_VALUE_COUNT 3
+
+struct names_param {
+    const char  *filename;
+    const char  *plain_filename;
+    unsigned    cache_size;
+};
+
+static const char *VALUE_NAMES[NAMES_VALUE_COUNT] = {
+    "request_latency_us", "response_status", "owner_team_name"
+};
+
+static int names_comparer(const void *x, const void *y)
+{
+    return strcmp((const char*)x, (const char*)y);
+}
+
+static void names_set_key(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name) + 1;
+    key->comparer = &names_comparer;
+}
+
+static long names_file_size(const char *filename)
+{
+    long size = -1;
+    FILE *f = fopen(filename, "rb");
+    if (f) {
+        if (fseek(f, 0, SEEK_END) == 0) {
+            size = ftell(f);
+        }
+        fclose(f);
+    }
+    return size;
+}
+
+/* Every key gets the same three named values, with or without interning their names */
+static int names_create_db(const char *filename, unsigned cache_size, int intern)
+{
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key, name;
+    AvsDbIntRec rec;
+    int32_t i;
+    int j, res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, filename, cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    for (j = 0; intern && j < NAMES_VALUE_COUNT; j++) {
+        names_set_key(&name, VALUE_NAMES[j]);
+        if (AVSTOR_OK != (res = avstor_intern(db, &name))) {
+            printf("%sERROR: avstor_intern failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < NAMES_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))) {
+            printf("%sERROR: creating key failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+        for (j = 0; j < NAMES_VALUE_COUNT; j++) {
+            names_set_key(&name, VALUE_NAMES[j]);
+            if (AVSTOR_OK != (res = avstor_create_int32(&node, &name, i * NAMES_VALUE_COUNT + j, NULL))) {
+                printf("%sERROR: creating value failed with %i%s\n", YEL, res, CRESET);
+                avstor_close(db);
+                return 0;
+            }
+        }
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+static int names_create(void *param)
+{
+    struct names_param *p = (struct names_param*)param;
+    long size, plain_size;
+    if (!names_create_db(p->filename, p->cache_size, 1)
+        || !names_create_db(p->plain_filename, p->cache_size, 0)) {
+        return 0;
+    }
+    size = names_file_size(p->filename);
+    plain_size = names_file_size(p->plain_filename);
+    if (size <= 0 || size >= plain_size) {
+        printf("%sERROR: file with interned names is not smaller (%li vs %li bytes)%s\n", YEL, size, plain_size, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Finds the values by name after reopening the file and reads their names back */
+static int names_find(void *param)
+{
+    struct names_param *p = (struct names_param*)param;
+    avstor *db;
+    avstor_node root, node, value_node;
+    avstor_key key, name, out_name;
+    AvsDbIntRec rec;
+    char buf[64];
+    int32_t i, value;
+    int j, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    out_name.buf = buf;
+    out_name.len = sizeof(buf);
+    out_name.comparer = NULL;
+    for (i = 0; i < NAMES_KEY_COUNT; i++) {
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            printf("%sERROR: key %i not found (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+        for (j = 0; j < NAMES_VALUE_COUNT; j++) {
+            names_set_key(&name, VALUE_NAMES[j]);
+            memset(buf, 0, sizeof(buf));
+            if (AVSTOR_OK != (res = avstor_find(&node, &name, AVSTOR_VALUES, &value_node))
+                || AVSTOR_OK != (res = avstor_get_int32(&value_node, &value))
+                || value != i * NAMES_VALUE_COUNT + j
+                || AVSTOR_OK != (res = avstor_get_name(&value_node, &out_name))
+                || strcmp(buf, VALUE_NAMES[j]) != 0) {
+                printf("%sERROR: value %s of key %i mismatch (%i)%s\n", YEL, VALUE_NAMES[j], i, res, CRESET);
+                goto close_and_return;
+            }
+        }
+    }
+    /* names can be added to a file that already has a dictionary */
+    names_set_key(&name, "added_after_reopen");
+    rec.key = 0;
+    if (AVSTOR_OK != (res = avstor_intern(db, &name))
+        || AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+        || AVSTOR_OK != (res = avstor_create_int32(&node, &name, -1, NULL))
+        || AVSTOR_OK != (res = avstor_find(&node, &name, AVSTOR_VALUES, &value_node))
+        || AVSTOR_OK != (res = avstor_get_int32(&value_node, &value)) || value != -1
+        || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: value with a name added after reopening failed (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct names_param NAMES_PARAM = { NAMES_DB, NAMES_PLAIN_DB, 1024 };
+
+DEFINE_TEST_LIST(NAMES) {
+    { "Create DBs with and without interned names", &names_create, AVSTEST_MUST_PASS, (void*)&NAMES_PARAM },
+    { "Find values by interned name", &names_find, 0, (void*)&NAMES_PARAM }
+};
+
+DEFINE_TESTS(NAMES);
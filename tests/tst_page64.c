@@ -0,0 +1,200 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define PAGE64_DB "page64.db"
+#define PAGE64_KEY_COUNT 5000
+
+struct page64_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+/* Creates keys [first, first + count) under the root */
+static int page64_add_keys(avstor *db, int32_t first, int32_t count)
+{
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = first; i < first + count; i++) {
+        rec.key = i;
+        rec.data = i;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))) {
+            printf("%sERROR: creating key %i failed with %i%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int page64_find_keys(avstor *db, int32_t count)
+{
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < count; i++) {
+        rec.key = i;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            printf("%sERROR: key %i not found (%i)%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Checks the page count flag against the expected state; 32-bit files never have it */
+static int page64_check_flags(avstor *db, int expect_page64)
+{
+    uint32_t flags;
+    int res;
+    if (AVSTOR_OK != (res = avstor_get_file_flags(db, &flags))) {
+        printf("%sERROR: avstor_get_file_flags failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!(flags & AVSTOR_FILE_64BIT)) {
+        expect_page64 = 0;
+    }
+    if (!(flags & AVSTOR_FILE_PAGE64) != !expect_page64) {
+        printf("%sERROR: file flags are 0x%x, AVSTOR_FILE_PAGE64 %s expected%s\n", YEL, (unsigned)flags,
+               expect_page64 ? "is" : "not", CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Creates a file, then clears the flag to get a file as written before page counts had 64 bits */
+static int page64_create(void *param)
+{
+    struct page64_param *p = (struct page64_param*)param;
+    avstor *db;
+    uint32_t flags;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!page64_check_flags(db, 1) || !page64_add_keys(db, 0, PAGE64_KEY_COUNT)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_get_file_flags(db, &flags))
+        || AVSTOR_OK != (res = avs_set_file_flags(db, flags & ~(uint32_t)AVSTOR_FILE_PAGE64))
+        || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: downgrading the file failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = page64_check_flags(db, 0);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* A file opened read-only is readable and keeps its revision */
+static int page64_read_old(void *param)
+{
+    struct page64_param *p = (struct page64_param*)param;
+    avstor *db;
+    int res, result;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    result = page64_check_flags(db, 0) && page64_find_keys(db, PAGE64_KEY_COUNT);
+    avstor_close(db);
+    return result;
+}
+
+/* A file opened for writing is upgraded by its next commit and keeps growing */
+static int page64_upgrade(void *param)
+{
+    struct page64_param *p = (struct page64_param*)param;
+    avstor *db;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE
+                                        | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (!page64_check_flags(db, 1) || !page64_add_keys(db, PAGE64_KEY_COUNT, PAGE64_KEY_COUNT)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    result = page64_check_flags(db, 1) && page64_find_keys(db, PAGE64_KEY_COUNT * 2);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct page64_param PAGE64_PARAM = { PAGE64_DB, 1024 };
+
+DEFINE_TEST_LIST(PAGE64) {
+    { "Create DB of the 32-bit page count revision", &page64_create, AVSTEST_MUST_PASS, (void*)&PAGE64_PARAM },
+    { "Read DB of the old revision", &page64_read_old, 0, (void*)&PAGE64_PARAM },
+    { "Upgrade DB to 64-bit page counts", &page64_upgrade, 0, (void*)&PAGE64_PARAM }
+};
+
+DEFINE_TESTS(PAGE64);
@@ -0,0 +1,269 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define PARENTS_DB "parents.db"
+#define PARENTS_SRC_DB "parents_src.db"
+#define PARENTS_SIBLINGS 2000
+
+struct parents_param {
+    const char  *filename;
+    const char  *src_filename;
+    unsigned    cache_size;
+};
+
+static void parents_set_key(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name);
+    key->comparer = NULL;
+}
+
+/* Checks that the path of node has the given names, separated by '/' */
+static int parents_check_path(const char *what, const avstor_node *node, const char *expected)
+{
+    avstor_node path[8];
+    char buf[256], name[64];
+    avstor_key key;
+    unsigned depth, i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_get_path(node, path, 8, &depth))) {
+        printf("%sERROR: avstor_get_path of %s failed with %i%s\n", YEL, what, res, CRESET);
+        return 0;
+    }
+    buf[0] = 0;
+    for (i = 0; i < depth; i++) {
+        memset(name, 0, sizeof(name));
+        key.buf = name;
+        key.len = sizeof(name) - 1;
+        key.comparer = NULL;
+        if (AVSTOR_OK != (res = avstor_get_name(&path[i], &key))) {
+            printf("%sERROR: avstor_get_name failed with %i%s\n", YEL, res, CRESET);
+            return 0;
+        }
+        if (i > 0) {
+            strcat(buf, "/");
+        }
+        strcat(buf, name);
+    }
+    if (strcmp(buf, expected) != 0 || path[depth - 1].ref != node->ref) {
+        printf("%sERROR: path of %s is %s, expected %s%s\n", YEL, what, buf, expected, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Parents and paths of keys and values, also after values are resized and nodes move */
+static int parents_resolve(void *param)
+{
+    const struct parents_param *p = (const struct parents_param*)param;
+    avstor *db;
+    avstor_node root, a, b, c, str, link, target, parent, node, path[2];
+    avstor_key key;
+    char name[32], text[200];
+    unsigned depth;
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_PARENTS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    parents_set_key(&key, "a");
+    res = avstor_create_key(&root, &key, &a);
+    parents_set_key(&key, "b");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&a, &key, &b);
+    parents_set_key(&key, "c");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&b, &key, &c);
+    parents_set_key(&key, "str");
+    res = res != AVSTOR_OK ? res : avstor_create_string(&c, &key, "x", &str);
+    parents_set_key(&key, "link");
+    res = res != AVSTOR_OK ? res : avstor_create_link(&a, &key, &str, &link);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: creating nodes failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_get_parent(&str, &parent)) || parent.ref != c.ref
+        || AVSTOR_OK != (res = avstor_get_parent(&b, &parent)) || parent.ref != a.ref
+        || AVSTOR_OK != (res = avstor_get_parent(&a, &parent)) || parent.ref != 0) {
+        printf("%sERROR: avstor_get_parent returned %i or the wrong key%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* the target of a link leads back to its place in the hierarchy */
+    if (AVSTOR_OK != (res = avstor_get_link(&link, &target))
+        || !parents_check_path("link target", &target, "a/b/c/str")
+        || !parents_check_path("key", &b, "a/b")) {
+        goto close_and_return;
+    }
+    if (AVSTOR_PARAM != (res = avstor_get_path(&str, path, 2, &depth)) || depth != 4
+        || AVSTOR_PARAM != (res = avstor_get_parent(&root, &parent))) {
+        printf("%sERROR: avstor_get_path with a small buffer returned %i and depth %u%s\n", YEL, res, depth, CRESET);
+        goto close_and_return;
+    }
+
+    /* siblings created and deleted around c move nodes within and between pages */
+    for (i = 0; i < PARENTS_SIBLINGS; i++) {
+        sprintf(name, "sibling%i", i);
+        parents_set_key(&key, name);
+        if (AVSTOR_OK != (res = avstor_create_key(&b, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_string(&c, &key, name, &node))) {
+            printf("%sERROR: creating siblings failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    for (i = 0; i < PARENTS_SIBLINGS; i += 2) {
+        sprintf(name, "sibling%i", i);
+        parents_set_key(&key, name);
+        if (AVSTOR_OK != (res = avstor_delete(&b, AVSTOR_KEYS, &key))
+            || AVSTOR_OK != (res = avstor_delete(&c, AVSTOR_VALUES, &key))) {
+            printf("%sERROR: deleting siblings failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    memset(text, 'y', sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    if (AVSTOR_OK != (res = avstor_update_string(&str, text))) {
+        printf("%sERROR: avstor_update_string failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    parents_set_key(&key, "sibling1");
+    if (!parents_check_path("resized value", &str, "a/b/c/str")
+        || AVSTOR_OK != (res = avstor_find(&c, &key, AVSTOR_VALUES, &node))
+        || !parents_check_path("sibling value", &node, "a/b/c/sibling1")
+        || AVSTOR_OK != (res = avstor_find(&b, &key, AVSTOR_KEYS, &node))
+        || !parents_check_path("sibling key", &node, "a/b/sibling1")) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    /* files without parent references */
+    if (AVSTOR_OK != (res = avstor_open(&db, p->src_filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    parents_set_key(&key, "a");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &a))
+        || AVSTOR_INVOPER != (res = avstor_get_parent(&a, &parent))
+        || AVSTOR_INVOPER != (res = avstor_get_path(&a, path, 2, &depth))) {
+        printf("%sERROR: avstor_get_parent without parent references returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Imported keys and values resolve through the key they were imported under */
+static int parents_import(void *param)
+{
+    const struct parents_param *p = (const struct parents_param*)param;
+    avstor *db;
+    avstor_node root, top, sub, node, parent;
+    avstor_key key;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->src_filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_PARENTS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    parents_set_key(&key, "top");
+    res = avstor_create_key(&root, &key, &top);
+    parents_set_key(&key, "sub");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&top, &key, &sub);
+    parents_set_key(&key, "value");
+    res = res != AVSTOR_OK ? res : avstor_create_int64(&sub, &key, 1, &node);
+    res = res != AVSTOR_OK ? res : avstor_commit(db, 1);
+    avstor_close(db);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: creating source file failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    parents_set_key(&key, "a");
+    res = avstor_find(&root, &key, AVSTOR_KEYS, &parent);
+    parents_set_key(&key, "imported");
+    res = res != AVSTOR_OK ? res : avstor_import_file(&parent, &key, p->src_filename);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_import_file failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    parents_set_key(&key, "imported");
+    res = avstor_find(&parent, &key, AVSTOR_KEYS, &node);
+    parents_set_key(&key, "top");
+    res = res != AVSTOR_OK ? res : avstor_find(&node, &key, AVSTOR_KEYS, &top);
+    parents_set_key(&key, "sub");
+    res = res != AVSTOR_OK ? res : avstor_find(&top, &key, AVSTOR_KEYS, &sub);
+    parents_set_key(&key, "value");
+    res = res != AVSTOR_OK ? res : avstor_find(&sub, &key, AVSTOR_VALUES, &node);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_find of imported nodes failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = parents_check_path("imported value", &node, "a/imported/top/sub/value")
+        && parents_check_path("imported key", &top, "a/imported/top");
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct parents_param PARENTS_PARAM = { PARENTS_DB, PARENTS_SRC_DB, 1024 };
+
+DEFINE_TEST_LIST(PARENTS) {
+    { "Parents and paths of nodes", &parents_resolve, 0, (void*)&PARENTS_PARAM },
+    { "Paths of imported nodes", &parents_import, 0, (void*)&PARENTS_PARAM }
+};
+
+DEFINE_TESTS(PARENTS);
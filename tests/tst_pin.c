@@ -0,0 +1,170 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define PIN_DB "pin.db"
+#define PIN_HOT_COUNT 500
+#define PIN_COLD_COUNT 20000
+
+struct pin_param {
+    const char  *filename;
+    unsigned    cache_size;
+    int         oflags;
+};
+
+/* Creates count keys with an int32 value each under parent */
+static int pin_fill(avstor_node *parent, int32_t count)
+{
+    avstor_node node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < count; i++) {
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_create_key(parent, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &key, i, NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Reads back the values created by pin_fill */
+static int pin_verify(avstor_node *parent, int32_t count)
+{
+    avstor_node node, value_node;
+    avstor_inorder st;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t value, n = 0;
+    int res;
+
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    res = avstor_inorder_first(&st, parent, NULL, AVSTOR_KEYS, &node);
+    while (res == AVSTOR_OK) {
+        rec.key = n;
+        if (AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value_node))
+            || AVSTOR_OK != (res = avstor_get_int32(&value_node, &value)) || value != n) {
+            printf("%sERROR: value mismatch at %i%s\n", YEL, n, CRESET);
+            return 0;
+        }
+        n++;
+        res = avstor_inorder_next(&st, &node);
+    }
+    if (res != AVSTOR_NOTFOUND || n != count) {
+        printf("%sERROR: key count mismatch (%i)%s\n", YEL, n, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+static int pin_subtree(void *param)
+{
+    struct pin_param *p = (struct pin_param*)param;
+    avstor *db;
+    avstor_node root, hot, cold;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | p->oflags))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.data = 0;
+    rec.key = -1;
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &hot))
+        || !pin_fill(&hot, PIN_HOT_COUNT)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_pin_subtree(&hot, AVSTOR_PRIORITY_PINNED))) {
+        printf("%sERROR: avstor_pin_subtree failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    rec.key = -2;
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &cold))
+        || !pin_fill(&cold, PIN_COLD_COUNT)
+        || !pin_verify(&cold, PIN_COLD_COUNT)
+        || !pin_verify(&hot, PIN_HOT_COUNT)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))
+        || AVSTOR_OK != (res = avs_check_cache_consistency(db))) {
+        printf("%sERROR: commit or cache check failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    /* unpinning returns the pages to the normal class */
+    if (AVSTOR_OK != (res = avstor_pin_subtree(&hot, AVSTOR_PRIORITY_NORMAL))
+        || AVSTOR_OK != (res = avstor_pin_subtree(&root, AVSTOR_PRIORITY_HIGH))
+        || !pin_verify(&cold, PIN_COLD_COUNT)
+        || AVSTOR_OK != (res = avstor_pin_subtree(&root, AVSTOR_PRIORITY_NORMAL))) {
+        printf("%sERROR: changing priority failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct pin_param PIN_PARAM = { PIN_DB, 64, 0 };
+static const struct pin_param PIN_KEYS_PARAM = { PIN_DB, 64, AVSTOR_OPEN_PRIORITIZE_KEYS };
+
+DEFINE_TEST_LIST(PIN) {
+    { "Pin subtree in cache", &pin_subtree, 0, (void*)&PIN_PARAM },
+    { "Pin subtree with key pages prioritized", &pin_subtree, 0, (void*)&PIN_KEYS_PARAM }
+};
+
+DEFINE_TESTS(PIN);
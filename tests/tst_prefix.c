@@ -0,0 +1,175 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define PREFIX_DB "prefix.db"
+#define PREFIX_KEY_COUNT 5000
+
+struct prefix_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+/* Half the names differ in their first 8 bytes, the other half only after a long common prefix */
+static void prefix_format(char *buf, int i)
+{
+    if (i & 1) {
+        sprintf(buf, "shared_prefix_of_names_%05i", i);
+    }
+    else {
+        sprintf(buf, "%05i", i);
+    }
+}
+
+static void prefix_set_key(avstor_key *key, char *buf)
+{
+    key->buf = buf;
+    key->len = strlen(buf) + 1;
+    key->comparer = NULL;
+}
+
+static int prefix_create(void *param)
+{
+    struct prefix_param *p = (struct prefix_param*)param;
+    avstor *db;
+    avstor_node root;
+    avstor_key key;
+    char buf[64];
+    int i, res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    /* insert in an order unrelated to the byte order */
+    for (i = 0; i < PREFIX_KEY_COUNT; i++) {
+        prefix_format(buf, (i * 7919) % PREFIX_KEY_COUNT);
+        prefix_set_key(&key, buf);
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, NULL))) {
+            printf("%sERROR: creating key %s failed with %i%s\n", YEL, buf, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(db);
+        return 0;
+    }
+    /* a failed create rolls back, so this comes after the commit */
+    prefix_set_key(&key, buf);
+    res = avstor_create_key(&root, &key, NULL);
+    avstor_close(db);
+    if (res != AVSTOR_EXISTS) {
+        printf("%sERROR: duplicate key %s was not detected (%i)%s\n", YEL, buf, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Finds every key and walks all keys in byte order */
+static int prefix_find(void *param)
+{
+    struct prefix_param *p = (struct prefix_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_inorder st;
+    avstor_key key, name;
+    char buf[64], prev[64], found[64];
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    for (i = 0; i < PREFIX_KEY_COUNT; i++) {
+        prefix_format(buf, i);
+        prefix_set_key(&key, buf);
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+            printf("%sERROR: key %s not found (%i)%s\n", YEL, buf, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    strcpy(buf, "shared_prefix_of_names_0000");
+    prefix_set_key(&key, buf);
+    if (AVSTOR_NOTFOUND != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))) {
+        printf("%sERROR: key %s should not exist (%i)%s\n", YEL, buf, res, CRESET);
+        goto close_and_return;
+    }
+
+    name.buf = found;
+    name.len = sizeof(found);
+    name.comparer = NULL;
+    prev[0] = 0;
+    res = avstor_inorder_first(&st, &root, NULL, AVSTOR_KEYS, &node);
+    for (i = 0; res == AVSTOR_OK; i++) {
+        memset(found, 0, sizeof(found));
+        if (AVSTOR_OK != (res = avstor_get_name(&node, &name))) {
+            break;
+        }
+        if (i > 0 && strcmp(prev, found) >= 0) {
+            printf("%sERROR: %s walked after %s%s\n", YEL, found, prev, CRESET);
+            goto close_and_return;
+        }
+        strcpy(prev, found);
+        res = avstor_inorder_next(&st, &node);
+    }
+    if (res != AVSTOR_NOTFOUND || i != PREFIX_KEY_COUNT) {
+        printf("%sERROR: walked %i keys (%i)%s\n", YEL, i, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct prefix_param PREFIX_PARAM = { PREFIX_DB, 1024 };
+
+DEFINE_TEST_LIST(PREFIX) {
+    { "Create keys ordered bytewise", &prefix_create, AVSTEST_MUST_PASS, (void*)&PREFIX_PARAM },
+    { "Find and walk keys ordered bytewise", &prefix_find, 0, (void*)&PREFIX_PARAM }
+};
+
+DEFINE_TESTS(PREFIX);
@@ -0,0 +1,479 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define ROLLUP_DB "rollup.db"
+#define ROLLUP_SRC_DB "rollup_src.db"
+#define ROLLUP_HOSTS 10
+
+struct rollup_param {
+    const char  *filename;
+    const char  *src_filename;
+    unsigned    cache_size;
+};
+
+static void rollup_set_key(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name);
+    key->comparer = NULL;
+}
+
+/* Compares a rollup with the expected one, returns 0 on mismatch */
+static int rollup_check(const char *what, const avstor_node *node, const char *name, int64_t sum,
+                        int64_t min, int64_t max, uint64_t count)
+{
+    avstor_rollup r;
+    avstor_key key;
+    int res;
+    rollup_set_key(&key, name);
+    if (AVSTOR_OK != (res = avstor_rollup_get(node, &key, &r))) {
+        printf("%sERROR: avstor_rollup_get of %s failed with %i%s\n", YEL, what, res, CRESET);
+        return 0;
+    }
+    if (r.sum != sum || r.min != min || r.max != max || r.count != count) {
+        printf("%sERROR: %s has sum %li, min %li, max %li and count %lu, expected %li, %li, %li and %lu%s\n",
+               YEL, what, (long)r.sum, (long)r.min, (long)r.max, (unsigned long)r.count, (long)sum,
+               (long)min, (long)max, (unsigned long)count, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Creates dc under region with ROLLUP_HOSTS hosts having an int64 "load" of base + host number */
+static int rollup_create_dc(const avstor_node *region, const char *dc_name, int64_t base, avstor_node *dc)
+{
+    avstor_node host, node;
+    avstor_key key;
+    char name[32];
+    int i, res;
+
+    rollup_set_key(&key, dc_name);
+    if (AVSTOR_OK != (res = avstor_create_key(region, &key, dc))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    for (i = 0; i < ROLLUP_HOSTS; i++) {
+        sprintf(name, "host%i", i);
+        rollup_set_key(&key, name);
+        res = avstor_create_key(dc, &key, &host);
+        rollup_set_key(&key, "load");
+        res = res != AVSTOR_OK ? res : avstor_create_int64(&host, &key, base + i, &node);
+        /* other names and types are not counted */
+        rollup_set_key(&key, "temp");
+        res = res != AVSTOR_OK ? res : avstor_create_int64(&host, &key, 1000, &node);
+        if (res != AVSTOR_OK) {
+            printf("%sERROR: creating host failed with %i%s\n", YEL, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int rollup_find(const avstor_node *parent, const char *name, int flags, avstor_node *out)
+{
+    avstor_key key;
+    int res;
+    rollup_set_key(&key, name);
+    if (AVSTOR_OK != (res = avstor_find(parent, &key, flags, out))) {
+        printf("%sERROR: avstor_find of %s failed with %i%s\n", YEL, name, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Creating, updating and deleting values keeps the rollups of all their ancestors */
+static int rollup_maintained(void *param)
+{
+    const struct rollup_param *p = (const struct rollup_param*)param;
+    avstor *db;
+    avstor_node root, region, dc1, dc2, host, node;
+    avstor_rollup r;
+    avstor_key key;
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE
+                                        | AVSTOR_OPEN_KEYSTATS | AVSTOR_OPEN_PARENTS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    rollup_set_key(&key, "region");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &region))
+        || !rollup_create_dc(&region, "dc1", 100, &dc1)) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* the declaration scans the values created so far */
+    rollup_set_key(&key, "load");
+    if (AVSTOR_OK != (res = avstor_rollup_declare(&region, &key))
+        || AVSTOR_OK != (res = avstor_rollup_declare(&dc1, &key))) {
+        printf("%sERROR: avstor_rollup_declare failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_check("declared region", &region, "load", 1045, 100, 109, 10)) {
+        goto close_and_return;
+    }
+    if (!rollup_create_dc(&region, "dc2", 200, &dc2)) {
+        goto close_and_return;
+    }
+    /* an int32 of the same name directly under the region, a string is ignored */
+    rollup_set_key(&key, "load");
+    if (AVSTOR_OK != (res = avstor_create_int32(&region, &key, -5, &node))
+        || AVSTOR_OK != (res = avstor_create_string(&dc2, &key, "high", &node))) {
+        printf("%sERROR: creating values failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_check("region", &region, "load", 1045 + 2045 - 5, -5, 209, 21)
+        || !rollup_check("dc1", &dc1, "load", 1045, 100, 109, 10)) {
+        goto close_and_return;
+    }
+
+    /* updates raising the maximum, lowering the minimum and moving the minimum up */
+    if (!rollup_find(&dc1, "host3", AVSTOR_KEYS, &host) || !rollup_find(&host, "load", AVSTOR_VALUES, &node)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_update_int64(&node, 500))
+        || !rollup_check("region after update", &region, "load", 1045 + 2045 - 5 + 397, -5, 500, 21)
+        || !rollup_check("dc1 after update", &dc1, "load", 1045 + 397, 100, 500, 10)) {
+        goto close_and_return;
+    }
+    if (!rollup_find(&dc1, "host0", AVSTOR_KEYS, &host) || !rollup_find(&host, "load", AVSTOR_VALUES, &node)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_update_int64(&node, 150))
+        || !rollup_check("dc1 after raising minimum", &dc1, "load", 1045 + 397 + 50, 101, 500, 10)) {
+        goto close_and_return;
+    }
+    if (!rollup_find(&region, "load", AVSTOR_VALUES, &node)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_update_int32(&node, -50))
+        || !rollup_check("region after lowering minimum", &region, "load", 1045 + 2045 - 50 + 447, -50, 500, 21)) {
+        goto close_and_return;
+    }
+
+    /* deleting the maximum and the minimum */
+    rollup_set_key(&key, "load");
+    if (!rollup_find(&dc1, "host3", AVSTOR_KEYS, &host)
+        || AVSTOR_OK != (res = avstor_delete(&host, AVSTOR_VALUES, &key))
+        || AVSTOR_OK != (res = avstor_delete(&region, AVSTOR_VALUES, &key))) {
+        printf("%sERROR: avstor_delete failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_check("region after deletes", &region, "load", 1045 + 2045 + 50 - 103, 101, 209, 19)
+        || !rollup_check("dc1 after deletes", &dc1, "load", 1045 + 50 - 103, 101, 150, 9)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    /* creating an existing key rolls back the value created before it */
+    if (!rollup_find(&dc2, "host0", AVSTOR_KEYS, &host)) {
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "load");
+    if (AVSTOR_OK != (res = avstor_delete(&host, AVSTOR_VALUES, &key))
+        || AVSTOR_OK != (res = avstor_create_int64(&host, &key, 1 << 20, &node))
+        || !rollup_check("region before rollback", &region, "load", 1045 + 2045 - 53 - 200 + (1 << 20),
+                         101, 1 << 20, 19)) {
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "dc1");
+    if (AVSTOR_EXISTS != (res = avstor_create_key(&region, &key, &node))) {
+        printf("%sERROR: avstor_create_key returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_check("region after rollback", &region, "load", 1045 + 2045 - 53, 101, 209, 19)) {
+        goto close_and_return;
+    }
+
+    /* deleting a key with a rollup drops it */
+    rollup_set_key(&key, "load");
+    for (i = 0; i < ROLLUP_HOSTS; i++) {
+        char name[32];
+        sprintf(name, "host%i", i);
+        if (!rollup_find(&dc1, name, AVSTOR_KEYS, &host)) {
+            goto close_and_return;
+        }
+        if (i != 3) {
+            res = avstor_delete(&host, AVSTOR_VALUES, &key);
+        }
+        rollup_set_key(&key, "temp");
+        res = res != AVSTOR_OK ? res : avstor_delete(&host, AVSTOR_VALUES, &key);
+        rollup_set_key(&key, name);
+        res = res != AVSTOR_OK ? res : avstor_delete(&dc1, AVSTOR_KEYS, &key);
+        rollup_set_key(&key, "load");
+        if (res != AVSTOR_OK) {
+            printf("%sERROR: deleting host failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (!rollup_check("emptied dc1", &dc1, "load", 0, 0, 0, 0)) {
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "dc1");
+    if (AVSTOR_OK != (res = avstor_delete(&region, AVSTOR_KEYS, &key))) {
+        printf("%sERROR: avstor_delete of dc1 failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_check("region without dc1", &region, "load", 2045, 200, 209, 10)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    if (!rollup_find(&root, "region", AVSTOR_KEYS, &region)
+        || !rollup_check("reopened region", &region, "load", 2045, 200, 209, 10)) {
+        goto close_and_return;
+    }
+
+    /* declaring twice, on the root, removing */
+    rollup_set_key(&key, "load");
+    if (AVSTOR_EXISTS != (res = avstor_rollup_declare(&region, &key))
+        || AVSTOR_PARAM != (res = avstor_rollup_declare(&root, &key))
+        || AVSTOR_OK != (res = avstor_rollup_remove(&region, &key))
+        || AVSTOR_NOTFOUND != (res = avstor_rollup_remove(&region, &key))) {
+        printf("%sERROR: declaring or removing returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_NOTFOUND != (res = avstor_rollup_get(&region, &key, &r))) {
+        printf("%sERROR: avstor_rollup_get of a removed rollup returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Importing a file below a key with a rollup rescans it, imported values keep updating it */
+static int rollup_import(void *param)
+{
+    const struct rollup_param *p = (const struct rollup_param*)param;
+    avstor *db;
+    avstor_node root, region, dc, host, node;
+    avstor_rollup r;
+    avstor_key key;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->src_filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_PARENTS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    rollup_set_key(&key, "load");
+    /* rollups of the imported file are not carried over */
+    if (!rollup_create_dc(&root, "dc", 300, &dc) || AVSTOR_OK != (res = avstor_rollup_declare(&dc, &key))
+        || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: creating source file failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_PARENTS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    if (!rollup_create_dc(&root, "region", 0, &region)) {
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "load");
+    if (AVSTOR_OK != (res = avstor_rollup_declare(&region, &key))
+        || !rollup_check("region", &region, "load", 45, 0, 9, 10)) {
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "imported");
+    if (AVSTOR_OK != (res = avstor_import_file(&region, &key, p->src_filename))) {
+        printf("%sERROR: avstor_import_file failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_check("region after import", &region, "load", 45 + 3045, 0, 309, 20)) {
+        goto close_and_return;
+    }
+    if (!rollup_find(&region, "imported", AVSTOR_KEYS, &node) || !rollup_find(&node, "dc", AVSTOR_KEYS, &dc)
+        || !rollup_find(&dc, "host9", AVSTOR_KEYS, &host) || !rollup_find(&host, "load", AVSTOR_VALUES, &node)) {
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "load");
+    if (AVSTOR_NOTFOUND != (res = avstor_rollup_get(&dc, &key, &r))) {
+        printf("%sERROR: avstor_rollup_get of an imported key returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_update_int64(&node, 1000))
+        || !rollup_check("region after imported update", &region, "load", 45 + 3045 + 691, 0, 1000, 20)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_delete(&host, AVSTOR_VALUES, &key))
+        || !rollup_check("region after imported delete", &region, "load", 45 + 3045 - 309, 0, 308, 19)) {
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    /* rollups need parent references */
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    rollup_set_key(&key, "region");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &region))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "load");
+    if (AVSTOR_INVOPER != (res = avstor_rollup_declare(&region, &key))) {
+        printf("%sERROR: avstor_rollup_declare without parent references returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Orders names of 4 bytes backwards */
+static int rollup_reverse_comparer(const void *v1, const void *v2)
+{
+    return memcmp(v2, v1, 4);
+}
+
+/* Values of the name of a rollup cannot be created or deleted with a comparer below its key, the
+   rollups themselves are named without comparer */
+static int rollup_comparer(void *param)
+{
+    const struct rollup_param *p = (const struct rollup_param*)param;
+    avstor *db;
+    avstor_node root, parent, host, other, node;
+    avstor_rollup r;
+    avstor_key key;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE | AVSTOR_OPEN_PARENTS))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    rollup_set_key(&key, "parent");
+    res = avstor_create_key(&root, &key, &parent);
+    rollup_set_key(&key, "host");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&parent, &key, &host);
+    rollup_set_key(&key, "other");
+    res = res != AVSTOR_OK ? res : avstor_create_key(&parent, &key, &other);
+    rollup_set_key(&key, "load");
+    res = res != AVSTOR_OK ? res : avstor_create_int64(&host, &key, 7, &node);
+    /* records of "aaaa", "load" and "zzzz", which a backwards search for "aaaa" misses */
+    res = res != AVSTOR_OK ? res : avstor_rollup_declare(&parent, &key);
+    rollup_set_key(&key, "aaaa");
+    res = res != AVSTOR_OK ? res : avstor_rollup_declare(&parent, &key);
+    rollup_set_key(&key, "zzzz");
+    res = res != AVSTOR_OK ? res : avstor_rollup_declare(&parent, &key);
+    /* failing writes roll back what was not committed */
+    res = res != AVSTOR_OK ? res : avstor_commit(db, 1);
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: creating keys and rollups failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    rollup_set_key(&key, "load");
+    key.comparer = &rollup_reverse_comparer;
+    if (AVSTOR_INVOPER != (res = avstor_create_int64(&parent, &key, 100, &node))
+        || AVSTOR_INVOPER != (res = avstor_delete(&host, AVSTOR_VALUES, &key))) {
+        printf("%sERROR: creating or deleting load with a comparer returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    rollup_set_key(&key, "aaaa");
+    key.comparer = &rollup_reverse_comparer;
+    if (AVSTOR_INVOPER != (res = avstor_create_int64(&other, &key, 100, &node))) {
+        printf("%sERROR: creating aaaa with a comparer returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* values of other names may have a comparer */
+    rollup_set_key(&key, "temp");
+    key.comparer = &rollup_reverse_comparer;
+    if (AVSTOR_OK != (res = avstor_create_int64(&other, &key, 100, &node))) {
+        printf("%sERROR: creating temp with a comparer failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!rollup_find(&host, "load", AVSTOR_VALUES, &node)
+        || !rollup_check("load", &parent, "load", 7, 7, 7, 1)
+        || !rollup_check("aaaa", &parent, "aaaa", 0, 0, 0, 0)) {
+        goto close_and_return;
+    }
+
+    rollup_set_key(&key, "load");
+    key.comparer = &rollup_reverse_comparer;
+    if (AVSTOR_PARAM != (res = avstor_rollup_declare(&host, &key))
+        || AVSTOR_PARAM != (res = avstor_rollup_get(&parent, &key, &r))
+        || AVSTOR_PARAM != (res = avstor_rollup_remove(&parent, &key))) {
+        printf("%sERROR: rollup named with a comparer returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct rollup_param ROLLUP_PARAM = { ROLLUP_DB, ROLLUP_SRC_DB, 1024 };
+
+DEFINE_TEST_LIST(ROLLUP) {
+    { "Rollups maintained on write", &rollup_maintained, AVSTEST_MUST_PASS, (void*)&ROLLUP_PARAM },
+    { "Rollups of imported files", &rollup_import, 0, (void*)&ROLLUP_PARAM },
+    { "Rollups of values named with a comparer", &rollup_comparer, 0, (void*)&ROLLUP_PARAM }
+};
+
+DEFINE_TESTS(ROLLUP);
@@ -0,0 +1,183 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define SAMPLE_DB "sample.db"
+#define SAMPLE_VALUES 1000
+#define SAMPLE_BATCH 1000
+#define SAMPLE_ROUNDS 100
+
+struct sample_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+static void sample_set_key(avstor_key *key, const char *name)
+{
+    key->buf = (void*)name;
+    key->len = strlen(name);
+    key->comparer = NULL;
+}
+
+/* Every value is picked about as often as the others, and seeds repeat the picks */
+static int sample_uniform_values(void *param)
+{
+    const struct sample_param *p = (const struct sample_param*)param;
+    static avstor_node picks[SAMPLE_BATCH], again[SAMPLE_BATCH];
+    static unsigned counts[SAMPLE_VALUES];
+    avstor *db;
+    avstor_node root, parent, node;
+    avstor_key key;
+    char name[32];
+    double chi2 = 0.0;
+    int32_t value;
+    int i, j, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    sample_set_key(&key, "values");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &parent))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* inserted out of order, so that the tree is not complete */
+    for (i = 0; i < SAMPLE_VALUES; i++) {
+        int v = (i * 7919) % SAMPLE_VALUES;
+        sprintf(name, "v%04i", v);
+        sample_set_key(&key, name);
+        if (AVSTOR_OK != (res = avstor_create_int32(&parent, &key, v, &node))) {
+            printf("%sERROR: avstor_create_int32 failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < SAMPLE_ROUNDS; i++) {
+        if (AVSTOR_OK != (res = avstor_sample(&parent, AVSTOR_VALUES, SAMPLE_BATCH, picks, i + 1))) {
+            printf("%sERROR: avstor_sample failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+        for (j = 0; j < SAMPLE_BATCH; j++) {
+            if (AVSTOR_OK != (res = avstor_get_int32(&picks[j], &value)) || value < 0 || value >= SAMPLE_VALUES) {
+                printf("%sERROR: sampled node is not one of the values (%i)%s\n", YEL, res, CRESET);
+                goto close_and_return;
+            }
+            counts[value]++;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_sample(&parent, AVSTOR_VALUES, SAMPLE_BATCH, again, SAMPLE_ROUNDS))) {
+        printf("%sERROR: avstor_sample failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (j = 0; j < SAMPLE_BATCH; j++) {
+        if (picks[j].ref != again[j].ref) {
+            printf("%sERROR: the same seed picked different nodes%s\n", YEL, CRESET);
+            goto close_and_return;
+        }
+    }
+    /* expected about SAMPLE_VALUES - 1 for uniform picks, with a deviation of about 45 */
+    for (i = 0; i < SAMPLE_VALUES; i++) {
+        double expected = (double)SAMPLE_BATCH * SAMPLE_ROUNDS / SAMPLE_VALUES;
+        chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+    }
+    if (chi2 > SAMPLE_VALUES * 1.25) {
+        printf("%sERROR: samples are not uniform, chi-square %.1f%s\n", YEL, chi2, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Keys can be sampled too, parents without children have nothing to sample */
+static int sample_keys(void *param)
+{
+    const struct sample_param *p = (const struct sample_param*)param;
+    avstor *db;
+    avstor_node root, parent, picks[4];
+    avstor_key key;
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE
+                                        | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    sample_set_key(&key, "only");
+    if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &parent))) {
+        printf("%sERROR: avstor_create_key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_sample(&root, AVSTOR_KEYS, 4, picks, 0))) {
+        printf("%sERROR: avstor_sample failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < 4; i++) {
+        if (picks[i].ref != parent.ref) {
+            printf("%sERROR: sample of a single key returned another node%s\n", YEL, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_NOTFOUND != (res = avstor_sample(&parent, AVSTOR_KEYS, 4, picks, 1))
+        || AVSTOR_NOTFOUND != (res = avstor_sample(&parent, AVSTOR_VALUES, 4, picks, 1))
+        || AVSTOR_PARAM != (res = avstor_sample(&root, AVSTOR_VALUES, 4, picks, 1))
+        || AVSTOR_OK != (res = avstor_sample(&root, AVSTOR_KEYS, 0, NULL, 1))) {
+        printf("%sERROR: avstor_sample returned %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct sample_param SAMPLE_PARAM = { SAMPLE_DB, 1024 };
+
+DEFINE_TEST_LIST(SAMPLE) {
+    { "Uniform samples of values", &sample_uniform_values, 0, (void*)&SAMPLE_PARAM },
+    { "Samples of keys", &sample_keys, 0, (void*)&SAMPLE_PARAM }
+};
+
+DEFINE_TESTS(SAMPLE);
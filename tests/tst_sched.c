@@ -0,0 +1,313 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+#if (defined(__STDC_VERSION__) && (__STDC_VERSION__ >=201112L))
+#include <threads.h>
+#else
+#include "../threads/threads.h"
+#endif
+#endif
+
+#include "avsdb.h"
+#include "avstest.h"
+#include "timer.h"
+
+#define SCHED_DB "sched.db"
+#define SCHED_TIER_FILE "sched_tier.dat"
+#define SCHED_KEY_COUNT 20000
+#define SCHED_SLOW_KB 1024
+
+struct sched_param {
+    const char  *filename;
+    const char  *tier_filename;
+    unsigned    cache_size;
+    unsigned    thread_count;
+    unsigned    kb_per_sec;
+    unsigned    iops;
+};
+
+static void sched_sleep_ms(unsigned ms)
+{
+#if defined(AVSTOR_CONFIG_THREAD_SAFE)
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    thrd_sleep(&ts, NULL);
+#else
+    (void)ms;
+#endif
+}
+
+/* Returns the size of a file, or -1 */
+static long sched_file_size(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    long size = -1;
+    if (f) {
+        if (fseek(f, 0, SEEK_END) == 0) {
+            size = ftell(f);
+        }
+        fclose(f);
+    }
+    return size;
+}
+
+/* Counts the keys under the root, which reads every page */
+static int sched_count_keys(avstor *db, int32_t *count)
+{
+    avstor_node root, node;
+    avstor_inorder st;
+    int res;
+
+    avstor_node_init(db, &root);
+    *count = 0;
+    res = avstor_inorder_first(&st, &root, NULL, AVSTOR_KEYS, &node);
+    while (res == AVSTOR_OK) {
+        (*count)++;
+        res = avstor_inorder_next(&st, &node);
+    }
+    return res == AVSTOR_NOTFOUND ? AVSTOR_OK : res;
+}
+
+/* Starts the scheduler with the budget of the test, returns 0 on failure and -1 if the build has
+   no scheduler */
+static int sched_begin(const struct sched_param *p)
+{
+    int res;
+    if (AVSTOR_INVOPER == (res = avstor_sched_start(p->thread_count))) {
+        printf("Maintenance scheduler is not available in this build, skipping\n");
+        return -1;
+    }
+    if (res != AVSTOR_OK || AVSTOR_INVOPER != avstor_sched_start(p->thread_count)) {
+        printf("%sERROR: avstor_sched_start failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_sched_set_budget(p->kb_per_sec, p->iops);
+    return 1;
+}
+
+/* Creates a file of SCHED_KEY_COUNT committed keys with an empty tier file */
+static int sched_create_db(const struct sched_param *p, avstor **db)
+{
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    remove(p->tier_filename);
+    if (AVSTOR_OK != (res = avstor_open(db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        *db = NULL;
+        return 0;
+    }
+    avstor_node_init(*db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < SCHED_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            return 0;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(*db, 1))
+        || AVSTOR_OK != (res = avstor_tier_open(*db, p->tier_filename))) {
+        printf("%sERROR: opening tier file failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Closes the file and stops the scheduler */
+static int sched_end(avstor *db, int result)
+{
+    if (db) {
+        avstor_close(db);
+    }
+    if (AVSTOR_OK != avstor_sched_stop()) {
+        printf("%sERROR: avstor_sched_stop failed%s\n", YEL, CRESET);
+        result = 0;
+    }
+    return result;
+}
+
+/* Runs tier migration as a throttled background task while the scheduler is paused and resumed */
+static int sched_tier_migrate(void *param)
+{
+    struct sched_param *p = (struct sched_param*)param;
+    avstor *db;
+    int32_t count;
+    long db_size, tier_size;
+    int res;
+
+    if ((res = sched_begin(p)) <= 0) {
+        return res < 0;
+    }
+    if (!sched_create_db(p, &db)) {
+        return sched_end(db, 0);
+    }
+    avstor_sched_pause(1);
+    res = avstor_tier_migrate_async(db, 0, AVSTOR_TASK_NORMAL);
+    avstor_sched_pause(0);
+    if (res == AVSTOR_INVOPER) {
+        printf("Tier migration is not supported on this platform, skipping\n");
+        return sched_end(db, 1);
+    }
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_tier_migrate_async failed with %i%s\n", YEL, res, CRESET);
+        return sched_end(db, 0);
+    }
+    /* reads run while the task waits for its I/O budget */
+    if (AVSTOR_OK != (res = sched_count_keys(db, &count)) || count != SCHED_KEY_COUNT
+        || AVSTOR_OK != (res = avstor_sched_wait(db))
+        || AVSTOR_OK != (res = sched_count_keys(db, &count)) || count != SCHED_KEY_COUNT) {
+        printf("%sERROR: background migration failed with %i%s\n", YEL, res, CRESET);
+        return sched_end(db, 0);
+    }
+    /* all pages but the header were cold */
+    db_size = sched_file_size(p->filename);
+    tier_size = sched_file_size(p->tier_filename);
+    if (db_size <= 0 || tier_size < db_size / 2) {
+        printf("%sERROR: %li bytes moved to the tier file of a %li byte file%s\n", YEL,
+               tier_size, db_size, CRESET);
+        return sched_end(db, 0);
+    }
+    return sched_end(db, 1);
+}
+
+/* A background migration takes as long as its I/O budget requires */
+static int sched_budget(void *param)
+{
+    struct sched_param *p = (struct sched_param*)param;
+    avstor *db;
+    Timer tm;
+    double expected;
+    long tier_size;
+    int res;
+
+    if ((res = sched_begin(p)) <= 0) {
+        return res < 0;
+    }
+    if (!sched_create_db(p, &db)) {
+        return sched_end(db, 0);
+    }
+    timer_start(&tm);
+    if (AVSTOR_INVOPER == (res = avstor_tier_migrate_async(db, 0, AVSTOR_TASK_NORMAL))) {
+        printf("Tier migration is not supported on this platform, skipping\n");
+        return sched_end(db, 1);
+    }
+    if (res != AVSTOR_OK || AVSTOR_OK != (res = avstor_sched_wait(db))) {
+        printf("%sERROR: background migration failed with %i%s\n", YEL, res, CRESET);
+        return sched_end(db, 0);
+    }
+    timer_stop(&tm);
+
+    /* each page moved is charged as read and written, less up to a second of saved budget */
+    tier_size = sched_file_size(p->tier_filename);
+    expected = (double)tier_size * 2 / (p->kb_per_sec * 1024.0) - 1.0;
+    if (tier_size <= 0 || tm.secs < expected) {
+        printf("%sERROR: moving %li bytes took %.3f s, expected at least %.3f s%s\n", YEL,
+               tier_size, tm.secs, expected, CRESET);
+        return sched_end(db, 0);
+    }
+    return sched_end(db, 1);
+}
+
+/* Pausing the scheduler stops a running migration, which closing the file then cancels */
+static int sched_pause_close(void *param)
+{
+    struct sched_param *p = (struct sched_param*)param;
+    avstor *db;
+    Timer tm;
+    long paused_size, tier_size;
+    int res, result;
+
+    if ((res = sched_begin(p)) <= 0) {
+        return res < 0;
+    }
+    if (!sched_create_db(p, &db)) {
+        return sched_end(db, 0);
+    }
+    if (AVSTOR_INVOPER == (res = avstor_tier_migrate_async(db, 0, AVSTOR_TASK_NORMAL))) {
+        printf("Tier migration is not supported on this platform, skipping\n");
+        return sched_end(db, 1);
+    }
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_tier_migrate_async failed with %i%s\n", YEL, res, CRESET);
+        return sched_end(db, 0);
+    }
+    sched_sleep_ms(200);
+    avstor_sched_pause(1);
+    /* the extent being copied is finished first */
+    sched_sleep_ms(100);
+    paused_size = sched_file_size(p->tier_filename);
+    sched_sleep_ms(300);
+    tier_size = sched_file_size(p->tier_filename);
+    if (paused_size <= 0 || tier_size != paused_size) {
+        printf("%sERROR: tier file grew from %li to %li bytes while paused%s\n", YEL,
+               paused_size, tier_size, CRESET);
+        avstor_sched_pause(0);
+        return sched_end(db, 0);
+    }
+
+    timer_start(&tm);
+    avstor_close(db);
+    timer_stop(&tm);
+    avstor_sched_pause(0);
+    result = tm.secs < 1.0;
+    if (!result) {
+        printf("%sERROR: closing the file took %.3f s while paused%s\n", YEL, tm.secs, CRESET);
+    }
+    return sched_end(NULL, result);
+}
+
+static const struct sched_param SCHED_PARAM = { SCHED_DB, SCHED_TIER_FILE, 1024, 2, 16384, 4096 };
+static const struct sched_param SCHED_SLOW_PARAM = { SCHED_DB, SCHED_TIER_FILE, 1024, 2, SCHED_SLOW_KB, 0 };
+
+DEFINE_TEST_LIST(SCHED) {
+    { "Background tier migration", &sched_tier_migrate, 0, (void*)&SCHED_PARAM },
+    { "Slow down background migration to the I/O budget", &sched_budget, 0, (void*)&SCHED_SLOW_PARAM },
+    { "Close a file while its migration is paused", &sched_pause_close, 0, (void*)&SCHED_SLOW_PARAM }
+};
+
+DEFINE_TESTS(SCHED);
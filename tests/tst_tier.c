@@ -0,0 +1,200 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define TIER_DB "tier.db"
+#define TIER_FILE "tier.dat"
+#define TIER_KEY_COUNT 20000
+
+struct tier_param {
+    const char  *filename;
+    const char  *tier_filename;
+    unsigned    cache_size;
+};
+
+/* Sums the int32 values of all keys under the root */
+static int tier_sum_values(avstor *db, int64_t *sum)
+{
+    avstor_node root, node, value_node;
+    avstor_inorder st;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t value;
+    int res;
+
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    *sum = 0;
+    res = avstor_inorder_first(&st, &root, NULL, AVSTOR_KEYS, &node);
+    while (res == AVSTOR_OK) {
+        if (AVSTOR_OK != (res = avstor_get_name(&node, &key))
+            || AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value_node))
+            || AVSTOR_OK != (res = avstor_get_int32(&value_node, &value))) {
+            return res;
+        }
+        *sum += value;
+        res = avstor_inorder_next(&st, &node);
+    }
+    return res == AVSTOR_NOTFOUND ? AVSTOR_OK : res;
+}
+
+static int tier_migrate(void *param)
+{
+    struct tier_param *p = (struct tier_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int64_t sum, expected = 0;
+    uint32_t pages;
+    int32_t i;
+    int res, result = 0;
+
+    remove(p->tier_filename);
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < TIER_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))
+            || AVSTOR_OK != (res = avstor_create_int32(&node, &key, i, NULL))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+        expected += i;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))
+        || AVSTOR_OK != (res = avstor_tier_open(db, p->tier_filename))) {
+        printf("%sERROR: opening tier file failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    res = avstor_tier_migrate(db, 0, &pages);
+    if (res == AVSTOR_INVOPER) {
+        printf("Tier migration is not supported on this platform, skipping\n");
+        result = 1;
+        goto close_and_return;
+    }
+    if (res != AVSTOR_OK || pages == 0) {
+        printf("%sERROR: avstor_tier_migrate failed with %i (%u pages)%s\n", YEL, res, (unsigned)pages, CRESET);
+        goto close_and_return;
+    }
+    /* nothing is left to move */
+    if (AVSTOR_OK != (res = avstor_tier_migrate(db, 0, &pages)) || pages != 0) {
+        printf("%sERROR: second migration moved %u pages (%i)%s\n", YEL, (unsigned)pages, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_tier_open(db, p->tier_filename))) {
+        printf("%sERROR: avstor_tier_open failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = tier_sum_values(db, &sum)) || sum != expected) {
+        printf("%sERROR: values read from tier file don't match (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+
+    /* pages written again after they were moved are read from the file after reopening, not
+       from their stale copies in the tier file */
+    avstor_node_init(db, &root);
+    for (i = 0; i < TIER_KEY_COUNT; i += 2) {
+        avstor_node value_node;
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_find(&root, &key, AVSTOR_KEYS, &node))
+            || AVSTOR_OK != (res = avstor_find(&node, &key, AVSTOR_VALUES, &value_node))
+            || AVSTOR_OK != (res = avstor_update_int32(&value_node, i + 1))) {
+            printf("%sERROR: updating value failed with %i%s\n", YEL, res, CRESET);
+            goto close_and_return;
+        }
+        expected++;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_tier_open(db, p->tier_filename))) {
+        printf("%sERROR: avstor_tier_open failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = tier_sum_values(db, &sum)) || sum != expected) {
+        printf("%sERROR: values written again don't match (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* only the pages written again are moved by the next migration */
+    if (AVSTOR_OK != (res = avstor_tier_migrate(db, 0, &pages)) || pages == 0) {
+        printf("%sERROR: migration after updates failed with %i (%u pages)%s\n", YEL, res, (unsigned)pages, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = tier_sum_values(db, &sum)) || sum != expected) {
+        printf("%sERROR: values read after second migration don't match (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct tier_param TIER_PARAM = { TIER_DB, TIER_FILE, 1024 };
+
+DEFINE_TEST_LIST(TIER) {
+    { "Move pages to tier file", &tier_migrate, 0, (void*)&TIER_PARAM }
+};
+
+DEFINE_TESTS(TIER);
@@ -0,0 +1,148 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define TRACE_DB "trace.db"
+#define TRACE_KEY_COUNT 20000
+#define TRACE_PAGE_SIZE 4096
+
+struct trace_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+static int trace_create_db(void *param)
+{
+    struct trace_param *p = (struct trace_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    AvsDbIntRec rec;
+    int32_t i;
+    int res;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size,
+                                        AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    for (i = 0; i < TRACE_KEY_COUNT; i++) {
+        rec.key = i;
+        rec.data = 0;
+        if (AVSTOR_OK != (res = avstor_create_key(&root, &key, &node))) {
+            printf("%sERROR: creating node failed with %i%s\n", YEL, res, CRESET);
+            avstor_close(db);
+            return 0;
+        }
+    }
+    res = avstor_commit(db, 1);
+    avstor_close(db);
+    return res == AVSTOR_OK;
+}
+
+/* Traces a cold and a warm lookup of the same key */
+static int trace_find(void *param)
+{
+    struct trace_param *p = (struct trace_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_key key;
+    avstor_trace cold, warm;
+    AvsDbIntRec rec;
+    unsigned i, misses = 0;
+    int res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_READONLY))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    key.buf = &rec;
+    key.len = sizeof(rec);
+    key.comparer = &AvsIntNode_comparer;
+    rec.key = TRACE_KEY_COUNT / 3;
+    rec.data = 0;
+
+    avstor_trace_begin(&cold);
+    res = avstor_find(&root, &key, AVSTOR_KEYS, &node);
+    avstor_trace_end();
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < cold.page_count; i++) {
+        misses += cold.pages[i].misses;
+    }
+    /* every level visited takes one comparison */
+    if (cold.depth < 2 || cold.depth > AVSTOR_AVL_HEIGHT || cold.comparisons != cold.depth || cold.cache_misses == 0
+        || cold.page_count == 0 || misses != cold.cache_misses
+        || cold.bytes_read != (unsigned long)cold.cache_misses * TRACE_PAGE_SIZE) {
+        printf("%sERROR: unexpected trace: depth %u, %u comparisons, %u misses, %lu bytes read%s\n", YEL,
+               cold.depth, cold.comparisons, cold.cache_misses, cold.bytes_read, CRESET);
+        goto close_and_return;
+    }
+
+    avstor_trace_begin(&warm);
+    res = avstor_find(&root, &key, AVSTOR_KEYS, &node);
+    avstor_trace_end();
+    if (res != AVSTOR_OK || warm.cache_misses != 0 || warm.bytes_read != 0
+        || warm.cache_hits != cold.cache_hits + cold.cache_misses || warm.depth != cold.depth) {
+        printf("%sERROR: unexpected trace of cached lookup (%u hits, %u misses)%s\n", YEL,
+               warm.cache_hits, warm.cache_misses, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct trace_param TRACE_PARAM = { TRACE_DB, 4096 };
+
+DEFINE_TEST_LIST(TRACE) {
+    { "Create DB for trace", &trace_create_db, AVSTEST_MUST_PASS, (void*)&TRACE_PARAM },
+    { "Trace key lookup", &trace_find, 0, (void*)&TRACE_PARAM }
+};
+
+DEFINE_TESTS(TRACE);
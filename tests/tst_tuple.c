@@ -0,0 +1,211 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avsdb.h"
+#include "avstest.h"
+
+#define TUPLE_DB "tuple.db"
+#define TUPLE_TS_COUNT 200
+
+struct tuple_param {
+    const char  *filename;
+    unsigned    cache_size;
+};
+
+/* Tenants in order, including one that differs from another only after an embedded null */
+static const char TENANTS[][8] = { "", "acme", "acme\0x", "beta" };
+static const size_t TENANT_LENS[] = { 0, 4, 6, 4 };
+#define TENANT_COUNT (sizeof(TENANT_LENS) / sizeof(TENANT_LENS[0]))
+
+static int tuple_encode(avstor_tuple *t, unsigned char *buf, size_t size, unsigned tenant, int64_t ts, double score)
+{
+    avstor_tuple_init(t, buf, size);
+    return AVSTOR_OK == avstor_tuple_add_bytes(t, TENANTS[tenant], TENANT_LENS[tenant])
+        && AVSTOR_OK == avstor_tuple_add_int64(t, ts)
+        && AVSTOR_OK == avstor_tuple_add_double(t, score);
+}
+
+static int64_t tuple_ts(int i)
+{
+    return ((int64_t)i - TUPLE_TS_COUNT / 2) * 1000000007;
+}
+
+static int tuple_compare(const avstor_tuple *a, const avstor_tuple *b)
+{
+    size_t len = a->len < b->len ? a->len : b->len;
+    int comp = memcmp(a->buf, b->buf, len);
+    return comp != 0 ? comp : (a->len > b->len) - (a->len < b->len);
+}
+
+/* Encoded tuples compare bytewise in field order and decode to the original fields */
+static int tuple_order(void *param)
+{
+    static const double SCORES[] = { -1e300, -2.5, -0.0, 0.0, 1e-300, 3.75, 1e300 };
+    unsigned char buf_a[64], buf_b[64];
+    avstor_tuple a, b;
+    unsigned tenant, s;
+    int i;
+    (void)param;
+
+    for (tenant = 0; tenant < TENANT_COUNT; tenant++) {
+        for (i = 0; i < TUPLE_TS_COUNT; i += 7) {
+            for (s = 0; s < sizeof(SCORES) / sizeof(SCORES[0]); s++) {
+                char name[8];
+                size_t len;
+                int64_t ts;
+                double score;
+                if (!tuple_encode(&a, buf_a, sizeof(buf_a), tenant, tuple_ts(i), SCORES[s])) {
+                    printf("%sERROR: encoding failed%s\n", YEL, CRESET);
+                    return 0;
+                }
+                /* next score, next timestamp and next tenant are all greater */
+                if ((s + 1 < sizeof(SCORES) / sizeof(SCORES[0])
+                     && (!tuple_encode(&b, buf_b, sizeof(buf_b), tenant, tuple_ts(i), SCORES[s + 1])
+                         || (SCORES[s] != 0.0 && tuple_compare(&a, &b) >= 0)))
+                    || (!tuple_encode(&b, buf_b, sizeof(buf_b), tenant, tuple_ts(i + 1), -1e300)
+                        || tuple_compare(&a, &b) >= 0)
+                    || (tenant + 1 < TENANT_COUNT
+                        && (!tuple_encode(&b, buf_b, sizeof(buf_b), tenant + 1, tuple_ts(0), -1e300)
+                            || tuple_compare(&a, &b) >= 0))) {
+                    printf("%sERROR: tuples out of order at %u/%i/%u%s\n", YEL, tenant, i, s, CRESET);
+                    return 0;
+                }
+                avstor_tuple_parse(&b, buf_a, a.len);
+                if (AVSTOR_OK != avstor_tuple_get_bytes(&b, name, sizeof(name), &len)
+                    || len != TENANT_LENS[tenant] || memcmp(name, TENANTS[tenant], len) != 0
+                    || AVSTOR_TUPLE_INT64 != avstor_tuple_type(&b)
+                    || AVSTOR_OK != avstor_tuple_get_int64(&b, &ts) || ts != tuple_ts(i)
+                    || AVSTOR_MISMATCH != avstor_tuple_get_int64(&b, &ts)
+                    || AVSTOR_OK != avstor_tuple_get_double(&b, &score) || score != SCORES[s]
+                    || AVSTOR_NOTFOUND != avstor_tuple_get_double(&b, &score)) {
+                    printf("%sERROR: decoding failed at %u/%i/%u%s\n", YEL, tenant, i, s, CRESET);
+                    return 0;
+                }
+            }
+        }
+    }
+    avstor_tuple_init(&a, buf_a, 8);
+    if (AVSTOR_PARAM != avstor_tuple_add_int64(&a, 1)) {
+        printf("%sERROR: buffer overflow not detected%s\n", YEL, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Keys (tenant, timestamp) are scanned over the range of one tenant */
+static int tuple_scan(void *param)
+{
+    struct tuple_param *p = (struct tuple_param*)param;
+    avstor *db;
+    avstor_node root, node;
+    avstor_inorder st;
+    avstor_tuple t, end, name;
+    avstor_key key, end_key, name_key;
+    unsigned char buf[64], end_buf[64], name_buf[64];
+    unsigned tenant;
+    int64_t ts;
+    int i, res, result = 0;
+
+    if (AVSTOR_OK != (res = avstor_open(&db, p->filename, p->cache_size, AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    for (i = TUPLE_TS_COUNT - 1; i >= 0; i--) {
+        for (tenant = 0; tenant < TENANT_COUNT; tenant++) {
+            avstor_tuple_init(&t, buf, sizeof(buf));
+            avstor_tuple_add_bytes(&t, TENANTS[tenant], TENANT_LENS[tenant]);
+            avstor_tuple_add_int64(&t, tuple_ts(i));
+            avstor_tuple_key(&t, &key);
+            if (AVSTOR_OK != (res = avstor_create_key(&root, &key, NULL))) {
+                printf("%sERROR: creating key failed with %i%s\n", YEL, res, CRESET);
+                goto close_and_return;
+            }
+        }
+    }
+
+    avstor_tuple_init(&t, buf, sizeof(buf));
+    avstor_tuple_add_string(&t, "acme");
+    avstor_tuple_key(&t, &key);
+    avstor_tuple_init(&end, end_buf, sizeof(end_buf));
+    avstor_tuple_add_string(&end, "acme");
+    avstor_tuple_range_end(&end);
+    avstor_tuple_key(&end, &end_key);
+    name_key.buf = name_buf;
+    name_key.len = sizeof(name_buf);
+    name_key.comparer = NULL;
+
+    res = avstor_inorder_first(&st, &root, &key, AVSTOR_KEYS, &node);
+    for (i = 0; res == AVSTOR_OK; i++) {
+        char tenant_name[8];
+        memset(name_buf, 0, sizeof(name_buf));
+        if (AVSTOR_OK != (res = avstor_get_name(&node, &name_key))) {
+            break;
+        }
+        if (memcmp(name_buf, end_buf, end.len) >= 0) {
+            break;
+        }
+        avstor_tuple_parse(&name, name_buf, sizeof(name_buf));
+        if (AVSTOR_OK != avstor_tuple_get_string(&name, tenant_name, sizeof(tenant_name))
+            || strcmp(tenant_name, "acme") != 0
+            || AVSTOR_OK != avstor_tuple_get_int64(&name, &ts) || ts != tuple_ts(i)
+            || AVSTOR_TUPLE_END != avstor_tuple_type(&name)) {
+            printf("%sERROR: unexpected key at %i in range%s\n", YEL, i, CRESET);
+            goto close_and_return;
+        }
+        res = avstor_inorder_next(&st, &node);
+    }
+    if ((res != AVSTOR_OK && res != AVSTOR_NOTFOUND) || i != TUPLE_TS_COUNT) {
+        printf("%sERROR: scanned %i keys in range (%i)%s\n", YEL, i, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct tuple_param TUPLE_PARAM = { TUPLE_DB, 1024 };
+
+DEFINE_TEST_LIST(TUPLE) {
+    { "Encode and decode tuple keys", &tuple_order, AVSTEST_MUST_PASS, NULL },
+    { "Scan the range of a tuple prefix", &tuple_scan, 0, (void*)&TUPLE_PARAM }
+};
+
+DEFINE_TESTS(TUPLE);
@@ -0,0 +1,520 @@
+/*
+* This file is part of libavstor.
+*
+* BSD 3-Clause License
+*
+* Copyright (c) 2025, Tamas Fejerpataky
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avstor.h>
+
+#include "avstest.h"
+
+#define WBUF_DB "wbuf.db"
+#define WBUF_LOG "wbuf.log"
+#define WBUF_COUNT 3000
+#define WBUF_AUTO_COUNT 5000
+#define WBUF_GROW_COUNT 400
+#define WBUF_GROW_LEN 250
+#define WBUF_DROP_COUNT 99
+
+struct wbuf_param {
+    const char  *filename;
+    const char  *log_filename;
+    unsigned    cache_size;
+};
+
+/* Keys are value numbers in big-endian order, so that bytewise order is numeric order */
+static void wbuf_set_key(int32_t i, unsigned char *buf, avstor_key *key)
+{
+    buf[0] = (unsigned char)(i >> 24);
+    buf[1] = (unsigned char)(i >> 16);
+    buf[2] = (unsigned char)(i >> 8);
+    buf[3] = (unsigned char)i;
+    key->buf = buf;
+    key->len = 4;
+    key->comparer = NULL;
+}
+
+static int wbuf_open(avstor **db, const struct wbuf_param *p, int flags)
+{
+    int res;
+    if (AVSTOR_OK != (res = avstor_open(db, p->filename, p->cache_size, flags | AVSTOR_OPEN_AUTOSAVE))) {
+        printf("%sERROR: avstor_open failed with %i%s\n", YEL, res, CRESET);
+        return 0;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_open(*db, p->log_filename))) {
+        printf("%sERROR: avstor_buffer_open failed with %i%s\n", YEL, res, CRESET);
+        avstor_close(*db);
+        return 0;
+    }
+    return 1;
+}
+
+/* Finds or creates the key the values are put under */
+static int wbuf_parent(avstor *db, const char *name, avstor_node *parent)
+{
+    avstor_node root;
+    avstor_key key;
+    int res;
+
+    avstor_node_init(db, &root);
+    key.buf = (void*)name;
+    key.len = (unsigned)strlen(name);
+    key.comparer = NULL;
+    res = avstor_create_key(&root, &key, parent);
+    if (res != AVSTOR_OK && res != AVSTOR_EXISTS) {
+        printf("%sERROR: creating key %s failed with %i%s\n", YEL, name, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Value i is i times mult, a string for every seventh. Which ones depends on mult, so that values
+   put again with another mult change type. */
+static int wbuf_put(const avstor_node *parent, int32_t i, int64_t mult)
+{
+    unsigned char buf[4];
+    avstor_key key;
+    char str[32];
+    int64_t val = i * mult;
+    int res;
+
+    wbuf_set_key(i, buf, &key);
+    if ((i + mult) % 7 == 6) {
+        sprintf(str, "v%li", (long)val);
+        res = avstor_buffer_put(parent, &key, AVSTOR_TYPE_STRING, str, strlen(str) + 1);
+    }
+    else {
+        res = avstor_buffer_put(parent, &key, AVSTOR_TYPE_INT64, &val, sizeof(val));
+    }
+    if (res != AVSTOR_OK) {
+        printf("%sERROR: avstor_buffer_put of value %i failed with %i%s\n", YEL, i, res, CRESET);
+        return 0;
+    }
+    return 1;
+}
+
+/* Puts values [0, count) in scattered order */
+static int wbuf_put_all(const avstor_node *parent, int32_t count, int64_t mult)
+{
+    int32_t i;
+    for (i = 0; i < count; i++) {
+        if (!wbuf_put(parent, (int32_t)((i * 7919L) % count), mult)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Deletes every tenth value of [0, count) */
+static int wbuf_delete_tenth(const avstor_node *parent, int32_t count)
+{
+    unsigned char buf[4];
+    avstor_key key;
+    int32_t i;
+    int res;
+
+    for (i = 9; i < count; i += 10) {
+        wbuf_set_key(i, buf, &key);
+        if (AVSTOR_OK != (res = avstor_buffer_delete(parent, &key))) {
+            printf("%sERROR: avstor_buffer_delete of value %i failed with %i%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Checks values [0, count) through the write buffer, or in the tree only if tree is set. Every
+   tenth value is expected to be deleted if deleted is set. */
+static int wbuf_check(const avstor_node *parent, int32_t count, int64_t mult, int deleted, int tree)
+{
+    unsigned char buf[4];
+    avstor_node node;
+    avstor_key key;
+    char data[32], str[32];
+    unsigned type;
+    size_t bytes;
+    uint32_t length;
+    int64_t val;
+    int32_t i;
+    int res;
+
+    for (i = 0; i < count; i++) {
+        wbuf_set_key(i, buf, &key);
+        if (tree) {
+            res = avstor_find(parent, &key, AVSTOR_VALUES, &node);
+            if (res == AVSTOR_OK) {
+                res = avstor_get_value(&node, data, sizeof(data), &type, &bytes, &length);
+            }
+        }
+        else {
+            res = avstor_buffer_get(parent, &key, data, sizeof(data), &type, &bytes, &length);
+        }
+        if (deleted && i % 10 == 9) {
+            if (res != AVSTOR_NOTFOUND) {
+                printf("%sERROR: deleted value %i found (%i)%s\n", YEL, i, res, CRESET);
+                return 0;
+            }
+            continue;
+        }
+        if (res != AVSTOR_OK) {
+            printf("%sERROR: value %i not found (%i)%s\n", YEL, i, res, CRESET);
+            return 0;
+        }
+        val = i * mult;
+        sprintf(str, "v%li", (long)val);
+        if ((i + mult) % 7 == 6 ? type != AVSTOR_TYPE_STRING || bytes != strlen(str) + 1 || memcmp(data, str, bytes) != 0
+                       : type != AVSTOR_TYPE_INT64 || bytes != sizeof(val) || memcmp(data, &val, bytes) != 0) {
+            printf("%sERROR: value %i mismatch%s\n", YEL, i, CRESET);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Mutations are read from the buffer before the merge and from the tree after it */
+static int wbuf_merge(void *param)
+{
+    const struct wbuf_param *p = (const struct wbuf_param*)param;
+    avstor *db;
+    avstor_node parent, node;
+    unsigned char buf[4];
+    avstor_key key;
+    int res, result = 0;
+
+    remove(p->filename);
+    remove(p->log_filename);
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_CREATE | AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "parent", &parent) || !wbuf_put_all(&parent, WBUF_COUNT, 1)
+        || !wbuf_delete_tenth(&parent, WBUF_COUNT) || !wbuf_check(&parent, WBUF_COUNT, 1, 1, 0)) {
+        goto close_and_return;
+    }
+    wbuf_set_key(0, buf, &key);
+    if (AVSTOR_NOTFOUND != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))) {
+        printf("%sERROR: value found in the tree before the merge (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: avstor_buffer_merge failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = wbuf_check(&parent, WBUF_COUNT, 1, 1, 1) && wbuf_check(&parent, WBUF_COUNT, 1, 1, 0)
+        && AVSTOR_OK == avs_check_cache_consistency(db);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Mutations not merged are loaded from the log when the file is opened again, merged ones are not */
+static int wbuf_reload(void *param)
+{
+    const struct wbuf_param *p = (const struct wbuf_param*)param;
+    avstor *db;
+    avstor_node parent, node;
+    unsigned char buf[4];
+    avstor_key key;
+    unsigned type;
+    size_t bytes;
+    uint32_t length;
+    int64_t val;
+    int res, result = 0;
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "parent", &parent) || !wbuf_put_all(&parent, 100, 3)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "parent", &parent) || !wbuf_check(&parent, 100, 3, 0, 0)
+        || !wbuf_check(&parent, 9, 1, 0, 1)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: avstor_buffer_merge failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    /* values put with another mult than the tree held have changed type */
+    if (!wbuf_check(&parent, 100, 3, 0, 1)) {
+        goto close_and_return;
+    }
+    /* a value changed in the tree after the merge must not be overwritten by the log */
+    wbuf_set_key(1, buf, &key);
+    if (AVSTOR_OK != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))
+        || AVSTOR_OK != (res = avstor_update_int64(&node, 12345))
+        || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: updating value 1 failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    avstor_close(db);
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READONLY)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "parent", &parent)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_get(&parent, &key, &val, sizeof(val), &type, &bytes, &length))
+        || type != AVSTOR_TYPE_INT64 || val != 12345) {
+        printf("%sERROR: value 1 reloaded from the log (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = 1;
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Puts merge the buffer once it holds enough mutations */
+static int wbuf_auto_merge(void *param)
+{
+    const struct wbuf_param *p = (const struct wbuf_param*)param;
+    avstor *db;
+    avstor_node parent;
+    int result = 0;
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "auto", &parent)) {
+        goto close_and_return;
+    }
+    /* puts in order, so that the first values are merged by the time the buffer fills */
+    for (result = 0; result < WBUF_AUTO_COUNT; result++) {
+        if (!wbuf_put(&parent, result, 5)) {
+            result = 0;
+            goto close_and_return;
+        }
+    }
+    result = avstor_sched_wait(db) == AVSTOR_OK && wbuf_check(&parent, 100, 5, 0, 1)
+        && wbuf_check(&parent, WBUF_AUTO_COUNT, 5, 0, 0);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Mutations under a key deleted before the merge are dropped, not applied to a key that reuses its
+   offset */
+static int wbuf_deleted_parent(void *param)
+{
+    const struct wbuf_param *p = (const struct wbuf_param*)param;
+    avstor *db;
+    avstor_node root, gone, other, node;
+    unsigned char buf[4];
+    avstor_key key;
+    char data[32];
+    unsigned type;
+    size_t bytes;
+    uint32_t length;
+    int res, result = 0;
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    avstor_node_init(db, &root);
+    if (!wbuf_parent(db, "gone", &gone) || !wbuf_put_all(&gone, 100, 2)) {
+        goto close_and_return;
+    }
+    key.buf = (void*)"gone";
+    key.len = 4;
+    key.comparer = NULL;
+    if (AVSTOR_OK != (res = avstor_delete(&root, 0, &key))) {
+        printf("%sERROR: deleting the key failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!wbuf_parent(db, "other", &other)) {
+        goto close_and_return;
+    }
+    if (other.ref != gone.ref) {
+        printf("%sERROR: offset of the deleted key not reused%s\n", YEL, CRESET);
+        goto close_and_return;
+    }
+    wbuf_set_key(0, buf, &key);
+    if (AVSTOR_NOTFOUND != (res = avstor_buffer_get(&other, &key, data, sizeof(data), &type, &bytes, &length))) {
+        printf("%sERROR: value of the deleted key found before the merge (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: avstor_buffer_merge failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_NOTFOUND != (res = avstor_find(&other, &key, AVSTOR_VALUES, &node))) {
+        printf("%sERROR: value of the deleted key merged (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = AVSTOR_OK == avs_check_cache_consistency(db);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* Puts binaries of WBUF_GROW_LEN bytes over small ones, which do not fit in their full pages */
+static int wbuf_grow(void *param)
+{
+    const struct wbuf_param *p = (const struct wbuf_param*)param;
+    avstor *db;
+    avstor_node parent, node;
+    unsigned char buf[4], data[WBUF_GROW_LEN], value[WBUF_GROW_LEN];
+    avstor_key key;
+    size_t bytes;
+    uint32_t length;
+    int32_t i;
+    int res, result = 0;
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "grow", &parent)) {
+        goto close_and_return;
+    }
+    for (i = 0; i < WBUF_GROW_COUNT; i++) {
+        wbuf_set_key(i, buf, &key);
+        if (AVSTOR_OK != (res = avstor_create_binary(&parent, &key, &i, sizeof(i), NULL))) {
+            printf("%sERROR: creating value %i failed with %i%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: avstor_commit failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < WBUF_GROW_COUNT; i++) {
+        wbuf_set_key(i, buf, &key);
+        memset(data, (unsigned char)i, sizeof(data));
+        if (AVSTOR_OK != (res = avstor_buffer_put(&parent, &key, AVSTOR_TYPE_BINARY, data, sizeof(data)))) {
+            printf("%sERROR: avstor_buffer_put of value %i failed with %i%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: avstor_buffer_merge failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    for (i = 0; i < WBUF_GROW_COUNT; i++) {
+        wbuf_set_key(i, buf, &key);
+        memset(data, (unsigned char)i, sizeof(data));
+        if (AVSTOR_OK != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))
+            || AVSTOR_OK != (res = avstor_get_binary(&node, value, sizeof(value), &bytes, &length))
+            || length != WBUF_GROW_LEN || memcmp(value, data, sizeof(data)) != 0) {
+            printf("%sERROR: value %i not merged (%i)%s\n", YEL, i, res, CRESET);
+            goto close_and_return;
+        }
+    }
+    result = AVSTOR_OK == avs_check_cache_consistency(db);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+/* A mutation that cannot be applied is dropped and reported, the others are merged. The last
+   value is the target of a link and its put changes its type, which would replace the node. */
+static int wbuf_drop_failed(void *param)
+{
+    const struct wbuf_param *p = (const struct wbuf_param*)param;
+    avstor *db;
+    avstor_node parent, node;
+    unsigned char buf[4];
+    avstor_key key;
+    int64_t val;
+    int res, result = 0;
+
+    if (!wbuf_open(&db, p, AVSTOR_OPEN_READWRITE)) {
+        return 0;
+    }
+    if (!wbuf_parent(db, "linked", &parent) || !wbuf_put_all(&parent, WBUF_DROP_COUNT, 3)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: avstor_buffer_merge failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    wbuf_set_key(WBUF_DROP_COUNT - 1, buf, &key);
+    if (AVSTOR_OK != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))) {
+        printf("%sERROR: avstor_find failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    key.buf = (void*)"link";
+    key.len = 4;
+    if (AVSTOR_OK != (res = avstor_create_link(&parent, &key, &node, NULL))
+        || AVSTOR_OK != (res = avstor_commit(db, 1))) {
+        printf("%sERROR: creating the link failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!wbuf_put_all(&parent, WBUF_DROP_COUNT, 6)) {
+        goto close_and_return;
+    }
+    if (AVSTOR_INVOPER != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: avstor_buffer_merge returned %i, expected %i%s\n", YEL, res, AVSTOR_INVOPER, CRESET);
+        goto close_and_return;
+    }
+    if (AVSTOR_OK != (res = avstor_buffer_merge(db))) {
+        printf("%sERROR: merging again failed with %i%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    if (!wbuf_check(&parent, WBUF_DROP_COUNT - 1, 6, 0, 1)) {
+        goto close_and_return;
+    }
+    wbuf_set_key(WBUF_DROP_COUNT - 1, buf, &key);
+    if (AVSTOR_OK != (res = avstor_find(&parent, &key, AVSTOR_VALUES, &node))
+        || AVSTOR_OK != (res = avstor_get_int64(&node, &val)) || val != (WBUF_DROP_COUNT - 1) * 3) {
+        printf("%sERROR: target of the link replaced (%i)%s\n", YEL, res, CRESET);
+        goto close_and_return;
+    }
+    result = AVSTOR_OK == avs_check_cache_consistency(db);
+close_and_return:
+    avstor_close(db);
+    return result;
+}
+
+static const struct wbuf_param WBUF_PARAM = { WBUF_DB, WBUF_LOG, 1024 };
+
+DEFINE_TEST_LIST(WBUF) {
+    { "Buffer and merge values", &wbuf_merge, AVSTEST_MUST_PASS, (void*)&WBUF_PARAM },
+    { "Reload unmerged mutations from the log", &wbuf_reload, 0, (void*)&WBUF_PARAM },
+    { "Merge when the buffer fills", &wbuf_auto_merge, 0, (void*)&WBUF_PARAM },
+    { "Drop mutations under a deleted key", &wbuf_deleted_parent, 0, (void*)&WBUF_PARAM },
+    { "Grow buffered values in full pages", &wbuf_grow, 0, (void*)&WBUF_PARAM },
+    { "Drop a mutation that cannot be applied", &wbuf_drop_failed, 0, (void*)&WBUF_PARAM }
+};
+
+DEFINE_TESTS(WBUF);